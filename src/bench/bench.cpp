@@ -0,0 +1,504 @@
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <fmt/core.h>
+#include <fmt/color.h>
+#include <nlohmann/json.hpp>
+
+#include "in-tunnel/intunnel.h"
+#include "out-tunnel/outtunnel.h"
+#include "latency_histogram.h"
+
+/**
+ * Loopback benchmark of the tunnel. For every backend, mode, packet size and rate, an
+ * in-tunnel and an out-tunnel are started in this process, a source sends RTP-like packets
+ * to the in-tunnel at a constant rate and a sink stands for the TURN server behind the
+ * out-tunnel. The results of every run are written as JSON.
+ */
+
+using nlohmann::json;
+using namespace std::string_literals;
+
+namespace def
+{
+
+constexpr auto IMPLS = "mvfst,quiche,msquic,quicgo,lsquic,tcp,udp";
+constexpr auto MODES = "datagram,stream";
+constexpr auto SIZES = "1200";
+constexpr auto RATES = "1M,10M";
+constexpr auto DURATION = 5;   // Seconds of load per run
+constexpr auto WARMUP = 1000;  // Milliseconds to set up the connection before the load
+constexpr auto DRAIN = 500;    // Milliseconds after the load for the packets still in flight
+constexpr auto QUIC_PORT = 8888; // Of the first run, the next ones take the next ports
+constexpr auto SINK_PORT = 3478;
+constexpr auto IN_PORT = 3479; // Always the one of InTunnel::allocate_in_port
+constexpr auto CC = "cubic";
+constexpr auto OUTPUT = "bench.json";
+
+}
+
+// Probe packets //////////////////////////////////////////////////////////////
+
+// RTP header, then the sequence number and the send time of the packet
+constexpr size_t RTP_HEADER_LEN = 12;
+constexpr size_t SEQ_OFFSET = RTP_HEADER_LEN;
+constexpr size_t TIME_OFFSET = SEQ_OFFSET + sizeof(uint64_t);
+constexpr size_t MIN_SIZE = TIME_OFFSET + sizeof(int64_t);
+constexpr size_t MAX_SIZE = 1400; // Fits a datagram of every backend
+
+static int64_t clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1'000'000'000ll + ts.tv_nsec;
+}
+
+static int64_t now_ns() { return clock_ns(CLOCK_MONOTONIC); }
+
+static void write_probe(uint8_t * buf, uint64_t seq)
+{
+  buf[0] = 0x80; // Version 2
+  buf[1] = 96;   // Dynamic payload type
+  buf[2] = seq >> 8;
+  buf[3] = seq;
+
+  uint32_t ts = htonl(seq * 3000); // 30 fps at 90 kHz, a frame per packet
+  uint32_t ssrc = htonl(0x5155'4943);
+  memcpy(buf + 4, &ts, sizeof(ts));
+  memcpy(buf + 8, &ssrc, sizeof(ssrc));
+
+  int64_t sent = now_ns();
+  memcpy(buf + SEQ_OFFSET, &seq, sizeof(seq));
+  memcpy(buf + TIME_OFFSET, &sent, sizeof(sent));
+}
+
+static bool make_addr(uint16_t port, struct sockaddr_in& addr)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  return inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr) == 1;
+}
+
+// Sink ///////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Stands for the TURN server behind the out-tunnel, counts the probes and records
+ * their latency through the tunnel
+ */
+class Sink
+{
+  static constexpr auto BATCH_LEN = 32u;
+
+  int _socket = -1;
+  std::thread _thread;
+  std::atomic<bool> _stop = false;
+
+  void run()
+  {
+    std::vector<uint8_t> bufs(BATCH_LEN * 2048);
+    struct mmsghdr msgs[BATCH_LEN];
+    struct iovec iovs[BATCH_LEN];
+
+    for(unsigned i = 0; i < BATCH_LEN; ++i) {
+      iovs[i] = { bufs.data() + i * 2048, 2048 };
+      msgs[i] = {};
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(!_stop.load(std::memory_order_relaxed)) {
+      int n = recvmmsg(_socket, msgs, BATCH_LEN, MSG_WAITFORONE, nullptr);
+      if(n <= 0) continue; // Timeout, checks _stop
+
+      auto now = now_ns();
+
+      for(int i = 0; i < n; ++i) {
+	size_t len = msgs[i].msg_len;
+
+	packets.fetch_add(1, std::memory_order_relaxed);
+	bytes.fetch_add(len, std::memory_order_relaxed);
+
+	if(len < MIN_SIZE) continue;
+
+	int64_t sent;
+	memcpy(&sent, (uint8_t*)iovs[i].iov_base + TIME_OFFSET, sizeof(sent));
+	latency.record((now - sent) / 1000);
+      }
+    }
+
+    cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  }
+
+public:
+  LatencyHistogram latency;
+  std::atomic<uint64_t> packets = 0;
+  std::atomic<uint64_t> bytes = 0;
+  int64_t cpu_ns = 0; // Of the sink thread, once stopped
+
+  ~Sink() { stop(); }
+
+  bool open(uint16_t port)
+  {
+    _socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(_socket == -1) {
+      perror("Could not create the sink socket");
+      return false;
+    }
+
+    struct timeval timeout{ 0, 100'000 };
+    setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int enable = 1;
+    setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    struct sockaddr_in addr;
+    make_addr(port, addr);
+
+    if(bind(_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+      perror("Could not bind the sink socket");
+      return false;
+    }
+
+    _thread = std::thread([this]() { run(); });
+
+    return true;
+  }
+
+  void stop()
+  {
+    _stop = true;
+    if(_thread.joinable()) _thread.join();
+
+    if(_socket != -1) ::close(_socket);
+    _socket = -1;
+  }
+};
+
+// Source /////////////////////////////////////////////////////////////////////
+
+struct SourceStats
+{
+  uint64_t packets = 0;
+  uint64_t bytes = 0;
+  int64_t  cpu_ns = 0;
+};
+
+/**
+ * @brief Sends probes of a fixed size to the in-tunnel at a constant rate, paced every
+ * millisecond, from the calling thread
+ */
+static SourceStats send_load(uint16_t port, size_t size, uint64_t rate_bps, std::chrono::seconds duration)
+{
+  SourceStats stats;
+
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if(sock == -1) {
+    perror("Could not create the source socket");
+    return stats;
+  }
+
+  struct sockaddr_in addr;
+  make_addr(port, addr);
+
+  std::vector<uint8_t> buf(size, 0);
+  double pps = (double)rate_bps / (8 * size);
+
+  auto cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + duration;
+
+  for(auto tick = start; tick < end; tick += std::chrono::milliseconds(1)) {
+    std::this_thread::sleep_until(tick);
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t due = elapsed * pps;
+
+    for(; stats.packets < due; ++stats.packets) {
+      write_probe(buf.data(), stats.packets);
+      if(sendto(sock, buf.data(), size, 0, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+	perror("Could not send probe");
+	break;
+      }
+
+      stats.bytes += size;
+    }
+  }
+
+  stats.cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+  ::close(sock);
+
+  return stats;
+}
+
+// Runs ///////////////////////////////////////////////////////////////////////
+
+struct Config
+{
+  std::vector<std::string> impls;
+  std::vector<std::string> modes;
+  std::vector<size_t>      sizes;
+  std::vector<uint64_t>    rates;
+  std::chrono::seconds      duration{def::DURATION};
+  std::chrono::milliseconds warmup{def::WARMUP};
+  std::chrono::milliseconds drain{def::DRAIN};
+  uint16_t    quic_port = def::QUIC_PORT;
+  uint16_t    sink_port = def::SINK_PORT;
+  std::string cc = def::CC;
+};
+
+/**
+ * @brief One backend, mode, size and rate.
+ * The CPU time per packet is the one of the whole process without the source and the sink
+ * threads, so it accounts both tunnels.
+ */
+static json run(const Config& config, const std::string& impl, const std::string& mode,
+		size_t size, uint64_t rate, uint16_t quic_port)
+{
+  json result = { { "impl", impl }, { "mode", mode }, { "size", size }, { "rate_bps", rate },
+		  { "duration_s", config.duration.count() } };
+
+  Sink sink;
+  if(!sink.open(config.sink_port)) {
+    result["error"] = "could not open the sink";
+    return result;
+  }
+
+  bool datagrams = mode == "datagram";
+  bool framed = mode == "framed";
+
+  auto out = std::make_shared<OutTunnel>(0, impl, "127.0.0.1", quic_port, config.sink_port);
+  out->set_cc(config.cc);
+  out->set_datagrams(datagrams);
+  out->set_framed_streams(framed);
+
+  if(!out->start()) {
+    result["error"] = "could not start the out-tunnel";
+    return result;
+  }
+
+  std::thread out_thread([out]() { out->run(); });
+
+  auto in = std::make_shared<InTunnel>(0, impl, "127.0.0.1", quic_port);
+  in->set_cc(config.cc);
+  in->set_datagram(datagrams);
+  if(framed && !in->set_framed_streams(true)) result["error"] = "framed streams not supported";
+
+  std::thread in_thread([in]() { in->run(); });
+
+  std::this_thread::sleep_for(config.warmup);
+
+  auto cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  auto source = send_load(def::IN_PORT, size, rate, config.duration);
+  std::this_thread::sleep_for(config.drain);
+  auto cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+  sink.stop();
+
+  in->stop();
+  in_thread.join();
+  out->stop();
+  out_thread.join();
+
+  uint64_t received = sink.packets;
+  double seconds = config.duration.count();
+  int64_t tunnel_cpu = std::max<int64_t>(0, cpu - source.cpu_ns - sink.cpu_ns);
+
+  result["sent"] = source.packets;
+  result["received"] = received;
+  result["lost"] = source.packets > received ? source.packets - received : 0;
+  result["loss"] = source.packets ? (double)result["lost"].get<uint64_t>() / source.packets : 0.;
+  result["throughput_bps"] = sink.bytes * 8 / seconds;
+  result["pps"] = received / seconds;
+  result["cpu_ns_per_packet"] = received ? tunnel_cpu / (double)received : 0.;
+  result["latency_us"] = {
+    { "p50", sink.latency.percentile(0.5) },
+    { "p99", sink.latency.percentile(0.99) },
+    { "p999", sink.latency.percentile(0.999) },
+    { "max", sink.latency.max() }
+  };
+
+  return result;
+}
+
+// Command line ///////////////////////////////////////////////////////////////
+
+static std::vector<std::string> split(std::string_view list)
+{
+  std::vector<std::string> items;
+
+  while(!list.empty()) {
+    auto item = list.substr(0, list.find(','));
+    list.remove_prefix(std::min(list.size(), item.size() + 1));
+    if(!item.empty()) items.emplace_back(item);
+  }
+
+  return items;
+}
+
+/** @brief Rate in bit/s, with an optional k, M or G suffix */
+static uint64_t parse_rate(const std::string& rate)
+{
+  size_t end = 0;
+  double value = std::stod(rate, &end);
+
+  switch(end < rate.size() ? rate[end] : ' ') {
+  case 'k': case 'K': value *= 1e3; break;
+  case 'm': case 'M': value *= 1e6; break;
+  case 'g': case 'G': value *= 1e9; break;
+  }
+
+  return value;
+}
+
+static void print_option(const char * name, const char * arg, std::string_view help)
+{
+  fmt::print(fg(fmt::color::crimson) | fmt::emphasis::bold, "--{} ", name);
+  fmt::print(fg(fmt::color::steel_blue) | fmt::emphasis::bold, "{}", arg);
+  fmt::print(" : {}\n", help);
+}
+
+void display_help()
+{
+  fmt::print("{:*^50}\n", " Quic tunnel bench help ");
+  fmt::print("\n");
+
+  print_option("impl", "LIST", fmt::format("Backends to run (default {})", def::IMPLS));
+  print_option("mode", "LIST", fmt::format("datagram, stream or framed (default {})", def::MODES));
+  print_option("size", "LIST", fmt::format("Packet sizes in bytes, {} to {} (default {})", MIN_SIZE, MAX_SIZE, def::SIZES));
+  print_option("rate", "LIST", fmt::format("Rates in bit/s, k M and G suffixes (default {})", def::RATES));
+  print_option("duration", "SEC", fmt::format("Load duration of a run (default {})", def::DURATION));
+  print_option("warmup", "MS", fmt::format("Connection setup before the load (default {})", def::WARMUP));
+  print_option("drain", "MS", fmt::format("Wait for the packets in flight after the load (default {})", def::DRAIN));
+  print_option("quic-port", "PORT", fmt::format("Quic port of the first run (default {})", def::QUIC_PORT));
+  print_option("sink-port", "PORT", fmt::format("Port of the sink behind the out-tunnel (default {})", def::SINK_PORT));
+  print_option("cc", "CC", fmt::format("Congestion controller (default {})", def::CC));
+  print_option("output", "FILE", fmt::format("JSON results, - for stdout (default {})", def::OUTPUT));
+
+  fmt::print("\n");
+}
+
+enum OptInd : uint8_t {
+  IMPL = 0,
+  MODE,
+  SIZE,
+  RATE,
+  DURATION,
+  WARMUP,
+  DRAIN,
+  QUIC_PORT,
+  SINK_PORT,
+  CC,
+  OUTPUT,
+  HELP
+};
+
+int main(int argc, char *argv[])
+{
+  struct option long_options[] = {
+    { "impl", required_argument, 0, 0 },
+    { "mode", required_argument, 0, 0 },
+    { "size", required_argument, 0, 0 },
+    { "rate", required_argument, 0, 0 },
+    { "duration", required_argument, 0, 0 },
+    { "warmup", required_argument, 0, 0 },
+    { "drain", required_argument, 0, 0 },
+    { "quic-port", required_argument, 0, 0 },
+    { "sink-port", required_argument, 0, 0 },
+    { "cc", required_argument, 0, 0 },
+    { "output", required_argument, 0, 0 },
+    { "help", no_argument, 0, 0 },
+    { 0, 0, 0, 0 },
+  };
+
+  Config config;
+  std::string impls = def::IMPLS, modes = def::MODES, sizes = def::SIZES, rates = def::RATES;
+  std::string output = def::OUTPUT;
+
+  while(true) {
+    int option_index = 0;
+
+    int c = getopt_long(argc, argv, "h", long_options, &option_index);
+
+    if(c == -1) break;
+    else if(c == 'h') {
+      display_help();
+      return 0;
+    }
+    else if(c != 0) continue;
+
+    switch(option_index) {
+    case OptInd::IMPL: impls = optarg; break;
+    case OptInd::MODE: modes = optarg; break;
+    case OptInd::SIZE: sizes = optarg; break;
+    case OptInd::RATE: rates = optarg; break;
+    case OptInd::DURATION: config.duration = std::chrono::seconds(std::stoi(optarg)); break;
+    case OptInd::WARMUP: config.warmup = std::chrono::milliseconds(std::stoi(optarg)); break;
+    case OptInd::DRAIN: config.drain = std::chrono::milliseconds(std::stoi(optarg)); break;
+    case OptInd::QUIC_PORT: config.quic_port = std::stoi(optarg); break;
+    case OptInd::SINK_PORT: config.sink_port = std::stoi(optarg); break;
+    case OptInd::CC: config.cc = optarg; break;
+    case OptInd::OUTPUT: output = optarg; break;
+    case OptInd::HELP: display_help(); return 0;
+    }
+  }
+
+  config.impls = split(impls);
+  config.modes = split(modes);
+  for(auto& size : split(sizes)) config.sizes.push_back(std::clamp<size_t>(std::stoul(size), MIN_SIZE, MAX_SIZE));
+  for(auto& rate : split(rates)) config.rates.push_back(parse_rate(rate));
+
+  json results = json::array();
+  uint16_t quic_port = config.quic_port;
+
+  for(auto& impl : config.impls) {
+    for(auto& mode : config.modes) {
+      for(auto size : config.sizes) {
+	for(auto rate : config.rates) {
+	  // A new port each run, the previous server may still hold its own
+	  auto result = run(config, impl, mode, size, rate, quic_port++);
+
+	  if(!result.contains("latency_us")) {
+	    fmt::print(stderr, "bench {} {} {}B {}bps: {}\n", impl, mode, size, rate, result.value("error", ""s));
+	  }
+	  else {
+	    fmt::print(stderr, "bench {} {} {}B {}bps: {:.0f} pps, loss {:.4f}, p50 {} us, p99 {} us, {:.0f} ns/packet\n",
+		       impl, mode, size, rate, result["pps"].get<double>(), result["loss"].get<double>(),
+		       result["latency_us"]["p50"].get<uint64_t>(), result["latency_us"]["p99"].get<uint64_t>(),
+		       result["cpu_ns_per_packet"].get<double>());
+	  }
+
+	  results.push_back(std::move(result));
+	}
+      }
+    }
+  }
+
+  json report = { { "results", std::move(results) } };
+
+  if(output == "-") fmt::print("{}\n", report.dump(2));
+  else {
+    std::ofstream ofs(output);
+    if(!ofs) {
+      fmt::print(stderr, "Could not open {}\n", output);
+      return -1;
+    }
+
+    ofs << report.dump(2) << "\n";
+  }
+
+  return 0;
+}
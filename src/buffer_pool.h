@@ -0,0 +1,113 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstddef>
+
+#include "metrics.h"
+
+/**
+ * @brief Fixed-size slab of equal buffers, acquired and released from any thread.
+ * A request larger than a slot, or made while every slot is in use, falls back to the heap
+ * and is counted as a miss.
+ */
+class BufferPool
+{
+  static constexpr size_t ALIGN = alignof(std::max_align_t);
+
+  size_t _slot_len;
+  size_t _nb_slots;
+  std::unique_ptr<char[]> _slab;
+
+  mutable std::mutex    _mutex;
+  std::vector<uint32_t> _free; // Indexes of the free slots, used as a stack
+
+  std::atomic<uint64_t> _misses{0};
+  std::atomic<uint64_t> _oversize{0};
+
+  bool owns(const void * ptr) const noexcept
+  {
+    auto * p = static_cast<const char*>(ptr);
+    return p >= _slab.get() && p < _slab.get() + _slot_len * _nb_slots;
+  }
+
+public:
+  BufferPool(size_t slot_len, size_t nb_slots)
+    : _slot_len((slot_len + ALIGN - 1) & ~(ALIGN - 1)), _nb_slots(nb_slots),
+      _slab(new char[_slot_len * nb_slots])
+  {
+    _free.reserve(nb_slots);
+    // Lowest slots on top, so a light load keeps reusing the same few cache lines
+    for(size_t i = nb_slots; i > 0; --i) _free.push_back(i - 1);
+  }
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  /** @brief Buffer of at least len bytes, nullptr only if the heap fallback failed too. */
+  void * acquire(size_t len)
+  {
+    if(len > _slot_len) {
+      ++_oversize;
+      return malloc(len);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      if(!_free.empty()) {
+	auto idx = _free.back();
+	_free.pop_back();
+	return _slab.get() + idx * _slot_len;
+      }
+    }
+
+    ++_misses;
+    return malloc(len);
+  }
+
+  /** @brief Gives back a buffer from acquire, slot or heap fallback. */
+  void release(void * ptr)
+  {
+    if(!ptr) return;
+
+    if(!owns(ptr)) {
+      free(ptr);
+      return;
+    }
+
+    auto idx = (static_cast<char*>(ptr) - _slab.get()) / _slot_len;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _free.push_back(idx);
+  }
+
+  /** @brief Acquisitions served by the heap because the pool was empty. */
+  uint64_t misses() const noexcept { return _misses.load(std::memory_order_relaxed); }
+  /** @brief Acquisitions served by the heap because they did not fit in a slot. */
+  uint64_t oversize() const noexcept { return _oversize.load(std::memory_order_relaxed); }
+
+  size_t available() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _free.size();
+  }
+
+  size_t slot_len() const noexcept { return _slot_len; }
+  size_t capacity() const noexcept { return _nb_slots; }
+
+  void collect(metrics::Writer& w) const
+  {
+    w.gauge("quic_tunnel_pool_capacity", "Slots of the send buffer pool", capacity());
+    w.gauge("quic_tunnel_pool_in_use", "Slots of the send buffer pool in use", capacity() - available());
+    w.counter("quic_tunnel_pool_misses_total", "Buffers taken from the heap, the pool being empty", misses());
+    w.counter("quic_tunnel_pool_oversize_total", "Buffers taken from the heap, too large for a slot", oversize());
+  }
+};
+
+#endif /* BUFFER_POOL_H */
@@ -10,6 +10,7 @@ struct Capabilities
   std::string              impl; /* which quic implementation (or if tcp / udp)*/
   bool                     datagrams; /* Does it support datagrams */
   bool                     streams = true; /* Does it support streams */
+  bool                     framed_streams = false; /* Can it send the packets length prefixed on one stream */
   std::vector<std::string> cc; /* Which congestion contorl algorithm it supports */
 };
 
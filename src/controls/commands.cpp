@@ -7,6 +7,7 @@
 #include "commands.h"
 #include "response.h"
 #include "link.h"
+#include "link_schedule.h"
 
 #include "in-tunnel/intunnel.h"
 #include "out-tunnel/outtunnel.h"
@@ -37,6 +38,7 @@ std::unique_ptr<response::Response> StartClient::run()
   // Set the cc
   client->set_cc(cc);
   client->set_datagram(datagrams);
+  client->set_framed_streams(framed_streams);
 
   if(external_file_transfer)
     client->enable_external_file_transfer();
@@ -60,11 +62,8 @@ std::unique_ptr<response::Response> StartClient::run()
 
 ResponsePtr StopClient::run()
 {
-  // Check if the specified id exists
-  if(InTunnel::sessions.contains(id)) {
-    auto client = InTunnel::sessions[id];
-    InTunnel::sessions.erase(id);
-
+  // Remove the session if the specified id exists
+  if(auto client = InTunnel::sessions.take(id)) {
     client->stop();
 
     auto resp = std::make_unique<response::StopClient>();
@@ -100,9 +99,6 @@ ResponsePtr StartServer::run()
 {
   // Create quic client
   auto server = ::OutTunnel::create(impl, addr_out, quic_port, port_out);
-  server->set_cc(cc);
-  server->set_datagrams(datagrams);
-  server->set_external_file_transfer(external_file_transfer);
   
   // Ensure it is created
   if(server == nullptr) {
@@ -113,7 +109,15 @@ ResponsePtr StartServer::run()
     return resp;
   }
 
+  server->set_cc(cc);
+  server->set_datagrams(datagrams);
+  server->set_framed_streams(framed_streams);
+  server->set_workers(workers);
+  server->set_external_file_transfer(external_file_transfer);
+
   if(!server->start()) {
+    OutTunnel::sessions.erase(server->id());
+    
     auto resp = std::make_unique<response::Error>();
     resp->trans_id = _trans_id;
     resp->message = "Internal error, could not start quic server";
@@ -139,11 +143,8 @@ ResponsePtr StartServer::run()
 
 ResponsePtr StopServer::run()
 {
-  // Check if the specified id exists
-  if(OutTunnel::sessions.contains(id)) {
-    auto server = OutTunnel::sessions[id];
-    OutTunnel::sessions.erase(id);
-
+  // Remove the session if the specified id exists
+  if(auto server = OutTunnel::sessions.take(id)) {
     server->stop();
 
     auto resp = std::make_unique<response::StopServer>();
@@ -163,6 +164,33 @@ ResponsePtr StopServer::run()
 }
 
 // Link ///////////////////////////////////////////////////////////////////////
+bool Link::set_schedule(const tc::LinkState& base)
+{
+  tc::LinkSchedule link_schedule;
+
+  if(!trace.empty()) {
+    bool csv = trace_format == "csv" || (trace_format.empty() && trace.ends_with(".csv"));
+
+    bool loaded = csv ? tc::LinkSchedule::load_csv(trace, base, link_schedule)
+      : tc::LinkSchedule::load_mahimahi(trace, base, link_schedule, std::chrono::milliseconds(trace_bin));
+    if(!loaded) return false;
+  }
+  else {
+    for(const auto& step : schedule) {
+      tc::LinkState state = base;
+      state.rate = bit::KiloBits(step.bitrate);
+      if(step.delay) state.delay = std::chrono::milliseconds(*step.delay);
+      if(step.loss) state.loss = *step.loss;
+
+      link_schedule.steps.push_back({ std::chrono::milliseconds(step.time), state });
+    }
+  }
+
+  if(period) link_schedule.period = std::chrono::milliseconds(*period);
+
+  return tc::Link::set_schedule(std::move(link_schedule));
+}
+
 ResponsePtr Link::run()
 {
   bool success = true;
@@ -171,10 +199,19 @@ ResponsePtr Link::run()
     tc::Link::reset_limit();
   }
   else {
-    success = tc::Link::set_limit(std::chrono::milliseconds(delay),
-				  bit::KiloBits(bitrate),
-				  loss.value_or(0),
-				  duplicates.value_or(0));
+    tc::LinkState state;
+    state.delay = std::chrono::milliseconds(delay);
+    state.rate = bit::KiloBits(bitrate);
+    state.burst = bit::KiloByte(burst);
+    state.latency = std::chrono::milliseconds(latency);
+    state.jitter = std::chrono::milliseconds(jitter);
+    state.loss = loss.value_or(0);
+    state.duplicates = duplicates.value_or(0);
+    state.reorder = reorder;
+    state.loss_burst = loss_burst;
+
+    if(!schedule.empty() || !trace.empty()) success = set_schedule(state);
+    else success = tc::Link::set_limit(state);
   }
 
   if(!success) {
@@ -274,7 +311,7 @@ ResponsePtr GetStats::run()
   fs::permissions(results_path, fs::perms::owner_all | fs::perms::group_all | fs::perms::others_all);
 
   // copy stats files into results directory
-  move_files(results_path, "bitrate.csv", "quic.csv", "file.csv");
+  move_files(results_path, "bitrate.csv", "quic.csv", "tunnel.csv", "file.csv", "latency.csv", "link.csv");
   
   // Generate csv curve from stats file
   pid_t pid = fork();
@@ -11,6 +11,11 @@ namespace response
 class Response;
 }
 
+namespace tc
+{
+struct LinkState;
+}
+
 namespace cmd
 {
 
@@ -27,6 +32,9 @@ public:
   virtual ~Command() = default;
   
   void set_transaction_id(int trans_id) { _trans_id = trans_id; }
+
+  /** @brief Commands of a same strand run in the order they came, empty for any order */
+  virtual std::string strand() const { return {}; }
   
   virtual ResponsePtr run() = 0;
 };
@@ -37,6 +45,7 @@ class StartClient : public Command
 {
 public:
   bool        datagrams = true;
+  bool        framed_streams = false; // Packets length prefixed on one stream instead of a stream each
   std::string cc        = "bbr";
   std::string impl      = "mvfst"; // TODO
 
@@ -56,6 +65,8 @@ class StopClient : public Command
 
 public:
   int id; // Id of the quic session
+
+  std::string strand() const override { return "in/" + std::to_string(id); }
   
   ResponsePtr run() override;
 };
@@ -74,9 +85,12 @@ public:
   std::string impl = "mvfst"; // TODO
 
   bool datagrams = true;
+  bool framed_streams = false; // Packets length prefixed on one stream instead of a stream each
   bool external_file_transfer    = false;
   bool multiplexed_file_transfer = false;
 
+  unsigned workers = 0; // Worker threads of the quic server, 0 for the implementation default
+
   ResponsePtr run() override;
 };
 
@@ -87,6 +101,8 @@ class StopServer : public Command
 
 public:
   int id; // Id of the quic session
+
+  std::string strand() const override { return "out/" + std::to_string(id); }
   
   ResponsePtr run() override;
 };
@@ -97,17 +113,40 @@ public:
 class Link : public Command
 {
 public:
-  int bitrate; // max bitrate in kbps
+  int bitrate = 0; // max bitrate in kbps
   int delay = 1; // one way delay / propagation delay in ms
   int burst = 20; // burst in kb
   int latency = 400; // queing latency in ms
+  int jitter = 0; // delay variation in ms
 
-  std::optional<int> loss;
+  std::optional<int> loss; // in thousandths of the packets, as duplicates and reorder
   std::optional<int> duplicates;
+  std::optional<int> reorder;
+  int loss_burst = 1; // mean length of the loss bursts in packets, emulated link only
+
+  // Time varying link, the conditions above are the ones of every step unless it sets them
+  struct Step
+  {
+    int time; // ms since the start of the schedule
+    int bitrate;
+    std::optional<int> delay;
+    std::optional<int> loss;
+  };
+
+  std::vector<Step> schedule;
+  std::string trace; // path of a mahimahi trace or of a csv of steps, on the in-tunnel host
+  std::string trace_format; // "mahimahi" or "csv", from the extension when empty
+  int trace_bin = 100; // ms over which the packets of a mahimahi trace give the rate
+  std::optional<int> period; // ms after which the schedule repeats, mahimahi traces repeat by default
 
   bool reset = false; // if reset has been requested
 
+  std::string strand() const override { return "link"; }
+
   ResponsePtr run() override;
+
+private:
+  bool set_schedule(const tc::LinkState& base);
 };
 
 // Impl ///////////////////////////////////////////////////////////////////////
@@ -140,6 +179,8 @@ public:
   };
 
   std::vector<Point> stats;
+
+  std::string strand() const override { return "stats"; }
   
   ResponsePtr run() override;
 };
@@ -150,6 +191,8 @@ public:
   std::string exp_name;
   std::string transport; // QUIC / TCP / UDP
   std::string medooze_dump_url; // dump
+
+  std::string strand() const override { return "stats"; } // After the stats it moves are written
   
   ResponsePtr run() override;
 };
@@ -1,52 +1,222 @@
 #ifndef CONCURRENT_QUEUE_H
 #define CONCURRENT_QUEUE_H
 
-#include <queue>
+#include <deque>
 #include <mutex>
+#include <chrono>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <optional>
 #include <condition_variable>
 
+/**
+ * @brief Multi producer multi consumer queue under one lock, for handing items between threads
+ * that may block. Bounded by its capacity, 0 for no bound: the producers wait while it is full.
+ * Once closed, the pushes fail and the pops return what is left, then nothing.
+ */
 template<typename T>
-class ConcurrentQueue : public std::queue<T>
+class ConcurrentQueue
 {
-  std::mutex push_mutex;
-  std::mutex pop_mutex;
-  std::condition_variable is_empty;
-  
+  mutable std::mutex      _mutex;
+  std::condition_variable _not_empty;
+  std::condition_variable _not_full;
+  std::deque<T>           _items;
+
+  const size_t _capacity;
+  bool         _closed = false;
+
+  // Threads waiting on each condition, so the ones nobody waits on are not notified
+  unsigned _pop_waiters  = 0;
+  unsigned _push_waiters = 0;
+
+  bool full() const noexcept { return _capacity != 0 && _items.size() >= _capacity; }
+
+  /** @brief Under _mutex, released before notifying a waiting consumer */
+  template<typename U>
+  void push_locked(std::unique_lock<std::mutex>& lock, U&& elt);
+
+  /** @brief Under _mutex with the queue not empty, released before notifying a waiting producer */
+  T pop_locked(std::unique_lock<std::mutex>& lock);
+
 public:
-  ConcurrentQueue() = default;
-  virtual ~ConcurrentQueue() = default;
+  explicit ConcurrentQueue(size_t capacity = 0) noexcept : _capacity(capacity) {}
+
+  ConcurrentQueue(const ConcurrentQueue&) = delete;
+  ConcurrentQueue& operator=(const ConcurrentQueue&) = delete;
+
+  /** @brief Wait for room, false if the queue is closed */
+  bool push(T&& elt);
+  bool push(const T& elt);
+
+  /** @brief False if the queue is full or closed */
+  bool try_push(T&& elt);
+  bool try_push(const T& elt);
 
-  T pop();
-  
-  void push(T&& elt) noexcept;
-  void push(const T& elt);
+  /** @brief Wait for an item, nothing once the queue is closed and empty */
+  std::optional<T> pop();
+
+  std::optional<T> try_pop();
+
+  /** @brief Wait for an item up to timeout, nothing if none came or the queue is closed and empty */
+  template<typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * @brief Wait for an item, then move up to max items to out in one lock
+   * @return The number of items appended to out, 0 once the queue is closed and empty
+   */
+  size_t pop_bulk(std::vector<T>& out, size_t max);
+
+  /** @brief Wake every waiting thread, the items left can still be popped */
+  void close();
+
+  bool closed() const { std::lock_guard<std::mutex> lock(_mutex); return _closed; }
+  size_t size() const { std::lock_guard<std::mutex> lock(_mutex); return _items.size(); }
+  bool empty() const { return size() == 0; }
+  size_t capacity() const noexcept { return _capacity; }
 };
 
 template<typename T>
-T ConcurrentQueue<T>::pop()
+template<typename U>
+void ConcurrentQueue<T>::push_locked(std::unique_lock<std::mutex>& lock, U&& elt)
+{
+  _items.push_back(std::forward<U>(elt));
+
+  bool notify = _pop_waiters > 0;
+  lock.unlock();
+
+  if(notify) _not_empty.notify_one();
+}
+
+template<typename T>
+T ConcurrentQueue<T>::pop_locked(std::unique_lock<std::mutex>& lock)
 {
-  std::unique_lock<std::mutex> lock(pop_mutex);
-  while(std::queue<T>::empty()) is_empty.wait(lock);
-  T elt = std::queue<T>::front();
-  std::queue<T>::pop();
+  T elt = std::move(_items.front());
+  _items.pop_front();
+
+  bool notify = _push_waiters > 0;
+  lock.unlock();
+
+  if(notify) _not_full.notify_one();
+
   return elt;
 }
 
 template<typename T>
-void ConcurrentQueue<T>::push(T&& elt) noexcept
+bool ConcurrentQueue<T>::push(T&& elt)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  ++_push_waiters;
+  _not_full.wait(lock, [this]() { return _closed || !full(); });
+  --_push_waiters;
+
+  if(_closed) return false;
+
+  push_locked(lock, std::move(elt));
+  return true;
+}
+
+template<typename T>
+bool ConcurrentQueue<T>::push(const T& elt)
+{
+  return push(T(elt));
+}
+
+template<typename T>
+bool ConcurrentQueue<T>::try_push(T&& elt)
 {
-  std::lock_guard<std::mutex> lock(push_mutex);
-  std::queue<T>::push(std::move(elt));
-  is_empty.notify_all();
+  std::unique_lock<std::mutex> lock(_mutex);
+  if(_closed || full()) return false;
+
+  push_locked(lock, std::move(elt));
+  return true;
+}
+
+template<typename T>
+bool ConcurrentQueue<T>::try_push(const T& elt)
+{
+  return try_push(T(elt));
+}
+
+template<typename T>
+std::optional<T> ConcurrentQueue<T>::pop()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  ++_pop_waiters;
+  _not_empty.wait(lock, [this]() { return _closed || !_items.empty(); });
+  --_pop_waiters;
+
+  if(_items.empty()) return std::nullopt;
+
+  return pop_locked(lock);
+}
+
+template<typename T>
+std::optional<T> ConcurrentQueue<T>::try_pop()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  if(_items.empty()) return std::nullopt;
+
+  return pop_locked(lock);
 }
 
 template<typename T>
-void ConcurrentQueue<T>::push(const T& elt)
+template<typename Rep, typename Period>
+std::optional<T> ConcurrentQueue<T>::pop_for(const std::chrono::duration<Rep, Period>& timeout)
 {
-  std::lock_guard<std::mutex> lock(push_mutex);
-  std::queue<T>::push(elt);
-  is_empty.notify_all();
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  ++_pop_waiters;
+  _not_empty.wait_for(lock, timeout, [this]() { return _closed || !_items.empty(); });
+  --_pop_waiters;
+
+  if(_items.empty()) return std::nullopt;
+
+  return pop_locked(lock);
 }
 
+template<typename T>
+size_t ConcurrentQueue<T>::pop_bulk(std::vector<T>& out, size_t max)
+{
+  if(max == 0) return 0;
+
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  ++_pop_waiters;
+  _not_empty.wait(lock, [this]() { return _closed || !_items.empty(); });
+  --_pop_waiters;
+
+  size_t count = std::min(max, _items.size());
+  for(size_t i = 0; i < count; ++i) {
+    out.push_back(std::move(_items.front()));
+    _items.pop_front();
+  }
+
+  bool notify = _push_waiters > 0 && count > 0;
+  lock.unlock();
+
+  // As much room as items taken
+  if(notify) {
+    if(count > 1) _not_full.notify_all();
+    else _not_full.notify_one();
+  }
+
+  return count;
+}
+
+template<typename T>
+void ConcurrentQueue<T>::close()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _closed = true;
+  }
+
+  _not_empty.notify_all();
+  _not_full.notify_all();
+}
 
 #endif /* CONCURRENT_QUEUE_H */
@@ -28,6 +28,9 @@ JsonParser::CommandPtr JsonParser::parse_start_client(const json& data)
   if(auto dgram = data.find("datagrams"); dgram != data.end()) {
     cmd->datagrams = dgram->get<bool>();
   }
+  if(auto framed = data.find("framed_streams"); framed != data.end()) {
+    cmd->framed_streams = framed->get<bool>();
+  }
   if(auto cc = data.find("cc"); cc != data.end()) {
     cmd->cc = cc->get<std::string>();
   }
@@ -69,6 +72,9 @@ JsonParser::CommandPtr JsonParser::parse_start_server(const json& data)
   if(auto dgram = data.find("datagrams"); dgram != data.end()) {
     cmd->datagrams = dgram->get<bool>();
   }
+  if(auto framed = data.find("framed_streams"); framed != data.end()) {
+    cmd->framed_streams = framed->get<bool>();
+  }
   if(auto port = data.find("port_out"); port != data.end()) {
     cmd->port_out = port->get<int>();
   }
@@ -93,6 +99,9 @@ JsonParser::CommandPtr JsonParser::parse_start_server(const json& data)
   if(auto transfer = data.find("multiplexed_file_transfer"); transfer != data.end()) {
     cmd->multiplexed_file_transfer = transfer->get<bool>();
   }
+  if(auto workers = data.find("workers"); workers != data.end()) {
+    cmd->workers = workers->get<unsigned>();
+  }
   
   return std::move(cmd);
 }
@@ -124,11 +133,56 @@ JsonParser::CommandPtr JsonParser::parse_link(const json& data)
   if(auto duplicates = data.find("duplicates"); duplicates != data.end()) {
     cmd->duplicates = duplicates->get<int>();
   }
+
+  if(auto burst = data.find("burst"); burst != data.end()) {
+    cmd->burst = burst->get<int>();
+  }
+
+  if(auto latency = data.find("latency"); latency != data.end()) {
+    cmd->latency = latency->get<int>();
+  }
+
+  if(auto jitter = data.find("jitter"); jitter != data.end()) {
+    cmd->jitter = jitter->get<int>();
+  }
+
+  if(auto reorder = data.find("reorder"); reorder != data.end()) {
+    cmd->reorder = reorder->get<int>();
+  }
+
+  if(auto loss_burst = data.find("loss_burst"); loss_burst != data.end()) {
+    cmd->loss_burst = loss_burst->get<int>();
+  }
+    
+  if(auto schedule = data.find("schedule"); schedule != data.end()) {
+    for(const auto& step : *schedule) {
+      cmd::Link::Step s{ step.at("t").get<int>(), step.at("bitrate").get<int>() };
+      if(auto delay = step.find("delay"); delay != step.end()) s.delay = delay->get<int>();
+      if(auto loss = step.find("loss"); loss != step.end()) s.loss = loss->get<int>();
+      cmd->schedule.push_back(s);
+    }
+  }
+
+  if(auto trace = data.find("trace"); trace != data.end()) {
+    cmd->trace = trace->get<std::string>();
+  }
+
+  if(auto format = data.find("trace_format"); format != data.end()) {
+    cmd->trace_format = format->get<std::string>();
+  }
+
+  if(auto bin = data.find("trace_bin"); bin != data.end()) {
+    cmd->trace_bin = bin->get<int>();
+  }
+
+  if(auto period = data.find("period"); period != data.end()) {
+    cmd->period = period->get<int>();
+  }
     
   if(auto bitrate = data.find("bitrate"); bitrate != data.end()) {
     cmd->bitrate = bitrate->get<int>();
   }
-  else cmd->reset = true;
+  else if(cmd->schedule.empty() && cmd->trace.empty()) cmd->reset = true;
 
   return cmd;
 }
@@ -1,4 +1,8 @@
 #include "link.h"
+#include "link_schedule.h"
+
+#include <fstream>
+#include <algorithm>
 
 #include <libnl3/netlink/route/tc.h>
 #include <libnl3/netlink/route/qdisc.h>
@@ -8,6 +12,8 @@
 #include <fmt/core.h>
 #include <fmt/color.h>
 
+#include "netem/emulator.h"
+
 namespace tc
 {
 
@@ -18,6 +24,14 @@ struct nl_cache   * Link::cache   = NULL;
 struct rtnl_link  * Link::link    = NULL;
 
 bool Link::_init = false;
+bool Link::_installed = false;
+
+std::mutex Link::_mutex;
+
+std::thread             Link::_schedule_thread;
+std::mutex              Link::_schedule_mutex;
+std::condition_variable Link::_schedule_cv;
+bool                    Link::_schedule_stop = false;
 
 int Link::if_index = 0;
 
@@ -30,6 +44,11 @@ bool display_tc_error(const char * msg)
 
 bool Link::init(const char * if_name)
 {
+  if(netem::enabled()) {
+    fmt::print("Link emulated in userspace, {} is left untouched\n", if_name);
+    return true;
+  }
+
   // Alloc netlink socket
   nl_sock = nl_socket_alloc();
   if(!nl_sock) return display_tc_error("Could not alloc socket");
@@ -72,6 +91,8 @@ bool Link::init(const char * if_name)
 
 void Link::exit()
 {
+  stop_schedule();
+  
   if(!_init) return;
   // First remove link constraints
   reset_limit();
@@ -90,45 +111,151 @@ void Link::exit()
 
 void Link::reset_limit()
 {
+  stop_schedule();
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  
+  if(netem::enabled()) netem::Emulator::reset();
   if(!_init) return;
   
   rtnl_qdisc_delete(nl_sock, qtbf);
   rtnl_qdisc_delete(nl_sock, qnetem);
+  _installed = false;
 }
 
-bool Link::set_limit(std::chrono::milliseconds delay, bit::KiloBits rate,
-		     std::optional<int> loss, std::optional<int> duplicates)
+bool Link::set_limit(const LinkState& state)
 {
-  if(!_init) return false;
+  stop_schedule();
+
+  fmt::print("Set link: {} kbps, delay {} ms, jitter {} ms, loss {}, duplicates {}, reorder {}\n",
+	     state.rate.bytes() * 8 / 1000, state.delay.count(), state.jitter.count(), state.loss.value_or(0),
+	     state.duplicates.value_or(0), state.reorder.value_or(0));
   
-  reset_limit();
+  return apply(state);
+}
 
-  // Set delay for netem qdisc
-  auto delay_us = std::chrono::duration_cast<std::chrono::microseconds>(delay);
-  rtnl_netem_set_delay(qnetem, delay_us.count());
-  if(loss.has_value()) {
-    fmt::print("Set loss to {} \n", *loss);
-    rtnl_netem_set_loss(qnetem, *loss * (UINT_MAX / 1000));
+bool Link::apply(const LinkState& state)
+{
+  // Quiet, the steps of a schedule come up to every few ms
+  std::lock_guard<std::mutex> lock(_mutex);
+  
+  if(netem::enabled()) {
+    netem::Params params;
+    params.rate = state.rate.bytes();
+    params.burst = state.burst.bytes();
+    params.latency = state.latency;
+    params.delay = state.delay;
+    params.jitter = state.jitter;
+    params.loss = state.loss.value_or(0) / 1000.;
+    params.loss_burst = state.loss_burst;
+    params.duplicate = state.duplicates.value_or(0) / 1000.;
+    params.reorder = state.reorder.value_or(0) / 1000.;
+
+    netem::Emulator::set_params(params);
+    return true;
   }
-  if(duplicates.has_value()) {
-    fmt::print("Set duplicates to {} \n", *duplicates);
-    rtnl_netem_set_duplicate(qnetem, *duplicates);
+  
+  if(!_init) return false;
+
+  // Once installed the qdiscs are replaced in place, so a change does not flush their queues
+  if(!_installed) {
+    rtnl_qdisc_delete(nl_sock, qtbf);
+    rtnl_qdisc_delete(nl_sock, qnetem);
   }
 
+  // Set delay for netem qdisc. The qdisc objects are reused, every attribute is set again
+  auto delay_us = std::chrono::duration_cast<std::chrono::microseconds>(state.delay);
+  auto jitter_us = std::chrono::duration_cast<std::chrono::microseconds>(state.jitter);
+  rtnl_netem_set_delay(qnetem, delay_us.count());
+  rtnl_netem_set_jitter(qnetem, jitter_us.count());
+  rtnl_netem_set_loss(qnetem, state.loss.value_or(0) * (UINT_MAX / 1000));
+  rtnl_netem_set_duplicate(qnetem, state.duplicates.value_or(0) * (UINT_MAX / 1000));
+  rtnl_netem_set_reorder_probability(qnetem, state.reorder.value_or(0) * (UINT_MAX / 1000));
+
   // Set rate and limit for tbf qdisc
-  auto latency_us = std::chrono::duration_cast<std::chrono::microseconds>(LATENCY);
-  rtnl_qdisc_tbf_set_rate(qtbf, rate.bytes(), BURST.bytes(), 0);
+  auto latency_us = std::chrono::duration_cast<std::chrono::microseconds>(state.latency);
+  rtnl_qdisc_tbf_set_rate(qtbf, state.rate.bytes(), state.burst.bytes(), 0);
   rtnl_qdisc_tbf_set_limit_by_latency(qtbf, latency_us.count());
 
-  // Add netem qdisc (qdisc add)
-  auto ret = rtnl_qdisc_add(nl_sock, qnetem, NLM_F_CREATE);
+  // Add netem qdisc (qdisc replace)
+  auto ret = rtnl_qdisc_add(nl_sock, qnetem, NLM_F_CREATE | NLM_F_REPLACE);
   if(ret != 0) return display_tc_error("Could not add netem qdisc");
 
   // Add tbf qdisc
-  ret = rtnl_qdisc_add(nl_sock, qtbf, NLM_F_CREATE);
+  ret = rtnl_qdisc_add(nl_sock, qtbf, NLM_F_CREATE | NLM_F_REPLACE);
   if(ret != 0) return display_tc_error("Could not add tbf qdisc");
+
+  _installed = true;
   
   return true;
 }
 
+bool Link::set_schedule(LinkSchedule schedule)
+{
+  stop_schedule();
+
+  if(schedule.steps.empty()) return display_tc_error("Empty link schedule");
+  if(!std::is_sorted(schedule.steps.begin(), schedule.steps.end(),
+		     [](const auto& a, const auto& b) { return a.time < b.time; })) {
+    return display_tc_error("Link schedule steps are not in time order");
+  }
+  if(schedule.period.count() > 0 && schedule.period <= schedule.steps.back().time) {
+    return display_tc_error("Link schedule period shorter than its steps");
+  }
+  if(!netem::enabled() && !_init) return false;
+
+  _schedule_thread = std::thread(run_schedule, std::move(schedule));
+  
+  return true;
+}
+
+void Link::stop_schedule()
+{
+  if(!_schedule_thread.joinable()) return;
+
+  {
+    std::lock_guard<std::mutex> lock(_schedule_mutex);
+    _schedule_stop = true;
+  }
+
+  _schedule_cv.notify_one();
+  _schedule_thread.join();
+
+  _schedule_stop = false;
+}
+
+void Link::run_schedule(LinkSchedule schedule)
+{
+  using namespace std::chrono;
+  
+  std::ofstream ofs("link.csv");
+  ofs << "time,rate,delay,loss,late_us\n";
+
+  auto start = steady_clock::now();
+
+  for(int64_t loop = 0; ; ++loop) {
+    for(auto& step : schedule.steps) {
+      auto time = loop * schedule.period + step.time;
+      auto at = start + time;
+
+      {
+	std::unique_lock<std::mutex> lock(_schedule_mutex);
+	if(_schedule_cv.wait_until(lock, at, []() { return _schedule_stop; })) return;
+      }
+
+      // Time is the one of the schedule, how late the step was applied is logged aside
+      auto late = duration_cast<microseconds>(steady_clock::now() - at);
+      if(!apply(step.state)) return;
+
+      ofs << fmt::format("{},{},{},{},{}\n", time.count(), step.state.rate.bytes() * 8 / 1000,
+			 step.state.delay.count(), step.state.loss.value_or(0), late.count());
+    }
+
+    // Once played, the last state holds
+    if(schedule.period.count() == 0) break;
+
+    ofs.flush();
+  }
+}
+
 }
@@ -1,9 +1,12 @@
 #ifndef LINK_H
 #define LINK_H
 
+#include <mutex>
 #include <chrono>
+#include <thread>
 #include <concepts>
 #include <optional>
+#include <condition_variable>
 
 namespace std
 {
@@ -101,9 +104,33 @@ struct rtnl_link;
 namespace tc
 {
 
+struct LinkSchedule;
+
 using namespace std::chrono_literals;
 using namespace bit_literals;
 
+/**
+ * @brief Conditions of the link.
+ * Loss, duplicates and reorder are in thousandths of the packets.
+ */
+struct LinkState
+{
+  std::chrono::milliseconds delay   = 1ms;   // One way delay
+  bit::KiloBits             rate{0};         // Max bitrate
+  bit::KiloByte             burst   = 20_KB; // Token bucket size
+  std::chrono::milliseconds latency = 400ms; // Max queuing delay in the token bucket
+  std::chrono::milliseconds jitter  = 0ms;
+
+  std::optional<int> loss;
+  std::optional<int> duplicates;
+  std::optional<int> reorder;
+  int loss_burst = 1; // Mean length of the loss bursts in packets, only emulated
+};
+
+/**
+ * @brief Limits of the link, set with netem and tbf qdiscs on the interface, or applied by the
+ * userspace emulator of the tunnels with QUIC_TUNNEL_LINK=emulated
+ */
 class Link
 {
   static struct nl_sock    * nl_sock;
@@ -115,19 +142,34 @@ class Link
   static int if_index;
 
   static bool _init;
+  static bool _installed; // Whether the qdiscs are on the interface
+
+  // Serializes the changes of the websocket and schedule threads
+  static std::mutex _mutex;
+
+  // Schedule thread
+  static std::thread             _schedule_thread;
+  static std::mutex              _schedule_mutex;
+  static std::condition_variable _schedule_cv;
+  static bool                    _schedule_stop;
+
+  static void run_schedule(LinkSchedule schedule);
+  static bool apply(const LinkState& state);
   
 public:
   
-  static constexpr auto LATENCY = 400ms;
-  static constexpr auto BURST = 20_KB;
-  
   static bool init(const char * if_name);
   static void exit();
 
-  static bool set_limit(std::chrono::milliseconds delay,
-			bit::KiloBits rate,
-			std::optional<int> loss,
-			std::optional<int> duplicates);
+  /** @brief Set the link conditions, stopping any running schedule */
+  static bool set_limit(const LinkState& state);
+
+  /**
+   * @brief Apply the states of the schedule at their time from a thread of its own, until its
+   * end or the next link change. The states are logged in link.csv as they are applied.
+   */
+  static bool set_schedule(LinkSchedule schedule);
+  static void stop_schedule();
   
   static void reset_limit();
 };
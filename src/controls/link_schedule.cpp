@@ -0,0 +1,138 @@
+#include "link_schedule.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <fmt/core.h>
+
+namespace tc
+{
+
+static constexpr unsigned long long MAHIMAHI_MTU = 1500; // Bytes of each packet of the trace
+
+/** @brief Append a step, or drop it if it does not change the link */
+static void append(LinkSchedule& schedule, std::chrono::milliseconds time, const LinkState& state)
+{
+  if(!schedule.steps.empty()) {
+    auto& last = schedule.steps.back().state;
+    if(last.rate.bytes() == state.rate.bytes() && last.delay == state.delay && last.loss == state.loss) return;
+  }
+
+  schedule.steps.push_back({ time, state });
+}
+
+bool LinkSchedule::load_mahimahi(const std::string& path, const LinkState& base, LinkSchedule& schedule,
+				 std::chrono::milliseconds bin)
+{
+  std::ifstream ifs(path);
+  if(!ifs.is_open()) {
+    fmt::print("Could not open the mahimahi trace {}\n", path);
+    return false;
+  }
+
+  if(bin.count() <= 0) bin = std::chrono::milliseconds(100);
+
+  std::vector<unsigned long long> packets; // Per bin
+  long long last = 0;
+  long long ts;
+
+  while(ifs >> ts) {
+    if(ts < last) {
+      fmt::print("Mahimahi trace {} is not in time order at {} ms\n", path, ts);
+      return false;
+    }
+
+    last = ts;
+
+    size_t index = ts / bin.count();
+    if(index >= packets.size()) packets.resize(index + 1, 0);
+    ++packets[index];
+  }
+
+  if(!ifs.eof() || packets.empty() || last == 0) {
+    fmt::print("Could not read the mahimahi trace {}\n", path);
+    return false;
+  }
+
+  schedule.steps.clear();
+  schedule.period = std::chrono::milliseconds(last);
+
+  for(size_t i = 0; i < packets.size(); ++i) {
+    long long start = i * bin.count();
+    long long len = std::min<long long>(bin.count(), last - start);
+    if(len <= 0) break;
+
+    // An empty bin is an outage, at a rate that queues the packets instead of the unlimited 0
+    auto kbps = std::max(1ull, packets[i] * MAHIMAHI_MTU * 8 / len);
+
+    LinkState state = base;
+    state.rate = bit::KiloBits(kbps);
+    append(schedule, std::chrono::milliseconds(start), state);
+  }
+
+  fmt::print("Loaded mahimahi trace {}: {} steps over {} ms\n", path, schedule.steps.size(), last);
+
+  return true;
+}
+
+bool LinkSchedule::load_csv(const std::string& path, const LinkState& base, LinkSchedule& schedule)
+{
+  std::ifstream ifs(path);
+  if(!ifs.is_open()) {
+    fmt::print("Could not open the link csv {}\n", path);
+    return false;
+  }
+
+  schedule.steps.clear();
+  schedule.period = std::chrono::milliseconds(0);
+
+  std::string line;
+  int line_number = 0;
+
+  while(std::getline(ifs, line)) {
+    ++line_number;
+
+    auto first = line.find_first_not_of(" \t\r");
+    if(first == std::string::npos || line[first] == '#') continue;
+
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::istringstream iss(line);
+
+    long long time;
+    unsigned long long rate;
+    if(!(iss >> time >> rate)) {
+      // The header
+      if(line_number == 1) continue;
+
+      fmt::print("Link csv {}: invalid line {}\n", path, line_number);
+      return false;
+    }
+
+    if(!schedule.steps.empty() && time < schedule.steps.back().time.count()) {
+      fmt::print("Link csv {}: line {} is not in time order\n", path, line_number);
+      return false;
+    }
+
+    LinkState state = base;
+    state.rate = bit::KiloBits(rate);
+
+    int delay, loss;
+    if(iss >> delay) state.delay = std::chrono::milliseconds(delay);
+    if(iss >> loss) state.loss = loss;
+
+    schedule.steps.push_back({ std::chrono::milliseconds(time), state });
+  }
+
+  if(schedule.steps.empty()) {
+    fmt::print("Link csv {} has no step\n", path);
+    return false;
+  }
+
+  fmt::print("Loaded link csv {}: {} steps over {} ms\n", path, schedule.steps.size(),
+	     schedule.steps.back().time.count());
+
+  return true;
+}
+
+}
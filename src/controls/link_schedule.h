@@ -0,0 +1,47 @@
+#ifndef LINK_SCHEDULE_H
+#define LINK_SCHEDULE_H
+
+#include <vector>
+#include <string>
+
+#include "link.h"
+
+namespace tc
+{
+
+/** @brief Link state applied at a time of the schedule */
+struct LinkStep
+{
+  std::chrono::milliseconds time; // Since the start of the schedule
+  LinkState                 state;
+};
+
+/**
+ * @brief Link states to apply over time, in the order of their time.
+ * The last state holds at the end, unless the schedule repeats every period.
+ */
+struct LinkSchedule
+{
+  std::vector<LinkStep>     steps;
+  std::chrono::milliseconds period{0}; // 0 to play it once
+
+  /**
+   * @brief Load a Mahimahi trace, one line per MTU sized packet the link delivers at that
+   * millisecond. The packets are counted over bins of the given length to get the rate of each
+   * step, the other conditions come from base. The schedule repeats at the end of the trace as
+   * Mahimahi does.
+   */
+  static bool load_mahimahi(const std::string& path, const LinkState& base, LinkSchedule& schedule,
+			    std::chrono::milliseconds bin = std::chrono::milliseconds(100));
+
+  /**
+   * @brief Load a csv of "t,rate,delay,loss" lines, in ms, kbps, ms and thousandths of the
+   * packets. Delay and loss may be left out to keep the ones of base, a header line and lines
+   * starting with # are skipped.
+   */
+  static bool load_csv(const std::string& path, const LinkState& base, LinkSchedule& schedule);
+};
+
+}
+
+#endif /* LINK_SCHEDULE_H */
@@ -61,6 +61,7 @@ nlohmann::json Capabilities::data() const
       c.emplace("cc", cap.cc);
       c.emplace("streams", cap.streams);
       c.emplace("datagrams", cap.datagrams);
+      c.emplace("framed_streams", cap.framed_streams);
       caps.push_back(c);
     }
     
@@ -76,6 +77,7 @@ nlohmann::json Capabilities::data() const
       c.emplace("cc", cap.cc);
       c.emplace("datagrams", cap.datagrams);
       c.emplace("streams", cap.streams);
+      c.emplace("framed_streams", cap.framed_streams);
       caps.push_back(c);
     }
     
@@ -6,10 +6,15 @@
 #include "response.h"
 #include "commands.h"
 #include "websocket_server.h"
+#include "metrics.h"
+
+#include "in-tunnel/intunnel.h"
+#include "out-tunnel/outtunnel.h"
 
 using nlohmann::json;
 
 WebsocketServer::WebsocketServer() noexcept
+  : _pool(COMMAND_WORKERS), _queue(MAX_PENDING_REQUESTS)
 {
   _endpoint.set_error_channels(websocketpp::log::elevel::all);
   _endpoint.set_access_channels(websocketpp::log::alevel::none);
@@ -17,49 +22,56 @@ WebsocketServer::WebsocketServer() noexcept
   _endpoint.init_asio();
   
   _endpoint.set_message_handler([this](auto&& hdl, auto&& msg) { on_message(hdl, msg); });
+  _endpoint.set_http_handler([this](auto&& hdl) { on_http(hdl); });
   _endpoint.set_tcp_pre_bind_handler([this](auto&& acceptor) { return tcp_handler(acceptor); });
 
-  _process_th = std::jthread([this](std::stop_token stoken) -> void { process(stoken); });
+  _process_th = std::jthread([this]() -> void { process(); });
 }
 
 WebsocketServer::~WebsocketServer() noexcept
 {
-  _process_th.request_stop();
-  _queue.push({});
+  _queue.close();
   _process_th.join();
 }
 
-void WebsocketServer::process(std::stop_token stoken)
+void WebsocketServer::process()
 {
-  while(true) {
-    auto [hdl, msg] = _queue.pop();
-    
-    if(stoken.stop_requested()) return;
+  while(auto request = _queue.pop()) {
+    auto& [hdl, msg] = *request;
 
-      std::thread([this, hdl, msg]() {
+    std::shared_ptr<cmd::Command> cmd;
 
-        try {
-	  auto message = json::parse(msg->get_payload());
-	  auto cmd = _parser.parse_request(message);
+    try {
+      auto message = json::parse(msg->get_payload());
+      cmd = _parser.parse_request(message);
+    } catch(json::parse_error& error) {
+      response::Error err;
+      err.message = "Not valid JSON message";
+
+      send(hdl, _parser.make_response(&err));
+      continue;
+    } catch(json::exception&) {
+      cmd = nullptr;
+    }
 	  
-	  if(cmd == nullptr) {
-	    response::Error err;
-	    err.message = "Could not parse request";
+    if(cmd == nullptr) {
+      response::Error err;
+      err.message = "Could not parse request";
 	    
-	    send(hdl, _parser.make_response(&err));
-	  }
-	  else {
-	    auto response = cmd->run();
-	    send(hdl, _parser.make_response(response.get()));
-	  }
-	  
-	} catch(json::parse_error& error) {
-	  response::Error err;
-	  err.message = "Not valid JSON message";
-	  
-	  send(hdl, _parser.make_response(&err));
-	}
-    }).detach();    
+      send(hdl, _parser.make_response(&err));
+      continue;
+    }
+
+    // Run by the pool, in order with the commands of the same session
+    _pool.post(cmd->strand(), [this, hdl, cmd]() {
+      try {
+	auto response = cmd->run();
+	send(hdl, _parser.make_response(response.get()));
+      } catch(std::exception& e) {
+	// Kept in the worker, the pool outlives a failed command or a closed connection
+	fmt::print("Command failed : {}\n", e.what());
+      }
+    });
   }
 }
 
@@ -91,7 +103,32 @@ void WebsocketServer::run(int port)
 
 void WebsocketServer::on_message(websocketpp::connection_hdl hdl, server_t::message_ptr msg)
 {
-  _queue.push(std::make_pair(hdl, msg));
+  // Not blocking the asio loop, a full queue is answered right away
+  if(!_queue.try_push(std::make_pair(hdl, msg))) {
+    response::Error err;
+    err.message = "Too many pending requests";
+    
+    send(hdl, _parser.make_response(&err));
+  }
+}
+
+void WebsocketServer::on_http(websocketpp::connection_hdl hdl)
+{
+  auto con = _endpoint.get_con_from_hdl(hdl);
+
+  if(con->get_request().get_method() != "GET" || con->get_resource() != "/metrics") {
+    con->set_status(websocketpp::http::status_code::not_found);
+    return;
+  }
+
+  metrics::Writer writer;
+  
+  InTunnel::sessions.for_each([&writer](InTunnel& tunnel) { tunnel.collect_metrics(writer); });
+  OutTunnel::sessions.for_each([&writer](OutTunnel& tunnel) { tunnel.collect_metrics(writer); });
+
+  con->set_status(websocketpp::http::status_code::ok);
+  con->append_header("Content-Type", "text/plain; version=0.0.4");
+  con->set_body(writer.render());
 }
 
 void WebsocketServer::send(websocketpp::connection_hdl hdl, const std::string& msg)
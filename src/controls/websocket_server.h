@@ -16,6 +16,7 @@
 
 #include "json_parser.h"
 #include "concurrent_queue.h"
+#include "thread_pool.h"
 
 using server_t = websocketpp::server<websocketpp::config::asio>;
 
@@ -23,8 +24,12 @@ class WebsocketServer
 {
   using AcceptorPtr = websocketpp::lib::shared_ptr<websocketpp::lib::asio::ip::tcp::acceptor>;
 
+  static constexpr unsigned COMMAND_WORKERS = 4; // Threads running the commands
+  static constexpr size_t   MAX_PENDING_REQUESTS = 256; // Requests waiting to be parsed
+
   server_t   _endpoint;
   JsonParser _parser;
+  ThreadPool _pool; // After the endpoint and parser, its last commands use them
 
   std::jthread _process_th;
   
@@ -41,9 +46,15 @@ class WebsocketServer
   void on_message(websocketpp::connection_hdl, server_t::message_ptr msg);
 
   /**
-   * @brief Thread to pop request from queue and send it to the database manager (can't do it from message handler)
+   * @brief Called for a plain HTTP request. GET /metrics answers the metrics of every tunnel
+   * in the Prometheus text format, on the asio loop
+   */
+  void on_http(websocketpp::connection_hdl hdl);
+
+  /**
+   * @brief Thread to pop request from queue, parse it and post the command to the pool (can't do it from message handler)
    */
-  void process(std::stop_token stoken);
+  void process();
   
 public:
   WebsocketServer() noexcept;
@@ -0,0 +1,126 @@
+#ifndef FLOW_STATS_H
+#define FLOW_STATS_H
+
+#include <atomic>
+#include <limits>
+#include <cstdint>
+#include <string_view>
+
+#include <fmt/core.h>
+
+#include "tunnel_header.h"
+#include "metrics.h"
+
+/**
+ * @brief Receive statistics of one tunnel flow, from the optional fields of its headers.
+ * Updated by the single thread delivering the flow, read from any thread.
+ *
+ * A packet older than the highest sequence number seen is counted as reordered, the loss is
+ * the count of sequence numbers in the received range that never arrived. The one way delay
+ * uses the sender timestamp and is only meaningful between synchronized clocks.
+ */
+class FlowStats
+{
+  std::atomic<uint64_t> _packets{0};
+  std::atomic<uint64_t> _bytes{0};
+
+  // HAS_SEQ packets
+  std::atomic<uint64_t> _seq_packets{0};
+  std::atomic<uint64_t> _first_seq{0};
+  std::atomic<uint64_t> _highest_seq{0};
+  std::atomic<uint64_t> _reordered{0};
+
+  // HAS_TIMESTAMP packets, microseconds
+  std::atomic<uint64_t> _owd_count{0};
+  std::atomic<int64_t>  _owd_sum{0};
+  std::atomic<int64_t>  _owd_min{std::numeric_limits<int64_t>::max()};
+  std::atomic<int64_t>  _owd_max{std::numeric_limits<int64_t>::min()};
+
+  static void add(std::atomic<uint64_t>& counter, uint64_t v) noexcept
+  {
+    counter.store(counter.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+
+public:
+  /** @brief Delivery thread. Accounts a packet of len bytes, header excluded */
+  void on_packet(const tunnel::Header& header, size_t len, uint32_t now_us) noexcept
+  {
+    add(_packets, 1);
+    add(_bytes, len);
+
+    if(header.has_seq()) {
+      auto count = _seq_packets.load(std::memory_order_relaxed);
+      auto highest = _highest_seq.load(std::memory_order_relaxed);
+
+      if(count == 0) {
+	_first_seq.store(header.seq, std::memory_order_relaxed);
+	_highest_seq.store(header.seq, std::memory_order_relaxed);
+      }
+      else if(header.seq > highest) _highest_seq.store(header.seq, std::memory_order_relaxed);
+      else {
+	add(_reordered, 1);
+	// Late packet from before the first one seen, it extends the range
+	if(header.seq < _first_seq.load(std::memory_order_relaxed))
+	  _first_seq.store(header.seq, std::memory_order_relaxed);
+      }
+
+      _seq_packets.store(count + 1, std::memory_order_relaxed);
+    }
+
+    if(header.has_timestamp()) {
+      int64_t owd = (int32_t)(now_us - header.timestamp);
+
+      add(_owd_count, 1);
+      _owd_sum.store(_owd_sum.load(std::memory_order_relaxed) + owd, std::memory_order_relaxed);
+      if(owd < _owd_min.load(std::memory_order_relaxed)) _owd_min.store(owd, std::memory_order_relaxed);
+      if(owd > _owd_max.load(std::memory_order_relaxed)) _owd_max.store(owd, std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t packets() const noexcept { return _packets.load(std::memory_order_relaxed); }
+  uint64_t bytes() const noexcept { return _bytes.load(std::memory_order_relaxed); }
+  uint64_t reordered() const noexcept { return _reordered.load(std::memory_order_relaxed); }
+
+  /** @brief Sequence numbers missing from the received range, duplicates make it lower */
+  uint64_t lost() const noexcept
+  {
+    auto count = _seq_packets.load(std::memory_order_relaxed);
+    if(count == 0) return 0;
+
+    auto expected = _highest_seq.load(std::memory_order_relaxed)
+      - _first_seq.load(std::memory_order_relaxed) + 1;
+    return expected > count ? expected - count : 0;
+  }
+
+  /** @brief One way delay in microseconds, min, average and max, all 0 without timestamps */
+  int64_t owd_min() const noexcept { return _owd_count ? _owd_min.load(std::memory_order_relaxed) : 0; }
+  int64_t owd_max() const noexcept { return _owd_count ? _owd_max.load(std::memory_order_relaxed) : 0; }
+  int64_t owd_avg() const noexcept
+  {
+    auto count = _owd_count.load(std::memory_order_relaxed);
+    return count ? _owd_sum.load(std::memory_order_relaxed) / (int64_t)count : 0;
+  }
+
+  void collect(metrics::Writer& w, uint64_t flow_id) const
+  {
+    auto label = fmt::format("flow=\"{}\"", flow_id);
+
+    w.counter("quic_tunnel_flow_packets_total", "Packets of the flow received from the tunnel", packets(), label);
+    w.counter("quic_tunnel_flow_lost_total", "Sequence numbers of the flow never received", lost(), label);
+    w.counter("quic_tunnel_flow_reordered_total", "Packets of the flow received after a later one", reordered(), label);
+    w.gauge("quic_tunnel_flow_owd_microseconds", "One way delay of the flow",
+	    owd_min(), fmt::format("{},stat=\"min\"", label));
+    w.gauge("quic_tunnel_flow_owd_microseconds", "One way delay of the flow",
+	    owd_avg(), fmt::format("{},stat=\"avg\"", label));
+    w.gauge("quic_tunnel_flow_owd_microseconds", "One way delay of the flow",
+	    owd_max(), fmt::format("{},stat=\"max\"", label));
+  }
+
+  void print(std::string_view name, uint64_t flow_id) const
+  {
+    fmt::print("{} flow {}: {} packets, {} bytes, {} lost, {} reordered, owd min/avg/max {}/{}/{} us\n",
+	       name, flow_id, packets(), bytes(), lost(), reordered(), owd_min(), owd_avg(), owd_max());
+  }
+};
+
+#endif /* FLOW_STATS_H */
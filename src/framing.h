@@ -0,0 +1,209 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <cerrno>
+
+#include <sys/uio.h>
+
+/**
+ * Length prefixed packets on a long lived stream. Each packet is preceded by its length as a
+ * 16 bits big endian integer, so a single stream can carry the packets in order without a FIN
+ * between them.
+ */
+namespace framing
+{
+
+static constexpr size_t HEADER_LEN = 2;
+static constexpr size_t MAX_PAYLOAD_LEN = 0xffff;
+
+/** @brief Writes the length prefix of a len bytes packet in dst, HEADER_LEN bytes long. */
+inline void write_header(uint8_t * dst, size_t len) noexcept
+{
+  dst[0] = (len >> 8) & 0xff;
+  dst[1] = len & 0xff;
+}
+
+/** @brief Copies the packet with its prefix in dst, which holds at least HEADER_LEN + len bytes. */
+inline size_t write_frame(uint8_t * dst, const void * data, size_t len) noexcept
+{
+  write_header(dst, len);
+  memcpy(dst + HEADER_LEN, data, len);
+
+  return HEADER_LEN + len;
+}
+
+/**
+ * @brief Writes the prefix and the packet on a stream socket with a single writev,
+ * the rest is written again if the kernel took only part of it
+ * @return false on a socket error, errno is set
+ */
+inline bool send_frame(int fd, const void * data, size_t len) noexcept
+{
+  uint8_t header[HEADER_LEN];
+  write_header(header, len);
+
+  struct iovec iov[2] = {
+    { header, HEADER_LEN },
+    { const_cast<void*>(data), len }
+  };
+
+  struct iovec * first = iov;
+  int count = 2;
+
+  while(count > 0) {
+    auto n = writev(fd, first, count);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+
+    // Skip what has been written
+    while(count > 0 && (size_t)n >= first->iov_len) {
+      n -= first->iov_len;
+      ++first;
+      --count;
+    }
+
+    if(count > 0) {
+      first->iov_base = (uint8_t*)first->iov_base + n;
+      first->iov_len -= n;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Sender side of a framed stream, for the stacks that take only part of a write when
+ * the stream is flow control blocked. Frames are written in order, the bytes not taken yet
+ * are kept for the next drain.
+ */
+class Framer
+{
+  std::vector<uint8_t> _pending;
+  size_t _offset = 0; // First byte of _pending not written yet
+  size_t _max_pending;
+
+public:
+  explicit Framer(size_t max_pending = 1 << 20) : _max_pending(max_pending) {}
+
+  /** @brief Appends a packet, dropped and false when max_pending bytes are already waiting. */
+  bool push(const void * data, size_t len)
+  {
+    if(len > MAX_PAYLOAD_LEN || pending() + HEADER_LEN + len > _max_pending) return false;
+
+    // Reclaim the written bytes before growing
+    if(_offset > 0 && _offset >= _pending.size() / 2) {
+      _pending.erase(_pending.begin(), _pending.begin() + _offset);
+      _offset = 0;
+    }
+
+    auto size = _pending.size();
+    _pending.resize(size + HEADER_LEN + len);
+    write_frame(_pending.data() + size, data, len);
+
+    return true;
+  }
+
+  /**
+   * @brief Writes the pending bytes
+   * @param write Called as write(const uint8_t* data, size_t len), returns the number of bytes
+   * taken by the stream, 0 or less when it can not take more
+   */
+  template<typename Write>
+  void drain(Write&& write)
+  {
+    while(_offset < _pending.size()) {
+      auto n = write(_pending.data() + _offset, _pending.size() - _offset);
+      if(n <= 0) break;
+
+      _offset += n;
+    }
+
+    if(_offset == _pending.size()) reset();
+  }
+
+  void reset() noexcept
+  {
+    _pending.clear();
+    _offset = 0;
+  }
+
+  size_t pending() const noexcept { return _pending.size() - _offset; }
+};
+
+/**
+ * @brief Receiver side of a framed stream. Stream data is fed as it comes, in chunks of any size,
+ * and the complete packets are handed to a callback. A packet split between two chunks is kept
+ * until the rest arrives, whole packets are handed without copy.
+ */
+class Deframer
+{
+  std::vector<uint8_t> _partial; // Start of a packet, prefix included, split between chunks
+  size_t _need = 0; // Bytes still missing to complete _partial
+
+public:
+  /**
+   * @brief Feed the next chunk of the stream
+   * @param callback Called as callback(const char* packet, size_t len) for each complete packet
+   */
+  template<typename Callback>
+  void feed(const uint8_t * data, size_t len, Callback&& callback)
+  {
+    // Finish the packet started in a previous chunk
+    while(!_partial.empty() && len > 0) {
+      if(_partial.size() < HEADER_LEN) {
+	_partial.push_back(*data++);
+	--len;
+
+	if(_partial.size() < HEADER_LEN) continue;
+	_need = (_partial[0] << 8) | _partial[1];
+      }
+      else {
+	auto n = _need < len ? _need : len;
+	_partial.insert(_partial.end(), data, data + n);
+	data  += n;
+	len   -= n;
+	_need -= n;
+      }
+
+      if(_need == 0) {
+	callback((const char*)_partial.data() + HEADER_LEN, _partial.size() - HEADER_LEN);
+	_partial.clear();
+      }
+    }
+
+    // Whole packets straight from the chunk
+    while(len >= HEADER_LEN) {
+      size_t plen = (data[0] << 8) | data[1];
+      if(len < HEADER_LEN + plen) break;
+
+      callback((const char*)data + HEADER_LEN, plen);
+      data += HEADER_LEN + plen;
+      len  -= HEADER_LEN + plen;
+    }
+
+    // Keep the beginning of the next one
+    if(len > 0) {
+      _partial.assign(data, data + len);
+      _need = len >= HEADER_LEN ? ((data[0] << 8) | data[1]) - (len - HEADER_LEN) : 0;
+    }
+  }
+
+  /** @brief Drops a partial packet, when the stream is reset. */
+  void reset() noexcept
+  {
+    _partial.clear();
+    _need = 0;
+  }
+
+  bool empty() const noexcept { return _partial.empty(); }
+};
+
+}
+
+#endif /* FRAMING_H */
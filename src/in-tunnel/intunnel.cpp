@@ -14,7 +14,7 @@
 
 #include <glog/logging.h>
 
-std::unordered_map<int, std::shared_ptr<InTunnel>> InTunnel::sessions;
+SessionRegistry<InTunnel> InTunnel::sessions(InTunnel::MAX_NUMBER_SESSION);
 
 // Random Number generation ///////////////////////////////////////////////////
 
@@ -25,14 +25,8 @@ static RandomGenerator random_sequence()
   std::default_random_engine dre(r());
   std::uniform_int_distribution<int> uniform_dist(0, InTunnel::MAX_NUMBER_SESSION - 1);
 
-  for(;;) {
-    if(InTunnel::sessions.size() == InTunnel::MAX_NUMBER_SESSION)
-      co_yield -1;
-    
-    int id = uniform_dist(dre);
-    if(InTunnel::sessions.contains(id))
-      co_yield id;
-  }
+  // The registry draws the ids until a free one, under its lock
+  for(;;) co_yield uniform_dist(dre);
 }
 
 RandomGenerator InTunnel::_random_generator = random_sequence();
@@ -40,7 +34,7 @@ RandomGenerator InTunnel::_random_generator = random_sequence();
 // Mvfstclient ////////////////////////////////////////////////////////////////
 
 InTunnel::InTunnel(int id, std::string_view impl, std::string_view server_addr, uint16_t server_port)
-  : _id(id), _quic_client(nullptr), _datagrams(true),
+  : _id(id), _impl(impl), _quic_client(nullptr), _datagrams(true),
     _external_file_transfer(false), _multiplexed_file_transfer(false)
 {
   using namespace std::literals::string_view_literals;
@@ -51,6 +45,20 @@ InTunnel::InTunnel(int id, std::string_view impl, std::string_view server_addr,
   builder.dst_host = server_addr;
   builder.dst_port = server_port;
   builder.src_port = _in_port;
+
+  // The client talks to the relay, which sends to the server through the emulated link
+  if(netem::enabled()) {
+    if(impl == "tcp"sv) fmt::print("The emulated link only relays UDP, the tcp tunnel is not limited\n");
+    else {
+      _relay = std::make_unique<netem::Relay>();
+
+      if(_relay->start(server_addr, server_port)) {
+	builder.dst_host = "127.0.0.1";
+	builder.dst_port = _relay->port();
+      }
+      else _relay = nullptr;
+    }
+  }
   
   if(impl == "quicgo"sv)     builder.impl  = QuicClientBuilder::QuicImplementation::QUICGO;
   else if(impl == "mvfst"sv) builder.impl  = QuicClientBuilder::QuicImplementation::MVFST;
@@ -98,21 +106,35 @@ void InTunnel::run()
     _quic_client->start();
   
     while(true) {
-      auto len = _udp_socket.recv();
-      if(len == -1) break;
+      auto batch = _udp_socket.recv_batch();
+      if(batch.empty()) break;
 
-      const char * buffer = _udp_socket.get_buffer();
-      
-      if(_datagrams) _quic_client->send_message_datagram(buffer, len);
-      else _quic_client->send_message_stream(buffer, len);
+      if(_datagrams) _quic_client->send_message_datagrams(batch);
+      else {
+	for(auto& msg : batch) _quic_client->send_message_stream(msg.data(), msg.size());
+      }
     }
 
     if(pid != -1) kill(pid, SIGTERM);
 
+    {
+      std::lock_guard<std::mutex> lock(_cv_mutex);
+      _stopped = true;
+    }
+    
     _cv.notify_all();
   }
 }
 
+void InTunnel::collect_metrics(metrics::Writer& w) const
+{
+  w.set_labels(fmt::format("tunnel=\"{}\",side=\"in\",impl=\"{}\"", _id, _impl));
+
+  _udp_socket.collect_metrics(w);
+  _quic_client->collect_metrics(w);
+  if(_relay) _relay->collect(w);
+}
+
 bool InTunnel::set_cc(std::string_view cc)
 {
   fmt::print("Set {} congestion controller\n", cc);
@@ -126,6 +148,18 @@ void InTunnel::set_datagram(bool enable)
   _datagrams = enable;
 }
 
+bool InTunnel::set_framed_streams(bool enable)
+{
+  fmt::print("Set framed streams : {}\n", enable);
+
+  if(!_quic_client->set_framed_streams(enable)) {
+    fmt::print("Framed streams are not supported by this implementation\n");
+    return false;
+  }
+
+  return true;
+}
+
 int InTunnel::allocate_in_port()
 {
   _in_port = 3479;
@@ -139,10 +173,11 @@ void InTunnel::stop()
 
   {
     std::unique_lock<std::mutex> lock(_cv_mutex);
-    _cv.wait(lock);
+    _cv.wait(lock, [this]() { return _stopped; });
   }
   
   _quic_client->stop();
+  if(_relay) _relay->stop();
 }
 
 std::string InTunnel::get_qlog_file()
@@ -170,12 +205,12 @@ std::shared_ptr<InTunnel> InTunnel::create(std::string_view impl,
 {
   fmt::print("Create new quic client \n");
   
-  auto id     = _random_generator();
+  auto id     = sessions.reserve(_random_generator);
   if(id == -1) return nullptr;
   
   auto client = std::make_shared<InTunnel>(id, impl, server_addr, server_port);
 
-  sessions[id] = client;
+  sessions.insert(id, client);
   
   return client;
 }
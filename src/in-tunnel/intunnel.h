@@ -9,7 +9,10 @@
 
 #include "udp_socket.h"
 #include "random_generator.h"
+#include "session_registry.h"
 #include "capabilities.h"
+#include "metrics.h"
+#include "netem/relay.h"
 
 class QuicClient;
 
@@ -20,7 +23,9 @@ class QuicClient;
 class InTunnel
 {
   int _id; // Session id
+  std::string _impl; // Quic implementation name
   int _in_port; // udp socket listening port
+  std::unique_ptr<netem::Relay> _relay; // Emulated link to the quic server, if enabled
   std::unique_ptr<QuicClient> _quic_client;
   in::UdpSocket _udp_socket; // Udp socket listening to incoming RTP data
   bool _datagrams; // Whether to use datagrams or streams
@@ -34,13 +39,14 @@ class InTunnel
 
   std::condition_variable _cv;
   std::mutex _cv_mutex;
+  bool _stopped = false; // Set by run when it returns, under _cv_mutex
   
   static RandomGenerator _random_generator; // Random generator to generate the session id
 public:
   static constexpr auto MAX_NUMBER_SESSION = 5; // Max InTunnel sessions
 
   // Keep a pointer of tunnel session for graceful shutdown
-  static std::unordered_map<int, std::shared_ptr<InTunnel>> sessions;
+  static SessionRegistry<InTunnel> sessions;
 
   /**
    * @brief InTunnel ctr. Called by the static member create
@@ -66,6 +72,13 @@ public:
    */
   void set_datagram(bool enable);
 
+  /**
+   * @brief Whether the quic streams carry one packet each or several length prefixed packets
+   * @param enable true for a long lived framed stream, false for a stream per packet
+   * @return false if the implementation does not support framed streams
+   */
+  bool set_framed_streams(bool enable);
+
   /** 
    * @brief Find and returns a port to bind the UDP socket listening to RTP
    * @return The port which the UDP socket can be bound to
@@ -84,6 +97,11 @@ public:
    */
   std::string get_qlog_file();
 
+  /**
+   * @brief Any thread. Traffic of the UDP socket and metrics of the quic client, labelled with the tunnel
+   */
+  void collect_metrics(metrics::Writer& w) const;
+
   /**
    * @brief Start the quic client and bind the UDP socket to listen to incoming RTP data
    */
@@ -1,12 +1,17 @@
 #include "lsquic_client.h"
 
+#include "udp_gso.h"
+
 #include <lsquic_types.h>
 #include <lsquic.h>
 
 #include <fmt/core.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <ev.h>
 
 #include <limits.h>
+#include <algorithm>
 
 #include <openssl/ssl.h>
 #include <openssl/crypto.h>
@@ -49,7 +54,6 @@ static lsquic_conn_ctx_t * lsquic_on_new_conn(void * stream_if_ctx, lsquic_conn_
   
 static lsquic_stream_ctx_t * lsquic_on_new_stream(void * stream_if_ctx, lsquic_stream_t * stream)
 {
-  fmt::print("lsquic on new stream\n");
   auto client = reinterpret_cast<LsquicClient*>(stream_if_ctx);
   return client->on_new_stream(stream);
 }
@@ -57,31 +61,69 @@ static lsquic_stream_ctx_t * lsquic_on_new_stream(void * stream_if_ctx, lsquic_s
 static void lsquic_on_conn_closed (lsquic_conn_t * conn)
 {
   fmt::print("lsquic On connection closed\n");
+  auto client = reinterpret_cast<LsquicClient*>(lsquic_conn_get_ctx(conn));
+  if(client) client->on_conn_closed(conn);
 }
 
 static void lsquic_on_read(lsquic_stream_t * stream, lsquic_stream_ctx_t * st_h)
 {
-   fmt::print("lsquic On read\n");
-  auto client = reinterpret_cast<LsquicClient*>(st_h);
-  client->on_read(stream);
+  auto ctx = reinterpret_cast<LsquicClient::StreamCtx*>(st_h);
+  ctx->client->on_read(stream, ctx);
 }
 
 static void lsquic_on_write(lsquic_stream_t * stream, lsquic_stream_ctx_t * st_h)
 {
-  // fmt::print("lsquic On write\n");
-  auto client = reinterpret_cast<LsquicClient*>(st_h);
-  client->on_write(stream);
+  auto ctx = reinterpret_cast<LsquicClient::StreamCtx*>(st_h);
+  ctx->client->on_write(stream, ctx);
 }
 
 
 static void lsquic_on_stream_close(lsquic_stream_t * stream, lsquic_stream_ctx_t * st_h)
 {
-  fmt::print("lsquic On stream close\n");
+  auto ctx = reinterpret_cast<LsquicClient::StreamCtx*>(st_h);
+  if(ctx) ctx->client->on_stream_close(stream, ctx);
 }
 
 static void lsquic_on_datagram(lsquic_conn_t * conn, const void * buf, size_t size)
 {
-  fmt::print("lsquic On datagram\n");
+  auto client = reinterpret_cast<LsquicClient*>(lsquic_conn_get_ctx(conn));
+  if(client) client->on_datagram(buf, size);
+}
+
+static ssize_t lsquic_on_dg_write(lsquic_conn_t * conn, void * buf, size_t size)
+{
+  auto client = reinterpret_cast<LsquicClient*>(lsquic_conn_get_ctx(conn));
+  return client ? client->on_dg_write(conn, buf, size) : -1;
+}
+
+static void recv_cb(EV_P_ ev_io *w, int revents)
+{
+  auto client = reinterpret_cast<LsquicClient*>(w->data);
+  client->on_readable();
+}
+
+static void write_cb(EV_P_ ev_io *w, int revents)
+{
+  auto client = reinterpret_cast<LsquicClient*>(w->data);
+  client->on_writable();
+}
+
+static void timeout_cb(EV_P_ ev_timer *w, int revents)
+{
+  auto client = reinterpret_cast<LsquicClient*>(w->data);
+  client->process_conns();
+}
+
+static void stop_cb(EV_P_ ev_async *w, int revents)
+{
+  fmt::print("break lsquic loop\n");
+  ev_break(EV_A_ EVBREAK_ONE);
+}
+
+static void send_cb(EV_P_ ev_async *w, int revents)
+{
+  auto client = reinterpret_cast<LsquicClient*>(w->data);
+  client->drain_send();
 }
 
 static int lsquic_send_packets(void *ctx, const struct lsquic_out_spec *specs, unsigned n_specs)
@@ -169,7 +211,7 @@ void LsquicClient::exit_lsquic()
 
 
 LsquicClient::LsquicClient(std::string host, int port) noexcept
-  : _host(host), _port(port)
+  : _host(host), _port(port), _conn(nullptr), _engine(nullptr), _socket(-1), _gso(false)
 {
    fmt::print("LsquicServer::LsquicServer {} {}\n", host, port);
 
@@ -203,10 +245,13 @@ LsquicClient::LsquicClient(std::string host, int port) noexcept
   _stream_if->on_write = lsquic_on_write;
   _stream_if->on_close = lsquic_on_stream_close;
   _stream_if->on_datagram = lsquic_on_datagram;
+  _stream_if->on_dg_write = lsquic_on_dg_write;
 
   lsquic_engine_init_settings(_engine_settings, 0);
   _engine_settings->es_datagrams = 1;
   _engine_settings->es_ecn = 0;
+  // A stream per packet, leave room for a burst of them in flight
+  _engine_settings->es_init_max_streams_bidi = MAX_PENDING_STREAMS;
 
   fmt::print("QUIC VERSION : {}\n", _engine_settings->es_versions);
   
@@ -219,19 +264,22 @@ LsquicClient::LsquicClient(std::string host, int port) noexcept
   _engine_api->ea_alpn = "echo";
   // _engine_api.ea_lookup_cert = lookup_cert;
   // _engine_api.ea_cert_lu_ctx = (void*)this;
-  
-  fmt::print("lsquic engine new\n");
-  _engine = lsquic_engine_new(0, _engine_api);
-  if(!_engine) {
-    fmt::print("lsquic engine not so new\n");
-    std::exit(EXIT_SUCCESS);
-  }
 
+  // The engine is created on start, once the congestion controller is known
   _start = false;
 }
 
 LsquicClient::~LsquicClient()
 {
+  if(_loop) {
+    ev_loop_destroy(_loop);
+    _loop = nullptr;
+  }
+
+  close_socket();
+
+  if(_engine) lsquic_engine_destroy(_engine);
+  
   free(_engine_api);
   free(_stream_if);
   free(_logger_if);
@@ -270,195 +318,277 @@ bool LsquicClient::set_cc(std::string_view cc) noexcept
   return true;
 }
 
-void LsquicClient::init_socket()
+bool LsquicClient::set_framed_streams(bool enable)
+{
+  _framed = enable;
+  return true;
+}
+
+bool LsquicClient::init_socket()
 {
   fmt::print("Init lsquic udp socket\n");
   
   _socket = socket(AF_INET, SOCK_DGRAM, 0);
-  
-  struct timeval optval;
-  optval.tv_usec = 0;
-  optval.tv_sec = 5;
 
-  setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &optval, sizeof(optval));
+  if(_socket == -1) {
+    perror("Could not create UDP socket");
+    return false;
+  }
+
+  // Reads happen on readiness, until the socket is drained
+  fcntl(_socket, F_SETFL, fcntl(_socket, F_GETFL, 0) | O_NONBLOCK);
 
-  // memset((char *)&_addr_local, 0, sizeof(_addr_local));
-  // memset((char *)&_addr_peer, 0, sizeof(_addr_peer));
+  _gso = udp::enable_gso(_socket);
+  bool gro = udp::enable_gro(_socket);
 
-  // _addr_local.sin_family = AF_INET;
-  // _addr_local.sin_port = htons(_port);
-  // _addr_local.sin_addr.s_addr = htonl(INADDR_ANY);
+  memset((char *)&_addr_local, 0, sizeof(_addr_local));
 
-  if(_socket == -1) {
-    perror("Could not create UDP socket");
-    std::exit(EXIT_FAILURE);
+  _addr_local.sin_family = AF_INET;
+  _addr_local.sin_port = 0;
+  _addr_local.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if(bind(_socket, (struct sockaddr*)&_addr_local, sizeof(_addr_local)) == -1) {
+    perror("Could not bind UDP socket");
+    return false;
   }
-  // else if(bind(_socket, (struct sockaddr*)&_addr_local, sizeof(_addr_local)) == -1) {
-  //   perror("Could not bind UDP socket");
-  //   std::exit(EXIT_FAILURE);
-  // }
+
+  // Port picked by the kernel, lsquic needs the real local address
+  _addr_local_len = sizeof(_addr_local);
+  getsockname(_socket, (struct sockaddr*)&_addr_local, &_addr_local_len);
+
+  // The ev loop waits on the socket or on the completion ring of the engine, see poll_fd
+  _io = io::Engine::create(MAX_RECV_LEN, MAX_BATCH_LEN);
+  _io->attach(_socket, gro);
+
+  return true;
 }
 
 void LsquicClient::close_socket()
 {
   if(_socket != -1) {
+    if(_io) _io->close();
     ::close(_socket);
     _socket = -1;
   }
 }
 
-ssize_t LsquicClient::recv()
+void LsquicClient::start()
 {
-  if(_socket == -1) return -1;
+  auto host = gethostbyname(_host.c_str());
+  if(!host) {
+    fmt::print("lsquic could not resolve {}\n", _host);
+    return;
+  }
   
-  struct sockaddr_in addr;
-  socklen_t          slen = sizeof(addr);
-  ssize_t rec_len;
+  memset((char *)&_addr_peer, 0, sizeof(_addr_peer));
   
-  do {
-    rec_len = recvfrom(_socket, _buf, MAX_BUF_LEN, 0, (struct sockaddr*)&addr, &slen);
-    
-    if(rec_len == -1) {
-      if(_socket == -1) {
-	puts("Closing UDP socket");
-	return -1;
-      }
-      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-	puts("Refreshing UDP socket");
-      }
-      else {
-	perror("Could not receive data in UDP socket");
-	return -1;
-      }
-    }
-  } while(rec_len < 0);
+  _addr_peer.sin_family = AF_INET;
+  _addr_peer.sin_port = htons(_port);
+  memcpy(&_addr_peer.sin_addr, host->h_addr_list[0], host->h_length);
 
-  // _addr_peer.sin_family = AF_INET;
-  // _addr_peer.sin_port = addr.sin_port;
-  // _addr_peer.sin_addr.s_addr = addr.sin_addr.s_addr;
-  // _addr_peer_len = slen;
+  if(!init_socket()) {
+    close_socket();
+    return;
+  }
 
-  return rec_len;
-}
+  _engine_settings->es_cc_algo = _cc;
 
+  fmt::print("lsquic engine new\n");
+  _engine = lsquic_engine_new(0, _engine_api);
+  if(!_engine) {
+    fmt::print("lsquic engine not so new\n");
+    return;
+  }
 
-ssize_t LsquicClient::recv_msg()
-{
-  // struct msghdr msg = {
-  //       .msg_name       = &_addr_peer,
-  //       .msg_namelen    = sizeof(_addr_peer),
-  //       .msg_iov        = &packs_in->vecs[iter->ri_idx],
-  //       .msg_iovlen     = 1,
-  //       .msg_control    = ctl_buf,
-  //       .msg_controllen = CTL_SZ,
-  //  };
+  _loop = ev_loop_new(EVFLAG_AUTO);
+  if(!_loop) {
+    fmt::print("LsquicClient could not create ev loop\n");
+    return;
+  }
 
-  //  auto nread = recvmsg(_socket, &msg, 0);
+  _io_watcher = std::make_unique<struct ev_io>();
+  ev_io_init(_io_watcher.get(), recv_cb, _io->poll_fd(), EV_READ);
+  _io_watcher->data = (void*)this;
+  ev_io_start(_loop, _io_watcher.get());
 
-  //  if (-1 == nread) {
-  //    if (!(EAGAIN == errno || EWOULDBLOCK == errno))
-  //      LSQ_ERROR("recvmsg: %s", strerror(errno));
-  //    return ROP_ERROR;
-  //  }
-  //  if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC))
-  //    {
-  //      if (msg.msg_flags & MSG_TRUNC)
-  // 	 LSQ_INFO("packet truncated - drop it");
-  //      if (msg.msg_flags & MSG_CTRUNC)
-  // 	 LSQ_WARN("packet's auxilicary data truncated - drop it");
-  //      goto top;
-  //    }
-}
+  _write_watcher = std::make_unique<struct ev_io>();
+  ev_io_init(_write_watcher.get(), write_cb, _socket, EV_WRITE);
+  _write_watcher->data = (void*)this;
 
+  _timer = std::make_unique<struct ev_timer>();
+  ev_init(_timer.get(), timeout_cb);
+  _timer->data = (void*)this;
 
-void LsquicClient::start()
-{
-  memset((char *)&_addr_local, 0, sizeof(_addr_local));
-  memset((char *)&_addr_peer, 0, sizeof(_addr_peer));
-
-  _addr_local.sin_family = AF_INET;
-  _addr_local.sin_port = 0;
-  _addr_local.sin_addr.s_addr = htonl(INADDR_ANY);
-
-  bind(_socket, (struct sockaddr*)&_addr_local, sizeof(_addr_local));
-
-  auto host = gethostbyname(_host.c_str());
-  
-  _addr_peer.sin_family = AF_INET;
-  _addr_peer.sin_port = htons(_port);
-  memcpy(&_addr_peer.sin_addr, host->h_addr_list[0], host->h_length);
+  _stop_watcher = std::make_unique<struct ev_async>();
+  ev_async_init(_stop_watcher.get(), stop_cb);
+  _stop_watcher->data = (void*)this;
+  ev_async_start(_loop, _stop_watcher.get());
 
-  init_socket();
+  _send_watcher = std::make_unique<struct ev_async>();
+  ev_async_init(_send_watcher.get(), send_cb);
+  _send_watcher->data = (void*)this;
+  ev_async_start(_loop, _send_watcher.get());
   
+  // The loop thread is not running yet, the engine can still be used from here
   _conn = lsquic_engine_connect(_engine, N_LSQVER,
 				(struct sockaddr *)&_addr_local, (struct sockaddr *)&_addr_peer,
 				(void *)this, NULL, NULL, 0, NULL, 0, NULL, 0);
 
-  lsquic_engine_process_conns(_engine);
+  process_conns();
+
+  _start = true;
   
   _thread = std::thread([this](){
-    _run = true;
-    int diff;
+    ev_run(_loop, 0);
+
+    ev_timer_stop(_loop, _timer.get());
+    ev_io_stop(_loop, _write_watcher.get());
+    ev_io_stop(_loop, _io_watcher.get());
     
-    while(_run) {
-      lsquic_engine_process_conns(_engine);
-
-      if (lsquic_engine_earliest_adv_tick(_engine, &diff)) {
-	std::this_thread::sleep_for(std::chrono::microseconds(diff));	
-      }
-      else {
-	std::this_thread::sleep_for(std::chrono::microseconds(100));
-      }
-    }
+    fmt::print("Exit lsquic loop\n");
   });
+}
 
-  _recv_th = std::thread([this](){
-    _run = true;
+void LsquicClient::stop()
+{
+  _start = false;
 
-    while(_run) {
-      auto len = recv();
-      if(len == -1) break;
+  if(_loop) {
+    ev_async_send(_loop, _stop_watcher.get());
+    if(_thread.joinable()) _thread.join();
+  }
+  
+  close_socket();
+}
+
+void LsquicClient::on_readable()
+{
+  // Bounded, so a flood can not starve the timer. The watcher fires again if data is left
+  for(unsigned batch = 0; batch < MAX_READ_BATCHES; ++batch) {
+    auto n = _io->recv();
+    if(n <= 0) break;
 
-      auto result = lsquic_engine_packet_in(_engine, _buf, len,
-					    (struct sockaddr*)&_addr_local, (struct sockaddr*)&_addr_peer,
+    // GRO coalesced reads are already split in packets by the io engine
+    for(int i = 0; i < n; ++i) {
+      auto packet = _io->payloads()[i];
+
+      auto result = lsquic_engine_packet_in(_engine, (const unsigned char*)packet.data(), packet.size(),
+					    (struct sockaddr*)&_addr_local, _io->peer(i),
 					    (void*)this, 0);
 
-      switch(result) {
-      case 0:
-	fmt::print("Packet was processed by a real connection.\n");
-	break;
-      case 1:
-	fmt::print("Packet was handled successfully, but not by a connection\n");
-	break;
-      case -1:
-	fmt::print("Error from lsquic_engine_packet_in\n");
-	break;
-      default:
-	fmt::print("Unknown result from lsquic_engine_packet_in\n");
-      }
-
-      lsquic_engine_process_conns(_engine);
+      if(result == -1) fmt::print("Error from lsquic_engine_packet_in\n");
     }
-  });
+  }
+
+  process_conns();
 }
 
-void LsquicClient::stop()
+void LsquicClient::on_writable()
 {
-  _run = false;
-  _thread.join();
-  _recv_th.join();
-  close_socket();
+  ev_io_stop(_loop, _write_watcher.get());
   
+  lsquic_engine_send_unsent_packets(_engine);
+  process_conns();
 }
 
-void LsquicClient::send_message_stream(const char * buffer, size_t len)
+void LsquicClient::process_conns()
+{
+  // Packets held after a send error other than a full socket buffer
+  if(!ev_is_active(_write_watcher.get()) && lsquic_engine_has_unsent_packets(_engine)) {
+    lsquic_engine_send_unsent_packets(_engine);
+  }
+  
+  lsquic_engine_process_conns(_engine);
+
+  ev_timer_stop(_loop, _timer.get());
+
+  int diff;
+  if(lsquic_engine_earliest_adv_tick(_engine, &diff)) {
+    // A tick already due runs on the next loop iteration
+    ev_timer_set(_timer.get(), std::max(diff, MIN_TICK_US) / 1e6, 0.);
+    ev_timer_start(_loop, _timer.get());
+  }
+}
+
+bool LsquicClient::queue_packet(const char * buffer, size_t len, bool datagram)
 {
+  auto * packet = _send_ring.claim();
+
+  if(!packet || len > sizeof(packet->data)) {
+    if(auto dropped = ++_send_dropped; dropped % 1000 == 1) fmt::print("lsquic client dropped {} packets\n", dropped);
+    return false;
+  }
 
+  memcpy(packet->data, buffer, len);
+  packet->len = len;
+  packet->datagram = datagram;
+  _send_ring.publish();
+
+  return true;
+}
+
+void LsquicClient::wake()
+{
+  // Wakeups are coalesced by libev until the loop runs the watcher
+  if(_start) ev_async_send(_loop, _send_watcher.get());
+}
+
+void LsquicClient::send_message_stream(const char * buffer, size_t len)
+{
+  if(queue_packet(buffer, len, false)) wake();
 }
 
 void LsquicClient::send_message_datagram(const char * buffer, size_t len)
 {
+  if(queue_packet(buffer, len, true)) wake();
+}
+
+void LsquicClient::send_message_datagrams(std::span<const std::string_view> messages)
+{
+  for(auto& msg : messages) queue_packet(msg.data(), msg.size(), true);
+
+  // Only one wakeup for the whole batch
+  wake();
+}
+
+void LsquicClient::drain_send()
+{
+  while(auto * packet = _send_ring.front()) {
+    if(!_conn) {
+      // Connection gone, nothing to tunnel the packet in
+      _send_ring.release();
+      continue;
+    }
+    
+    if(packet->datagram) {
+      // Taken from the ring by on_dg_write, as soon as the connection can send it
+      lsquic_conn_want_datagram_write(_conn, 1);
+      break;
+    }
+
+    send_stream(packet->data, packet->len);
+    _send_ring.release();
+  }
+
+  process_conns();
+}
+
+void LsquicClient::send_stream(const char * buffer, size_t len)
+{
+  if(_framed) {
+    if(!_framer.push(buffer, len)) fmt::print("Framed stream blocked, packet dropped\n");
+    else if(_stream) lsquic_stream_wantwrite(_stream, 1);
+    return;
+  }
 
+  if(_pending_streams.size() >= MAX_PENDING_STREAMS) {
+    fmt::print("Too many lsquic streams pending, packet dropped\n");
+    return;
+  }
+  
+  // The packet is written once lsquic gives the new stream in on_new_stream
+  _pending_streams.emplace_back(buffer, buffer + len);
+  lsquic_conn_make_stream(_conn);
 }
 
 Capabilities LsquicClient::get_capabilities()
@@ -468,6 +598,7 @@ Capabilities LsquicClient::get_capabilities()
   
   cap.datagrams = true;
   cap.streams = true;
+  cap.framed_streams = true;
   
   cap.cc.emplace_back("cubic");
   cap.cc.emplace_back("bbrv1");
@@ -479,85 +610,163 @@ Capabilities LsquicClient::get_capabilities()
 lsquic_conn_ctx_t * LsquicClient::on_new_conn(lsquic_conn_t *conn)
 {
   fmt::print("LsquicClient::on_new_conn\n");
-  // lsquic_engine_process_conns(_engine);
-  lsquic_conn_make_stream(conn);
+
+  // One bidirectional stream for the whole connection, the server answers on it
+  if(_framed) lsquic_conn_make_stream(conn);
+  
+  return (lsquic_conn_ctx_t*)this;
 }
 
 // lsquic callback
 lsquic_stream_ctx_t * LsquicClient::on_new_stream(lsquic_stream_t * stream)
 {
-  fmt::print("LsquicClient::on_new_stream\n");
-  _stream = stream;
-  // lsquic_engine_process_conns(_engine);
+  // The connection is going away, the stream will not be created
+  if(!stream) {
+    if(!_pending_streams.empty()) _pending_streams.pop_front();
+    return nullptr;
+  }
   
-  lsquic_stream_wantwrite(_stream, 1);
-  lsquic_stream_wantread(_stream, 1);
+  auto * ctx = new StreamCtx{this};
+
+  if(lsquic_stream_id(stream) & 0x01) {
+    // Opened by the server, for one packet
+    lsquic_stream_wantread(stream, 1);
+  }
+  else if(_framed && !_stream) {
+    fmt::print("LsquicClient framed stream open\n");
+    
+    _stream = stream;
+    ctx->framed = true;
+    
+    lsquic_stream_wantread(stream, 1);
+    if(_framer.pending() > 0) lsquic_stream_wantwrite(stream, 1);
+  }
+  else if(!_pending_streams.empty()) {
+    ctx->buf = std::move(_pending_streams.front());
+    _pending_streams.pop_front();
+    
+    lsquic_stream_wantwrite(stream, 1);
+  }
+  else {
+    lsquic_stream_close(stream);
+  }
+
+  return (lsquic_stream_ctx_t*)ctx;
 }
 
 void LsquicClient::on_conn_closed(lsquic_conn_t * conn)
 {
   fmt::print("LsquicClient::on_conn_closed\n");
+
+  _conn = nullptr;
+  _pending_streams.clear();
+  lsquic_conn_set_ctx(conn, nullptr);
 }
 
-void LsquicClient::on_read(lsquic_stream_t * stream)
+void LsquicClient::on_read(lsquic_stream_t * stream, StreamCtx * ctx)
 {
-  fmt::print("LsquicClient::on_read\n");
+  uint8_t buf[READ_BUF_LEN];
+  ssize_t nr;
 
-  unsigned char buf[MAX_BUF_LEN];
-  ssize_t nr = lsquic_stream_read(stream, buf, sizeof(buf));
+  while((nr = lsquic_stream_read(stream, buf, sizeof(buf))) > 0) {
+    if(ctx->framed) {
+      if(_on_received_callback) _deframer.feed(buf, nr, _on_received_callback);
+    }
+    else if(ctx->buf.size() + nr <= framing::MAX_PAYLOAD_LEN) {
+      ctx->buf.insert(ctx->buf.end(), buf, buf + nr);
+    }
+  }
 
-  fmt::print("Received {} bytes message : {}", nr, (char*)buf);
+  if(nr == 0) {
+    // FIN, the packet of this stream is complete
+    if(!ctx->framed && _on_received_callback) _on_received_callback(ctx->buf.data(), ctx->buf.size());
+    lsquic_stream_close(stream);
+  }
+  else if(errno != EWOULDBLOCK && errno != EAGAIN) {
+    perror("lsquic could not read stream");
+    lsquic_stream_close(stream);
+  }
+}
 
-  if (nr == 0) /* EOF */ {
-    lsquic_stream_shutdown(stream, 0);
-    // lsquic_stream_wantwrite(stream, 1); /* Want to reply */
+void LsquicClient::on_write(lsquic_stream_t * stream, StreamCtx * ctx)
+{
+  if(ctx->framed) {
+    _framer.drain([stream](const uint8_t * data, size_t len) {
+      return lsquic_stream_write(stream, data, len);
+    });
+    
+    if(_framer.pending() == 0) lsquic_stream_wantwrite(stream, 0);
+    lsquic_stream_flush(stream);
+    return;
   }
+  
+  auto n = lsquic_stream_write(stream, ctx->buf.data() + ctx->offset, ctx->buf.size() - ctx->offset);
+  if(n < 0) {
+    perror("lsquic could not write stream");
+    lsquic_stream_close(stream);
+    return;
+  }
+
+  ctx->offset += n;
+
+  // Whole packet written, close sends it with the FIN
+  if(ctx->offset == ctx->buf.size()) lsquic_stream_close(stream);
 }
 
-void LsquicClient::on_write(lsquic_stream_t * stream)
+void LsquicClient::on_stream_close(lsquic_stream_t * stream, StreamCtx * ctx)
 {
-  fmt::print("LsquicClient::on_write\n");
+  if(ctx->framed) {
+    fmt::print("LsquicClient framed stream closed\n");
+    
+    _stream = nullptr;
+    _framer.reset();
+    _deframer.reset();
+  }
 
-  // lsquic_engine_process_conns(_engine);
-  
-  char buf[] = "Hello";
-  lsquic_stream_write(stream, buf, sizeof(buf));
-  
-  lsquic_stream_wantwrite(stream, 0);
-  lsquic_stream_wantread(stream, 1);
-  
-  // lsquic_stream_shutdown(stream, 0);
+  delete ctx;
 }
 
-void LsquicClient::on_stream_close(lsquic_stream_t * stream)
+void LsquicClient::on_datagram(const void * buf, size_t len)
 {
-  fmt::print("LsquicClient::on_stream_close\n");
+  if(_on_received_callback) _on_received_callback((const char*)buf, len);
 }
 
-int LsquicClient::send_packets_out(const struct lsquic_out_spec *specs, unsigned n_specs)
+ssize_t LsquicClient::on_dg_write(lsquic_conn_t * conn, void * buf, size_t len)
 {
-  fmt::print("LsquicClient::send_packets_out\n");
+  auto * packet = _send_ring.front();
+
+  // Larger than what a QUIC packet can carry, it would never be sent
+  while(packet && packet->datagram && packet->len > len) {
+    if(auto dropped = ++_send_dropped; dropped % 1000 == 1) fmt::print("lsquic client dropped {} packets\n", dropped);
+    _send_ring.release();
+    packet = _send_ring.front();
+  }
   
-  struct msghdr msg;
-  unsigned n;
-
-  memset(&msg, 0, sizeof(msg));
-
-  for (n = 0; n < n_specs; ++n) {
-    msg.msg_name       = (void *) specs[n].dest_sa;
-    msg.msg_namelen    = sizeof(struct sockaddr_in);
-    msg.msg_iov        = specs[n].iov;
-    msg.msg_iovlen     = specs[n].iovlen;
-    if (sendmsg(_socket, &msg, 0) < 0) {
-      perror("noooo");
-      break;
-    }
-    else {
-      // fmt::print("Sending at least something\n");
-    }
+  if(!packet || !packet->datagram) {
+    lsquic_conn_want_datagram_write(conn, 0);
+
+    // Stream packets queued behind the datagrams go on the next loop iteration
+    if(packet) ev_async_send(_loop, _send_watcher.get());
+    return -1;
   }
 
-  // fmt::print("n : {} {}\n", n, n_specs);
+  ssize_t written = packet->len;
+  memcpy(buf, packet->data, packet->len);
+  _send_ring.release();
+
+  return written;
+}
 
-  return (int) n;
+int LsquicClient::send_packets_out(const struct lsquic_out_spec *specs, unsigned n_specs)
+{
+  // Equal sized packets for one peer go out in a single sendmsg when GSO is enabled
+  errno = 0;
+  int n = udp::send_specs(_socket, _gso, specs, n_specs);
+
+  // The engine holds the rest until lsquic_engine_send_unsent_packets
+  if(n < (int)n_specs && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    ev_io_start(_loop, _write_watcher.get());
+  }
+  
+  return n;
 }
@@ -2,6 +2,9 @@
 #define LSQUIC_CLIENT_H
 
 #include "quic_client.h"
+#include "io/io_engine.h"
+#include "spsc_ring.h"
+#include "framing.h"
 
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -11,6 +14,9 @@
 #include <condition_variable>
 #include <atomic>
 #include <thread>
+#include <memory>
+#include <deque>
+#include <vector>
 
 struct lsquic_engine;
 typedef struct lsquic_engine lsquic_engine_t;
@@ -38,9 +44,24 @@ typedef struct ssl_ctx_st SSL_CTX;
 struct lsquic_stream;
 typedef struct lsquic_stream lsquic_stream_t;
 
+struct ev_loop;
+struct ev_io;
+struct ev_timer;
+struct ev_async;
+
+/**
+ * @brief lsquic client. The socket and the engine belong to one ev loop thread,
+ * every lsquic call happens on that thread.
+ */
 class LsquicClient final : public QuicClient
 {
   static constexpr auto MAX_BUF_LEN = 2048u;
+  static constexpr auto MAX_RECV_LEN = 65535u; // Room for GRO coalesced reads
+  static constexpr auto MAX_BATCH_LEN = 8u;
+  static constexpr auto MAX_READ_BATCHES = 16u; // Per socket readiness
+  static constexpr int  MIN_TICK_US = 1; // A zero timer would not be armed
+  static constexpr auto MAX_PENDING_STREAMS = 1024u; // Packets waiting for their stream
+  static constexpr auto READ_BUF_LEN = 16384u;
 
   enum Congestion : uint8_t {
     DEFAULT_CC = 0,
@@ -54,7 +75,8 @@ class LsquicClient final : public QuicClient
   std::string _qlog_filename;
   int         _port;
   bool        _datagrams;
-  uint8_t     _cc;
+  bool        _framed = false;
+  uint8_t     _cc = DEFAULT_CC;
 
   SSL_CTX    * _ssl_ctx;
 
@@ -64,36 +86,68 @@ class LsquicClient final : public QuicClient
   lsquic_stream_if   *     _stream_if;
   lsquic_logger_if   *     _logger_if;
   lsquic_engine_settings * _engine_settings;
-  lsquic_stream_t * _stream;
+  lsquic_stream_t * _stream = nullptr; // Framed stream
   
   int _socket;
-  unsigned char _buf[MAX_BUF_LEN];
+  bool _gso; // UDP_SEGMENT egress
+
+  std::unique_ptr<io::Engine> _io; // Batched (and GRO) reads on _socket
   
   struct sockaddr_in _addr_peer;
   struct sockaddr_in _addr_local;
   socklen_t          _addr_local_len;
   socklen_t          _addr_peer_len;
 
-  std::condition_variable _cv;
-  std::mutex _cv_mutex;
-  
   static std::atomic<int> _ref_count;
   std::atomic<bool>       _start;
 
+  struct ev_loop * _loop = nullptr;
+  std::unique_ptr<struct ev_io>    _io_watcher;
+  std::unique_ptr<struct ev_io>    _write_watcher; // Started while the socket buffer is full
+  std::unique_ptr<struct ev_timer> _timer; // Next tick asked by the engine
+  std::unique_ptr<struct ev_async> _stop_watcher;
+  std::unique_ptr<struct ev_async> _send_watcher; // Wakes the loop when the send ring is filled
   std::thread _thread;
-  std::thread _recv_th;
-  bool _run;
+
+  /** @brief A packet handed from the in-tunnel thread to the loop thread */
+  struct Packet
+  {
+    uint32_t len;
+    bool     datagram;
+    char     data[MAX_BUF_LEN];
+  };
+
+  // In-tunnel thread -> loop thread. Every lsquic call happens on the loop thread
+  SpscRing<Packet, 1024> _send_ring;
+  std::atomic<uint64_t> _send_dropped = 0; // Also counted by the loop thread, in on_dg_write
+
+  // Loop thread only. Packets sent on a stream of their own, until lsquic creates it
+  std::deque<std::vector<char>> _pending_streams;
+
+  // Framed mode, packets not taken by the stream yet and partial packet received
+  framing::Framer   _framer;
+  framing::Deframer _deframer;
   
   static void init_lsquic();
   static void exit_lsquic();
 
-  void init_socket();
+  bool init_socket();
   void close_socket();
 
-  ssize_t recv();
-  ssize_t recv_msg();
+  bool queue_packet(const char * buffer, size_t len, bool datagram);
+  void wake();
+  void send_stream(const char * buffer, size_t len);
   
 public:
+  /** @brief State of one lsquic stream, given back by lsquic in every stream callback */
+  struct StreamCtx
+  {
+    LsquicClient *    client;
+    bool              framed = false;
+    std::vector<char> buf; // Packet to write, or packet read so far
+    size_t            offset = 0; // Bytes of buf already written
+  };
+  
   static constexpr const char * DEFAULT_QLOG_PATH = "tunnel-in-logs";
   static constexpr const char * IMPL_NAME = "lsquic";
   
@@ -106,20 +160,38 @@ public:
   std::string_view get_qlog_filename() const noexcept override;
 
   bool set_cc(std::string_view cc) noexcept override;
+  bool set_framed_streams(bool enable) override;
   void start() override;
   void stop() override;
   void send_message_stream(const char * buffer, size_t len) override;
   void send_message_datagram(const char * buffer, size_t len) override;
+  void send_message_datagrams(std::span<const std::string_view> messages) override;
 
   SSL_CTX* get_ssl_ctx() { return _ssl_ctx; }
+
+  // Loop thread callbacks
+  void on_readable();
+  void on_writable();
+
+  /**
+   * @brief Loop thread. Process the connections and arm the timer for the next tick the engine asks
+   */
+  void process_conns();
+
+  /**
+   * @brief Loop thread. Sends the packets queued since the last wakeup
+   */
+  void drain_send();
   
   // lsquic callback
   lsquic_conn_ctx_t   * on_new_conn(lsquic_conn_t *conn);
   lsquic_stream_ctx_t * on_new_stream(lsquic_stream_t * stream);
   void on_conn_closed (lsquic_conn_t * conn);
-  void on_read(lsquic_stream_t * stream);
-  void on_write(lsquic_stream_t * stream);
-  void on_stream_close(lsquic_stream_t * stream);
+  void on_read(lsquic_stream_t * stream, StreamCtx * ctx);
+  void on_write(lsquic_stream_t * stream, StreamCtx * ctx);
+  void on_stream_close(lsquic_stream_t * stream, StreamCtx * ctx);
+  void on_datagram(const void * buf, size_t len);
+  ssize_t on_dg_write(lsquic_conn_t * conn, void * buf, size_t len);
   int send_packets_out(const struct lsquic_out_spec *specs, unsigned n_specs);
   
   static Capabilities get_capabilities();
@@ -21,7 +21,8 @@ QUIC_STATUS ClientStreamCallback(HQUIC Stream, void* Context, QUIC_STREAM_EVENT*
   return client->stream_callback(Stream, Event);
 }
 
-MsquicClient::MsquicClient(std::string host, int port) noexcept : _host(std::move(host)), _port(port)
+MsquicClient::MsquicClient(std::string host, int port) noexcept
+  : _host(std::move(host)), _port(port), _pool(sizeof(QUIC_BUFFER) + framing::HEADER_LEN + MAX_BUF_LEN, POOL_LEN)
 {
   QUIC_STATUS status = QUIC_STATUS_SUCCESS;
   if (QUIC_FAILED(status = MsQuicOpen2(&_msquic))) {
@@ -134,7 +135,7 @@ unsigned int MsquicClient::stream_callback(QUIC_HANDLE* stream, QUIC_STREAM_EVEN
     // A previous StreamSend call has completed, and the context is being
     // returned back to the app.
     //
-    free(event->SEND_COMPLETE.ClientContext);
+    _pool.release(event->SEND_COMPLETE.ClientContext);
     // printf("[strm][%p] Data sent\n", stream);
     break;
   case QUIC_STREAM_EVENT_RECEIVE:
@@ -144,7 +145,10 @@ unsigned int MsquicClient::stream_callback(QUIC_HANDLE* stream, QUIC_STREAM_EVEN
     // printf("[strm][%p] Data received\n", stream);
     for(int i = 0; i < event->RECEIVE.BufferCount; ++i) {
       const QUIC_BUFFER Buffer = event->RECEIVE.Buffers[i];
-      if(_on_received_callback) _on_received_callback((const char*)Buffer.Buffer, Buffer.Length);
+      if(!_on_received_callback) continue;
+
+      if(_framed) _deframer.feed(Buffer.Buffer, Buffer.Length, _on_received_callback);
+      else _on_received_callback((const char*)Buffer.Buffer, Buffer.Length);
     }
     break;
   case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
@@ -152,6 +156,7 @@ unsigned int MsquicClient::stream_callback(QUIC_HANDLE* stream, QUIC_STREAM_EVEN
     // The peer gracefully shut down its send direction of the stream.
     //
     printf("[strm][%p] Peer aborted\n", stream);
+    _deframer.reset();
     break;
   case QUIC_STREAM_EVENT_PEER_SEND_SHUTDOWN:
     //
@@ -165,6 +170,11 @@ unsigned int MsquicClient::stream_callback(QUIC_HANDLE* stream, QUIC_STREAM_EVEN
     // with the stream. It can now be safely cleaned up.
     //
     // printf("[strm][%p] All done\n", stream);
+    if(HQUIC own = stream; _stream.compare_exchange_strong(own, nullptr)) {
+      // The framed stream is opened again on the next packet
+      printf("[strm][%p] Framed stream closed\n", stream);
+    }
+    
     if (!event->SHUTDOWN_COMPLETE.AppCloseInProgress) {
       _msquic->StreamClose(stream);
     }
@@ -177,13 +187,17 @@ unsigned int MsquicClient::stream_callback(QUIC_HANDLE* stream, QUIC_STREAM_EVEN
 
 void MsquicClient::on_datagram_send_state_changed(unsigned int state, void *ctx)
 {
+  static_assert(QUIC_DATAGRAM_SEND_CANCELED + 1 == DATAGRAM_STATES);
+  
+  if(state < DATAGRAM_STATES) _datagram_states[state].fetch_add(1, std::memory_order_relaxed);
+  
   switch(state) {
   case QUIC_DATAGRAM_SEND_UNKNOWN:
     printf("QUIC_DATAGRAM_SEND_UNKNOWN\n");
     break;
   case QUIC_DATAGRAM_SEND_SENT:
     // printf("QUIC_DATAGRAM_SEND_SENT\n");
-    free(ctx);
+    _pool.release(ctx);
     break;
   case QUIC_DATAGRAM_SEND_LOST_SUSPECT:
     printf("QUIC_DATAGRAM_SEND_LOST_SUSPECT\n");
@@ -199,12 +213,41 @@ void MsquicClient::on_datagram_send_state_changed(unsigned int state, void *ctx)
     break;
   case QUIC_DATAGRAM_SEND_CANCELED:
     printf("QUIC_DATAGRAM_SEND_CANCELED\n");
+    // Never sent, msquic will not report it again
+    _pool.release(ctx);
     break;
   default:
     printf("Unknown datagram send state\n");
   }
 }
 
+void MsquicClient::collect_metrics(metrics::Writer& w) const
+{
+  static constexpr const char * STATES[DATAGRAM_STATES] = {
+    "unknown", "sent", "lost_suspect", "lost_discarded", "acknowledged", "acknowledged_spurious", "canceled"
+  };
+
+  for(size_t i = 0; i < DATAGRAM_STATES; ++i) {
+    w.counter("quic_tunnel_datagram_send_total", "Datagram send state changes, by QUIC_DATAGRAM_SEND_* state",
+	      _datagram_states[i].load(std::memory_order_relaxed), fmt::format("state=\"{}\"", STATES[i]));
+  }
+
+  _pool.collect(w);
+
+  if(!_connection) return;
+
+  QUIC_STATISTICS_V2 stats;
+  uint32_t size = sizeof(stats);
+  
+  if(QUIC_FAILED(_msquic->GetParam(_connection, QUIC_PARAM_CONN_STATISTICS_V2, &size, &stats))) return;
+
+  w.gauge("quic_tunnel_cwnd_bytes", "Congestion window", stats.SendCongestionWindow);
+  w.gauge("quic_tunnel_rtt_microseconds", "Smoothed RTT", stats.Rtt);
+  w.gauge("quic_tunnel_min_rtt_microseconds", "Minimum RTT", stats.MinRtt);
+  w.counter("quic_tunnel_lost_packets_total", "Packets declared lost by the transport",
+	    stats.SendSuspectedLostPackets - stats.SendSpuriousLostPackets);
+}
+
 
 std::string_view MsquicClient::get_qlog_path()   const noexcept
 {
@@ -224,6 +267,12 @@ bool MsquicClient::set_cc(std::string_view cc) noexcept
   return true;
 }
 
+bool MsquicClient::set_framed_streams(bool enable)
+{
+  _framed = enable;
+  return true;
+}
+
 void MsquicClient::start()
 {
    QUIC_SETTINGS settings = { 0 };
@@ -279,43 +328,91 @@ void MsquicClient::stop()
   printf("Closing configuration\n");
   _msquic->ConfigurationClose(_configuration);
   _configuration = nullptr;
+
+  printf("Buffer pool: %lu misses, %lu oversize\n", _pool.misses(), _pool.oversize());
+}
+
+QUIC_BUFFER * MsquicClient::alloc_buffer(const char * buf, size_t len, bool framed)
+{
+  size_t prefix = framed ? framing::HEADER_LEN : 0;
+  
+  auto * buffer = (QUIC_BUFFER*)_pool.acquire(sizeof(QUIC_BUFFER) + prefix + len);
+  if(!buffer) return nullptr;
+
+  buffer->Length = prefix + len;
+  buffer->Buffer = (uint8_t*)buffer + sizeof(QUIC_BUFFER);
+  
+  if(framed) framing::write_frame(buffer->Buffer, buf, len);
+  else memcpy(buffer->Buffer, buf, len);
+
+  return buffer;
 }
 
 void MsquicClient::send_message_stream(const char * buf, size_t len)
 {
+  if(_framed) {
+    send_message_framed(buf, len);
+    return;
+  }
+  
   QUIC_STATUS status;
   HQUIC stream;
 
-  QUIC_BUFFER * buffer = (QUIC_BUFFER*)malloc(sizeof(QUIC_BUFFER) + len);
-  buffer->Length = len;
-  buffer->Buffer = (uint8_t*)buffer + sizeof(QUIC_BUFFER);
-  memcpy(buffer->Buffer, buf, len);
+  QUIC_BUFFER * buffer = alloc_buffer(buf, len);
+  if(!buffer) return;
 
   if(QUIC_FAILED(status = _msquic->StreamOpen(_connection, QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL, ClientStreamCallback, this, &stream))) {
     printf("StreamOpen failed, 0x%x!\n", status);
-    free(buffer);
+    _pool.release(buffer);
     return;
   }
 
   if (QUIC_FAILED(status = _msquic->StreamSend(stream, buffer, 1, QUIC_SEND_FLAG_START | QUIC_SEND_FLAG_FIN, buffer))) {
     printf("StreamSend failed, 0x%x!\n", status);
-    free(buffer);
+    _pool.release(buffer);
     _msquic->StreamShutdown(stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
   } 
 }
 
+void MsquicClient::send_message_framed(const char * buf, size_t len)
+{
+  QUIC_STATUS status;
+  HQUIC stream = _stream.load();
+  QUIC_SEND_FLAGS flags = QUIC_SEND_FLAG_NONE;
+
+  if(!stream) {
+    if(QUIC_FAILED(status = _msquic->StreamOpen(_connection, QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL, ClientStreamCallback, this, &stream))) {
+      printf("StreamOpen failed, 0x%x!\n", status);
+      return;
+    }
+
+    _stream = stream;
+    flags = QUIC_SEND_FLAG_START;
+  }
+
+  QUIC_BUFFER * buffer = alloc_buffer(buf, len, true);
+  if(!buffer) return;
+
+  if(QUIC_FAILED(status = _msquic->StreamSend(stream, buffer, 1, flags, buffer))) {
+    printf("StreamSend failed, 0x%x!\n", status);
+    _pool.release(buffer);
+    
+    // The peer drops its partial packet on the abort, a new stream is opened on the next packet
+    _stream.compare_exchange_strong(stream, nullptr);
+    _msquic->StreamShutdown(stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+  }
+}
+
 void MsquicClient::send_message_datagram(const char * buf, size_t len)
 {
   QUIC_STATUS status;
 
-  QUIC_BUFFER * buffer = (QUIC_BUFFER*)malloc(sizeof(QUIC_BUFFER) + len);
-  buffer->Length = len;
-  buffer->Buffer = (uint8_t*)buffer + sizeof(QUIC_BUFFER);
-  memcpy(buffer->Buffer, buf, len);
+  QUIC_BUFFER * buffer = alloc_buffer(buf, len);
+  if(!buffer) return;
   
   if(QUIC_FAILED(status = _msquic->DatagramSend(_connection, buffer, 1, QUIC_SEND_FLAG_NONE, buffer))) {
     printf("Datagram Send failed, 0x%x!\n", status);
-    free(buffer);
+    _pool.release(buffer);
   }
 }
   
@@ -325,6 +422,7 @@ Capabilities MsquicClient::get_capabilities()
   caps.impl = IMPL_NAME;
   caps.datagrams = true;
   caps.streams = true;
+  caps.framed_streams = true;
   caps.cc.push_back("bbr");
   caps.cc.push_back("cubic");
 
@@ -1,7 +1,12 @@
 #ifndef MSQUIC_CLIENT_H
 #define MSQUIC_CLIENT_H
 
+#include <atomic>
+#include <array>
+
 #include "quic_client.h"
+#include "buffer_pool.h"
+#include "framing.h"
 
 struct QUIC_API_TABLE;
 struct QUIC_HANDLE;
@@ -17,16 +22,33 @@ class MsquicClient final : public QuicClient
   std::string _qlog_filename;
   int         _port;
   uint16_t    _cc;
+  bool        _framed = false;
   
   const QUIC_API_TABLE * _msquic = nullptr;
   QUIC_HANDLE * _listener = nullptr;
   QUIC_HANDLE * _configuration = nullptr;
   QUIC_HANDLE * _registration = nullptr;
   QUIC_HANDLE * _connection = nullptr;
+
+  // Long lived stream of the framed mode, opened on the first packet
+  std::atomic<QUIC_HANDLE*> _stream = nullptr;
+  framing::Deframer _deframer;
+
+  // QUIC_BUFFER and payload of each send, given back once msquic is done with it
+  BufferPool _pool;
+
+  // Datagrams per QUIC_DATAGRAM_SEND_* state change, UNKNOWN to CANCELED
+  static constexpr size_t DATAGRAM_STATES = 7;
+  std::array<std::atomic<uint64_t>, DATAGRAM_STATES> _datagram_states{};
+
+  QUIC_BUFFER * alloc_buffer(const char * buf, size_t len, bool framed = false);
+  void send_message_framed(const char * buffer, size_t len);
     
 public:
   static constexpr const char * DEFAULT_QLOG_PATH = "tunnel-in-logs";
   static constexpr const char * IMPL_NAME = "msquic";
+  static constexpr auto MAX_BUF_LEN = 2048u;
+  static constexpr auto POOL_LEN = 1024u;
 
   struct conn_io * conn_io;
   
@@ -39,6 +61,7 @@ public:
   std::string_view get_qlog_filename() const noexcept override;
 
   bool set_cc(std::string_view cc) noexcept override;
+  bool set_framed_streams(bool enable) override;
   void start() override;
   void stop() override;
   void send_message_stream(const char * buffer, size_t len) override;
@@ -47,6 +70,8 @@ public:
   unsigned int connection_callback(QUIC_HANDLE* connection, QUIC_CONNECTION_EVENT* event);
   unsigned int stream_callback(QUIC_HANDLE* stream, QUIC_STREAM_EVENT* event);
   void on_datagram_send_state_changed(unsigned int state, void *ctx);
+
+  void collect_metrics(metrics::Writer& w) const override;
   
   static Capabilities get_capabilities();
 };
@@ -6,8 +6,10 @@
 #include <functional>
 #include <optional>
 #include <memory>
+#include <span>
 
 #include "capabilities.h"
+#include "metrics.h"
 
 class QuicClient
 {
@@ -44,6 +46,14 @@ public:
    */
   virtual bool set_cc(std::string_view cc) noexcept = 0;
 
+  /**
+   * @brief Send the stream packets length prefixed on one long lived stream,
+   * instead of opening a stream per packet
+   * @param enable True for the framed mode, false for a stream per packet
+   * @return False if not supported. True otherwise.
+   */
+  virtual bool set_framed_streams(bool enable) { return !enable; }
+
   /**
    * @brief Start the quic connection
    */
@@ -64,6 +74,15 @@ public:
    */
   virtual void send_message_datagram(const char * buffer, size_t len) = 0;
 
+  /**
+   * @brief Send a batch of packets, each one in its own quic datagram.
+   * Implementations can override it to coalesce the work (one flush per batch)
+   * @param messages The packets to send, only valid during the call
+   */
+  virtual void send_message_datagrams(std::span<const std::string_view> messages) {
+    for(auto& msg : messages) send_message_datagram(msg.data(), msg.size());
+  }
+
   /**
    * @brief Set the callback to get the data from the quic server
    * @param callback The callback called when data are received fron the quic connection
@@ -71,6 +90,12 @@ public:
   void set_on_received_callback(QuicDataCallback callback) noexcept {
     _on_received_callback = callback;
   }
+
+  /**
+   * @brief Any thread. Write the transport metrics the implementation knows about:
+   * congestion window, RTT, queue depths, drops...
+   */
+  virtual void collect_metrics(metrics::Writer&) const {}
 };
 
 class QuicClientBuilder
@@ -12,6 +12,7 @@ import (
 	"fmt"
 	"unsafe"
 	"context"
+	"encoding/binary"
 	//"bytes"
 	// "sync"
 	"io"
@@ -27,11 +28,6 @@ import (
 const addr = "localhost:4242"
 const message = "foobar"
 
-type datagram struct {
-	flowID uint64
-	data   []byte
-}
-
 type Session struct {
 	sess quic.Connection
 	wrapper *C.wrapper_t
@@ -85,12 +81,63 @@ func Close() error {
 	return quicSession.sess.CloseWithError(0, "normal shutdown")
 }
 
-func sendDatagram(d *datagram) error {
-	return quicSession.sess.SendMessage(d.data)
+// The flow ID, sequence number and timestamp are in the tunnel header at the start of data,
+// written by the UDP sockets, so datagrams and streams carry them the same way
+func sendDatagram(data []byte) error {
+	return quicSession.sess.SendMessage(data)
 }
 
 const streamDataPacketLength = 2048
 
+// Framed mode : packets are sent length prefixed (16 bits big endian) on one long lived stream
+var framedStreams = false
+var framedStream quic.SendStream
+
+func sendFramed(data []byte) {
+	if framedStream == nil {
+		stream, err := quicSession.sess.OpenUniStream()
+		if err != nil {
+			panic(err)
+		}
+		framedStream = stream
+	}
+
+	frame := make([]byte, 2 + len(data))
+	binary.BigEndian.PutUint16(frame, uint16(len(data)))
+	copy(frame[2:], data)
+
+	if _, err := framedStream.Write(frame); err != nil {
+		// The peer drops its partial packet, a new stream is opened on the next packet
+		fmt.Println("Framed stream write failed", err)
+		framedStream.CancelWrite(0)
+		framedStream = nil
+	}
+}
+
+func readFramed(stream quic.ReceiveStream, wrapper *C.wrapper_t) {
+	header := make([]byte, 2)
+	buffer := make([]byte, 0xffff)
+
+	for {
+		if _, err := io.ReadFull(stream, header); err != nil {
+			return
+		}
+
+		n := int(binary.BigEndian.Uint16(header))
+		if _, err := io.ReadFull(stream, buffer[:n]); err != nil {
+			return
+		}
+
+		// Copied by the callback, no need for a C string
+		C.on_message_received(wrapper, (*C.char)(unsafe.Pointer(&buffer[0])), C.int(n))
+	}
+}
+
+//export goClientSetFramedStreams
+func goClientSetFramedStreams(enable bool) {
+	framedStreams = enable
+}
+
 //export goClientStart
 func goClientStart(addr *C.char, datagrams bool, qlogDir *C.char, wrapper *C.wrapper_t) {
 	fmt.Println("Starting quic go client", C.GoString(addr))
@@ -148,6 +195,11 @@ func goClientStart(addr *C.char, datagrams bool, qlogDir *C.char, wrapper *C.wra
 				}
 			}
 
+			if framedStreams {
+				readFramed(stream, wrapper)
+				continue
+			}
+
 			exit := false
 			buffer := make([]byte, streamDataPacketLength)
 			for {
@@ -181,6 +233,11 @@ func goClientStop() {
 
 //export goClientSendMessageStream
 func goClientSendMessageStream(buf *C.char, len uint64) {
+	if framedStreams {
+		sendFramed(C.GoBytes(unsafe.Pointer(buf), C.int(len)))
+		return
+	}
+
 	stream, err := quicSession.sess.OpenUniStream();
 	if err != nil {
 		panic(err)
@@ -194,7 +251,7 @@ func goClientSendMessageStream(buf *C.char, len uint64) {
 func goClientSendMessageDatagram(buf *C.char, len uint64) {
 	if len <= 1200 {
 		bufGo:= C.GoBytes(unsafe.Pointer(buf), C.int(len))
-		sendDatagram(&datagram{0, bufGo})
+		sendDatagram(bufGo)
 	} else {
 		goClientSendMessageStream(buf, len)
 	}
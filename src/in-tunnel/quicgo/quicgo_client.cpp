@@ -9,6 +9,7 @@ Capabilities QuicGoClient::get_capabilities()
 
   cap.cc.emplace_back("newreno");
   cap.datagrams = true;
+  cap.framed_streams = true;
   cap.impl = IMPL_NAME;
   
   return cap;
@@ -40,6 +41,12 @@ bool QuicGoClient::set_cc(std::string_view cc) noexcept
   return true;
 }
 
+bool QuicGoClient::set_framed_streams(bool enable)
+{
+  goClientSetFramedStreams(enable);
+  return true;
+}
+
 void QuicGoClient::start()
 {
   std::string addr = _host + ":" + std::to_string(_port);
@@ -28,6 +28,7 @@ public:
   std::string_view get_qlog_filename() const noexcept override;
 
   bool set_cc(std::string_view cc) noexcept override;
+  bool set_framed_streams(bool enable) override;
   void start() override;
   void stop() override;
   void send_message_stream(const char * buffer, size_t len) override;
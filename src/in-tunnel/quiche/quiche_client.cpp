@@ -14,6 +14,8 @@
 #include <cinttypes>
 #include <array>
 
+#include "udp_gso.h"
+
 constexpr size_t LOCAL_CONN_ID_LEN = 16;
 constexpr size_t MAX_DATAGRAM_SIZE = 2500;
 
@@ -57,6 +59,8 @@ struct conn_io {
   
   quiche_conn  * conn;
   QuicheClient * client;
+
+  bool gso; // Send with UDP_SEGMENT
 };
 
 struct timeout_cb_data
@@ -67,29 +71,31 @@ struct timeout_cb_data
   
 static void flush_egress(struct ev_loop *loop, struct conn_io *conn_io)
 {
-  static uint8_t out[65535];
+  static udp::GsoBatch batch;
 
   quiche_send_info send_info;
 
-  while (1) {
+  {
     std::lock_guard<std::mutex> lock(client_flush_mutex);
-    ssize_t written = quiche_conn_send(conn_io->conn, out, sizeof(out), &send_info);
+    
+    while (1) {
+      ssize_t written = quiche_conn_send(conn_io->conn, batch.tail(), batch.room(), &send_info);
 
-    if (written == QUICHE_ERR_DONE) break;
+      if (written == QUICHE_ERR_DONE) break;
     
-    if (written < 0) {
-      fprintf(stderr, "failed to create packet: %zd\n", written);
-      return;
+      if (written < 0) {
+	fprintf(stderr, "failed to create packet: %zd\n", written);
+	break;
+      }
+
+      // Equal sized packets are sent together when GSO is enabled
+      if (!batch.push(conn_io->sock, conn_io->gso, written,
+		      (struct sockaddr *) &send_info.to, send_info.to_len)) {
+	break;
+      }
     }
 
-    ssize_t sent = sendto(conn_io->sock, out, written, 0,
-			  (struct sockaddr *) &send_info.to,
-			  send_info.to_len);
-
-    if (sent != written) {
-      perror("failed to send");
-      return;
-    }
+    batch.flush(conn_io->sock, conn_io->gso);
   }
 
   auto uni = quiche_conn_peer_streams_left_uni(conn_io->conn);
@@ -117,9 +123,9 @@ static void recv_cb(EV_P_ ev_io *w, int revents)
     socklen_t peer_addr_len = sizeof(peer_addr);
     memset(&peer_addr, 0, peer_addr_len);
 
-    ssize_t read = recvfrom(conn_io->sock, buf, sizeof(buf), 0,
-			    (struct sockaddr *) &peer_addr,
-			    &peer_addr_len);
+    size_t segment;
+    ssize_t read = udp::recv_gro(conn_io->sock, buf, sizeof(buf),
+				 &peer_addr, &peer_addr_len, &segment);
 
     if (read < 0) {
       if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) break;
@@ -136,19 +142,18 @@ static void recv_cb(EV_P_ ev_io *w, int revents)
       conn_io->local_addr_len,
     };
 
-    auto uni = quiche_conn_peer_streams_left_uni(conn_io->conn);
-    auto bidi = quiche_conn_peer_streams_left_bidi(conn_io->conn);
-
-    ssize_t done;
+    // With GRO, one read may hold several packets of segment bytes
+    for(size_t off = 0; off < (size_t)read; off += segment) {
+      ssize_t done;
 
-    {
-      std::lock_guard<std::mutex> lock(client_flush_mutex);
-      done = quiche_conn_recv(conn_io->conn, buf, read, &recv_info);
-    }
+      {
+	std::lock_guard<std::mutex> lock(client_flush_mutex);
+	done = quiche_conn_recv(conn_io->conn, buf + off, std::min(segment, (size_t)read - off), &recv_info);
+      }
 
-    if (done < 0) {
-      fprintf(stderr, "failed to process packet\n");
-      continue;
+      if (done < 0) {
+	fprintf(stderr, "failed to process packet\n");
+      }
     }
   }
 
@@ -172,11 +177,17 @@ static void recv_cb(EV_P_ ev_io *w, int revents)
 						 &fin);
       if (recv_len < 0) break;
             
-      conn_io->client->recv_cb(buf, recv_len);
+      conn_io->client->recv_stream_cb(buf, recv_len);
     }
 
     quiche_stream_iter_free(readable);
 
+    {
+      // Acks may have opened the stream window
+      std::lock_guard<std::mutex> lock(client_flush_mutex);
+      conn_io->client->resume_framed();
+    }
+
     if(auto dgram_len = quiche_conn_dgram_recv(conn_io->conn, buf, sizeof(buf)); dgram_len >= 0) {
       conn_io->client->recv_cb(buf, dgram_len);
     }
@@ -215,7 +226,7 @@ static void async_callback(EV_P_ ev_async*, int)
 }
 
 QuicheClient::QuicheClient(std::string host, int port) noexcept
-  : _host(std::move(host)), _port(port), _qlog_dir(DEFAULT_QLOG_PATH), _stream_id{1}
+  : _host(std::move(host)), _port(port), _qlog_dir(DEFAULT_QLOG_PATH), _framed(false), _stream_id{1}
 {
   auto ver = quiche_version();
   fmt::print("Quiche version : {}\n", ver);
@@ -391,6 +402,8 @@ void QuicheClient::start()
   conn_io->sock = _socket;
   conn_io->conn = _conn;
   conn_io->client = this;
+  conn_io->gso = udp::enable_gso(_socket);
+  udp::enable_gro(_socket);
 
   _loop = ev_default_loop(0);
   _watcher = std::make_unique<ev_io>();
@@ -433,6 +446,17 @@ void QuicheClient::stop()
 
 void QuicheClient::send_message_stream(const char * buffer, size_t len)
 {
+  if(_framed) {
+    {
+      std::lock_guard<std::mutex> lock(client_flush_mutex);
+      if(!_framer.push(buffer, len)) fmt::print("Framed stream blocked, packet dropped\n");
+      resume_framed();
+    }
+
+    flush_egress(_loop, conn_io);
+    return;
+  }
+  
   {
     std::lock_guard<std::mutex> lock(client_flush_mutex);
     uint64_t id = (_stream_id << 2) | 0x02;
@@ -460,11 +484,59 @@ void QuicheClient::send_message_datagram(const char * buffer, size_t len)
   flush_egress(_loop, conn_io);  
 }
 
+void QuicheClient::send_message_datagrams(std::span<const std::string_view> messages)
+{
+  {
+    std::lock_guard<std::mutex> lock(client_flush_mutex);
+    for(auto& msg : messages) {
+      if(int err = quiche_conn_dgram_send(_conn, (const uint8_t*)msg.data(), msg.size()); err < 0) {
+	fmt::print("failed to send dgram {}\n", err);
+	break;
+      }
+    }
+  }
+
+  // Only one flush for the whole batch
+  flush_egress(_loop, conn_io);
+}
+
 void QuicheClient::recv_cb(const uint8_t* buf, size_t len)
 {
   if(_on_received_callback) _on_received_callback((const char*)buf, len);
 }
 
+void QuicheClient::recv_stream_cb(const uint8_t* buf, size_t len)
+{
+  if(!_framed) {
+    recv_cb(buf, len);
+    return;
+  }
+
+  _deframer.feed(buf, len, [this](const char * packet, size_t packet_len) {
+    recv_cb((const uint8_t*)packet, packet_len);
+  });
+}
+
+void QuicheClient::resume_framed()
+{
+  if(!_framed || !_conn) return;
+  
+  _framer.drain([this](const uint8_t * data, size_t len) -> ssize_t {
+    auto written = quiche_conn_stream_send(_conn, FRAMED_STREAM_ID, data, len, false);
+    if(written < 0 && written != QUICHE_ERR_DONE) {
+      fmt::print("failed to send in framed stream {}\n", get_quiche_error(written));
+    }
+    
+    return written;
+  });
+}
+
+bool QuicheClient::set_framed_streams(bool enable)
+{
+  _framed = enable;
+  return true;
+}
+
 Capabilities QuicheClient::get_capabilities()
 {
   Capabilities caps;
@@ -472,6 +544,7 @@ Capabilities QuicheClient::get_capabilities()
   caps.impl = IMPL_NAME;
   caps.datagrams = true;
   caps.streams = true;
+  caps.framed_streams = true;
   
   caps.cc.push_back("newreno");
   caps.cc.push_back("cubic");
@@ -13,6 +13,8 @@
 
 #include <quic_client.h>
 
+#include "framing.h"
+
 class quiche_config;
 class quiche_conn;
 struct ev_loop;
@@ -24,12 +26,14 @@ struct conn_io;
 class QuicheClient final : public QuicClient
 {
   static constexpr auto MAX_BUF_LEN = 2048u;
+  static constexpr uint64_t FRAMED_STREAM_ID = 0x02; // First client unidirectional stream
  
   std::string _host;
   std::string _qlog_dir;
   std::string _qlog_filename;
   int         _port;
   bool        _datagrams;
+  bool        _framed;
   uint8_t     _cc;
 
   int _socket;
@@ -54,6 +58,10 @@ class QuicheClient final : public QuicClient
   quiche_conn   * _conn;
 
   int _stream_id;
+
+  // Framed mode, packets not taken by the stream yet and partial packet received
+  framing::Framer   _framer;
+  framing::Deframer _deframer;
   
   bool init_socket();
   void close_socket();
@@ -81,12 +89,20 @@ public:
   std::string_view get_qlog_filename() const noexcept override;
 
   bool set_cc(std::string_view cc) noexcept override;
+  bool set_framed_streams(bool enable) override;
   void start() override;
   void stop() override;
   void send_message_stream(const char * buffer, size_t len) override;
   void send_message_datagram(const char * buffer, size_t len) override;
+  void send_message_datagrams(std::span<const std::string_view> messages) override;
 
   void recv_cb(const uint8_t* buf, size_t len);
+  void recv_stream_cb(const uint8_t* buf, size_t len);
+
+  /**
+   * @brief Loop thread, flush lock held. Writes the framed bytes the stream could not take before
+   */
+  void resume_framed();
   
   static Capabilities get_capabilities();
 };
@@ -14,75 +14,23 @@
 #include <iostream>
 #include <linux/tcp.h>
 
-constexpr int ANNOUNCE_FIELD = 4;
-
-ssize_t TcpClient::get_announce_len(int start, const char* buf, size_t len)
-{
-  auto size = ANNOUNCE_FIELD - announce_len_ptr;
-
-  if(len - start < ANNOUNCE_FIELD) size -= (len - start);
-  
-  for(int i = start; i < start + size; ++i) {   
-    announce_len[announce_len_ptr] = buf[i];
-    ++announce_len_ptr;
-  }
-
-  if(announce_len_ptr == ANNOUNCE_FIELD) {
-    announce_len_ptr = 0;
-    return atoll(announce_len);
-  }
-  else return -1;
-}
-
 void TcpClient::receive_loop()
 {
-  constexpr size_t MAX = 2048;
-  char buf[MAX], pending_buf[MAX];
-  ssize_t pending_len = -1, pending_buf_size;
-
-  static int i = 0;
+  auto buf = std::make_unique<uint8_t[]>(READ_BUF_LEN);
   
   for(;;) {
-    int data_start = 0;
-      
-    auto res = read(_socket, buf, MAX);
+    auto res = read(_socket, buf.get(), READ_BUF_LEN);
 
     if(res < 0) {
       perror("Error reading tcp socket");
       break;
     }
 
-    while(res > 0) {
-      if(pending_len == -1) {
-	pending_len = pending_buf_size = get_announce_len(data_start, buf, res);
-	data_start += ANNOUNCE_FIELD;
-	res -= ANNOUNCE_FIELD;
-      }
-
-      std::cout << i << " " << "log :"
-		<< res << " "
-		<< pending_len << " "
-		<< pending_buf_size << " "
-		<< data_start << " "
-		<< "\n";
-
-      if(res <= 0) continue;
-
-      int copy_len = std::min(pending_len, res);
-      memcpy(pending_buf, buf + data_start, copy_len);
-
-      pending_len -= copy_len;
-      res -= copy_len;
-      data_start += copy_len;
-
-      if(pending_len == 0) {
-	std::cout << i++ << " " << "Transmitting: " <<  pending_buf_size << "\n";
-	if(_on_received_callback) _on_received_callback(pending_buf, pending_buf_size);
-	pending_len = -1;
-      }
-    }
+    if(res == 0) break; // Closed by the server
 
-    ++i;
+    _deframer.feed(buf.get(), res, [this](const char * packet, size_t len) {
+      if(_on_received_callback) _on_received_callback(packet, len);
+    });
   }
 }
 
@@ -125,9 +73,7 @@ Capabilities TcpClient::get_capabilities()
 
 void TcpClient::send_message_stream(const char * buffer, size_t len)
 {
-  [[maybe_unused]] auto _ = write(_socket, std::to_string(len).c_str(), 4);
-  
-  if(write(_socket, buffer, len) < 0) {
+  if(!framing::send_frame(_socket, buffer, len)) {
     perror("tcp socket write error");
   }
 }
@@ -2,6 +2,7 @@
 #define TCP_CLIENT_H
 
 #include "quic_client.h"
+#include "framing.h"
 
 class TcpClient : public QuicClient
 {
@@ -11,12 +12,12 @@ class TcpClient : public QuicClient
   uint16_t    _src_port;  
 
   int _socket;
-  
-private:
-  char announce_len[4];
-  int announce_len_ptr;
+
+  framing::Deframer _deframer; // Packets split between two reads
   
 public:
+  static constexpr size_t READ_BUF_LEN = 1 << 16; // Many packets parsed out of each read
+
 
   TcpClient(std::string dst_host, uint16_t dst_port, uint16_t src_port) noexcept
     : _dst_host(std::move(dst_host)), _dst_port(dst_port), _src_port(src_port) {}
@@ -33,7 +34,6 @@ public:
   void send_message_datagram(const char * buffer, size_t len) override {}
 
   void receive_loop();
-  ssize_t get_announce_len(int start, const char* buf, size_t len);
 
   static Capabilities get_capabilities();
 };
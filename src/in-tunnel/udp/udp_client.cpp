@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <thread>
+#include <algorithm>
 
 UdpClient::UdpClient(std::string dst_host, int dst_port, int src_port)
   : _dst_host(std::move(dst_host)), _dst_port(dst_port), _src_port(src_port), _socket(-1)
@@ -18,20 +19,17 @@ UdpClient::~UdpClient()
 
 void UdpClient::recv()
 {
-  char buffer[MAX_BUF_LEN];
-
-  struct sockaddr_in addr_tmp;
-  socklen_t slen_tmp = sizeof(addr_tmp);
-
   while(_socket >= 0) {
-    auto rlen = recvfrom(_socket, buffer, MAX_BUF_LEN, 0, (struct sockaddr *)&addr_tmp, &slen_tmp);
+    auto n = _engine->recv();
     
-    if(rlen <= 0) {
+    if(n < 0) {
       if(_socket < 0) puts("closing udp socket");
-      else if(errno == EAGAIN || errno == EWOULDBLOCK) continue;
       else perror("Could not receive data in udp socket");
+      break;
+    }
+    else if(_on_received_callback) {
+      for(auto& msg : _engine->payloads()) _on_received_callback(msg.data(), msg.size());
     }
-    else if(_on_received_callback) _on_received_callback(buffer, rlen);
   }
 }
 
@@ -55,6 +53,9 @@ void UdpClient::start()
   if(setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &optval, sizeof(optval)) < 0)
     perror("Could not set timeout");
 
+  _engine = io::Engine::create(MAX_BUF_LEN, MAX_BATCH_LEN);
+  _engine->attach(_socket);
+
   _recv_th = std::thread([this](){ recv(); });
 }
 
@@ -64,9 +65,13 @@ void UdpClient::stop()
 
   puts("Try closing udp socket");
 
+  int fd = _socket;
   _socket = -1;
+  _engine->close();
 
   if(_recv_th.joinable()) _recv_th.join();
+
+  close(fd);
 }
 
 void UdpClient::send_message_datagram(const char * buffer, size_t len)
@@ -74,17 +79,33 @@ void UdpClient::send_message_datagram(const char * buffer, size_t len)
   if(_socket < 0) return;
 
   while(len > 0) {
-    auto buf_len = std::min((int)MAX_BUF_LEN, (int)len);
-    
-    auto l = sendto(_socket, buffer, buf_len, 0, (struct sockaddr*) &_addr, sizeof(_addr));
+    auto buf_len = std::min((size_t)MAX_BUF_LEN, len);
     
-    if(l < 0) {
+    if(!_engine->send(buffer, buf_len, (struct sockaddr*) &_addr, sizeof(_addr))) {
       perror("Could not send data in UDP socket");
       break;
     }
 
+    buffer += buf_len;
     len -= buf_len;
   }
+
+  _engine->flush();
+}
+
+void UdpClient::send_message_datagrams(std::span<const std::string_view> messages)
+{
+  if(_socket < 0) return;
+
+  // Queued by the engine and sent with one flush
+  for(auto& msg : messages) {
+    if(!_engine->send(msg.data(), std::min<size_t>(msg.size(), MAX_BUF_LEN), (struct sockaddr*) &_addr, sizeof(_addr))) {
+      perror("Could not send data in UDP socket");
+      break;
+    }
+  }
+
+  _engine->flush();
 }
 
 Capabilities UdpClient::get_capabilities()
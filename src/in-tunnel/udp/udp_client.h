@@ -2,6 +2,7 @@
 #define UDP_CLIENT_H
 
 #include "quic_client.h"
+#include "io/io_engine.h"
 
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -23,6 +24,9 @@ class UdpClient : public QuicClient
   socklen_t          _len_addr;
   
   static constexpr auto MAX_BUF_LEN = 2048u;
+  static constexpr auto MAX_BATCH_LEN = 32u;
+
+  std::unique_ptr<io::Engine> _engine; // Batched reads and writes on _socket
 
   std::thread _recv_th;
   
@@ -45,6 +49,7 @@ public:
   /* only datagram available for udp */
   void send_message_stream(const char * buffer, size_t len) override {}
   void send_message_datagram(const char * buffer, size_t len) override;
+  void send_message_datagrams(std::span<const std::string_view> messages) override;
 
   static Capabilities get_capabilities();
 };
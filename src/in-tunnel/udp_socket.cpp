@@ -10,8 +10,66 @@
 namespace in
 {
 
-UdpSocket::UdpSocket() noexcept : _socket(-1)
-{}
+UdpSocket::UdpSocket() noexcept
+  : _socket(-1), _table(TABLE_LEN, 0), _peers(new Peer[MAX_FLOWS]), _nb_flows(0),
+    _batch_bufs(MAX_BATCH_LEN * MAX_BUF_LEN)
+{
+  _batch.reserve(MAX_BATCH_LEN);
+}
+
+UdpSocket::PeerKey UdpSocket::make_key(const struct sockaddr * addr)
+{
+  PeerKey key;
+  memset(&key, 0, sizeof(key));
+
+  key.family = addr->sa_family;
+  
+  if(addr->sa_family == AF_INET6) {
+    auto * in6 = (const struct sockaddr_in6 *)addr;
+    memcpy(key.addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    key.port = in6->sin6_port;
+  }
+  else {
+    auto * in4 = (const struct sockaddr_in *)addr;
+    memcpy(key.addr, &in4->sin_addr, sizeof(in4->sin_addr));
+    key.port = in4->sin_port;
+  }
+
+  return key;
+}
+
+uint32_t UdpSocket::flow_of(const struct sockaddr * addr, socklen_t addr_len)
+{
+  auto key = make_key(addr);
+
+  // FNV-1a, the local address and port are the same for every peer of the socket
+  uint32_t hash = 2166136261u;
+  for(size_t i = 0; i < sizeof(key); ++i) {
+    hash ^= ((const uint8_t*)&key)[i];
+    hash *= 16777619u;
+  }
+
+  for(uint32_t slot = hash & (TABLE_LEN - 1);; slot = (slot + 1) & (TABLE_LEN - 1)) {
+    if(auto entry = _table[slot]; entry != 0) {
+      if(_peers[entry - 1].key == key) return entry - 1;
+      continue;
+    }
+
+    // New peer
+    auto flow = _nb_flows.load(std::memory_order_relaxed);
+    if(flow == MAX_FLOWS) return NO_FLOW;
+
+    auto& peer = _peers[flow];
+    peer.key = key;
+    memcpy(&peer.addr, addr, addr_len);
+    peer.addr_len = addr_len;
+
+    _table[slot] = flow + 1;
+    _nb_flows.store(flow + 1, std::memory_order_release);
+
+    return flow;
+  }
+}
 
 void UdpSocket::open(int port)
 {
@@ -28,7 +86,6 @@ void UdpSocket::open(int port)
   struct sockaddr_in addr;
   
   memset((char *)&addr, 0, sizeof(addr));
-  memset((char *)&_addr_other, 0, sizeof(_addr_other));
 
   addr.sin_family = AF_INET;
   addr.sin_port = htons(port);
@@ -42,60 +99,113 @@ void UdpSocket::open(int port)
     perror("Could not bind UDP socket");
     std::exit(EXIT_FAILURE);
   }
+
+  // One byte above the payload limit, so the packets with no room left for the tunnel header are
+  // seen whole and dropped below. The longer ones are dropped by the engine
+  _engine = io::Engine::create(MAX_PAYLOAD_LEN + 1, MAX_BATCH_LEN);
+  _engine->attach(_socket);
 }
 
-ssize_t UdpSocket::recv() noexcept
+std::span<const std::string_view> UdpSocket::recv_batch() noexcept
 {
-  if(_socket == -1) return -1;
+  if(_socket == -1) return {};
+
+  _batch.clear();
   
-  struct sockaddr_in addr;
-  socklen_t          slen = sizeof(addr);
-  ssize_t rec_len;
+  tunnel::Header header;
+  header.flags = tunnel::default_flags();
   
-  do {
-    rec_len = recvfrom(_socket, _buf, MAX_BUF_LEN, 0, (struct sockaddr*)&addr, &slen);
-    
-    if(rec_len == -1) {
-      if(_socket == -1) {
+  // Until at least one packet of a known or new flow is read
+  while(_batch.empty()) {
+    int n;
+
+    // 0 means a timeout or a wake up without data
+    do {
+      n = _engine->recv();
+
+      if(n == -1) {
 	puts("Closing UDP socket");
-	return -1;
-      }
-      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-	puts("Refreshing UDP socket");
+	return {};
       }
-      else {
-	perror("Could not receive data in UDP socket");
-	return -1;
+    } while(n == 0);
+
+    // One timestamp for the whole batch, the packets were read at once
+    header.timestamp = tunnel::now_us();
+
+    uint64_t batch_bytes = 0;
+
+    for(int i = 0; i < n; ++i) {
+      auto payload = _engine->payloads()[i];
+      batch_bytes += payload.size();
+
+      auto flow = flow_of(_engine->peer(i), _engine->peer_len(i));
+      if(flow == NO_FLOW || payload.size() > MAX_PAYLOAD_LEN) {
+	if(auto dropped = ++_dropped; dropped % 1000 == 1) std::cout << "in::UdpSocket dropped " << dropped << " packets\n";
+	continue;
       }
-    }
-  } while(rec_len < 0);
 
-  // _addr_other = addr;
-  _addr_other.sin_family = AF_INET;
-  _addr_other.sin_port = addr.sin_port;
-  _addr_other.sin_addr.s_addr = addr.sin_addr.s_addr;
-  _addr_other_len = slen;
+      header.flow_id = flow;
+      header.seq = _peers[flow].next_seq++;
 
-  return rec_len;
+      uint8_t * dst = &_batch_bufs[_batch.size() * MAX_BUF_LEN];
+      auto header_len = tunnel::write_header(dst, header);
+      memcpy(dst + header_len, payload.data(), payload.size());
+
+      _batch.emplace_back((const char*)dst, header_len + payload.size());
+    }
+
+    _traffic.on_rx(batch_bytes, n);
+  }
+  
+  return _batch;
 }
 
 bool UdpSocket::send_back(const char * buf, size_t len)
 {
   if(_socket == -1) return false;
 
-  // puts("Sendign back some good data");
-  auto send_len = sendto(_socket, buf, len, 0, (struct sockaddr *)&_addr_other, _addr_other_len);
-  if(send_len == -1) {
-    perror("Could not send back");
+  tunnel::Header header;
+  auto header_len = tunnel::read_header((const uint8_t*)buf, len, header);
+
+  if(header_len == 0 || header.flow_id >= nb_flows()) {
+    if(auto dropped = ++_dropped; dropped % 1000 == 1) std::cout << "in::UdpSocket dropped " << dropped << " packets for an unknown flow\n";
     return false;
   }
+
+  auto& peer = _peers[header.flow_id];
+  peer.stats.on_packet(header, len - header_len, tunnel::now_us());
+  
+  if(!_engine->send(buf + header_len, len - header_len, (struct sockaddr *)&peer.addr, peer.addr_len)) {
+    if(auto dropped = ++_dropped; dropped % 1000 == 1) std::cout << "in::UdpSocket dropped " << dropped << " packets on send\n";
+    return false;
+  }
+
+  _engine->flush();
+  _traffic.on_tx(len - header_len);
   
   return true;
 }
 
+void UdpSocket::collect_metrics(metrics::Writer& w) const
+{
+  _traffic.collect(w, "udp");
+  
+  w.counter("quic_tunnel_dropped_total", "Packets dropped by the tunnel",
+	    _dropped.load(std::memory_order_relaxed), "reason=\"udp_socket\"");
+  if(_engine) w.counter("quic_tunnel_dropped_total", "Packets dropped by the tunnel", _engine->truncated(), "reason=\"truncated\"");
+
+  auto count = nb_flows();
+  w.gauge("quic_tunnel_flows", "Flows of the tunnel", count);
+  
+  for(uint32_t i = 0; i < count; ++i) _peers[i].stats.collect(w, i);
+}
+
 void UdpSocket::close()
 {
   if(_socket != -1) {
+    for(uint32_t i = 0; i < nb_flows(); ++i) _peers[i].stats.print("in::UdpSocket", i);
+
+    if(_engine) _engine->close();
     ::close(_socket);
     _socket = -1;
   }
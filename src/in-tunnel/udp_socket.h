@@ -6,21 +6,83 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <mutex>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <span>
+#include <string_view>
+
+#include "io/io_engine.h"
+#include "tunnel_header.h"
+#include "flow_stats.h"
+#include "traffic_stats.h"
 
 namespace in
 {
 
+/**
+ * @brief Socket receiving the RTP/TURN traffic of the in-tunnel. Every peer is a flow, its
+ * packets go in the tunnel with the flow ID in their header and the answers carrying this
+ * flow ID are sent back to it. The headers also carry the sequence number and the send
+ * time of the packets, the ones of the answers feed the flow statistics.
+ */
 class UdpSocket
 {
-  static constexpr auto MAX_BUF_LEN = 2048u;
+public:
+  static constexpr auto MAX_BUF_LEN = 2048u; // Max tunnel packet, header included
+  static constexpr auto MAX_PAYLOAD_LEN = MAX_BUF_LEN - tunnel::MAX_HEADER_LEN;
+  static constexpr auto MAX_BATCH_LEN = 32u; // Max number of packets read at once
+  static constexpr uint32_t MAX_FLOWS = 1024; // Peers beyond are dropped
+
+private:
+  static constexpr uint32_t TABLE_LEN = MAX_FLOWS * 2; // Power of two, half full at most
+  static constexpr uint32_t NO_FLOW = UINT32_MAX;
+
+  /** @brief Peer address, zero padded so it can be hashed and compared as bytes */
+  struct PeerKey
+  {
+    uint8_t  addr[16];
+    uint16_t port;
+    uint16_t family;
+
+    bool operator==(const PeerKey&) const = default;
+  };
+
+  struct Peer
+  {
+    PeerKey                 key;
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    uint64_t                next_seq = 0; // Receive thread only
+    FlowStats               stats;        // Of the answers, written by send_back
+  };
   
   int  _port;
   int  _socket;
 
-  char _buf[MAX_BUF_LEN];
+  std::unique_ptr<io::Engine> _engine; // Batched reads and writes on _socket
 
-  struct sockaddr_in _addr_other;
-  socklen_t          _addr_other_len;
+  // Open addressing on the peer key, flow ID + 1 in each slot, 0 when empty. Receive thread only
+  std::vector<uint32_t> _table;
+  
+  // Indexed by flow ID. A peer is written before _nb_flows is raised, then never changes
+  std::unique_ptr<Peer[]> _peers;
+  std::atomic<uint32_t>   _nb_flows;
+  std::atomic<uint64_t>   _dropped = 0;
+
+  TrafficCounters _traffic; // Peer side, rx from the peers and tx back to them
+
+  // Packets of the last recv_batch, header included
+  std::vector<uint8_t>          _batch_bufs;
+  std::vector<std::string_view> _batch;
+
+  static PeerKey make_key(const struct sockaddr * addr);
+
+  /**
+   * @brief Receive thread. Flow of this peer, added to the table on its first packet
+   * @return NO_FLOW if the table is full
+   */
+  uint32_t flow_of(const struct sockaddr * addr, socklen_t addr_len);
   
 public:  
   UdpSocket() noexcept;
@@ -28,11 +90,30 @@ public:
 
   void open(int port);
   
-  ssize_t recv() noexcept;
-  const char* get_buffer() const noexcept { return _buf; }
+  /**
+   * @brief Read up to MAX_BATCH_LEN packets at once.
+   * Blocks until at least one packet is available.
+   * @return The received packets prefixed with the tunnel header of their flow,
+   * empty if the socket has been closed or on error
+   */
+  std::span<const std::string_view> recv_batch() noexcept;
 
   void close();
+
+  /**
+   * @brief Send a packet from the tunnel to the peer of the flow in its header
+   */
   bool send_back(const char * buf, size_t len);
+
+  uint32_t nb_flows() const noexcept { return _nb_flows.load(std::memory_order_acquire); }
+
+  const TrafficCounters& traffic() const noexcept { return _traffic; }
+
+  /** @brief Any thread. Traffic, drops and statistics of every flow */
+  void collect_metrics(metrics::Writer& w) const;
+
+  /** @brief Statistics of the answers sent back to a flow, flow_id < nb_flows() */
+  const FlowStats& stats(uint32_t flow_id) const noexcept { return _peers[flow_id].stats; }
 };
 
 }
@@ -0,0 +1,68 @@
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include <fmt/core.h>
+
+#include "io_engine.h"
+#include "socket_engine.h"
+
+#ifdef WITH_IO_URING
+#include "uring_engine.h"
+#endif
+
+namespace io
+{
+
+void Engine::push_datagram(const char * buf, size_t len, size_t segment, const void * peer, socklen_t peer_len)
+{
+  if(segment == 0) segment = len;
+
+  for(size_t off = 0; off < len; off += segment) {
+    _payloads.emplace_back(buf + off, std::min(segment, len - off));
+
+    auto& addr = _peers.emplace_back();
+    memcpy(&addr, peer, std::min((size_t)peer_len, sizeof(addr)));
+    _peer_lens.push_back(peer_len);
+  }
+}
+
+void Engine::on_truncated() noexcept
+{
+  if(auto n = _truncated.fetch_add(1, std::memory_order_relaxed) + 1; n % 1000 == 1) {
+    fmt::print("I/O engine: {} truncated datagrams dropped\n", n);
+  }
+}
+
+void Engine::clear_datagrams()
+{
+  _payloads.clear();
+  _peers.clear();
+  _peer_lens.clear();
+}
+
+Engine::Type Engine::default_type()
+{
+  const char * env = std::getenv("QUIC_TUNNEL_IO");
+  if(env && strcmp(env, "uring") == 0) return Type::URING;
+
+  return Type::SOCKET;
+}
+
+std::unique_ptr<Engine> Engine::create(size_t buf_len, size_t batch_len, Type type)
+{
+#ifdef WITH_IO_URING
+  if(type == Type::URING) {
+    auto engine = std::make_unique<UringEngine>(buf_len, batch_len);
+    if(engine->init()) return engine;
+
+    fmt::print("Could not create io_uring engine, falling back to sockets\n");
+  }
+#else
+  if(type == Type::URING) fmt::print("Built without io_uring, falling back to sockets\n");
+#endif
+
+  return std::make_unique<SocketEngine>(buf_len, batch_len);
+}
+
+}
@@ -0,0 +1,104 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#include <sys/socket.h>
+
+namespace io
+{
+
+/**
+ * @brief Datagram I/O on an already bound UDP socket.
+ * Receives are batched, sends are queued until flush.
+ * recv must always be called from the same thread, send and flush can be called from any thread.
+ */
+class Engine
+{
+public:
+  enum class Type { SOCKET, URING };
+
+  static constexpr auto DEFAULT_BUF_LEN   = 2048u; // Size of one receive buffer
+  static constexpr auto DEFAULT_BATCH_LEN = 32u; // Max datagrams per receive or send batch
+
+protected:
+  int _socket = -1;
+
+  // Datagrams of the last recv call and their source address
+  std::vector<std::string_view>        _payloads;
+  std::vector<struct sockaddr_storage> _peers;
+  std::vector<socklen_t>               _peer_lens;
+
+  std::atomic<uint64_t> _truncated = 0; // Received datagrams longer than the buffers, dropped
+
+  /** @brief Add a received datagram, split in segment sized packets if it was coalesced by GRO */
+  void push_datagram(const char * buf, size_t len, size_t segment, const void * peer, socklen_t peer_len);
+  void clear_datagrams();
+
+  /** @brief Count a datagram dropped because it did not fit in a receive buffer */
+  void on_truncated() noexcept;
+
+public:
+  Engine() = default;
+  virtual ~Engine() = default;
+
+  /**
+   * @brief Use this socket. The socket stays owned by the caller.
+   * @param gro Whether UDP_GRO has been enabled on the socket
+   */
+  virtual bool attach(int socket, bool gro = false) = 0;
+
+  /**
+   * @brief Wait for incoming datagrams, or only take the ones already there if the socket is non-blocking
+   * @return The number of datagrams, available with payloads(). 0 on timeout or if there are none
+   * yet, -1 on error or once closed
+   */
+  virtual int recv() = 0;
+
+  /**
+   * @brief Descriptor readable when recv has something to handle, for a loop polling several
+   * descriptors. The socket itself, or the completion ring
+   */
+  virtual int poll_fd() const { return _socket; }
+
+  /** @brief Datagrams of the last recv call, valid until the next one */
+  std::span<const std::string_view> payloads() const noexcept { return _payloads; }
+  const struct sockaddr * peer(size_t i) const noexcept { return (const struct sockaddr *)&_peers[i]; }
+  socklen_t peer_len(size_t i) const noexcept { return _peer_lens[i]; }
+
+  /** @brief Any thread. Datagrams dropped by recv because they were longer than buf_len */
+  uint64_t truncated() const noexcept { return _truncated.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Queue a datagram. It is copied, and sent at the latest on the next flush
+   * @return false if the datagram is longer than buf_len, or could not be queued nor sent
+   */
+  virtual bool send(const char * buf, size_t len, const struct sockaddr * to, socklen_t to_len) = 0;
+
+  /** @brief Send all the queued datagrams */
+  virtual void flush() = 0;
+
+  /** @brief Wake up recv, which returns -1 from now on. Does not close the socket */
+  virtual void close() = 0;
+
+  /** @brief Engine selected with the QUIC_TUNNEL_IO environment variable ("socket" or "uring") */
+  static Type default_type();
+
+  /**
+   * @brief Create an I/O engine. Falls back to the socket engine if io_uring is not available
+   * @param buf_len Max datagram size, or GRO read size
+   * @param batch_len Max number of reads per recv and of queued sends
+   */
+  static std::unique_ptr<Engine> create(size_t buf_len = DEFAULT_BUF_LEN,
+					size_t batch_len = DEFAULT_BATCH_LEN,
+					Type type = default_type());
+};
+
+}
+
+#endif /* IO_ENGINE_H */
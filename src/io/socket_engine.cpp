@@ -0,0 +1,158 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "socket_engine.h"
+#include "udp_gso.h"
+
+namespace io
+{
+
+static constexpr size_t CTRL_LEN = CMSG_SPACE(sizeof(int));
+
+SocketEngine::SocketEngine(size_t buf_len, size_t batch_len)
+  : _buf_len(buf_len), _batch_len(batch_len), _gro(false), _closed(false),
+    _recv_bufs(buf_len * batch_len), _recv_ctrl(CTRL_LEN * batch_len),
+    _recv_iovs(batch_len), _recv_msgs(batch_len), _recv_addrs(batch_len),
+    _send_bufs(buf_len * batch_len), _send_iovs(batch_len),
+    _send_msgs(batch_len), _send_addrs(batch_len), _send_count(0)
+{
+  for(size_t i = 0; i < _batch_len; ++i) {
+    _recv_iovs[i].iov_base = &_recv_bufs[i * _buf_len];
+    _recv_iovs[i].iov_len  = _buf_len;
+
+    _send_iovs[i].iov_base = &_send_bufs[i * _buf_len];
+
+    memset(&_send_msgs[i].msg_hdr, 0, sizeof(_send_msgs[i].msg_hdr));
+    _send_msgs[i].msg_hdr.msg_name   = &_send_addrs[i];
+    _send_msgs[i].msg_hdr.msg_iov    = &_send_iovs[i];
+    _send_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+bool SocketEngine::attach(int socket, bool gro)
+{
+  _socket = socket;
+  _gro = gro;
+  _closed = false;
+
+  return _socket != -1;
+}
+
+int SocketEngine::recv()
+{
+  clear_datagrams();
+
+  if(_closed || _socket == -1) return -1;
+
+  for(size_t i = 0; i < _batch_len; ++i) {
+    auto& hdr = _recv_msgs[i].msg_hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name    = &_recv_addrs[i];
+    hdr.msg_namelen = sizeof(_recv_addrs[i]);
+    hdr.msg_iov     = &_recv_iovs[i];
+    hdr.msg_iovlen  = 1;
+
+    if(_gro) {
+      hdr.msg_control    = &_recv_ctrl[i * CTRL_LEN];
+      hdr.msg_controllen = CTRL_LEN;
+    }
+  }
+
+  // Wait for the first datagram, then take whatever is already queued
+  int n = recvmmsg(_socket, _recv_msgs.data(), _batch_len, MSG_WAITFORONE, nullptr);
+
+  if(n == -1) {
+    if(_closed) return -1;
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+
+    perror("Could not receive data in UDP socket");
+    return -1;
+  }
+
+  if(_closed) return -1; // Woken up by shutdown
+
+  for(int i = 0; i < n; ++i) {
+    auto& hdr = _recv_msgs[i].msg_hdr;
+    size_t segment = 0;
+
+    if(hdr.msg_flags & MSG_TRUNC) {
+      on_truncated();
+      continue;
+    }
+
+    if(_gro) {
+      for(struct cmsghdr * cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+	if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+	  int gso_size;
+	  memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+	  segment = gso_size;
+	}
+      }
+    }
+
+    push_datagram((const char*)_recv_iovs[i].iov_base, _recv_msgs[i].msg_len, segment,
+		  &_recv_addrs[i], hdr.msg_namelen);
+  }
+
+  return _payloads.size();
+}
+
+bool SocketEngine::send(const char * buf, size_t len, const struct sockaddr * to, socklen_t to_len)
+{
+  if(_socket == -1 || len > _buf_len) return false;
+
+  std::lock_guard<std::mutex> lock(_send_mutex);
+
+  if(_send_count == _batch_len) flush_locked();
+
+  memcpy(_send_iovs[_send_count].iov_base, buf, len);
+  _send_iovs[_send_count].iov_len = len;
+
+  memcpy(&_send_addrs[_send_count], to, to_len);
+  _send_msgs[_send_count].msg_hdr.msg_namelen = to_len;
+
+  ++_send_count;
+
+  return true;
+}
+
+void SocketEngine::flush_locked()
+{
+  auto * msgs = _send_msgs.data();
+  auto count  = _send_count;
+
+  while(count > 0) {
+    auto sent = sendmmsg(_socket, msgs, count, 0);
+
+    if(sent == -1) {
+      perror("Could not send data in UDP socket");
+      break;
+    }
+
+    msgs  += sent;
+    count -= sent;
+  }
+
+  _send_count = 0;
+}
+
+void SocketEngine::flush()
+{
+  std::lock_guard<std::mutex> lock(_send_mutex);
+  if(_send_count > 0 && _socket != -1) flush_locked();
+}
+
+void SocketEngine::close()
+{
+  _closed = true;
+
+  // Wakes up a blocked recvmmsg, otherwise it returns on SO_RCVTIMEO
+  if(_socket != -1) shutdown(_socket, SHUT_RD);
+}
+
+}
@@ -0,0 +1,54 @@
+#ifndef SOCKET_ENGINE_H
+#define SOCKET_ENGINE_H
+
+#include <mutex>
+#include <atomic>
+
+#include "io_engine.h"
+
+namespace io
+{
+
+/**
+ * @brief Default engine, with recvmmsg and sendmmsg on a blocking socket.
+ * recv returns on the socket SO_RCVTIMEO timeout.
+ */
+class SocketEngine final : public Engine
+{
+  size_t _buf_len;
+  size_t _batch_len;
+  bool   _gro;
+
+  std::atomic<bool> _closed;
+
+  // Receive side
+  std::vector<char>                    _recv_bufs;
+  std::vector<char>                    _recv_ctrl;
+  std::vector<struct iovec>            _recv_iovs;
+  std::vector<struct mmsghdr>          _recv_msgs;
+  std::vector<struct sockaddr_storage> _recv_addrs;
+
+  // Send side
+  std::mutex                           _send_mutex;
+  std::vector<char>                    _send_bufs;
+  std::vector<struct iovec>            _send_iovs;
+  std::vector<struct mmsghdr>          _send_msgs;
+  std::vector<struct sockaddr_storage> _send_addrs;
+  size_t                               _send_count;
+
+  void flush_locked();
+
+public:
+  SocketEngine(size_t buf_len, size_t batch_len);
+  ~SocketEngine() override = default;
+
+  bool attach(int socket, bool gro = false) override;
+  int recv() override;
+  bool send(const char * buf, size_t len, const struct sockaddr * to, socklen_t to_len) override;
+  void flush() override;
+  void close() override;
+};
+
+}
+
+#endif /* SOCKET_ENGINE_H */
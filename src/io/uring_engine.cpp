@@ -0,0 +1,417 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <fmt/core.h>
+
+#include "uring_engine.h"
+#include "udp_gso.h"
+
+namespace io
+{
+
+static constexpr uint64_t RECV_TAG   = 1ull << 62;
+static constexpr uint64_t CLOSE_TAG  = 1ull << 61;
+static constexpr uint64_t CANCEL_TAG = 1ull << 60;
+static constexpr uint64_t SEND_TAG   = 1ull << 59; // Low bits hold the send slot index
+
+static unsigned next_pow2(size_t n)
+{
+  unsigned p = 1;
+  while(p < n) p <<= 1;
+  return p;
+}
+
+UringEngine::UringEngine(size_t buf_len, size_t batch_len)
+  : _buf_len(buf_len), _batch_len(batch_len), _gro(false), _nonblocking(false), _closed(false), _ring_init(false),
+    _buf_ring(nullptr), _nb_bufs(0), _recv_buf_len(0), _recv_armed(false), _failed(false), _queued(0)
+{
+  memset(&_recv_msg, 0, sizeof(_recv_msg));
+}
+
+UringEngine::~UringEngine()
+{
+  if(!_ring_init) return;
+
+  if(_buf_ring) io_uring_free_buf_ring(&_ring, _buf_ring, _nb_bufs, BUF_GROUP);
+  io_uring_queue_exit(&_ring);
+}
+
+bool UringEngine::init()
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  // Room for a full batch of sends plus the receive and control requests
+  unsigned entries = next_pow2(std::max<size_t>(64, _batch_len * 4));
+
+  if(int ret = io_uring_queue_init_params(entries, &_ring, &params); ret < 0) {
+    fmt::print("io_uring_queue_init failed : {}\n", strerror(-ret));
+    return false;
+  }
+
+  _ring_init = true;
+
+  if(!(params.features & IORING_FEAT_EXT_ARG)) {
+    fmt::print("io_uring: kernel too old, no IORING_FEAT_EXT_ARG\n");
+    return false;
+  }
+
+  // Provided buffers: recvmsg header, peer address, GRO cmsg, then the payload
+  _nb_bufs = next_pow2(std::max<size_t>(64, _batch_len * 4));
+  _recv_buf_len = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage)
+    + CMSG_SPACE(sizeof(int)) + _buf_len;
+  _recv_bufs.resize(_nb_bufs * _recv_buf_len);
+
+  int ret;
+  _buf_ring = io_uring_setup_buf_ring(&_ring, _nb_bufs, BUF_GROUP, 0, &ret);
+  if(!_buf_ring) {
+    fmt::print("io_uring_setup_buf_ring failed : {}\n", strerror(-ret));
+    return false;
+  }
+
+  for(unsigned i = 0; i < _nb_bufs; ++i) {
+    io_uring_buf_ring_add(_buf_ring, &_recv_bufs[i * _recv_buf_len], _recv_buf_len, i,
+			  io_uring_buf_ring_mask(_nb_bufs), i);
+  }
+  io_uring_buf_ring_advance(_buf_ring, _nb_bufs);
+
+  // Without it every receive completes with EINVAL, the socket engine is used instead
+  if(!probe_multishot()) {
+    fmt::print("io_uring: multishot recvmsg is not supported, needs a 6.0+ kernel\n");
+    return false;
+  }
+
+  // Twice a batch, so a batch can be queued while the previous one completes
+  auto nb_slots = _batch_len * 2;
+  _send_bufs.resize(nb_slots * _buf_len);
+  _send_slots.resize(nb_slots);
+
+  for(size_t i = 0; i < nb_slots; ++i) {
+    _send_slots[i].data = &_send_bufs[i * _buf_len];
+    _free_slots.push_back(i);
+  }
+
+  return true;
+}
+
+bool UringEngine::probe_multishot()
+{
+  int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+  if(sock == -1) return false;
+
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+
+  if(bind(sock, (struct sockaddr*)&addr, addr_len) == -1 || getsockname(sock, (struct sockaddr*)&addr, &addr_len) == -1) {
+    ::close(sock);
+    return false;
+  }
+
+  struct msghdr msg{};
+  msg.msg_namelen = sizeof(struct sockaddr_storage);
+
+  auto * sqe = io_uring_get_sqe(&_ring);
+  io_uring_prep_recvmsg_multishot(sqe, sock, &msg, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  io_uring_sqe_set_data64(sqe, RECV_TAG);
+  io_uring_submit(&_ring);
+
+  // One datagram to itself, the request completes with it or with EINVAL
+  char byte = 0;
+  sendto(sock, &byte, sizeof(byte), 0, (struct sockaddr*)&addr, addr_len);
+
+  bool supported = false;
+  bool armed = true;
+  bool cancelled = false;
+
+  while(armed) {
+    struct __kernel_timespec ts = { .tv_sec = 1, .tv_nsec = 0 };
+    struct io_uring_cqe * cqe;
+
+    if(io_uring_wait_cqe_timeout(&_ring, &cqe, &ts) < 0) break;
+
+    if(io_uring_cqe_get_data64(cqe) == RECV_TAG) {
+      if(!cancelled) supported = cqe->res >= 0;
+      if(!(cqe->flags & IORING_CQE_F_MORE)) armed = false;
+
+      if(cqe->flags & IORING_CQE_F_BUFFER) {
+	_used_bids.push_back(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	recycle_buffers();
+      }
+    }
+
+    io_uring_cqe_seen(&_ring, cqe);
+
+    // Still armed on the probe socket, cancel it before the socket goes
+    if(armed && !cancelled) {
+      auto * cancel = io_uring_get_sqe(&_ring);
+      io_uring_prep_cancel64(cancel, RECV_TAG, 0);
+      io_uring_sqe_set_data64(cancel, CANCEL_TAG);
+      io_uring_submit(&_ring);
+      cancelled = true;
+    }
+  }
+
+  // The cancel completion, if any
+  struct io_uring_cqe * cqe;
+  while(io_uring_peek_cqe(&_ring, &cqe) == 0) io_uring_cqe_seen(&_ring, cqe);
+
+  ::close(sock);
+
+  return supported && !armed;
+}
+
+struct io_uring_sqe * UringEngine::get_sqe()
+{
+  auto * sqe = io_uring_get_sqe(&_ring);
+
+  if(!sqe) {
+    // Submission queue full, make room
+    io_uring_submit(&_ring);
+    _queued = 0;
+    sqe = io_uring_get_sqe(&_ring);
+  }
+
+  return sqe;
+}
+
+void UringEngine::arm_recv()
+{
+  auto * sqe = get_sqe();
+  if(!sqe) return;
+
+  io_uring_prep_recvmsg_multishot(sqe, _socket, &_recv_msg, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  io_uring_sqe_set_data64(sqe, RECV_TAG);
+
+  _recv_armed = true;
+}
+
+bool UringEngine::attach(int socket, bool gro)
+{
+  _socket = socket;
+  _gro = gro;
+  _closed = false;
+  _nonblocking = fcntl(socket, F_GETFL, 0) & O_NONBLOCK;
+
+  memset(&_recv_msg, 0, sizeof(_recv_msg));
+  _recv_msg.msg_namelen    = sizeof(struct sockaddr_storage);
+  _recv_msg.msg_controllen = gro ? CMSG_SPACE(sizeof(int)) : 0;
+
+  std::lock_guard<std::mutex> lock(_sq_mutex);
+  arm_recv();
+  io_uring_submit(&_ring);
+  _queued = 0;
+
+  return _recv_armed;
+}
+
+void UringEngine::recycle_buffers()
+{
+  if(_used_bids.empty()) return;
+
+  int i = 0;
+  for(auto bid : _used_bids) {
+    io_uring_buf_ring_add(_buf_ring, &_recv_bufs[bid * _recv_buf_len], _recv_buf_len, bid,
+			  io_uring_buf_ring_mask(_nb_bufs), i++);
+  }
+
+  io_uring_buf_ring_advance(_buf_ring, i);
+  _used_bids.clear();
+}
+
+void UringEngine::handle_recv(struct io_uring_cqe * cqe)
+{
+  // The multishot request ends on error or when it ran out of buffers
+  if(!(cqe->flags & IORING_CQE_F_MORE)) _recv_armed = false;
+
+  if(cqe->res < 0) {
+    // Out of buffers or cancelled, it is armed again. Anything else would fail again each time
+    if(cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+      fmt::print("io_uring recvmsg failed, closing the engine : {}\n", strerror(-cqe->res));
+      _failed = true;
+    }
+    return;
+  }
+
+  if(!(cqe->flags & IORING_CQE_F_BUFFER)) return;
+
+  uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  _used_bids.push_back(bid);
+
+  char * buf = &_recv_bufs[bid * _recv_buf_len];
+  auto * out = io_uring_recvmsg_validate(buf, cqe->res, &_recv_msg);
+  if(!out) return;
+
+  // Without the GRO cmsg its room is left to the payload, longer than the socket engine would take
+  auto len = io_uring_recvmsg_payload_length(out, cqe->res, &_recv_msg);
+  if((out->flags & MSG_TRUNC) || len > _buf_len) {
+    on_truncated();
+    return;
+  }
+
+  size_t segment = 0;
+
+  if(_gro) {
+    for(auto * cm = io_uring_recvmsg_cmsg_firsthdr(out, &_recv_msg); cm;
+	cm = io_uring_recvmsg_cmsg_nexthdr(out, &_recv_msg, cm)) {
+      if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+	int gso_size;
+	memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+	segment = gso_size;
+      }
+    }
+  }
+
+  push_datagram((const char*)io_uring_recvmsg_payload(out, &_recv_msg), len,
+		segment, io_uring_recvmsg_name(out), out->namelen);
+}
+
+int UringEngine::recv()
+{
+  clear_datagrams();
+
+  // The caller is done with the previous batch
+  recycle_buffers();
+
+  if(_closed || _failed || _socket == -1) return -1;
+
+  {
+    std::lock_guard<std::mutex> lock(_sq_mutex);
+    if(!_recv_armed) arm_recv();
+    io_uring_submit(&_ring);
+    _queued = 0;
+  }
+
+  struct __kernel_timespec ts = { .tv_sec = RECV_TIMEOUT_SEC, .tv_nsec = 0 };
+  struct io_uring_cqe * cqe;
+
+  int ret = _nonblocking ? io_uring_peek_cqe(&_ring, &cqe) : io_uring_wait_cqe_timeout(&_ring, &cqe, &ts);
+  if(ret == -ETIME || ret == -EINTR || ret == -EAGAIN) return _closed ? -1 : 0;
+  if(ret < 0) {
+    fmt::print("io_uring wait failed : {}\n", strerror(-ret));
+    return -1;
+  }
+
+  unsigned head, count = 0;
+  bool closing = false;
+
+  io_uring_for_each_cqe(&_ring, head, cqe) {
+    ++count;
+
+    auto tag = io_uring_cqe_get_data64(cqe);
+
+    if(tag == RECV_TAG) handle_recv(cqe);
+    else if(tag == CLOSE_TAG) closing = true;
+    else if(tag & SEND_TAG) {
+      if(cqe->res < 0) fmt::print("io_uring sendmsg failed : {}\n", strerror(-cqe->res));
+
+      std::lock_guard<std::mutex> lock(_sq_mutex);
+      _free_slots.push_back(tag & ~SEND_TAG);
+    }
+  }
+
+  io_uring_cq_advance(&_ring, count);
+
+  if(closing || _closed || _failed) return -1;
+
+  // Polled on the ring, recv is only called again on a completion, so the receive request
+  // ended by running out of buffers is armed again now
+  if(_nonblocking && !_recv_armed) {
+    std::lock_guard<std::mutex> lock(_sq_mutex);
+    arm_recv();
+    io_uring_submit(&_ring);
+    _queued = 0;
+  }
+
+  return _payloads.size();
+}
+
+bool UringEngine::send(const char * buf, size_t len, const struct sockaddr * to, socklen_t to_len)
+{
+  if(_socket == -1 || len > _buf_len) return false;
+
+  std::lock_guard<std::mutex> lock(_sq_mutex);
+
+  if(_free_slots.empty()) {
+    // Every slot is in flight, submit what is queued and send this one synchronously
+    io_uring_submit(&_ring);
+    _queued = 0;
+
+    return sendto(_socket, buf, len, 0, to, to_len) >= 0;
+  }
+
+  auto idx = _free_slots.back();
+  auto& slot = _send_slots[idx];
+
+  auto * sqe = get_sqe();
+  if(!sqe) return false;
+
+  _free_slots.pop_back();
+
+  memcpy(slot.data, buf, len);
+  memcpy(&slot.to, to, std::min((size_t)to_len, sizeof(slot.to)));
+
+  slot.iov.iov_base = slot.data;
+  slot.iov.iov_len  = len;
+
+  memset(&slot.msg, 0, sizeof(slot.msg));
+  slot.msg.msg_name    = &slot.to;
+  slot.msg.msg_namelen = to_len;
+  slot.msg.msg_iov     = &slot.iov;
+  slot.msg.msg_iovlen  = 1;
+
+  io_uring_prep_sendmsg(sqe, _socket, &slot.msg, 0);
+  io_uring_sqe_set_data64(sqe, SEND_TAG | idx);
+
+  if(++_queued == _batch_len) {
+    io_uring_submit(&_ring);
+    _queued = 0;
+  }
+
+  return true;
+}
+
+void UringEngine::flush()
+{
+  std::lock_guard<std::mutex> lock(_sq_mutex);
+
+  if(_queued > 0) {
+    io_uring_submit(&_ring);
+    _queued = 0;
+  }
+}
+
+void UringEngine::close()
+{
+  _closed = true;
+
+  std::lock_guard<std::mutex> lock(_sq_mutex);
+
+  if(auto * sqe = get_sqe()) {
+    io_uring_prep_cancel64(sqe, RECV_TAG, 0);
+    io_uring_sqe_set_data64(sqe, CANCEL_TAG);
+  }
+
+  // Wakes up recv
+  if(auto * sqe = get_sqe()) {
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data64(sqe, CLOSE_TAG);
+  }
+
+  io_uring_submit(&_ring);
+  _queued = 0;
+}
+
+}
@@ -0,0 +1,83 @@
+#ifndef URING_ENGINE_H
+#define URING_ENGINE_H
+
+#include <mutex>
+#include <atomic>
+
+#include <liburing.h>
+
+#include "io_engine.h"
+
+namespace io
+{
+
+/**
+ * @brief io_uring engine. Receives with a multishot recvmsg into a ring of provided buffers
+ * registered with the kernel, sends are prepared as sendmsg SQEs and submitted once per flush.
+ * Needs a 6.0+ kernel.
+ */
+class UringEngine final : public Engine
+{
+  static constexpr int BUF_GROUP = 0;
+  static constexpr auto RECV_TIMEOUT_SEC = 5; // Same refresh period as the blocking sockets
+
+  struct SendSlot
+  {
+    struct msghdr           msg;
+    struct iovec            iov;
+    struct sockaddr_storage to;
+    char *                  data;
+  };
+
+  size_t _buf_len;
+  size_t _batch_len;
+  bool   _gro;
+  bool   _nonblocking; // Of the socket, recv only takes the completions already there
+
+  std::atomic<bool> _closed;
+
+  struct io_uring _ring;
+  bool            _ring_init;
+
+  // Receive side, owned by the recv thread
+  struct io_uring_buf_ring * _buf_ring;
+  unsigned                   _nb_bufs;
+  size_t                     _recv_buf_len; // payload + recvmsg header + name + control
+  std::vector<char>          _recv_bufs;
+  std::vector<uint16_t>      _used_bids; // Buffers of the last batch, given back on the next recv
+  struct msghdr              _recv_msg;
+  bool                       _recv_armed;
+  bool                       _failed; // The receive request failed, the ring is not used anymore
+
+  // Send side and submission queue, shared between threads
+  std::mutex            _sq_mutex;
+  std::vector<char>     _send_bufs;
+  std::vector<SendSlot> _send_slots;
+  std::vector<uint16_t> _free_slots;
+  unsigned              _queued;
+
+  /** @brief Whether the kernel runs multishot recvmsg, which came after the buffer rings */
+  bool probe_multishot();
+
+  struct io_uring_sqe * get_sqe();
+  void arm_recv();
+  void recycle_buffers();
+  void handle_recv(struct io_uring_cqe * cqe);
+
+public:
+  UringEngine(size_t buf_len, size_t batch_len);
+  ~UringEngine() override;
+
+  bool init();
+
+  bool attach(int socket, bool gro = false) override;
+  int recv() override;
+  int poll_fd() const override { return _ring.ring_fd; }
+  bool send(const char * buf, size_t len, const struct sockaddr * to, socklen_t to_len) override;
+  void flush() override;
+  void close() override;
+};
+
+}
+
+#endif /* URING_ENGINE_H */
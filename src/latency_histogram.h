@@ -0,0 +1,134 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <string_view>
+
+#include <fmt/core.h>
+
+#include "metrics.h"
+
+/**
+ * @brief Lock-free log-linear histogram of latencies in microseconds, HdrHistogram style.
+ * Values below SUB_COUNT have their own bucket, above each power of two is split in
+ * SUB_HALF buckets, so a recorded value is known within 1/SUB_HALF of itself, up to MAX_VALUE.
+ * Any number of threads can record and read at the same time.
+ */
+class LatencyHistogram
+{
+public:
+  static constexpr unsigned SUB_BITS = 7;
+  static constexpr uint64_t SUB_COUNT = 1u << SUB_BITS;
+  static constexpr uint64_t SUB_HALF = SUB_COUNT / 2;
+  static constexpr unsigned VALUE_BITS = 32; // Above an hour
+  static constexpr uint64_t MAX_VALUE = (1ull << VALUE_BITS) - 1;
+  static constexpr size_t NB_BUCKETS = (VALUE_BITS - SUB_BITS + 2) * SUB_HALF;
+
+private:
+  std::array<std::atomic<uint64_t>, NB_BUCKETS> _buckets{};
+  std::atomic<uint64_t> _count{0};
+  std::atomic<uint64_t> _sum{0};
+  std::atomic<uint64_t> _max{0};
+  std::atomic<uint64_t> _negative{0}; // Sender clock ahead of the receiver one
+
+public:
+  static size_t index_of(uint64_t value) noexcept
+  {
+    if(value < SUB_COUNT) return value;
+    if(value > MAX_VALUE) value = MAX_VALUE;
+
+    unsigned shift = (63 - __builtin_clzll(value)) - (SUB_BITS - 1);
+    return shift * SUB_HALF + (value >> shift);
+  }
+
+  /** @brief Highest value that lands in the bucket */
+  static uint64_t value_at(size_t index) noexcept
+  {
+    if(index < SUB_COUNT) return index;
+
+    unsigned shift = index / SUB_HALF - 1;
+    uint64_t sub = index - shift * SUB_HALF;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  void record(int64_t value_us) noexcept
+  {
+    if(value_us < 0) {
+      _negative.fetch_add(1, std::memory_order_relaxed);
+      value_us = 0;
+    }
+
+    uint64_t value = value_us;
+
+    _buckets[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+
+    auto max = _max.load(std::memory_order_relaxed);
+    while(value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed));
+  }
+
+  uint64_t count() const noexcept { return _count.load(std::memory_order_relaxed); }
+  uint64_t sum() const noexcept { return _sum.load(std::memory_order_relaxed); }
+  uint64_t max() const noexcept { return _max.load(std::memory_order_relaxed); }
+  uint64_t negative() const noexcept { return _negative.load(std::memory_order_relaxed); }
+
+  /** @brief Value under which a fraction q of the recorded values are, 0 when empty */
+  uint64_t percentile(double q) const noexcept
+  {
+    auto total = count();
+    if(total == 0) return 0;
+
+    uint64_t target = q * total;
+    if(target < 1) target = 1;
+
+    uint64_t seen = 0;
+    for(size_t i = 0; i < NB_BUCKETS; ++i) {
+      seen += _buckets[i].load(std::memory_order_relaxed);
+      if(seen >= target) return std::min(value_at(i), max());
+    }
+
+    return max();
+  }
+
+  /** @brief Writes the non empty buckets, one "value_us,count" line each */
+  void dump(FILE * file) const
+  {
+    for(size_t i = 0; i < NB_BUCKETS; ++i) {
+      if(auto n = _buckets[i].load(std::memory_order_relaxed)) fmt::print(file, "{},{}\n", value_at(i), n);
+    }
+  }
+
+  /** @brief Prints the quantiles and writes the buckets in a csv file, false if it could not be opened */
+  bool dump(const char * file_name, std::string_view name) const
+  {
+    fmt::print("Latency {}: {} packets, p50 {} us, p99 {} us, p999 {} us, max {} us, {} negative\n",
+	       name, count(), percentile(0.5), percentile(0.99), percentile(0.999), max(), negative());
+
+    FILE * file = fopen(file_name, "w");
+    if(!file) {
+      perror("Could not open the latency file");
+      return false;
+    }
+
+    fmt::print(file, "# {}\n", name);
+    dump(file);
+    fclose(file);
+
+    return true;
+  }
+
+  /** @brief Quantiles as a Prometheus summary, with the current labels of w */
+  void collect(metrics::Writer& w) const
+  {
+    w.summary<uint64_t>("quic_tunnel_latency_microseconds", "One way delay added by the tunnel",
+			{ { "0.5", percentile(0.5) }, { "0.99", percentile(0.99) }, { "0.999", percentile(0.999) } },
+			sum(), count());
+  }
+};
+
+#endif /* LATENCY_HISTOGRAM_H */
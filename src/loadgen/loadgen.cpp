@@ -0,0 +1,442 @@
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <vector>
+#include <string>
+#include <csignal>
+#include <cstring>
+#include <unordered_map>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <fmt/core.h>
+#include <fmt/color.h>
+
+#include "rtp_stats.h"
+#include "pcap_reader.h"
+
+/**
+ * Reproducible RTP load for the tunnel, without a WebRTC peer. The sender emits synthetic
+ * video to the in-tunnel, the replayer sends the UDP payloads of a capture with their
+ * original timing, and the sink stands for the TURN server behind the out-tunnel and
+ * checks the sequence numbers and the jitter of every stream it receives.
+ */
+
+using namespace std::string_literals;
+
+namespace def
+{
+
+constexpr auto HOST = "127.0.0.1";
+constexpr auto SEND_PORT = 3479; // In-tunnel
+constexpr auto SINK_PORT = 3478; // TURN port of the out-tunnel
+constexpr auto BITRATE = 2'000'000;
+constexpr auto FPS = 30.;
+constexpr auto KEYFRAME_INTERVAL = 2.; // Seconds, 0 for none
+constexpr auto KEYFRAME_RATIO = 5.;    // Size of a keyframe over a delta frame
+constexpr auto PAYLOAD = 1200;         // Max RTP payload of a packet
+constexpr auto STREAMS = 1;
+constexpr auto DURATION = 0;           // Seconds, 0 until interrupted
+constexpr auto PAYLOAD_TYPE = 96;
+
+}
+
+static std::atomic<bool> stop_requested = false;
+
+static void on_signal(int) { stop_requested = true; }
+
+using Clock = std::chrono::steady_clock;
+
+static int64_t now_us()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static bool resolve(const std::string& host, uint16_t port, struct sockaddr_storage& addr, socklen_t& addr_len)
+{
+  struct addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  struct addrinfo * res = nullptr;
+  if(getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0 || !res) {
+    fmt::print("Could not resolve {}\n", host);
+    return false;
+  }
+
+  memcpy(&addr, res->ai_addr, res->ai_addrlen);
+  addr_len = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  return true;
+}
+
+// Sender /////////////////////////////////////////////////////////////////////
+
+struct VideoConfig
+{
+  uint64_t bitrate = def::BITRATE;
+  double   fps = def::FPS;
+  double   keyframe_interval = def::KEYFRAME_INTERVAL;
+  double   keyframe_ratio = def::KEYFRAME_RATIO;
+  size_t   payload = def::PAYLOAD;
+  unsigned streams = def::STREAMS;
+};
+
+/**
+ * @brief Synthetic video streams: a frame every 1/fps, a keyframe keyframe_ratio times larger
+ * than the other frames every keyframe_interval, with the same average bitrate. A frame is
+ * split in equal packets sent back to back, the last one with the marker bit. Every stream
+ * has its own socket, so it is its own flow in the tunnel.
+ */
+static int send_video(const VideoConfig& config, const struct sockaddr_storage& addr, socklen_t addr_len,
+		      std::chrono::seconds duration)
+{
+  struct Stream
+  {
+    int         socket;
+    rtp::Header header;
+  };
+
+  std::mt19937 rng(std::random_device{}());
+  std::vector<Stream> streams;
+
+  for(unsigned i = 0; i < config.streams; ++i) {
+    int sock = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock == -1) {
+      perror("Could not create UDP socket");
+      return -1;
+    }
+
+    streams.push_back({ sock, { false, def::PAYLOAD_TYPE, (uint16_t)rng(), (uint32_t)rng(), (uint32_t)rng() } });
+  }
+
+  uint64_t gop = config.keyframe_interval > 0 ? std::max(1l, std::lround(config.keyframe_interval * config.fps)) : 0;
+  double frame_bytes = config.bitrate / 8. / config.fps;
+  double delta_bytes = gop ? frame_bytes * gop / (gop - 1 + config.keyframe_ratio) : frame_bytes;
+  double key_bytes = gop ? delta_bytes * config.keyframe_ratio : delta_bytes;
+  uint32_t ts_step = rtp::VIDEO_CLOCK_RATE / config.fps;
+
+  fmt::print("Sending {} stream(s) of {} bit/s, {} fps, frames of {:.0f} bytes, keyframes of {:.0f} bytes\n",
+	     config.streams, config.bitrate, config.fps, delta_bytes, key_bytes);
+
+  std::vector<uint8_t> buf(rtp::HEADER_LEN + config.payload, 0);
+  uint64_t packets = 0, bytes = 0;
+
+  auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1. / config.fps));
+  auto start = Clock::now();
+
+  for(uint64_t frame = 0; !stop_requested; ++frame) {
+    auto due = start + frame * period;
+    if(duration.count() > 0 && due - start >= duration) break;
+
+    std::this_thread::sleep_until(due);
+
+    size_t size = std::max<size_t>(1, std::lround(gop && frame % gop == 0 ? key_bytes : delta_bytes));
+    size_t nb_packets = (size + config.payload - 1) / config.payload;
+    size_t packet_payload = (size + nb_packets - 1) / nb_packets;
+
+    for(auto& stream : streams) {
+      size_t left = size;
+
+      for(size_t i = 0; i < nb_packets; ++i) {
+	size_t len = std::min(left, packet_payload);
+	left -= len;
+
+	stream.header.marker = i == nb_packets - 1;
+	rtp::write(buf.data(), stream.header);
+	++stream.header.seq;
+
+	if(sendto(stream.socket, buf.data(), rtp::HEADER_LEN + len, 0, (struct sockaddr*)&addr, addr_len) == -1) {
+	  perror("Could not send RTP packet");
+	  continue;
+	}
+
+	++packets;
+	bytes += rtp::HEADER_LEN + len;
+      }
+
+      stream.header.timestamp += ts_step;
+    }
+  }
+
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  fmt::print("Sent {} packets, {} bytes in {:.1f} s, {:.0f} bit/s\n", packets, bytes, elapsed, bytes * 8 / elapsed);
+
+  for(auto& stream : streams) ::close(stream.socket);
+
+  return 0;
+}
+
+// Replayer ///////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Sends the UDP payloads of a capture with their original spacing. The packets of
+ * every source port of the capture go through their own socket, so the flows of the capture
+ * stay separate in the tunnel.
+ * @param port_filter Only the packets from or to this port, 0 for all
+ */
+static int replay_pcap(const char * file_name, uint16_t port_filter,
+		       const struct sockaddr_storage& addr, socklen_t addr_len)
+{
+  PcapReader reader;
+  if(!reader.open(file_name)) return -1;
+
+  std::unordered_map<uint16_t, int> sockets;
+  uint64_t packets = 0, bytes = 0;
+
+  PcapReader::Packet packet;
+  int64_t first_us = -1;
+  auto start = Clock::now();
+
+  while(!stop_requested && reader.next(packet)) {
+    if(port_filter && packet.src_port != port_filter && packet.dst_port != port_filter) continue;
+
+    if(first_us < 0) first_us = packet.time_us;
+    std::this_thread::sleep_until(start + std::chrono::microseconds(packet.time_us - first_us));
+
+    auto [it, inserted] = sockets.try_emplace(packet.src_port, -1);
+    if(inserted) it->second = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+
+    if(it->second == -1) {
+      perror("Could not create UDP socket");
+      break;
+    }
+
+    if(sendto(it->second, packet.payload.data(), packet.payload.size(), 0, (struct sockaddr*)&addr, addr_len) == -1) {
+      perror("Could not send packet");
+      continue;
+    }
+
+    ++packets;
+    bytes += packet.payload.size();
+  }
+
+  fmt::print("Replayed {} packets, {} bytes from {} flow(s)\n", packets, bytes, sockets.size());
+
+  for(auto& [port, sock] : sockets) if(sock != -1) ::close(sock);
+
+  return 0;
+}
+
+// Sink ///////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Receives the RTP streams and prints, every second, the rate, loss and jitter of
+ * each of them, then their totals when stopped
+ */
+static int run_sink(uint16_t port, std::chrono::seconds duration)
+{
+  int sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+  if(sock == -1) {
+    perror("Could not create UDP socket");
+    return -1;
+  }
+
+  int off = 0;
+  setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+  struct timeval timeout{ 0, 100'000 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // Keyframes arrive in bursts, the sink must not be the one losing them
+  int rcvbuf = 4 << 20;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  struct sockaddr_in6 addr{};
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port);
+  addr.sin6_addr = in6addr_any;
+
+  if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    perror("Could not bind UDP socket");
+    return -1;
+  }
+
+  fmt::print("Listening for RTP on port {}\n", port);
+
+  std::unordered_map<uint32_t, rtp::StreamStats> streams;
+  std::unordered_map<uint32_t, uint64_t> interval_bytes;
+  uint64_t not_rtp = 0;
+  uint8_t buf[2048];
+
+  auto start = Clock::now();
+  auto next_report = start + std::chrono::seconds(1);
+
+  while(!stop_requested) {
+    auto now = Clock::now();
+    if(duration.count() > 0 && now - start >= duration) break;
+
+    if(now >= next_report) {
+      double sec = std::chrono::duration<double>(now - start).count();
+
+      for(auto& [ssrc, stats] : streams) {
+	fmt::print("{:.1f} ssrc {:08x}: {:.0f} bit/s, loss {:.2f} %, jitter {:.2f} ms\n", sec, ssrc,
+		   interval_bytes[ssrc] * 8., stats.interval_loss() * 100., stats.jitter_ms());
+	interval_bytes[ssrc] = 0;
+      }
+
+      next_report += std::chrono::seconds(1);
+    }
+
+    ssize_t len = recv(sock, buf, sizeof(buf), 0);
+    if(len <= 0) continue;
+
+    rtp::Header header;
+    if(!rtp::parse(buf, len, header)) {
+      ++not_rtp;
+      continue;
+    }
+
+    streams[header.ssrc].on_packet(header, len, now_us());
+    interval_bytes[header.ssrc] += len;
+  }
+
+  for(auto& [ssrc, stats] : streams) stats.print("Total", ssrc);
+  if(not_rtp > 0) fmt::print("{} packets were not RTP\n", not_rtp);
+
+  ::close(sock);
+
+  return 0;
+}
+
+// Command line ///////////////////////////////////////////////////////////////
+
+static void print_option(const char * name, const char * arg, std::string_view help)
+{
+  fmt::print(fg(fmt::color::crimson) | fmt::emphasis::bold, "--{} ", name);
+  fmt::print(fg(fmt::color::steel_blue) | fmt::emphasis::bold, "{}", arg);
+  fmt::print(" : {}\n", help);
+}
+
+void display_help()
+{
+  fmt::print("{:*^50}\n", " RTP load generator help ");
+  fmt::print("\n");
+
+  print_option("mode", "MODE", "send synthetic video, replay a pcap, or sink <send|replay|sink>");
+  print_option("host", "HOST", fmt::format("Destination of send and replay (default {})", def::HOST));
+  print_option("port", "PORT", fmt::format("Destination port, or listening port of the sink "
+					   "(default {} to send, {} for the sink)", def::SEND_PORT, def::SINK_PORT));
+  print_option("bitrate", "BPS", fmt::format("Bitrate of a stream (default {})", def::BITRATE));
+  print_option("fps", "FPS", fmt::format("Frame rate (default {})", def::FPS));
+  print_option("keyframe-interval", "SEC", fmt::format("Time between keyframes, 0 for none (default {})", def::KEYFRAME_INTERVAL));
+  print_option("keyframe-ratio", "N", fmt::format("Size of a keyframe over a delta frame (default {})", def::KEYFRAME_RATIO));
+  print_option("payload", "BYTES", fmt::format("Max RTP payload of a packet (default {})", def::PAYLOAD));
+  print_option("streams", "N", fmt::format("Number of streams, each with its own socket (default {})", def::STREAMS));
+  print_option("duration", "SEC", "Stop after this time, 0 until interrupted (default 0)");
+  print_option("pcap", "FILE", "Capture to replay");
+  print_option("pcap-port", "PORT", "Replay only the packets from or to this port (default all)");
+
+  fmt::print("\n");
+}
+
+enum OptInd : uint8_t {
+  MODE = 0,
+  HOST,
+  PORT,
+  BITRATE,
+  FPS,
+  KEYFRAME_INTERVAL,
+  KEYFRAME_RATIO,
+  PAYLOAD,
+  STREAMS,
+  DURATION,
+  PCAP,
+  PCAP_PORT,
+  HELP
+};
+
+int main(int argc, char *argv[])
+{
+  struct option long_options[] = {
+    { "mode", required_argument, 0, 0 },
+    { "host", required_argument, 0, 0 },
+    { "port", required_argument, 0, 0 },
+    { "bitrate", required_argument, 0, 0 },
+    { "fps", required_argument, 0, 0 },
+    { "keyframe-interval", required_argument, 0, 0 },
+    { "keyframe-ratio", required_argument, 0, 0 },
+    { "payload", required_argument, 0, 0 },
+    { "streams", required_argument, 0, 0 },
+    { "duration", required_argument, 0, 0 },
+    { "pcap", required_argument, 0, 0 },
+    { "pcap-port", required_argument, 0, 0 },
+    { "help", no_argument, 0, 0 },
+    { 0, 0, 0, 0 },
+  };
+
+  std::string mode;
+  std::string host = def::HOST;
+  int port = -1;
+  VideoConfig video;
+  std::chrono::seconds duration{def::DURATION};
+  std::string pcap;
+  uint16_t pcap_port = 0;
+
+  while(true) {
+    int option_index = 0;
+
+    int c = getopt_long(argc, argv, "h", long_options, &option_index);
+
+    if(c == -1) break;
+    else if(c == 'h') {
+      display_help();
+      return 0;
+    }
+    else if(c != 0) continue;
+
+    switch(option_index) {
+    case OptInd::MODE: mode = optarg; break;
+    case OptInd::HOST: host = optarg; break;
+    case OptInd::PORT: port = std::stoi(optarg); break;
+    case OptInd::BITRATE: video.bitrate = std::stoull(optarg); break;
+    case OptInd::FPS: video.fps = std::stod(optarg); break;
+    case OptInd::KEYFRAME_INTERVAL: video.keyframe_interval = std::stod(optarg); break;
+    case OptInd::KEYFRAME_RATIO: video.keyframe_ratio = std::max(1., std::stod(optarg)); break;
+    case OptInd::PAYLOAD: video.payload = std::max(1, std::stoi(optarg)); break;
+    case OptInd::STREAMS: video.streams = std::max(1, std::stoi(optarg)); break;
+    case OptInd::DURATION: duration = std::chrono::seconds(std::stoi(optarg)); break;
+    case OptInd::PCAP: pcap = optarg; break;
+    case OptInd::PCAP_PORT: pcap_port = std::stoi(optarg); break;
+    case OptInd::HELP: display_help(); return 0;
+    }
+  }
+
+  if(mode != "send" && mode != "replay" && mode != "sink") {
+    fmt::print(fg(fmt::color::red) | fmt::emphasis::bold, "error : ");
+    fmt::print("You must specify a mode, send, replay or sink\n");
+    return -1;
+  }
+
+  if(video.fps <= 0) {
+    fmt::print(fg(fmt::color::red) | fmt::emphasis::bold, "error : ");
+    fmt::print("The frame rate must be positive\n");
+    return -1;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  if(mode == "sink") return run_sink(port != -1 ? port : def::SINK_PORT, duration);
+
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  if(!resolve(host, port != -1 ? port : def::SEND_PORT, addr, addr_len)) return -1;
+
+  if(mode == "send") return send_video(video, addr, addr_len, duration);
+
+  if(pcap.empty()) {
+    fmt::print(fg(fmt::color::red) | fmt::emphasis::bold, "error : ");
+    fmt::print("The replay mode needs a --pcap file\n");
+    return -1;
+  }
+
+  return replay_pcap(pcap.c_str(), pcap_port, addr, addr_len);
+}
@@ -0,0 +1,170 @@
+#ifndef PCAP_READER_H
+#define PCAP_READER_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include <fmt/core.h>
+
+/**
+ * @brief Reads the UDP packets of a classic pcap capture, in either byte order and with
+ * microsecond or nanosecond timestamps. Ethernet, loopback, raw IP and Linux cooked
+ * captures of IPv4 and IPv6 are understood, the other packets are skipped.
+ */
+class PcapReader
+{
+  static constexpr uint32_t MAGIC_US = 0xa1b2c3d4;
+  static constexpr uint32_t MAGIC_NS = 0xa1b23c4d;
+  static constexpr uint32_t MAGIC_PCAPNG = 0x0a0d0d0a;
+
+  enum LinkType : uint32_t { NULL_LOOPBACK = 0, ETHERNET = 1, RAW = 101, LINUX_SLL = 113, LINUX_SLL2 = 276 };
+
+  FILE *   _file = nullptr;
+  bool     _swap = false;
+  bool     _nano = false;
+  uint32_t _link_type = 0;
+  std::vector<uint8_t> _buf;
+
+  uint32_t u32(uint32_t v) const noexcept { return _swap ? __builtin_bswap32(v) : v; }
+
+  static uint16_t be16(const uint8_t * p) noexcept { return (p[0] << 8) | p[1]; }
+
+  /** @brief Offset and ethertype of the network header, -1 if it is not IP */
+  int network_offset(const uint8_t * data, size_t len, uint16_t& ethertype) const noexcept
+  {
+    switch(_link_type) {
+    case NULL_LOOPBACK: {
+      if(len < 4) return -1;
+      uint8_t version = len > 4 ? data[4] >> 4 : 0;
+      ethertype = version == 6 ? 0x86dd : 0x0800;
+      return 4;
+    }
+    case ETHERNET: {
+      if(len < 14) return -1;
+      int offset = 14;
+      ethertype = be16(data + 12);
+      while(ethertype == 0x8100 && len >= (size_t)offset + 4) { // VLAN tags
+	ethertype = be16(data + offset + 2);
+	offset += 4;
+      }
+      return offset;
+    }
+    case RAW:
+      if(len < 1) return -1;
+      ethertype = (data[0] >> 4) == 6 ? 0x86dd : 0x0800;
+      return 0;
+    case LINUX_SLL:
+      if(len < 16) return -1;
+      ethertype = be16(data + 14);
+      return 16;
+    case LINUX_SLL2:
+      if(len < 20) return -1;
+      ethertype = be16(data);
+      return 20;
+    }
+
+    return -1;
+  }
+
+public:
+  struct Packet
+  {
+    int64_t          time_us;
+    uint16_t         src_port;
+    uint16_t         dst_port;
+    std::string_view payload; // Valid until the next call to next
+  };
+
+  ~PcapReader() { if(_file) fclose(_file); }
+
+  bool open(const char * file_name)
+  {
+    _file = fopen(file_name, "rb");
+    if(!_file) {
+      perror("Could not open the pcap file");
+      return false;
+    }
+
+    uint32_t header[6];
+    if(fread(header, sizeof(header), 1, _file) != 1) {
+      fmt::print("{} is too short for a pcap file\n", file_name);
+      return false;
+    }
+
+    if(header[0] == MAGIC_PCAPNG) {
+      fmt::print("{} is a pcapng file, convert it with editcap -F pcap\n", file_name);
+      return false;
+    }
+
+    _swap = header[0] == __builtin_bswap32(MAGIC_US) || header[0] == __builtin_bswap32(MAGIC_NS);
+    uint32_t magic = u32(header[0]);
+
+    if(magic != MAGIC_US && magic != MAGIC_NS) {
+      fmt::print("{} is not a pcap file\n", file_name);
+      return false;
+    }
+
+    _nano = magic == MAGIC_NS;
+    _link_type = u32(header[5]) & 0xffff;
+    _buf.resize(u32(header[4]) ? u32(header[4]) : 65535);
+
+    return true;
+  }
+
+  /**
+   * @brief Next UDP packet of the capture
+   * @return false at the end of the file
+   */
+  bool next(Packet& packet)
+  {
+    while(true) {
+      uint32_t record[4]; // Seconds, fraction, captured length, original length
+      if(fread(record, sizeof(record), 1, _file) != 1) return false;
+
+      uint32_t caplen = u32(record[2]);
+      if(caplen > _buf.size()) _buf.resize(caplen);
+      if(fread(_buf.data(), 1, caplen, _file) != caplen) return false;
+
+      packet.time_us = (int64_t)u32(record[0]) * 1'000'000 + (_nano ? u32(record[1]) / 1000 : u32(record[1]));
+
+      const uint8_t * data = _buf.data();
+      uint16_t ethertype = 0;
+      int offset = network_offset(data, caplen, ethertype);
+      if(offset < 0) continue;
+
+      data += offset;
+      size_t len = caplen - offset;
+
+      if(ethertype == 0x0800) {
+	if(len < 20 || data[9] != 17) continue;
+	if(be16(data + 6) & 0x1fff) continue; // Not the first fragment
+
+	size_t ihl = (data[0] & 0x0f) * 4;
+	if(len < ihl + 8) continue;
+	data += ihl;
+	len -= ihl;
+      }
+      else if(ethertype == 0x86dd) {
+	if(len < 48 || data[6] != 17) continue; // Extension headers are not followed
+	data += 40;
+	len -= 40;
+      }
+      else continue;
+
+      size_t udp_len = be16(data + 4);
+      if(udp_len < 8) continue;
+
+      packet.src_port = be16(data);
+      packet.dst_port = be16(data + 2);
+      packet.payload = std::string_view((const char*)data + 8, std::min(len, udp_len) - 8);
+
+      return true;
+    }
+  }
+};
+
+#endif /* PCAP_READER_H */
@@ -0,0 +1,160 @@
+#ifndef RTP_STATS_H
+#define RTP_STATS_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include <arpa/inet.h>
+#include <fmt/core.h>
+
+namespace rtp
+{
+
+constexpr size_t HEADER_LEN = 12;
+constexpr uint32_t VIDEO_CLOCK_RATE = 90000;
+
+struct Header
+{
+  bool     marker;
+  uint8_t  payload_type;
+  uint16_t seq;
+  uint32_t timestamp;
+  uint32_t ssrc;
+};
+
+/**
+ * @brief Parse the fixed RTP header
+ * @return false if this is not RTP version 2, or if it is RTCP
+ */
+inline bool parse(const uint8_t * buf, size_t len, Header& header) noexcept
+{
+  if(len < HEADER_LEN || (buf[0] >> 6) != 2) return false;
+
+  uint8_t pt = buf[1] & 0x7f;
+  if(pt >= 72 && pt <= 76) return false; // RTCP SR, RR, SDES, BYE, APP multiplexed on the port
+
+  header.marker = buf[1] & 0x80;
+  header.payload_type = pt;
+  header.seq = (buf[2] << 8) | buf[3];
+
+  memcpy(&header.timestamp, buf + 4, 4);
+  memcpy(&header.ssrc, buf + 8, 4);
+  header.timestamp = ntohl(header.timestamp);
+  header.ssrc = ntohl(header.ssrc);
+
+  return true;
+}
+
+inline void write(uint8_t * buf, const Header& header) noexcept
+{
+  buf[0] = 0x80; // Version 2, no padding, extension or CSRC
+  buf[1] = (header.marker ? 0x80 : 0) | header.payload_type;
+  buf[2] = header.seq >> 8;
+  buf[3] = header.seq;
+
+  uint32_t ts = htonl(header.timestamp);
+  uint32_t ssrc = htonl(header.ssrc);
+  memcpy(buf + 4, &ts, 4);
+  memcpy(buf + 8, &ssrc, 4);
+}
+
+/**
+ * @brief Receive statistics of an RTP stream, as an RTCP receiver report computes them
+ * (RFC 3550 appendix A.1 and A.8): extended sequence numbers, loss from the expected count,
+ * interarrival jitter. Gaps are the jumps forward in the sequence numbers.
+ */
+class StreamStats
+{
+  uint32_t _clock_rate;
+  bool     _init = false;
+
+  uint32_t _base_seq = 0;
+  uint32_t _max_seq = 0; // Extended
+  uint64_t _received = 0;
+  uint64_t _bytes = 0;
+  uint64_t _reordered = 0;
+  uint64_t _gaps = 0;
+  uint32_t _max_gap = 0;
+
+  double   _jitter = 0; // In clock rate units
+  int64_t  _last_transit = 0;
+
+  // Start of the current report interval
+  uint64_t _interval_received = 0;
+  uint32_t _interval_max_seq = 0;
+
+public:
+  explicit StreamStats(uint32_t clock_rate = VIDEO_CLOCK_RATE) noexcept : _clock_rate(clock_rate) {}
+
+  /** @brief Account a packet of len bytes, received at arrival_us */
+  void on_packet(const Header& header, size_t len, int64_t arrival_us) noexcept
+  {
+    int64_t arrival = arrival_us * _clock_rate / 1'000'000;
+    int64_t transit = arrival - (int64_t)header.timestamp;
+
+    if(!_init) {
+      _init = true;
+      _base_seq = _interval_max_seq = (uint32_t)header.seq - 1; // The first packet is expected
+      _max_seq = header.seq;
+      _last_transit = transit;
+    }
+    else {
+      // Nearest extended sequence number to the last one, handles the wrap in both directions
+      int16_t delta = header.seq - (uint16_t)_max_seq;
+      uint32_t seq = _max_seq + delta;
+
+      if(delta > 0) {
+	if(delta > 1) {
+	  ++_gaps;
+	  if((uint32_t)delta - 1 > _max_gap) _max_gap = delta - 1;
+	}
+	_max_seq = seq;
+      }
+      else ++_reordered;
+
+      // Wrapped RTP timestamps give a huge transit step, uint32 arithmetic keeps it small
+      int32_t d = (int32_t)(uint32_t)(transit - _last_transit);
+      _last_transit = transit;
+      _jitter += (std::abs(d) - _jitter) / 16.;
+    }
+
+    ++_received;
+    _bytes += len;
+  }
+
+  uint64_t received() const noexcept { return _received; }
+  uint64_t bytes() const noexcept { return _bytes; }
+  uint64_t expected() const noexcept { return _init ? _max_seq - _base_seq : 0; }
+  uint64_t reordered() const noexcept { return _reordered; }
+  uint64_t gaps() const noexcept { return _gaps; }
+  uint32_t max_gap() const noexcept { return _max_gap; }
+
+  /** @brief Cumulative loss, negative with duplicates as in RTCP */
+  int64_t lost() const noexcept { return (int64_t)expected() - (int64_t)_received; }
+
+  double jitter_ms() const noexcept { return _jitter * 1000. / _clock_rate; }
+
+  /** @brief Fraction of the packets lost since the previous call */
+  double interval_loss() noexcept
+  {
+    uint64_t expected = _max_seq - _interval_max_seq;
+    uint64_t received = _received - _interval_received;
+
+    _interval_max_seq = _max_seq;
+    _interval_received = _received;
+
+    return expected > received ? (double)(expected - received) / expected : 0.;
+  }
+
+  void print(std::string_view prefix, uint32_t ssrc) const
+  {
+    fmt::print("{} ssrc {:08x}: {} packets, {} bytes, {} lost, {} gaps (max {}), {} reordered, jitter {:.2f} ms\n",
+	       prefix, ssrc, received(), bytes(), lost(), gaps(), max_gap(), reordered(), jitter_ms());
+  }
+};
+
+}
+
+#endif /* RTP_STATS_H */
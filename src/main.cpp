@@ -23,6 +23,7 @@ constexpr auto WEBSOCKET_PORT = 3333;
 constexpr const char * TURN_HOSTNAME = "turn.dabaldassi.fr";
 constexpr const char * IF_NAME = "eth0";
 constexpr const char * QUIC_IMPL = "mvfst";
+constexpr auto WORKERS = 0u;
 
 }
 
@@ -70,6 +71,11 @@ void display_help()
   fmt::print(" : Set the host of the quic server "
 	     "(default {})\n", def::QUIC_SERVER_HOST);
 
+  fmt::print(fg(fmt::color::crimson) | fmt::emphasis::bold, "--workers ");
+  fmt::print(fg(fmt::color::steel_blue) | fmt::emphasis::bold, "N");
+  fmt::print(" : Set the number of quic server worker threads, 0 for the implementation default "
+	     "(default {})\n", def::WORKERS);
+
   fmt::print("\n");
 }
 
@@ -83,6 +89,7 @@ enum OptInd : uint8_t {
   IF_NAME,
   QUIC_SERVER_HOST,
   QUIC_IMPL,
+  WORKERS,
   HELP
 };
 
@@ -117,6 +124,7 @@ int main(int argc, char *argv[])
     { "if_name", required_argument, 0, 0 },
     { "quic-server-host", required_argument, 0, 0 },
     { "quic-impl", required_argument, 0, 0 },
+    { "workers", required_argument, 0, 0 },
     { "help", no_argument, 0, 0 },
     { 0, 0, 0, 0 },
   };
@@ -130,6 +138,7 @@ int main(int argc, char *argv[])
   std::string turn_addr = def::TURN_HOSTNAME;
   std::string quic_server_host = def::QUIC_SERVER_HOST;
   std::string quic_impl = def::QUIC_IMPL;
+  unsigned workers      = def::WORKERS;
   
   while(true) {
     int option_index = 0;
@@ -162,6 +171,7 @@ int main(int argc, char *argv[])
     case OptInd::QUIC_SERVER_HOST: quic_server_host = optarg; break;
     case OptInd::QUIC_PORT: quic_port = std::stoi(optarg); break;
     case OptInd::QUIC_IMPL: quic_impl = optarg; break;
+    case OptInd::WORKERS: workers = std::stoi(optarg); break;
     case OptInd::HELP: display_help(); std::exit(0);
     }    
   }
@@ -189,6 +199,7 @@ int main(int argc, char *argv[])
   else if(*mode == "server") {
     OutTunnel out(0, quic_impl, turn_addr, quic_port, turn_port);
     out.set_datagrams(true);
+    out.set_workers(workers);
 
     __out__ = &out;    
     signal(SIGINT, onstop<OutTunnel>);
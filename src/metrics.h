@@ -0,0 +1,109 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <initializer_list>
+#include <utility>
+#include <cstdint>
+
+#include <fmt/core.h>
+
+/**
+ * Metrics in the Prometheus text exposition format. They are collected when the endpoint is
+ * scraped, each object writes its current values, so nothing is kept between two scrapes.
+ */
+namespace metrics
+{
+
+class Writer
+{
+  struct Family
+  {
+    std::string_view type;
+    std::string      help;
+    std::string      samples;
+  };
+
+  std::map<std::string, Family, std::less<>> _families; // By name, samples of a family together
+  std::string _labels; // Of the object being collected
+
+  /** @param suffix Added to the family name for the samples of a summary, "_sum" or "_count" */
+  template<typename T>
+  void sample(std::string_view type, std::string_view name, std::string_view help, T value, std::string_view extra,
+	      std::string_view suffix = {})
+  {
+    auto it = _families.find(name);
+    if(it == _families.end()) it = _families.emplace(std::string(name), Family{ type, std::string(help), {} }).first;
+
+    auto& samples = it->second.samples;
+    samples += name;
+    samples += suffix;
+
+    if(!_labels.empty() || !extra.empty()) {
+      samples += '{';
+      samples += _labels;
+      if(!_labels.empty() && !extra.empty()) samples += ',';
+      samples += extra;
+      samples += '}';
+    }
+
+    samples += fmt::format(" {}\n", value);
+  }
+
+public:
+  /** @brief Labels of the next samples, as name="value" pairs separated by commas */
+  void set_labels(std::string labels) { _labels = std::move(labels); }
+  const std::string& labels() const noexcept { return _labels; }
+
+  /**
+   * @brief Monotonic value
+   * @param extra Labels of this sample only, added to the current ones
+   */
+  template<typename T>
+  void counter(std::string_view name, std::string_view help, T value, std::string_view extra = {})
+  {
+    sample("counter", name, help, value, extra);
+  }
+
+  /** @brief Value that can go up and down */
+  template<typename T>
+  void gauge(std::string_view name, std::string_view help, T value, std::string_view extra = {})
+  {
+    sample("gauge", name, help, value, extra);
+  }
+
+  /**
+   * @brief Distribution given by some of its quantiles, with the sum and the number of the values
+   * @param quantiles Label value of each quantile, "0.5" for the median, and the value under it
+   */
+  template<typename T>
+  void summary(std::string_view name, std::string_view help,
+	       std::initializer_list<std::pair<std::string_view, T>> quantiles, T sum, uint64_t count)
+  {
+    for(auto& [quantile, value] : quantiles) {
+      sample("summary", name, help, value, fmt::format("quantile=\"{}\"", quantile));
+    }
+
+    sample("summary", name, help, sum, {}, "_sum");
+    sample("summary", name, help, count, {}, "_count");
+  }
+
+  std::string render() const
+  {
+    std::string out;
+
+    for(auto& [name, family] : _families) {
+      out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", name, family.help, name, family.type);
+      out += family.samples;
+    }
+
+    return out;
+  }
+};
+
+}
+
+#endif /* METRICS_H */
@@ -0,0 +1,260 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "emulator.h"
+
+namespace netem
+{
+
+static int64_t now_us()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool enabled()
+{
+  static const bool emulated = [](){
+    const char * env = std::getenv("QUIC_TUNNEL_LINK");
+    return env && std::strcmp(env, "emulated") == 0;
+  }();
+
+  return emulated;
+}
+
+/** @brief QUIC_TUNNEL_LINK_SEED makes the random losses reproducible */
+static uint64_t seed()
+{
+  if(const char * env = std::getenv("QUIC_TUNNEL_LINK_SEED")) return std::strtoull(env, nullptr, 10);
+  return std::random_device{}();
+}
+
+void Emulator::set_params(const Params& params)
+{
+  {
+    std::lock_guard<std::mutex> lock(_params_mutex);
+    _shared_params = params;
+    _params_version.fetch_add(1, std::memory_order_release);
+  }
+
+  // The emulator threads apply the new rate to the packets already in their bucket
+  std::lock_guard<std::mutex> lock(_instances_mutex);
+  for(auto * emulator : _instances) {
+    std::lock_guard<std::mutex> instance_lock(emulator->_mutex);
+    emulator->_cv.notify_one();
+  }
+}
+
+Emulator::Emulator(Deliver deliver)
+  : _deliver(std::move(deliver)), _pool(MAX_PACKET_LEN, POOL_LEN), _rng(seed())
+{
+  _thread = std::thread([this]() { run(); });
+
+  std::lock_guard<std::mutex> lock(_instances_mutex);
+  _instances.push_back(this);
+}
+
+Emulator::~Emulator()
+{
+  {
+    std::lock_guard<std::mutex> lock(_instances_mutex);
+    std::erase(_instances, this);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+
+  _cv.notify_one();
+  _thread.join();
+
+  for(auto& packet : _bucket) _pool.release(packet.data);
+
+  while(!_queue.empty()) {
+    _pool.release(_queue.top().data);
+    _queue.pop();
+  }
+}
+
+void Emulator::refresh()
+{
+  auto version = _params_version.load(std::memory_order_acquire);
+  if(version == _version) return;
+
+  std::lock_guard<std::mutex> params_lock(_params_mutex);
+  _params = _shared_params;
+  _version = _params_version.load(std::memory_order_relaxed);
+
+  // The bucket level carries over, a change does not let a fresh burst through
+  _tokens = std::min<double>(_tokens, _params.burst);
+}
+
+bool Emulator::lose()
+{
+  if(_params.loss <= 0) return false;
+  if(_params.loss >= 1) return true;
+
+  // Two states, the bad one lasts loss_burst packets on average and the mean loss is the one set
+  double to_good = 1. / std::max(1., _params.loss_burst);
+  double to_bad = _params.loss * to_good / (1. - _params.loss);
+
+  std::uniform_real_distribution<double> uniform(0., 1.);
+  _bad = _bad ? uniform(_rng) >= to_good : uniform(_rng) < to_bad;
+
+  return _bad;
+}
+
+void Emulator::fill(int64_t now)
+{
+  if(_params.rate > 0 && now > _tokens_us) {
+    // A packet bigger than the burst still leaves once the bucket holds it
+    double size = std::max<double>(_params.burst, _bucket.empty() ? 0 : _bucket.front().len);
+    _tokens = std::min(size, _tokens + (now - _tokens_us) * (_params.rate / 1e6));
+  }
+
+  _tokens_us = now;
+}
+
+int64_t Emulator::release(int64_t now)
+{
+  fill(now);
+
+  while(!_bucket.empty()) {
+    auto& packet = _bucket.front();
+
+    if(_params.rate > 0) {
+      if(_tokens < packet.len) {
+	return now + (int64_t)std::ceil((packet.len - _tokens) / (_params.rate / 1e6));
+      }
+
+      _tokens -= packet.len;
+    }
+
+    _bucket_bytes -= packet.len;
+    delay(packet, now);
+    _bucket.pop_front();
+  }
+
+  return -1;
+}
+
+void Emulator::delay(Packet packet, int64_t now)
+{
+  std::uniform_real_distribution<double> uniform(0., 1.);
+  packet.time_us = now;
+
+  if(_params.reorder <= 0 || uniform(_rng) >= _params.reorder) {
+    int64_t jitter = _params.jitter.count();
+    int64_t delay = _params.delay.count();
+    if(jitter > 0) delay += std::uniform_int_distribution<int64_t>(-jitter, jitter)(_rng);
+
+    packet.time_us += std::max<int64_t>(0, delay);
+  }
+
+  if(_params.duplicate > 0 && uniform(_rng) < _params.duplicate) {
+    if(auto * data = static_cast<char*>(_pool.acquire(packet.len))) {
+      memcpy(data, packet.data, packet.len);
+      _queue.push({ packet.time_us, _order++, data, packet.len });
+      ++_duplicated;
+    }
+  }
+
+  packet.order = _order++;
+  _queue.push(packet);
+}
+
+void Emulator::submit(const char * buf, size_t len)
+{
+  auto now = now_us();
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    refresh();
+
+    if(_params.active() || !_bucket.empty() || !_queue.empty()) {
+      if(lose()) {
+	++_lost;
+	return;
+      }
+
+      // Dropped if it would wait in the bucket longer than the latency limit at the current rate
+      if(_params.rate > 0 && _params.latency.count() > 0) {
+	fill(now);
+	double wait_us = (_bucket_bytes + len - _tokens) / (_params.rate / 1e6);
+	if(wait_us > _params.latency.count()) {
+	  ++_overflow;
+	  return;
+	}
+      }
+
+      auto * data = static_cast<char*>(_pool.acquire(len));
+      if(!data) return;
+
+      memcpy(data, buf, len);
+
+      // The emulator thread moves it on, and waits for its tokens if there are none yet
+      bool wake = _bucket.empty();
+      _bucket.push_back({ 0, 0, data, len });
+      _bucket_bytes += len;
+
+      if(wake) _cv.notify_one();
+      return;
+    }
+  }
+
+  // Nothing emulated, and nothing left in the link to overtake
+  _deliver(buf, len);
+  ++_delivered;
+}
+
+void Emulator::run()
+{
+  std::vector<Packet> due;
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while(!_stop) {
+    refresh();
+
+    auto now = now_us();
+    int64_t next_us = release(now);
+
+    while(!_queue.empty() && _queue.top().time_us <= now) {
+      due.push_back(_queue.top());
+      _queue.pop();
+    }
+
+    if(!due.empty()) {
+      // Delivered without the lock, submit is not held up by the socket
+      lock.unlock();
+
+      for(auto& packet : due) {
+	_deliver(packet.data, packet.len);
+	_pool.release(packet.data);
+      }
+
+      _delivered.fetch_add(due.size(), std::memory_order_relaxed);
+      due.clear();
+
+      lock.lock();
+      continue;
+    }
+
+    if(!_queue.empty() && (next_us < 0 || _queue.top().time_us < next_us)) next_us = _queue.top().time_us;
+
+    // Woken early by a packet in an empty bucket or by new conditions
+    if(next_us < 0) _cv.wait(lock);
+    else _cv.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::microseconds(next_us)));
+  }
+}
+
+void Emulator::collect(metrics::Writer& w) const
+{
+  w.counter("quic_tunnel_emulator_delivered_total", "Packets through the emulated link", _delivered.load(std::memory_order_relaxed));
+  w.counter("quic_tunnel_emulator_lost_total", "Packets lost by the emulated link", _lost.load(std::memory_order_relaxed));
+  w.counter("quic_tunnel_emulator_overflow_total", "Packets dropped by the emulated link queue", _overflow.load(std::memory_order_relaxed));
+  w.counter("quic_tunnel_emulator_duplicated_total", "Packets duplicated by the emulated link", _duplicated.load(std::memory_order_relaxed));
+}
+
+}
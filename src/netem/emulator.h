@@ -0,0 +1,151 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <mutex>
+#include <deque>
+#include <queue>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+#include "buffer_pool.h"
+#include "metrics.h"
+
+/**
+ * Userspace link emulation, netem and tbf without root: the packets go through a token bucket,
+ * then are delayed, lost, duplicated or reordered, and are released at their delivery time by
+ * a thread of their own.
+ */
+namespace netem
+{
+
+/** @brief Link conditions, nothing is emulated with the default ones */
+struct Params
+{
+  uint64_t rate  = 0; // Bytes per second, 0 for no limit
+  uint64_t burst = 0; // Bytes the bucket holds, sent at once above the rate
+  std::chrono::microseconds latency{0}; // Max wait in the bucket, the later packets are dropped. 0 for no limit
+  std::chrono::microseconds delay{0};
+  std::chrono::microseconds jitter{0};  // Delay varies uniformly by up to this much in both directions
+
+  double loss       = 0; // Probabilities
+  double loss_burst = 1; // Mean length of the loss bursts in packets, 1 for independent losses
+  double duplicate  = 0;
+  double reorder    = 0; // Of a packet skipping the delay, so it overtakes the ones before
+
+  bool active() const noexcept
+  {
+    return rate > 0 || delay.count() > 0 || jitter.count() > 0 || loss > 0 || duplicate > 0 || reorder > 0;
+  }
+};
+
+/** @brief Whether the link is emulated, with the QUIC_TUNNEL_LINK=emulated environment variable */
+bool enabled();
+
+/**
+ * @brief One emulated link. Every instance is its own bottleneck, with the conditions set for
+ * all of them by set_params. Packets are submitted from any thread, wait in the token bucket,
+ * which the emulator thread drains at the current rate as tbf does, then are delivered by that
+ * thread in the order of their delivery time.
+ */
+class Emulator
+{
+public:
+  using Deliver = std::function<void(const char * buf, size_t len)>;
+
+  /** @brief Conditions of every emulator, the packets in the bucket leave at the new rate */
+  static void set_params(const Params& params);
+  static void reset() { set_params(Params{}); }
+
+  explicit Emulator(Deliver deliver);
+  ~Emulator();
+
+  Emulator(const Emulator&) = delete;
+  Emulator& operator=(const Emulator&) = delete;
+
+  /** @brief Any thread. Copy a packet in the link, or deliver it now if nothing is emulated */
+  void submit(const char * buf, size_t len);
+
+  void collect(metrics::Writer& w) const;
+
+private:
+  static constexpr size_t MAX_PACKET_LEN = 2048; // Bigger ones go to the heap
+  static constexpr size_t POOL_LEN = 4096;
+
+  struct Packet
+  {
+    int64_t  time_us; // Of delivery
+    uint64_t order;   // Of submission, keeps the packets of a same time in order
+    char *   data;
+    size_t   len;
+
+    bool operator>(const Packet& other) const noexcept
+    {
+      return time_us != other.time_us ? time_us > other.time_us : order > other.order;
+    }
+  };
+
+  static inline std::mutex            _params_mutex;
+  static inline Params                _shared_params;
+  static inline std::atomic<uint64_t> _params_version{0};
+
+  // Woken by set_params. Taken before the _mutex of an instance, never while holding it
+  static inline std::mutex             _instances_mutex;
+  static inline std::vector<Emulator*> _instances;
+
+  Deliver    _deliver;
+  BufferPool _pool;
+
+  // Submitting threads -> emulator thread
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::deque<Packet> _bucket; // Waiting for tokens, in order
+  size_t             _bucket_bytes = 0;
+  std::priority_queue<Packet, std::vector<Packet>, std::greater<Packet>> _queue; // Delayed
+  uint64_t _order = 0;
+  bool     _stop = false;
+
+  // Link state, under _mutex
+  Params   _params;
+  uint64_t _version = 0;
+  std::mt19937_64 _rng;
+  bool     _bad = false;  // Gilbert-Elliott state, every packet is lost in the bad one
+  double   _tokens = 0;   // Bytes
+  int64_t  _tokens_us = 0;
+
+  std::atomic<uint64_t> _delivered{0};
+  std::atomic<uint64_t> _lost{0};
+  std::atomic<uint64_t> _overflow{0}; // Dropped by the bucket latency limit
+  std::atomic<uint64_t> _duplicated{0};
+
+  std::thread _thread;
+
+  void run();
+
+  /** @brief Under _mutex. Take the conditions set since the last call */
+  void refresh();
+
+  /** @brief Under _mutex. Whether the loss model drops the next packet */
+  bool lose();
+
+  /** @brief Under _mutex. Add the tokens of the time elapsed at the current rate */
+  void fill(int64_t now_us);
+
+  /**
+   * @brief Under _mutex. Move the packets the tokens allow from the bucket to the delay queue
+   * @return Time the next packet of the bucket can leave, -1 if it is empty
+   */
+  int64_t release(int64_t now_us);
+
+  /** @brief Under _mutex. Delay, reorder and duplicate a packet out of the bucket */
+  void delay(Packet packet, int64_t now_us);
+};
+
+}
+
+#endif /* EMULATOR_H */
@@ -0,0 +1,120 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <fmt/core.h>
+
+#include "relay.h"
+
+namespace netem
+{
+
+bool Relay::start(std::string_view host, uint16_t port)
+{
+  struct addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  struct addrinfo * res = nullptr;
+  if(getaddrinfo(std::string(host).c_str(), std::to_string(port).c_str(), &hints, &res) != 0 || !res) {
+    fmt::print("Relay could not resolve {}\n", host);
+    return false;
+  }
+
+  _server_socket = socket(res->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+  if(_server_socket == -1 || connect(_server_socket, res->ai_addr, res->ai_addrlen) == -1) {
+    perror("Relay could not connect to the quic server");
+    freeaddrinfo(res);
+    return false;
+  }
+
+  freeaddrinfo(res);
+
+  _client_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+  struct sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = 0;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if(_client_socket == -1 || bind(_client_socket, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    perror("Relay could not bind its socket");
+    return false;
+  }
+
+  _uplink = std::make_unique<Emulator>([this](const char * buf, size_t len) {
+    if(send(_server_socket, buf, len, 0) == -1 && errno != ECONNREFUSED) perror("Relay could not send to the quic server");
+  });
+
+  _thread = std::thread([this]() { run(); });
+
+  fmt::print("Emulated link relay on port {} to {}:{}\n", this->port(), host, port);
+
+  return true;
+}
+
+uint16_t Relay::port() const
+{
+  struct sockaddr_in addr{};
+  socklen_t len = sizeof(addr);
+
+  if(getsockname(_client_socket, (struct sockaddr*)&addr, &len) == -1) return 0;
+
+  return ntohs(addr.sin_port);
+}
+
+void Relay::run()
+{
+  std::vector<char> buf(MAX_PACKET_LEN);
+
+  struct pollfd fds[2] = {
+    { _client_socket, POLLIN, 0 },
+    { _server_socket, POLLIN, 0 }
+  };
+
+  while(!_stop.load(std::memory_order_relaxed)) {
+    // The timeout only bounds the time to notice a stop
+    if(poll(fds, 2, 100) <= 0) continue;
+
+    if(fds[0].revents & POLLIN) {
+      while(true) {
+	_client_addr_len = sizeof(_client_addr);
+	auto len = recvfrom(_client_socket, buf.data(), buf.size(), MSG_DONTWAIT,
+			    (struct sockaddr*)&_client_addr, &_client_addr_len);
+	if(len < 0) break;
+
+	_uplink->submit(buf.data(), len);
+      }
+    }
+
+    if(fds[1].revents & POLLIN) {
+      while(true) {
+	auto len = recv(_server_socket, buf.data(), buf.size(), MSG_DONTWAIT);
+	if(len < 0) break;
+
+	if(_client_addr_len > 0) sendto(_client_socket, buf.data(), len, 0, (struct sockaddr*)&_client_addr, _client_addr_len);
+      }
+    }
+  }
+}
+
+void Relay::stop()
+{
+  _stop = true;
+  if(_thread.joinable()) _thread.join();
+
+  // After the thread, the emulator delivers on the server socket until it is destroyed
+  _uplink.reset();
+
+  if(_client_socket != -1) ::close(_client_socket);
+  if(_server_socket != -1) ::close(_server_socket);
+  _client_socket = _server_socket = -1;
+}
+
+}
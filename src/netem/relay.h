@@ -0,0 +1,61 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <string_view>
+
+#include <sys/socket.h>
+
+#include "emulator.h"
+
+namespace netem
+{
+
+/**
+ * @brief UDP relay in front of the quic server, so the emulated link works with every quic
+ * implementation, even the ones owning their socket. The quic client talks to the relay on
+ * the loopback instead of the server, the packets to the server go through the emulated link
+ * and the ones from the server are passed back as they come, as a link shaped by tc on the
+ * in-tunnel host would.
+ */
+class Relay
+{
+  static constexpr size_t MAX_PACKET_LEN = 65536; // A GSO coalesced send on the loopback
+
+  int _client_socket = -1; // Bound on the loopback, where the quic client sends
+  int _server_socket = -1; // Connected to the quic server
+
+  // Last address the client sent from, relay thread only
+  struct sockaddr_storage _client_addr{};
+  socklen_t               _client_addr_len = 0;
+
+  std::unique_ptr<Emulator> _uplink;
+
+  std::thread       _thread;
+  std::atomic<bool> _stop = false;
+
+  /** @brief Relay thread. Forwards the packets of both sockets until stopped */
+  void run();
+
+public:
+  Relay() = default;
+  ~Relay() { stop(); }
+
+  Relay(const Relay&) = delete;
+  Relay& operator=(const Relay&) = delete;
+
+  /** @brief Bind the relay and start forwarding to the quic server at host:port */
+  bool start(std::string_view host, uint16_t port);
+  void stop();
+
+  /** @brief Loopback port the quic client must send to */
+  uint16_t port() const;
+
+  void collect(metrics::Writer& w) const { if(_uplink) _uplink->collect(w); }
+};
+
+}
+
+#endif /* RELAY_H */
@@ -1,10 +1,14 @@
 #include "lsquic_server.h"
 
+#include "udp_gso.h"
+
 #include <lsquic_types.h>
 #include <lsquic.h>
 
 #include <fmt/core.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <ev.h>
 
 #include <openssl/ssl.h>
 #include <openssl/crypto.h>
@@ -16,6 +20,7 @@
 #endif
 
 #include <fstream>
+#include <algorithm>
 
 #include <cstdlib>
 
@@ -45,7 +50,6 @@ static lsquic_conn_ctx_t * lsquic_on_new_conn(void * stream_if_ctx, lsquic_conn_
   
 static lsquic_stream_ctx_t * lsquic_on_new_stream(void * stream_if_ctx, lsquic_stream_t * stream)
 {
-  fmt::print("lsquic on new stream\n");
   auto server = reinterpret_cast<LsquicServer*>(stream_if_ctx);
   return server->on_new_stream(stream);
 }
@@ -53,29 +57,69 @@ static lsquic_stream_ctx_t * lsquic_on_new_stream(void * stream_if_ctx, lsquic_s
 static void lsquic_on_conn_closed (lsquic_conn_t * conn)
 {
   fmt::print("lsquic On connection closed\n");
+  auto server = reinterpret_cast<LsquicServer*>(lsquic_conn_get_ctx(conn));
+  if(server) server->on_conn_closed(conn);
 }
 
 static void lsquic_on_read(lsquic_stream_t * stream, lsquic_stream_ctx_t * st_h)
 {
-  fmt::print("lsquic on read\n");
-  auto server = reinterpret_cast<LsquicServer*>(st_h);
-  server->on_read(stream);
+  auto ctx = reinterpret_cast<LsquicServer::StreamCtx*>(st_h);
+  ctx->server->on_read(stream, ctx);
 }
 
 static void lsquic_on_write(lsquic_stream_t * stream, lsquic_stream_ctx_t * st_h)
 {
-  fmt::print("lsquic On write\n");
+  auto ctx = reinterpret_cast<LsquicServer::StreamCtx*>(st_h);
+  ctx->server->on_write(stream, ctx);
 }
 
 
 static void lsquic_on_stream_close(lsquic_stream_t * stream, lsquic_stream_ctx_t * st_h)
 {
-  fmt::print("lsquic On stream close\n");
+  auto ctx = reinterpret_cast<LsquicServer::StreamCtx*>(st_h);
+  if(ctx) ctx->server->on_stream_close(stream, ctx);
 }
 
 static void lsquic_on_datagram(lsquic_conn_t * conn, const void * buf, size_t size)
 {
-  fmt::print("lsquic On datagram\n");
+  auto server = reinterpret_cast<LsquicServer*>(lsquic_conn_get_ctx(conn));
+  if(server) server->on_datagram(buf, size);
+}
+
+static ssize_t lsquic_on_dg_write(lsquic_conn_t * conn, void * buf, size_t size)
+{
+  auto server = reinterpret_cast<LsquicServer*>(lsquic_conn_get_ctx(conn));
+  return server ? server->on_dg_write(conn, buf, size) : -1;
+}
+
+static void recv_cb(EV_P_ ev_io *w, int revents)
+{
+  auto server = reinterpret_cast<LsquicServer*>(w->data);
+  server->on_readable();
+}
+
+static void write_cb(EV_P_ ev_io *w, int revents)
+{
+  auto server = reinterpret_cast<LsquicServer*>(w->data);
+  server->on_writable();
+}
+
+static void timeout_cb(EV_P_ ev_timer *w, int revents)
+{
+  auto server = reinterpret_cast<LsquicServer*>(w->data);
+  server->process_conns();
+}
+
+static void stop_cb(EV_P_ ev_async *w, int revents)
+{
+  fmt::print("break lsquic loop\n");
+  ev_break(EV_A_ EVBREAK_ONE);
+}
+
+static void send_cb(EV_P_ ev_async *w, int revents)
+{
+  auto server = reinterpret_cast<LsquicServer*>(w->data);
+  server->drain_send();
 }
 
 static int lsquic_send_packets(void *ctx, const struct lsquic_out_spec *specs, unsigned n_specs)
@@ -146,7 +190,7 @@ void LsquicServer::exit_lsquic()
 }
 
 LsquicServer::LsquicServer(const std::string& host, uint16_t port, out::UdpSocket * udp_socket)
-  : _port(port), _socket(-1), _udp_socket(nullptr)
+  : _port(port), _udp_socket(udp_socket), _engine(nullptr), _socket(-1), _gso(false)
 {
   fmt::print("LsquicServer::LsquicServer {} {}\n", host, port);
 
@@ -221,10 +265,13 @@ LsquicServer::LsquicServer(const std::string& host, uint16_t port, out::UdpSocke
   _stream_if->on_write = lsquic_on_write;
   _stream_if->on_close = lsquic_on_stream_close;
   _stream_if->on_datagram = lsquic_on_datagram;
+  _stream_if->on_dg_write = lsquic_on_dg_write;
 
   lsquic_engine_init_settings(_engine_settings, LSENG_SERVER);
   _engine_settings->es_datagrams = true;
   _engine_settings->es_ecn = 0;
+  // A stream per packet, leave room for a burst of them in flight
+  _engine_settings->es_init_max_streams_bidi = MAX_PENDING_STREAMS;
 
   fmt::print("QUIC VERSION : {}\n", _engine_settings->es_versions);
   
@@ -237,19 +284,24 @@ LsquicServer::LsquicServer(const std::string& host, uint16_t port, out::UdpSocke
   _engine_api->ea_alpn = "echo";
   _engine_api->ea_lookup_cert = lookup_cert;
   _engine_api->ea_cert_lu_ctx = (void*)this;
-  
-  fmt::print("lsquic engine new\n");
-  _engine = lsquic_engine_new(LSENG_SERVER, _engine_api);
-  if(!_engine) {
-    fmt::print("lsquic engine not so new\n");
-    std::exit(EXIT_SUCCESS);
-  }
 
+  // The engine is created on start, once the congestion controller is known
   _start = false;
+
+  _udp_socket->set_callback(this);
 }
 
 LsquicServer::~LsquicServer()
 {
+  if(_loop) {
+    ev_loop_destroy(_loop);
+    _loop = nullptr;
+  }
+
+  close_socket();
+
+  if(_engine) lsquic_engine_destroy(_engine);
+  
   free(_engine_api);
   free(_stream_if);
   free(_logger_if);
@@ -265,12 +317,12 @@ void LsquicServer::init_socket()
   fmt::print("Init lsquic udp socket\n");
   
   _socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  
-  struct timeval optval;
-  optval.tv_usec = 0;
-  optval.tv_sec = 5;
 
-  setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &optval, sizeof(optval));
+  // Reads happen on readiness, until the socket is drained
+  fcntl(_socket, F_SETFL, fcntl(_socket, F_GETFL, 0) | O_NONBLOCK);
+
+  _gso = udp::enable_gso(_socket);
+  bool gro = udp::enable_gro(_socket);
 
   memset((char *)&_addr_local, 0, sizeof(_addr_local));
   memset((char *)&_addr_peer, 0, sizeof(_addr_peer));
@@ -287,11 +339,16 @@ void LsquicServer::init_socket()
     perror("Could not bind UDP socket");
     std::exit(EXIT_FAILURE);
   }
+
+  // The ev loop waits on the socket or on the completion ring of the engine, see poll_fd
+  _io = io::Engine::create(MAX_RECV_LEN, MAX_BATCH_LEN);
+  _io->attach(_socket, gro);
 }
 
 void LsquicServer::close_socket()
 {
   if(_socket != -1) {
+    if(_io) _io->close();
     ::close(_socket);
     _socket = -1;
   }
@@ -303,6 +360,7 @@ Capabilities LsquicServer::get_capabilities()
   cap.impl = IMPL_NAME;
   cap.datagrams = true;
   cap.streams = true;
+  cap.framed_streams = true;
   cap.cc.emplace_back("cubic");
   cap.cc.emplace_back("bbrv1");
   cap.cc.emplace_back("adaptive");
@@ -315,100 +373,189 @@ void LsquicServer::set_qlog_filename(std::string file_name)
   
 }
 
-ssize_t LsquicServer::recv()
+bool LsquicServer::start()
 {
-  if(_socket == -1) return -1;
+  fmt::print("Starting lsquic\n");
   
-  struct sockaddr_in addr;
-  socklen_t          slen = sizeof(addr);
-  ssize_t rec_len;
+  init_socket();
+
+  _engine_settings->es_cc_algo = _cc;
+
+  fmt::print("lsquic engine new\n");
+  _engine = lsquic_engine_new(LSENG_SERVER, _engine_api);
+  if(!_engine) {
+    fmt::print("lsquic engine not so new\n");
+    return false;
+  }
+
+  // Own loop, several servers can run side by side
+  _loop = ev_loop_new(EVFLAG_AUTO);
+  if(!_loop) {
+    fmt::print("LsquicServer could not create ev loop\n");
+    return false;
+  }
+
+  _io_watcher = std::make_unique<struct ev_io>();
+  ev_io_init(_io_watcher.get(), recv_cb, _io->poll_fd(), EV_READ);
+  _io_watcher->data = (void*)this;
+  ev_io_start(_loop, _io_watcher.get());
+
+  _write_watcher = std::make_unique<struct ev_io>();
+  ev_io_init(_write_watcher.get(), write_cb, _socket, EV_WRITE);
+  _write_watcher->data = (void*)this;
+
+  _timer = std::make_unique<struct ev_timer>();
+  ev_init(_timer.get(), timeout_cb);
+  _timer->data = (void*)this;
+
+  _stop_watcher = std::make_unique<struct ev_async>();
+  ev_async_init(_stop_watcher.get(), stop_cb);
+  _stop_watcher->data = (void*)this;
+  ev_async_start(_loop, _stop_watcher.get());
+
+  _send_watcher = std::make_unique<struct ev_async>();
+  ev_async_init(_send_watcher.get(), send_cb);
+  _send_watcher->data = (void*)this;
+  ev_async_start(_loop, _send_watcher.get());
+  
+  _start = true;
+
+  // The loop is ready to be woken up by the packets of the out socket
+  _udp_socket->start();
+  
+  return true;
+}
+
+void LsquicServer::loop()
+{
+  if(!_loop) return;
+  
+  fmt::print("Start receiving udp message\n");
+  
+  ev_run(_loop, 0);
+
+  ev_timer_stop(_loop, _timer.get());
+  ev_io_stop(_loop, _write_watcher.get());
+  ev_io_stop(_loop, _io_watcher.get());
+
+  close_socket();
   
-  do {
-    rec_len = recvfrom(_socket, _buf, MAX_BUF_LEN, 0, (struct sockaddr*)&addr, &slen);
+  fmt::print("Exit lsquic loop\n");
+}
+
+void LsquicServer::on_readable()
+{
+  // Bounded, so a flood can not starve the timer. The watcher fires again if data is left
+  for(unsigned batch = 0; batch < MAX_READ_BATCHES; ++batch) {
+    auto n = _io->recv();
+    if(n <= 0) break;
+
+    uint64_t bytes = 0;
     
-    if(rec_len == -1) {
-      if(_socket == -1) {
-	puts("Closing UDP socket");
-	return -1;
-      }
-      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-	puts("Refreshing UDP socket");
-      }
-      else {
-	perror("Could not receive data in UDP socket");
-	return -1;
-      }
+    // GRO coalesced reads are already split in packets by the io engine
+    for(int i = 0; i < n; ++i) {
+      auto packet = _io->payloads()[i];
+      bytes += packet.size();
+
+      auto result = lsquic_engine_packet_in(_engine, (const unsigned char*)packet.data(), packet.size(),
+					    (struct sockaddr*)&_addr_local, _io->peer(i),
+					    (void*)this, 0);
+
+      if(result == -1) fmt::print("Error from lsquic_engine_packet_in\n");
     }
-  } while(rec_len < 0);
 
-  _addr_peer.sin_family = AF_INET;
-  _addr_peer.sin_port = addr.sin_port;
-  _addr_peer.sin_addr.s_addr = addr.sin_addr.s_addr;
-  _addr_peer_len = slen;
+    _wire.on_rx(bytes, n);
+  }
 
-  return rec_len;
+  process_conns();
 }
 
+void LsquicServer::on_writable()
+{
+  ev_io_stop(_loop, _write_watcher.get());
+  
+  lsquic_engine_send_unsent_packets(_engine);
+  process_conns();
+}
 
-bool LsquicServer::start()
+void LsquicServer::process_conns()
 {
-  fmt::print("Starting lsquic\n");
+  // Packets held after a send error other than a full socket buffer
+  if(!ev_is_active(_write_watcher.get()) && lsquic_engine_has_unsent_packets(_engine)) {
+    lsquic_engine_send_unsent_packets(_engine);
+  }
   
-  init_socket();
+  lsquic_engine_process_conns(_engine);
 
-  _start = true;
+  ev_timer_stop(_loop, _timer.get());
 
-  std::thread([this]() {
-    int diff;
+  int diff;
+  if(lsquic_engine_earliest_adv_tick(_engine, &diff)) {
+    // A tick already due runs on the next loop iteration
+    ev_timer_set(_timer.get(), std::max(diff, MIN_TICK_US) / 1e6, 0.);
+    ev_timer_start(_loop, _timer.get());
+  }
 
-    while(_start) {
-      lsquic_engine_process_conns(_engine);
+  // Everything received during this pass goes out at once
+  _udp_socket->flush();
+}
 
-      if (lsquic_engine_earliest_adv_tick(_engine, &diff)) {
-	std::this_thread::sleep_for(std::chrono::microseconds(diff));	
-      }
-      else {
-	std::this_thread::sleep_for(std::chrono::microseconds(100));
-      }
-      // std::this_thread::sleep_for(std::chrono::microseconds(100));
+void LsquicServer::drain_send()
+{
+  while(auto * packet = _send_ring.front()) {
+    if(!_conn) {
+      // Nothing to tunnel in until a client is connected
+      _send_ring.release();
+      continue;
+    }
+    
+    if(_datagrams) {
+      // Taken from the ring by on_dg_write, as soon as the connection can send it
+      lsquic_conn_want_datagram_write(_conn, 1);
+      break;
     }
 
-    fmt::print("Exit Process cons\n");
-  }).detach();
-  
-  fmt::print("Start receiving udp message\n");
-  
-  return true;
+    send_stream(packet->data, packet->len);
+    _send_ring.release();
+  }
+
+  process_conns();
 }
 
-void LsquicServer::loop()
+void LsquicServer::send_stream(const char * buffer, size_t len)
 {
-  while(_start) {
-    auto len = recv();
-    if(len == -1) break;
+  if(_framed) {
+    // Written on the stream opened by the client, kept until then
+    if(!_framer.push(buffer, len)) fmt::print("Framed stream blocked, packet dropped\n");
+    else if(_stream) lsquic_stream_wantwrite(_stream, 1);
+    return;
+  }
 
-    auto result = lsquic_engine_packet_in(_engine, _buf, len,
-					  (struct sockaddr*)&_addr_local, (struct sockaddr*)&_addr_peer,
-					  (void*)this, 0);
+  if(_pending_streams.size() >= MAX_PENDING_STREAMS) {
+    fmt::print("Too many lsquic streams pending, packet dropped\n");
+    return;
+  }
+  
+  // The packet is written once lsquic gives the new stream in on_new_stream
+  _pending_streams.emplace_back(buffer, buffer + len);
+  lsquic_conn_make_stream(_conn);
+}
 
-    switch(result) {
-    case 0:
-      fmt::print("Packet was processed by a real connection.\n");
-      break;
-    case 1:
-      fmt::print("Packet was handled successfully, but not by a connection\n");
-      break;
-    case -1:
-      fmt::print("Error from lsquic_engine_packet_in\n");
-      break;
-    default:
-      fmt::print("Unknown result from lsquic_engine_packet_in\n");
-    }
+void LsquicServer::onUdpMessage(const char* buffer, size_t len) noexcept
+{
+  auto * packet = _send_ring.claim();
 
-    lsquic_engine_process_conns(_engine);
+  if(!packet || len > sizeof(packet->data)) {
+    if(auto dropped = ++_send_dropped; dropped % 1000 == 1) fmt::print("lsquic server dropped {} udp packets\n", dropped);
+    return;
   }
 
-  _cv.notify_all();
+  memcpy(packet->data, buffer, len);
+  packet->len = len;
+  _send_ring.publish();
+
+  // Wakeups are coalesced by libev until the loop runs the watcher
+  ev_async_send(_loop, _send_watcher.get());
 }
 
 bool LsquicServer::set_datagrams(bool enable)
@@ -417,6 +564,12 @@ bool LsquicServer::set_datagrams(bool enable)
   
   return true;
 }
+
+bool LsquicServer::set_framed_streams(bool enable)
+{
+  _framed = enable;
+  return true;
+}
   
 bool LsquicServer::set_cc(std::string_view cc) noexcept
 {
@@ -433,78 +586,197 @@ bool LsquicServer::set_cc(std::string_view cc) noexcept
 void LsquicServer::stop()
 {
   _start = false;
-  close_socket();
+  _udp_socket->close();
 
-  // std::unique_lock<std::mutex> lock(_cv_mutex);
-  // _cv.wait(lock);
+  // The loop thread closes the socket once it is out of ev_run
+  if(_loop) ev_async_send(_loop, _stop_watcher.get());
+  else close_socket();
 }
 
 lsquic_conn_ctx_t * LsquicServer::on_new_conn(lsquic_conn_t *conn)
 {
   fmt::print("LsquicServer::on_new_conn\n");
+
+  if(_conn) {
+    // One client per server, as for the other implementations
+    fmt::print("LsquicServer already has a client, connection refused\n");
+    lsquic_conn_close(conn);
+    return nullptr;
+  }
+
+  _conn = conn;
+  
+  return (lsquic_conn_ctx_t*)this;
 }
 
 // lsquic callback
 lsquic_stream_ctx_t * LsquicServer::on_new_stream(lsquic_stream_t * stream)
 {
-  fmt::print("LsquicServer::on_new_stream\n");
-  lsquic_stream_wantread(stream, 1);
+  // The connection is going away, the stream will not be created
+  if(!stream) {
+    if(!_pending_streams.empty()) _pending_streams.pop_front();
+    return nullptr;
+  }
+  
+  auto * ctx = new StreamCtx{this};
+
+  if(lsquic_stream_id(stream) & 0x01) {
+    // Opened by us, for the packet at the front
+    if(!_pending_streams.empty()) {
+      ctx->buf = std::move(_pending_streams.front());
+      _pending_streams.pop_front();
+
+      lsquic_stream_wantwrite(stream, 1);
+    }
+    else {
+      lsquic_stream_close(stream);
+    }
+  }
+  else if(_framed && !_stream) {
+    fmt::print("LsquicServer framed stream open\n");
+
+    _stream = stream;
+    ctx->framed = true;
+
+    lsquic_stream_wantread(stream, 1);
+    if(_framer.pending() > 0) lsquic_stream_wantwrite(stream, 1);
+  }
+  else {
+    // Opened by the client, for one packet
+    lsquic_stream_wantread(stream, 1);
+  }
+  
+  return (lsquic_stream_ctx_t*)ctx;
 }
 
 void LsquicServer::on_conn_closed(lsquic_conn_t * conn)
 {
   fmt::print("LsquicServer::on_conn_closed\n");
+
+  if(conn == _conn) {
+    _conn = nullptr;
+    _pending_streams.clear();
+  }
+
+  lsquic_conn_set_ctx(conn, nullptr);
 }
 
-void LsquicServer::on_read(lsquic_stream_t * stream)
+void LsquicServer::on_read(lsquic_stream_t * stream, StreamCtx * ctx)
 {
-  fmt::print("LsquicServer::on_read\n");
+  uint8_t buf[READ_BUF_LEN];
+  ssize_t nr;
 
-  unsigned char buf[MAX_BUF_LEN];
-  ssize_t nr = lsquic_stream_read(stream, buf, sizeof(buf));
+  while((nr = lsquic_stream_read(stream, buf, sizeof(buf))) > 0) {
+    if(ctx->framed) {
+      _deframer.feed(buf, nr, [this](const char * packet, size_t len) {
+	_udp_socket->queue(packet, len);
+      });
+    }
+    else if(ctx->buf.size() + nr <= framing::MAX_PAYLOAD_LEN) {
+      ctx->buf.insert(ctx->buf.end(), buf, buf + nr);
+    }
+  }
 
-  fmt::print("Received {} bytes message : {}", nr, (char*)buf);
+  if(nr == 0) {
+    // FIN, the packet of this stream is complete. Sent with the next flush
+    if(!ctx->framed) _udp_socket->queue(ctx->buf.data(), ctx->buf.size());
+    lsquic_stream_close(stream);
+  }
+  else if(errno != EWOULDBLOCK && errno != EAGAIN) {
+    perror("lsquic could not read stream");
+    lsquic_stream_close(stream);
+  }
+}
 
-  if (nr == 0) /* EOF */ {
-    lsquic_stream_shutdown(stream, 0);
-    // lsquic_stream_wantwrite(stream, 1); /* Want to reply */
+void LsquicServer::on_write(lsquic_stream_t * stream, StreamCtx * ctx)
+{
+  if(ctx->framed) {
+    _framer.drain([stream](const uint8_t * data, size_t len) {
+      return lsquic_stream_write(stream, data, len);
+    });
+    
+    if(_framer.pending() == 0) lsquic_stream_wantwrite(stream, 0);
+    lsquic_stream_flush(stream);
+    return;
   }
+  
+  auto n = lsquic_stream_write(stream, ctx->buf.data() + ctx->offset, ctx->buf.size() - ctx->offset);
+  if(n < 0) {
+    perror("lsquic could not write stream");
+    lsquic_stream_close(stream);
+    return;
+  }
+
+  ctx->offset += n;
+
+  // Whole packet written, close sends it with the FIN
+  if(ctx->offset == ctx->buf.size()) lsquic_stream_close(stream);
 }
 
-void LsquicServer::on_write(lsquic_stream_t * stream)
+void LsquicServer::on_stream_close(lsquic_stream_t * stream, StreamCtx * ctx)
 {
-  fmt::print("LsquicServer::on_write\n");
+  if(ctx->framed) {
+    fmt::print("LsquicServer framed stream closed\n");
+    
+    _stream = nullptr;
+    _framer.reset();
+    _deframer.reset();
+  }
+
+  delete ctx;
 }
 
-void LsquicServer::on_stream_close(lsquic_stream_t * stream)
+void LsquicServer::on_datagram(const void * buf, size_t len)
 {
-  fmt::print("LsquicServer::on_stream_close\n");
+  _udp_socket->queue((const char*)buf, len);
 }
 
-int LsquicServer::send_packets_out(const struct lsquic_out_spec *specs, unsigned n_specs)
+ssize_t LsquicServer::on_dg_write(lsquic_conn_t * conn, void * buf, size_t len)
 {
-  fmt::print("LsquicServer::send_packets_out\n");
+  auto * packet = _send_ring.front();
+
+  // Larger than what a QUIC packet can carry, it would never be sent
+  while(packet && packet->len > len) {
+    if(auto dropped = ++_send_dropped; dropped % 1000 == 1) fmt::print("lsquic server dropped {} udp packets\n", dropped);
+    _send_ring.release();
+    packet = _send_ring.front();
+  }
   
-  struct msghdr msg;
-  unsigned n;
+  if(!packet) {
+    lsquic_conn_want_datagram_write(conn, 0);
+    return -1;
+  }
 
-  memset(&msg, 0, sizeof(msg));
+  ssize_t written = packet->len;
+  memcpy(buf, packet->data, packet->len);
+  _send_ring.release();
 
-  for (n = 0; n < n_specs; ++n) {
-    msg.msg_name       = (void *) specs[n].dest_sa;
-    msg.msg_namelen    = sizeof(struct sockaddr_in);
-    msg.msg_iov        = specs[n].iov;
-    msg.msg_iovlen     = specs[n].iovlen;
-    if (sendmsg(_socket, &msg, 0) < 0) {
-      perror("noooo");
-      break;
-    }
-    else {
-      // fmt::print("Sending at least something\n");
-    }
-  }
+  return written;
+}
+
+void LsquicServer::collect_metrics(metrics::Writer& w) const
+{
+  w.gauge("quic_tunnel_queue_depth", "Packets waiting to be handed over to another thread",
+	  _send_ring.size(), "queue=\"send_ring\"");
+  w.counter("quic_tunnel_dropped_total", "Packets dropped by the tunnel",
+	    _send_dropped.load(std::memory_order_relaxed), "reason=\"queue_full\"");
+}
 
-  // fmt::print("n : {} {}\n", n, n_specs);
+int LsquicServer::send_packets_out(const struct lsquic_out_spec *specs, unsigned n_specs)
+{
+  // Equal sized packets for one peer go out in a single sendmsg when GSO is enabled
+  errno = 0;
+  int n = udp::send_specs(_socket, _gso, specs, n_specs);
+
+  uint64_t bytes = 0;
+  for(int i = 0; i < n; ++i)
+    for(size_t j = 0; j < specs[i].iovlen; ++j) bytes += specs[i].iov[j].iov_len;
+  if(n > 0) _wire.on_tx(bytes, n);
 
-  return (int) n;
+  // The engine holds the rest until lsquic_engine_send_unsent_packets
+  if(n < (int)n_specs && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    ev_io_start(_loop, _write_watcher.get());
+  }
+  
+  return n;
 }
@@ -2,7 +2,9 @@
 #define LSQUIC_SERVER_H
 
 #include <atomic>
-#include <condition_variable>
+#include <memory>
+#include <deque>
+#include <vector>
 
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -10,6 +12,9 @@
 #include <netdb.h>
 
 #include "quic_server.h"
+#include "io/io_engine.h"
+#include "spsc_ring.h"
+#include "framing.h"
 
 struct lsquic_engine;
 typedef struct lsquic_engine lsquic_engine_t;
@@ -34,7 +39,16 @@ typedef struct lsquic_stream_ctx lsquic_stream_ctx_t;
 struct ssl_ctx_st;
 typedef struct ssl_ctx_st SSL_CTX;
 
-class LsquicServer : public QuicServer
+struct ev_loop;
+struct ev_io;
+struct ev_timer;
+struct ev_async;
+
+/**
+ * @brief lsquic server. The socket and the engine belong to the ev loop run by loop(),
+ * every lsquic call happens on that thread.
+ */
+class LsquicServer : public QuicServer, public out::UdpSocketCallback
 {
   enum Congestion : uint8_t {
     DEFAULT_CC = 0,
@@ -44,6 +58,12 @@ class LsquicServer : public QuicServer
   };
   
   static constexpr auto MAX_BUF_LEN = 2048u;
+  static constexpr auto MAX_RECV_LEN = 65535u; // Room for GRO coalesced reads
+  static constexpr auto MAX_BATCH_LEN = 8u;
+  static constexpr auto MAX_READ_BATCHES = 16u; // Per socket readiness
+  static constexpr int  MIN_TICK_US = 1; // A zero timer would not be armed
+  static constexpr auto MAX_PENDING_STREAMS = 1024u; // Packets waiting for their stream
+  static constexpr auto READ_BUF_LEN = 16384u;
   
   std::string      _host;
   uint16_t         _port;
@@ -52,7 +72,8 @@ class LsquicServer : public QuicServer
 
   std::string _qlog_file;
   bool        _datagrams;
-  bool        _start;
+  bool        _framed = false;
+  std::atomic<bool> _start; // Cleared by stop from the control thread
 
   lsquic_engine_t    *     _engine;
   lsquic_engine_api  *     _engine_api;
@@ -62,19 +83,47 @@ class LsquicServer : public QuicServer
 
   SSL_CTX    * _ssl_ctx;
   ssl_ctx_st * _cert_ctx;
+
+  lsquic_conn_t   * _conn = nullptr; // Connection of the client
+  lsquic_stream_t * _stream = nullptr; // Framed stream, opened by the client
   
-  uint8_t _cc;
+  uint8_t _cc = DEFAULT_CC;
   
   int _socket;
-  unsigned char _buf[MAX_BUF_LEN];
+  bool _gso; // UDP_SEGMENT egress
+
+  std::unique_ptr<io::Engine> _io; // Batched (and GRO) reads on _socket
+  TrafficCounters _wire; // Packets on _socket
   
   struct sockaddr_in _addr_peer;
   struct sockaddr_in _addr_local;
   socklen_t          _addr_local_len;
   socklen_t          _addr_peer_len;
 
-  std::condition_variable _cv;
-  std::mutex _cv_mutex;
+  struct ev_loop * _loop = nullptr;
+  std::unique_ptr<struct ev_io>    _io_watcher;
+  std::unique_ptr<struct ev_io>    _write_watcher; // Started while the socket buffer is full
+  std::unique_ptr<struct ev_timer> _timer; // Next tick asked by the engine
+  std::unique_ptr<struct ev_async> _stop_watcher;
+  std::unique_ptr<struct ev_async> _send_watcher; // Wakes the loop when the send ring is filled
+
+  /** @brief A packet handed from the UDP receive thread to the loop thread */
+  struct Packet
+  {
+    uint32_t len;
+    char     data[out::UdpSocket::MAX_BUF_LEN];
+  };
+
+  // UDP receive thread -> loop thread. Every lsquic call happens on the loop thread
+  SpscRing<Packet, 1024> _send_ring;
+  std::atomic<uint64_t> _send_dropped = 0;
+
+  // Loop thread only. Packets sent on a stream of their own, until lsquic creates it
+  std::deque<std::vector<char>> _pending_streams;
+
+  // Framed mode, packets not taken by the stream yet and partial packet received
+  framing::Framer   _framer;
+  framing::Deframer _deframer;
   
   static std::atomic<int> _ref_count;
 
@@ -83,8 +132,19 @@ class LsquicServer : public QuicServer
 
   void init_socket();
   void close_socket();
+
+  void send_stream(const char * buffer, size_t len);
   
 public:
+  /** @brief State of one lsquic stream, given back by lsquic in every stream callback */
+  struct StreamCtx
+  {
+    LsquicServer *    server;
+    bool              framed = false;
+    std::vector<char> buf; // Packet to write, or packet read so far
+    size_t            offset = 0; // Bytes of buf already written
+  };
+  
   static constexpr const char * DEFAULT_QLOG_PATH = "tunnel-out-logs";
   static constexpr const char * IMPL_NAME = "lsquic";
   
@@ -95,29 +155,56 @@ public:
   
   void set_qlog_filename(std::string file_name) override;
 
-  ssize_t recv();
   bool start() override;
+
+  /**
+   * @brief Run the ev loop until stop
+   */
   void loop() override;
 
   std::string_view get_qlog_path() const noexcept override { return DEFAULT_QLOG_PATH; }
   std::string_view get_qlog_filename() const noexcept override { return DEFAULT_QLOG_PATH; }
   bool set_datagrams(bool enable) override;
+  bool set_framed_streams(bool enable) override;
+  const TrafficCounters * wire_traffic() const noexcept override { return &_wire; }
+  void collect_metrics(metrics::Writer& w) const override;
   
   bool set_cc(std::string_view cc) noexcept override;
   void stop() override;
 
   SSL_CTX* get_ssl_ctx() { return _ssl_ctx; }
   ssl_ctx_st* get_cert_ctx() { return _cert_ctx; }
+
+  // Loop thread callbacks
+  void on_readable();
+  void on_writable();
+
+  /**
+   * @brief Loop thread. Process the connections and arm the timer for the next tick the engine asks
+   */
+  void process_conns();
+
+  /**
+   * @brief Loop thread. Sends the packets received on the UDP socket since the last wakeup
+   */
+  void drain_send();
   
   // lsquic callback
   lsquic_conn_ctx_t   * on_new_conn(lsquic_conn_t *conn);
   lsquic_stream_ctx_t * on_new_stream(lsquic_stream_t * stream);
   void on_conn_closed (lsquic_conn_t * conn);
-  void on_read(lsquic_stream_t * stream);
-  void on_write(lsquic_stream_t * stream);
-  void on_stream_close(lsquic_stream_t * stream);
+  void on_read(lsquic_stream_t * stream, StreamCtx * ctx);
+  void on_write(lsquic_stream_t * stream, StreamCtx * ctx);
+  void on_stream_close(lsquic_stream_t * stream, StreamCtx * ctx);
+  void on_datagram(const void * buf, size_t len);
+  ssize_t on_dg_write(lsquic_conn_t * conn, void * buf, size_t len);
   int send_packets_out(const struct lsquic_out_spec *specs, unsigned n_specs);
 
+  /**
+   * @brief UDP receive thread. Copies the packet in the ring and wakes the loop up
+   */
+  void onUdpMessage(const char* buffer, size_t len) noexcept override;
+
 };
 
 #endif /* LSQUIC_SERVER_H */
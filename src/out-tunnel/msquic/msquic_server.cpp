@@ -45,7 +45,8 @@ QUIC_STATUS ServerStreamCallback(HQUIC Stream, void* Context, QUIC_STREAM_EVENT*
 }
 
 MsquicServer::MsquicServer(const std::string& host, uint16_t port, out::UdpSocket * udp_socket)
-  : _host(host), _port(port), _udp_socket(udp_socket)
+  : _host(host), _port(port), _udp_socket(udp_socket),
+    _pool(sizeof(QUIC_BUFFER) + framing::HEADER_LEN + out::UdpSocket::MAX_BUF_LEN, POOL_LEN)
 {
   QUIC_STATUS status = QUIC_STATUS_SUCCESS;
   if (QUIC_FAILED(status = MsQuicOpen2(&_msquic))) {
@@ -77,6 +78,7 @@ Capabilities MsquicServer::get_capabilities()
   caps.impl = "msquic";
   caps.datagrams = true;
   caps.streams = true;
+  caps.framed_streams = true;
   caps.cc.push_back("bbr");
   caps.cc.push_back("cubic");
   
@@ -187,6 +189,8 @@ void MsquicServer::stop()
       _configuration = nullptr;
     }
   }
+
+  printf("Buffer pool: %lu misses, %lu oversize\n", _pool.misses(), _pool.oversize());
   
   _cv.notify_all();
 }
@@ -304,7 +308,7 @@ QUIC_STATUS MsquicServer::server_stream_callback(QUIC_HANDLE* stream, QUIC_STREA
     // A previous StreamSend call has completed, and the context is being
     // returned back to the app.
     //
-    free(event->SEND_COMPLETE.ClientContext);
+    _pool.release(event->SEND_COMPLETE.ClientContext);
     // printf("[strm][%p] Data sent\n", stream);
     break;
   case QUIC_STREAM_EVENT_RECEIVE:{
@@ -315,8 +319,16 @@ QUIC_STATUS MsquicServer::server_stream_callback(QUIC_HANDLE* stream, QUIC_STREA
 
     for(int i = 0; i < event->RECEIVE.BufferCount; ++i) {
       const QUIC_BUFFER Buffer = event->RECEIVE.Buffers[i];
-      _udp_socket->send((const char*)Buffer.Buffer, Buffer.Length);
+
+      if(_framed) {
+	_deframer.feed(Buffer.Buffer, Buffer.Length, [this](const char * packet, size_t len) {
+	  _udp_socket->queue(packet, len);
+	});
+      }
+      else _udp_socket->queue((const char*)Buffer.Buffer, Buffer.Length);
     }
+
+    _udp_socket->flush();
     
     break;
   }
@@ -332,6 +344,7 @@ QUIC_STATUS MsquicServer::server_stream_callback(QUIC_HANDLE* stream, QUIC_STREA
     // The peer aborted its send direction of the stream.
     //
     printf("[strm][%p] Peer aborted\n", stream);
+    _deframer.reset();
     _msquic->StreamShutdown(stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
     break;
   case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
@@ -340,6 +353,11 @@ QUIC_STATUS MsquicServer::server_stream_callback(QUIC_HANDLE* stream, QUIC_STREA
     // with the stream. It can now be safely cleaned up.
     //
     // printf("[strm][%p] All done\n", stream);
+    if(HQUIC own = stream; _stream.compare_exchange_strong(own, nullptr)) {
+      // The framed stream is opened again on the next packet
+      printf("[strm][%p] Framed stream closed\n", stream);
+    }
+    
     _msquic->StreamClose(stream);
     break;
   default:
@@ -350,13 +368,17 @@ QUIC_STATUS MsquicServer::server_stream_callback(QUIC_HANDLE* stream, QUIC_STREA
 
 void MsquicServer::server_on_datagram_send_state_changed(unsigned int state, void *ctx)
 {
+  static_assert(QUIC_DATAGRAM_SEND_CANCELED + 1 == DATAGRAM_STATES);
+  
+  if(state < DATAGRAM_STATES) _datagram_states[state].fetch_add(1, std::memory_order_relaxed);
+  
   switch(state) {
   case QUIC_DATAGRAM_SEND_UNKNOWN:
     printf("QUIC_DATAGRAM_SEND_UNKNOWN\n");
     break;
   case QUIC_DATAGRAM_SEND_SENT:
     // printf("QUIC_DATAGRAM_SEND_SENT\n");
-    free(ctx);
+    _pool.release(ctx);
     break;
   case QUIC_DATAGRAM_SEND_LOST_SUSPECT:
     printf("QUIC_DATAGRAM_SEND_LOST_SUSPECT\n");
@@ -372,12 +394,41 @@ void MsquicServer::server_on_datagram_send_state_changed(unsigned int state, voi
     break;
   case QUIC_DATAGRAM_SEND_CANCELED:
     printf("QUIC_DATAGRAM_SEND_CANCELED\n");
+    // Never sent, msquic will not report it again
+    _pool.release(ctx);
     break;
   default:
     printf("Unknown datagram send state\n");
   }
 }
 
+void MsquicServer::collect_metrics(metrics::Writer& w) const
+{
+  static constexpr const char * STATES[DATAGRAM_STATES] = {
+    "unknown", "sent", "lost_suspect", "lost_discarded", "acknowledged", "acknowledged_spurious", "canceled"
+  };
+
+  for(size_t i = 0; i < DATAGRAM_STATES; ++i) {
+    w.counter("quic_tunnel_datagram_send_total", "Datagram send state changes, by QUIC_DATAGRAM_SEND_* state",
+	      _datagram_states[i].load(std::memory_order_relaxed), fmt::format("state=\"{}\"", STATES[i]));
+  }
+
+  _pool.collect(w);
+
+  if(!_connection) return;
+
+  QUIC_STATISTICS_V2 stats;
+  uint32_t size = sizeof(stats);
+  
+  if(QUIC_FAILED(_msquic->GetParam(_connection, QUIC_PARAM_CONN_STATISTICS_V2, &size, &stats))) return;
+
+  w.gauge("quic_tunnel_cwnd_bytes", "Congestion window", stats.SendCongestionWindow);
+  w.gauge("quic_tunnel_rtt_microseconds", "Smoothed RTT", stats.Rtt);
+  w.gauge("quic_tunnel_min_rtt_microseconds", "Minimum RTT", stats.MinRtt);
+  w.counter("quic_tunnel_lost_packets_total", "Packets declared lost by the transport",
+	    stats.SendSuspectedLostPackets - stats.SendSpuriousLostPackets);
+}
+
 void MsquicServer::write_stats(const QUIC_CONNECTION_EVENT* event)
 {
   if(_qlog_file.empty()) return;
@@ -438,35 +489,70 @@ void MsquicServer::server_send_stream(QUIC_BUFFER* buffer)
 
   if(QUIC_FAILED(status = _msquic->StreamOpen(_connection, QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL, ServerStreamCallback, this, &stream))) {
     printf("StreamOpen failed, 0x%x!\n", status);
-    free(buffer);
+    _pool.release(buffer);
     return;
   }
 
   if (QUIC_FAILED(status = _msquic->StreamSend(stream, buffer, 1, QUIC_SEND_FLAG_START | QUIC_SEND_FLAG_FIN, buffer))) {
     printf("StreamSend failed, 0x%x!\n", status);
-    free(buffer);
+    _pool.release(buffer);
     _msquic->StreamShutdown(stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
   } 
 }
 
+void MsquicServer::server_send_framed(QUIC_BUFFER* buffer)
+{
+  QUIC_STATUS status;
+  HQUIC stream = _stream.load();
+  QUIC_SEND_FLAGS flags = QUIC_SEND_FLAG_NONE;
+
+  if(!stream) {
+    if(QUIC_FAILED(status = _msquic->StreamOpen(_connection, QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL, ServerStreamCallback, this, &stream))) {
+      printf("StreamOpen failed, 0x%x!\n", status);
+      _pool.release(buffer);
+      return;
+    }
+
+    _stream = stream;
+    flags = QUIC_SEND_FLAG_START;
+  }
+
+  if(QUIC_FAILED(status = _msquic->StreamSend(stream, buffer, 1, flags, buffer))) {
+    printf("StreamSend failed, 0x%x!\n", status);
+    _pool.release(buffer);
+
+    // The peer drops its partial packet on the abort, a new stream is opened on the next packet
+    _stream.compare_exchange_strong(stream, nullptr);
+    _msquic->StreamShutdown(stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+  }
+}
+
 void MsquicServer::server_send_datagram(QUIC_BUFFER* buffer)
 {
   QUIC_STATUS status;
 
   if(QUIC_FAILED(status = _msquic->DatagramSend(_connection, buffer, 1, QUIC_SEND_FLAG_NONE, buffer))) {
     printf("Datagram Send failed, 0x%x!\n", status);
-    free(buffer);
+    _pool.release(buffer);
   }
 }
 
 void MsquicServer::onUdpMessage(const char *buffer, size_t len) noexcept
 {  
-  QUIC_BUFFER * qbuffer = (QUIC_BUFFER*)malloc(sizeof(QUIC_BUFFER) + len);
-  qbuffer->Length = len;
+  bool framed = !_datagrams && _framed;
+  size_t prefix = framed ? framing::HEADER_LEN : 0;
+  
+  QUIC_BUFFER * qbuffer = (QUIC_BUFFER*)_pool.acquire(sizeof(QUIC_BUFFER) + prefix + len);
+  if(!qbuffer) return;
+
+  qbuffer->Length = prefix + len;
   qbuffer->Buffer = (uint8_t*)qbuffer + sizeof(QUIC_BUFFER);
-  memcpy(qbuffer->Buffer, buffer, len);
+  
+  if(framed) framing::write_frame(qbuffer->Buffer, buffer, len);
+  else memcpy(qbuffer->Buffer, buffer, len);
   
   if(_datagrams) server_send_datagram(qbuffer);
+  else if(framed) server_send_framed(qbuffer);
   else server_send_stream(qbuffer);
 }
 
@@ -486,6 +572,12 @@ bool MsquicServer::set_datagrams(bool enable)
   return true;
 }
   
+bool MsquicServer::set_framed_streams(bool enable)
+{
+  _framed = enable;
+  return true;
+}
+
 bool MsquicServer::set_cc(std::string_view cc) noexcept
 {
   if(cc == "bbr")        _cc = QUIC_CONGESTION_CONTROL_ALGORITHM_BBR;
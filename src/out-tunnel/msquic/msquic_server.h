@@ -5,8 +5,12 @@
 #include <mutex>
 #include <fstream>
 #include <chrono>
+#include <atomic>
+#include <array>
 
 #include "quic_server.h"
+#include "buffer_pool.h"
+#include "framing.h"
 
 struct QUIC_API_TABLE;
 struct QUIC_HANDLE;
@@ -25,6 +29,7 @@ class MsquicServer : public QuicServer, public out::UdpSocketCallback
   std::string   _qlog_file;
   std::ofstream _qlog_ofs;
   bool          _datagrams;
+  bool          _framed = false;
 
   const QUIC_API_TABLE * _msquic = nullptr;
   QUIC_HANDLE * _listener = nullptr;
@@ -37,13 +42,26 @@ class MsquicServer : public QuicServer, public out::UdpSocketCallback
 
   std::chrono::time_point<std::chrono::system_clock> _time_0;
 
+  // Long lived stream of the framed mode, opened on the first packet
+  std::atomic<QUIC_HANDLE*> _stream = nullptr;
+  framing::Deframer _deframer;
+
+  // QUIC_BUFFER and payload of each send, given back once msquic is done with it
+  BufferPool _pool;
+
+  // Datagrams per QUIC_DATAGRAM_SEND_* state change, UNKNOWN to CANCELED
+  static constexpr size_t DATAGRAM_STATES = 7;
+  std::array<std::atomic<uint64_t>, DATAGRAM_STATES> _datagram_states{};
+
   void server_send_stream(QUIC_BUFFER* buffer);
   void server_send_datagram(QUIC_BUFFER* buffer);
+  void server_send_framed(QUIC_BUFFER* buffer);
   void write_stats(const QUIC_CONNECTION_EVENT* event);
   
 public:
   static constexpr const char * DEFAULT_QLOG_PATH = "tunnel-out-logs";
   static constexpr const char * IMPL_NAME = "msquic";
+  static constexpr auto POOL_LEN = 1024u;
   
   MsquicServer(const std::string& host, uint16_t port, out::UdpSocket * udp_socket);
   ~MsquicServer() override;
@@ -58,6 +76,7 @@ public:
   std::string_view get_qlog_path() const noexcept override;
   std::string_view get_qlog_filename() const noexcept override;
   bool set_datagrams(bool enable) override;
+  bool set_framed_streams(bool enable) override;
   
   bool set_cc(std::string_view cc) noexcept override;
   void stop() override;
@@ -66,6 +85,8 @@ public:
   unsigned int server_connection_callback(QUIC_HANDLE* connection, QUIC_CONNECTION_EVENT* event);
   unsigned int server_stream_callback(QUIC_HANDLE* stream, QUIC_STREAM_EVENT* event);
   void server_on_datagram_send_state_changed(unsigned int state, void* ctx);
+
+  void collect_metrics(metrics::Writer& w) const override;
   
   void onUdpMessage(const char* buffer, size_t len) noexcept override;
 };
@@ -1,6 +1,40 @@
-#include <quic/logging/FileQLogger.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "callback_handler.h"
+#include "qlogfile.h"
+
+CallbackHandler::SlotArena::SlotArena() : slots(SLOT_LEN * NB_SLOTS)
+{
+  for(uint32_t i = 0; i < NB_SLOTS; ++i) free.push(i);
+}
+
+CallbackHandler::CallbackHandler()
+  : _evb(nullptr), _udp_socket(nullptr), _arena(new SlotArena),
+    _event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), _wake(false), _dropped(0),
+    datagrams(false), framed_streams(false)
+{
+  PCHECK(_event_fd != -1) << "Could not create eventfd";
+}
+
+CallbackHandler::~CallbackHandler()
+{
+  _notifier.reset();
+  ::close(_event_fd);
+
+  // Freed now, or by the last buffer mvfst gives back
+  _arena->unref();
+}
+
+bool CallbackHandler::set_evb(folly::EventBase* evb) noexcept
+{
+  // The workers make their transports concurrently
+  folly::EventBase * pinned = nullptr;
+  if(!_evb.compare_exchange_strong(pinned, evb, std::memory_order_acq_rel)) return pinned == evb;
+
+  _notifier = std::make_unique<PacketNotifier>(evb, _event_fd, this);
+  return true;
+}
 
 // ConnectionSetupCallback ////////////////////////////////////////////////////
 void CallbackHandler::onFirstPeerPacketProcessed() noexcept
@@ -16,9 +50,9 @@ void CallbackHandler::onConnectionSetupError(quic::QuicError error) noexcept
 void CallbackHandler::onTransportReady() noexcept
 {
   LOG(INFO) << "onTransportReady";
-  auto dcid = _transport->getClientChosenDestConnectionId();
-  if(dcid.hasValue())
-    qlog_file = dcid.value().hex() + quic::FileQLogger::kQlogExtension;
+  // As named by the qlogger, which picks a name of its own when the connection ID is missing
+  if(auto name = qlog_file_name<quic::VantagePoint::Server>(_transport->getQLogger()); !name.empty())
+    qlog_file = std::move(name);
 }
 
 void CallbackHandler::onReplaySafe() noexcept
@@ -52,6 +86,9 @@ void CallbackHandler::onNewUnidirectionalStream(quic::StreamId id) noexcept
 void CallbackHandler::onStopSending(quic::StreamId id, quic::ApplicationErrorCode) noexcept
 {
   LOG(INFO) << "Out Quic tunnel got StopSending stream id=" << id;
+
+  // A new framed stream is opened on the next packet
+  if(_framed_id == id) _framed_id.reset();
 }
 
 void CallbackHandler::onConnectionEnd() noexcept
@@ -105,8 +142,10 @@ void CallbackHandler::onDatagramsAvailable() noexcept
 
   for(const auto& dg : res.value()) {
     auto copy = dg.bufQueue().front()->cloneCoalesced();
-    _udp_socket->send((const char*)copy->data(), copy->length());
+    _udp_socket->queue((const char*)copy->data(), copy->length());
   }
+
+  _udp_socket->flush();
 }
 
 // ReadCallback ///////////////////////////////////////////////////////////////
@@ -123,6 +162,20 @@ void CallbackHandler::readAvailable(quic::StreamId id) noexcept
 
   _queue_ids.push_front(id);
 
+  if(framed_streams) {
+    if(!data->first) return;
+
+    // The packets can span the buffers of the chain
+    for(auto range : *data->first) {
+      _deframer.feed(range.data(), range.size(), [this](const char * packet, size_t len) {
+	_udp_socket->queue(packet, len);
+      });
+    }
+
+    _udp_socket->flush();
+    return;
+  }
+
   if(data->first) {
     auto copy = data->first->clone();
     auto message = copy->moveToFbString().toStdString();
@@ -137,6 +190,8 @@ void CallbackHandler::readError(quic::StreamId id, quic::QuicError error) noexce
 {
   LOG(ERROR) << "Out Quic tunnel failed read from stream=" << id
 	     << ", error=" << toString(error);
+  _deframer.reset();
+  
   // A read error only terminates the ingress portion of the stream state.
   // Your application should probably terminate the egress portion via
   // resetStream
@@ -168,38 +223,123 @@ void CallbackHandler::onConnectionWriteError(quic::QuicError error) noexcept
 
 // UdpSocketCallback //////////////////////////////////////////////////////////
 
-void CallbackHandler::onUdpMessage(const char * buffer, size_t len) noexcept
+CallbackHandler::PacketNotifier::PacketNotifier(folly::EventBase * evb, int fd, CallbackHandler * handler)
+  : folly::EventHandler(evb, folly::NetworkSocket::fromFd(fd)), _handler(handler)
+{
+  registerHandler(folly::EventHandler::READ | folly::EventHandler::PERSIST);
+}
+
+void CallbackHandler::PacketNotifier::handlerReady(uint16_t) noexcept
+{
+  _handler->drain_packets();
+}
+
+void CallbackHandler::release_slot(void * buf, void * user_data) noexcept
+{
+  auto * arena = static_cast<SlotArena*>(user_data);
+  auto slot = ((char*)buf - arena->slots.data()) / SLOT_LEN;
+
+  // IOBufs are only freed on the event base thread, the single producer of this ring
+  arena->free.push(slot);
+  arena->unref();
+}
+
+void CallbackHandler::drain_packets() noexcept
 {
-  std::string m{buffer, len};
-
-  _evb->runInEventBaseThread([this, msg=std::move(m)]() {
-    // LOG(INFO) << "OnUDPmessage : " << msg;
-    // auto id = _queue_ids.back();
-    // _queue_ids.pop_back();
-
-    size_t len = msg.size();
-    auto qbuf = folly::IOBuf::copyBuffer(std::move(msg));
-
-    // LOG(INFO) << "len: " << len << " " << quic::kMinMaxUDPPayload;
-    if(!datagrams || len >= quic::kMinMaxUDPPayload) {
-      // LOG(INFO) << "len: " << len;
-      auto r = _transport->createUnidirectionalStream();
-      if(r.hasError()) {
-	LOG(ERROR) << "In quic tunnel write chain error=" << uint32_t(r.error() );
-	return;
-      }
-      auto id = r.value();
-      auto res = _transport->writeChain(id, std::move(qbuf), true);
-      if(res.hasError()) {
-	LOG(ERROR) << "In quic tunnel write chain error=" << uint32_t(res.error());
-      }
+  uint64_t count;
+  if(read(_event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+    PLOG(ERROR) << "Could not read eventfd";
+  }
+
+  // Packets pushed from now on need a new wakeup. A store could be reordered after the loads
+  // of the ring below, missing a packet whose producer still saw the flag set. As a read-modify-write
+  // it either reads the producer flag, and the packet is visible, or precedes it, and the producer wakes us
+  _wake.exchange(false, std::memory_order_acq_rel);
+
+  Packet packet;
+  while(_filled.pop(packet)) {
+    _arena->refs.fetch_add(1, std::memory_order_relaxed);
+    auto buf = folly::IOBuf::takeOwnership(&_arena->slots[packet.slot * SLOT_LEN], SLOT_LEN, packet.len,
+					   &CallbackHandler::release_slot, _arena);
+    send_packet(std::move(buf));
+  }
+}
+
+void CallbackHandler::send_packet(std::unique_ptr<folly::IOBuf> qbuf) noexcept
+{
+  auto len = qbuf->length();
+  
+  // LOG(INFO) << "len: " << len << " " << quic::kMinMaxUDPPayload;
+  if(framed_streams && (!datagrams || len >= quic::kMinMaxUDPPayload)) {
+    send_framed(std::move(qbuf));
+  }
+  else if(!datagrams || len >= quic::kMinMaxUDPPayload) {
+    // LOG(INFO) << "len: " << len;
+    auto r = _transport->createUnidirectionalStream();
+    if(r.hasError()) {
+      LOG(ERROR) << "In quic tunnel write chain error=" << uint32_t(r.error() );
+      return;
     }
-    else {
-      auto res = _transport->writeDatagram(std::move(qbuf));
-      // auto res = _transport->writeChain(id, std::move(qbuf), false, nullptr);
-      if(res.hasError()) {
-	LOG(ERROR) << "In quic tunnel write dgram error=" << uint32_t(res.error());
-      }
+    auto id = r.value();
+    auto res = _transport->writeChain(id, std::move(qbuf), true);
+    if(res.hasError()) {
+      LOG(ERROR) << "In quic tunnel write chain error=" << uint32_t(res.error());
     }
-  });
+  }
+  else {
+    auto res = _transport->writeDatagram(std::move(qbuf));
+    if(res.hasError()) {
+      LOG(ERROR) << "In quic tunnel write dgram error=" << uint32_t(res.error());
+    }
+  }
+}
+
+void CallbackHandler::send_framed(std::unique_ptr<folly::IOBuf> qbuf) noexcept
+{
+  if(!_framed_id) {
+    auto r = _transport->createUnidirectionalStream();
+    if(r.hasError()) {
+      LOG(ERROR) << "In quic tunnel create framed stream error=" << uint32_t(r.error());
+      return;
+    }
+
+    _framed_id = r.value();
+  }
+
+  // Length prefix chained in front of the slot, the payload is not copied
+  uint8_t header[framing::HEADER_LEN];
+  framing::write_header(header, qbuf->length());
+  
+  auto frame = folly::IOBuf::copyBuffer(header, sizeof(header));
+  frame->prependChain(std::move(qbuf));
+
+  auto res = _transport->writeChain(*_framed_id, std::move(frame), false);
+  if(res.hasError()) {
+    LOG(ERROR) << "In quic tunnel framed write chain error=" << uint32_t(res.error());
+
+    // The peer drops its partial packet on the reset, a new stream is opened on the next packet
+    _transport->resetStream(*_framed_id, quic::GenericApplicationErrorCode::UNKNOWN);
+    _framed_id.reset();
+  }
+}
+
+void CallbackHandler::onUdpMessage(const char * buffer, size_t len) noexcept
+{
+  uint32_t slot;
+
+  // Runs on the UDP receive thread, the single producer of _filled and consumer of the free slots.
+  // Packets received before set_evb wait in the ring, the eventfd stays readable
+  if(len > SLOT_LEN || !_arena->free.pop(slot)) {
+    if(++_dropped % 1000 == 1) LOG(WARNING) << "Out quic tunnel dropped " << _dropped << " packets";
+    return;
+  }
+
+  memcpy(&_arena->slots[slot * SLOT_LEN], buffer, len);
+  _filled.push({ slot, (uint32_t)len });
+
+  // One eventfd write per batch, until the event base drains the ring
+  if(!_wake.exchange(true, std::memory_order_acq_rel)) {
+    uint64_t one = 1;
+    if(write(_event_fd, &one, sizeof(one)) == -1) PLOG(ERROR) << "Could not write eventfd";
+  }
 }
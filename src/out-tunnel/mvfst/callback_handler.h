@@ -2,13 +2,19 @@
 #define CALLBACK_HANDLER_H
 
 #include <deque>
+#include <atomic>
+#include <vector>
+#include <optional>
 
 #include <quic/api/QuicSocket.h>
 
 #include <folly/io/async/EventBase.h>
+#include <folly/io/async/EventHandler.h>
 #include <quic/common/BufUtil.h>
 
 #include "udp_socket.h"
+#include "spsc_ring.h"
+#include "framing.h"
 
 class CallbackHandler : public quic::QuicSocket::ConnectionSetupCallback,
 			public quic::QuicSocket::ConnectionCallback,
@@ -17,21 +23,81 @@ class CallbackHandler : public quic::QuicSocket::ConnectionSetupCallback,
 			public quic::QuicSocket::DatagramCallback,
 			public out::UdpSocketCallback
 {
-  folly::EventBase*                 _evb;
+  static constexpr size_t SLOT_LEN = out::UdpSocket::MAX_BUF_LEN;
+  static constexpr size_t NB_SLOTS = 4096; // Packets received but not yet released by mvfst
+
+  struct Packet
+  {
+    uint32_t slot;
+    uint32_t len;
+  };
+
+  /**
+   * @brief Wakes the event base up on the eventfd when packets are waiting in the ring
+   */
+  class PacketNotifier : public folly::EventHandler
+  {
+    CallbackHandler * _handler;
+
+  public:
+    PacketNotifier(folly::EventBase * evb, int fd, CallbackHandler * handler);
+    void handlerReady(uint16_t events) noexcept override;
+  };
+
+  /**
+   * @brief Slots of the packets handed to mvfst. Counted by the handler and by each buffer mvfst
+   * holds, so the buffers freed by the transports after the handler is gone still have their slots
+   */
+  struct SlotArena
+  {
+    std::vector<char>            slots;
+    SpscRing<uint32_t, NB_SLOTS> free;
+    std::atomic<uint32_t>        refs{1}; // The handler, plus one per buffer held by mvfst
+
+    SlotArena();
+    void unref() noexcept { if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this; }
+  };
+  
+  std::atomic<folly::EventBase*>    _evb; // Set once, by the first transport made
   std::shared_ptr<quic::QuicSocket> _transport;
   out::UdpSocket *                  _udp_socket;
   std::deque<quic::StreamId>        _queue_ids;
+
+  // UDP thread -> event base handoff. The IOBufs wrap the slots, which go back
+  // to the free ring of the arena when mvfst releases them
+  SlotArena *                     _arena;
+  SpscRing<Packet, NB_SLOTS>      _filled;
+  int                             _event_fd;
+  std::atomic<bool>               _wake;
+  std::unique_ptr<PacketNotifier> _notifier;
+  uint64_t                        _dropped;
+
+  // Framed mode, long lived stream opened on the first packet and partial packet received
+  std::optional<quic::StreamId> _framed_id;
+  framing::Deframer             _deframer;
+
+  void drain_packets() noexcept;
+  void send_packet(std::unique_ptr<folly::IOBuf> buf) noexcept;
+  void send_framed(std::unique_ptr<folly::IOBuf> buf) noexcept;
+  static void release_slot(void * buf, void * user_data) noexcept;
   
 public:
   std::string                       qlog_file;
   bool                              datagrams;
+  bool                              framed_streams;
 
-  CallbackHandler() = default;
+  CallbackHandler();
+  ~CallbackHandler();
 
   void set_quic_socket(std::shared_ptr<quic::QuicSocket> sock) noexcept {
     _transport = sock;
   }
-  void set_evb(folly::EventBase* evb)   noexcept { _evb = evb; }
+  
+  /**
+   * @brief Pin the packet ring and its notifier to the event base of a transport, from its thread
+   * @return false if the handler is already pinned to another event base
+   */
+  bool set_evb(folly::EventBase* evb) noexcept;
   void set_udp_socket(out::UdpSocket * sock) noexcept { _udp_socket = sock; }
   
   /* ConnectionSetupCallback */
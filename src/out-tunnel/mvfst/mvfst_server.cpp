@@ -132,7 +132,12 @@ MvfstTransportFactory::make(folly::EventBase* evb,
   
   CHECK_EQ(evb, sock->getEventBase());
 
-  _handler->set_evb(evb);
+  // The handler and its packet ring are driven from the event base of the first connection,
+  // the tunnel carries only one. A connection made on another worker would share them
+  if(!_handler->set_evb(evb)) {
+    LOG(ERROR) << "Out quic tunnel already runs on another worker, connection refused";
+    return nullptr;
+  }
   
   auto transport = quic::QuicServerTransport::make(evb,
 						   std::move(sock),
@@ -143,7 +148,9 @@ MvfstTransportFactory::make(folly::EventBase* evb,
   _handler->set_quic_socket(transport);
   
   transport->setDatagramCallback(_handler);
-  transport->setQLogger(QLog<quic::VantagePoint::Server>::create(QuicServer::DEFAULT_QLOG_PATH));
+  if(auto qlogger = make_qlogger<quic::VantagePoint::Server>(QuicServer::DEFAULT_QLOG_PATH)) {
+    transport->setQLogger(std::move(qlogger));
+  }
 
   // std::vector<quic::QuicVersion> v = { quic::QuicVersion::QUIC_DRAFT, ver };
   // transport->setSupportedVersions(v);
@@ -165,12 +172,13 @@ Capabilities MvfstServer::get_capabilities()
   cap.cc.emplace_back("none");
 
   cap.datagrams = true;
+  cap.framed_streams = true;
 
   return cap;
 }
 
 MvfstServer::MvfstServer(const std::string& host, uint16_t port, out::UdpSocket * udp_socket)
-  : _host(host), _port(port), _server(nullptr), _udp_socket(udp_socket), _datagrams(false)
+  : _host(host), _port(port), _server(nullptr), _udp_socket(udp_socket), _datagrams(false), _framed(false), _workers(0)
 {}
 
 void MvfstServer::set_qlog_filename(std::string file_name)
@@ -186,6 +194,7 @@ bool MvfstServer::start()
   _handler = std::make_unique<CallbackHandler>();
   _handler->set_udp_socket(_udp_socket);
   _handler->datagrams = _datagrams;
+  _handler->framed_streams = _framed;
 
   _udp_socket->set_callback(_handler.get());
 
@@ -211,7 +220,10 @@ bool MvfstServer::start()
 
   _server->setCongestionControllerFactory(std::make_shared<quic::ServerCongestionControllerFactory>());
   _server->setTransportSettings(std::move(settings));  
-  _server->start(addr, 0);
+
+  // mvfst runs one event base per worker, one per core for 0, and routes the packets of a
+  // connection to its worker from the worker id encoded in the connection ID
+  _server->start(addr, _workers);
 
   return true;
 }
@@ -236,6 +248,18 @@ bool MvfstServer::set_datagrams(bool enable)
   return true;
 }
 
+bool MvfstServer::set_framed_streams(bool enable)
+{
+  _framed = enable;
+  return true;
+}
+
+bool MvfstServer::set_workers(unsigned workers)
+{
+  _workers = workers;
+  return true;
+}
+
 bool MvfstServer::set_cc(std::string_view cc) noexcept
 {
   if(cc == "newreno")    _cc = static_cast<uint8_t>(quic::CongestionControlType::NewReno);
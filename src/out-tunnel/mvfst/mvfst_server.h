@@ -31,6 +31,8 @@ class MvfstServer : public QuicServer
 
   std::string _qlog_file;
   bool        _datagrams;
+  bool        _framed;
+  unsigned    _workers;
   
 public:
   static constexpr const char * DEFAULT_QLOG_PATH = "tunnel-out-logs";
@@ -48,6 +50,8 @@ public:
   std::string_view get_qlog_path() const noexcept override;
   std::string_view get_qlog_filename() const noexcept override;
   bool set_datagrams(bool enable);
+  bool set_framed_streams(bool enable) override;
+  bool set_workers(unsigned workers) override;
   
   bool set_cc(std::string_view cc) noexcept override;
   void stop() override;
@@ -7,8 +7,10 @@
 
 #include "outtunnel.h"
 #include "quic_server.h"
+#include "traffic_stats.h"
 
-std::unordered_map<int, std::shared_ptr<OutTunnel>> OutTunnel::sessions;
+SessionRegistry<OutTunnel> OutTunnel::sessions(OutTunnel::MAX_NUMBER_SESSION);
+std::atomic<int> OutTunnel::_own_port_sessions{0};
 
 // Random Number generation ///////////////////////////////////////////////////
 
@@ -19,14 +21,8 @@ static RandomGenerator random_sequence()
   std::default_random_engine dre(r());
   std::uniform_int_distribution<int> uniform_dist(0, OutTunnel::MAX_NUMBER_SESSION - 1);
 
-  for(;;) {
-    if(OutTunnel::sessions.size() == OutTunnel::MAX_NUMBER_SESSION)
-      co_yield -1;
-    
-    int id = uniform_dist(dre);
-    if(OutTunnel::sessions.contains(id))
-      co_yield id;
-  }
+  // The registry draws the ids until a free one, under its lock
+  for(;;) co_yield uniform_dist(dre);
 }
 
 RandomGenerator OutTunnel::_random_generator = random_sequence();
@@ -39,10 +35,13 @@ OutTunnel::OutTunnel(int id,
 		     uint16_t server_port,
 		     uint16_t out_port)
   : _id{id},
+    _impl{impl},
     _out_port{out_port},
     _udp_socket(server_addr.data(), out_port),
     _quic_server(nullptr),
-    _external_file_transfer(false)
+    _external_file_transfer(false),
+    _datagrams(false),
+    _framed(false)
 {
   using namespace std::string_view_literals;
   
@@ -62,10 +61,13 @@ OutTunnel::OutTunnel(int id,
   else if(impl == "udp"sv)    builder.impl = QuicServerBuilder::QuicImplementation::UDP;
 
   _quic_server = builder.create();
+  _udp_socket.set_latency(&_latency);
 }
 
 OutTunnel::~OutTunnel() noexcept
-{}
+{
+  if(_own_port) _own_port_sessions.fetch_sub(1, std::memory_order_relaxed);
+}
 
 int run_tcpdump(const char* if_env_name, const char* file_name)
 {
@@ -76,7 +78,7 @@ int run_tcpdump(const char* if_env_name, const char* file_name)
     // return if parent process
     if(pid != 0) return pid;
     
-    fmt::print("Starting tcpdump for quic output\n");
+    fmt::print("Starting tcpdump for {}\n", file_name);
 
     int fd[2]; // pipe file descriptor. 0: rx 1: tx
 
@@ -123,17 +125,29 @@ bool OutTunnel::start()
 
 void OutTunnel::run()
 {
-  int quic_pid = run_tcpdump("IFQUIC", "quic.csv");
-  if(quic_pid == 0) return;
-
+  // The file transfer does not go through the tunnel, only a capture can see it
   int file_pid = -1;
   if(_external_file_transfer) {
     file_pid = run_tcpdump("IFSCP", "file.csv");
     if(file_pid == 0) return;
   }
+
+  // The quic libraries owning their socket are only seen by a capture, the rate of the tunneled
+  // packets is then written aside so it is not mistaken for the quic one
+  const TrafficCounters * wire = _quic_server->wire_traffic();
+  int quic_pid = -1;
+  if(!wire) {
+    quic_pid = run_tcpdump("IFQUIC", "quic.csv");
+    if(quic_pid == 0) return;
+  }
+
+  TrafficSampler sampler(wire ? wire : &_udp_socket.traffic(), wire ? "quic.csv" : "tunnel.csv");
+  sampler.start();
   
   _quic_server->loop();
 
+  sampler.stop();
+  
   if(quic_pid > 0) kill(quic_pid, SIGTERM);
   if(file_pid > 0) kill(file_pid, SIGTERM);
 }
@@ -141,6 +155,8 @@ void OutTunnel::run()
 void OutTunnel::stop()
 {
   _quic_server->stop();
+
+  _latency.dump("latency.csv", fmt::format("{},{}", _impl, mode()));
 }
 
 std::string OutTunnel::get_qlog_file()
@@ -151,6 +167,18 @@ std::string OutTunnel::get_qlog_file()
   return oss.str();
 }
 
+void OutTunnel::collect_metrics(metrics::Writer& w) const
+{
+  w.set_labels(fmt::format("tunnel=\"{}\",side=\"out\",impl=\"{}\"", _id, _impl));
+
+  _udp_socket.collect_metrics(w);
+  if(auto * wire = _quic_server->wire_traffic()) wire->collect(w, "quic");
+  _quic_server->collect_metrics(w);
+
+  w.set_labels(fmt::format("{},mode=\"{}\"", w.labels(), mode()));
+  _latency.collect(w);
+}
+
 void OutTunnel::set_cc(std::string_view cc)
 {
   fmt::print("Set {} congestion controller\n", cc);
@@ -158,10 +186,30 @@ void OutTunnel::set_cc(std::string_view cc)
   _quic_server->set_cc(cc);
 }
 
+void OutTunnel::set_workers(unsigned workers)
+{
+  fmt::print("Set {} workers\n", workers);
+  
+  if(!_quic_server->set_workers(workers)) {
+    fmt::print("Workers are not supported by this implementation, using one\n");
+  }
+}
+
 void OutTunnel::set_datagrams(bool enable)
 {
   fmt::print("Set datagrams : {}\n", enable);
   _quic_server->set_datagrams(enable);
+  _datagrams = enable;
+}
+
+void OutTunnel::set_framed_streams(bool enable)
+{
+  fmt::print("Set framed streams : {}\n", enable);
+  
+  if(!_quic_server->set_framed_streams(enable)) {
+    fmt::print("Framed streams are not supported by this implementation\n");
+  }
+  else _framed = enable;
 }
 
 std::shared_ptr<OutTunnel> OutTunnel::create(std::string_view impl,
@@ -169,12 +217,27 @@ std::shared_ptr<OutTunnel> OutTunnel::create(std::string_view impl,
 					     uint16_t server_port,
 					     uint16_t out_port)
 {
-  auto id     = _random_generator();
-  if(id == -1) return nullptr;
+  using namespace std::string_view_literals;
+
+  // Only quiche shares a listener between sessions, the other backends keep the former limit
+  bool own_port = impl != "quiche"sv;
+  if(own_port) {
+    int count = _own_port_sessions.load(std::memory_order_relaxed);
+    do {
+      if(count >= MAX_OWN_PORT_SESSION) return nullptr;
+    } while(!_own_port_sessions.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+  }
+  
+  auto id     = sessions.reserve(_random_generator);
+  if(id == -1) {
+    if(own_port) _own_port_sessions.fetch_sub(1, std::memory_order_relaxed);
+    return nullptr;
+  }
   
   auto server = std::make_shared<OutTunnel>(id, impl, server_addr, server_port, out_port);
+  server->_own_port = own_port;
 
-  sessions[id] = server;
+  sessions.insert(id, server);
   
   return server;
 }
@@ -5,27 +5,38 @@
 #include <unordered_map>
 #include <memory>
 #include <vector>
+#include <atomic>
 
 #include "out-tunnel/udp_socket.h"
 #include "random_generator.h"
+#include "session_registry.h"
 #include "capabilities.h"
+#include "metrics.h"
+#include "latency_histogram.h"
 
 class QuicServer;
 
 class OutTunnel
 {
   int _id;
+  std::string _impl;
   int _out_port;
+  LatencyHistogram _latency; // Of this tunnel only, so each experiment starts from an empty one
   out::UdpSocket _udp_socket;
   std::unique_ptr<QuicServer> _quic_server;
   bool _external_file_transfer;
+  bool _datagrams;
+  bool _framed;
+  bool _own_port = false; // Counted in _own_port_sessions, set by create
 
   static RandomGenerator _random_generator;
+  static std::atomic<int> _own_port_sessions;
 public:
 
-  static constexpr auto MAX_NUMBER_SESSION = 5;
+  static constexpr auto MAX_NUMBER_SESSION = 1024; // Quiche sessions on the same port share one listener
+  static constexpr auto MAX_OWN_PORT_SESSION = 5; // Sessions of the other backends, binding a port each
   
-  static std::unordered_map<int, std::shared_ptr<OutTunnel>> sessions;
+  static SessionRegistry<OutTunnel> sessions;
 
   OutTunnel(int id, std::string_view impl, std::string_view server_addr, uint16_t server_port, uint16_t out_port);
   ~OutTunnel() noexcept;
@@ -35,13 +46,20 @@ public:
 
   bool start();
   void set_datagrams(bool enable);
+  void set_framed_streams(bool enable);
   void run();
   void stop();
 
   void set_cc(std::string_view cc);
+  void set_workers(unsigned workers);
   void set_external_file_transfer(bool enable) noexcept { _external_file_transfer = enable; }
+  /** @brief How the packets cross the tunnel, "datagram", "framed" or "stream" */
+  std::string_view mode() const noexcept { return _datagrams ? "datagram" : (_framed ? "framed" : "stream"); }
   std::string get_qlog_file();
 
+  /** @brief Any thread. Traffic of the sockets and metrics of the quic server, labelled with the tunnel */
+  void collect_metrics(metrics::Writer& w) const;
+
   static std::shared_ptr<OutTunnel> create(std::string_view impl,
 					   std::string_view server_addr,
 					   uint16_t server_port,
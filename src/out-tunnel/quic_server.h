@@ -7,6 +7,7 @@
 
 #include "capabilities.h"
 #include "udp_socket.h"
+#include "traffic_stats.h"
 
 /**
  * @brief Interface for a quic server implementation
@@ -61,12 +62,39 @@ public:
    */
   virtual bool set_datagrams(bool enable) = 0;
 
+  /**
+   * @brief Send and receive the stream packets length prefixed on one long lived stream,
+   * instead of a stream per packet. Must match the client setting
+   * @param enable True for the framed mode, false for a stream per packet
+   * @return false if not supported, true otherwise.
+   */
+  virtual bool set_framed_streams(bool enable) { return !enable; }
+
   /**
    * @brief Set the congestion control algorithm to use
    * @param cc The congestion control name.
    * @return false if not supported or an error occured, true otherwise.
    */
   virtual bool set_cc(std::string_view cc) noexcept = 0;  
+
+  /**
+   * @brief Set the number of worker threads, each with its own socket and event loop
+   * @param workers The number of workers. 0 for the implementation default
+   * @return false if not supported, true otherwise.
+   */
+  virtual bool set_workers(unsigned workers) { return workers <= 1; }
+
+  /**
+   * @brief Counters of the packets sent and received on the quic socket, headers included
+   * @return nullptr if the socket belongs to the quic library and can not be counted
+   */
+  virtual const TrafficCounters * wire_traffic() const noexcept { return nullptr; }
+
+  /**
+   * @brief Any thread. Write the transport metrics the implementation knows about:
+   * congestion window, RTT, queue depths, drops...
+   */
+  virtual void collect_metrics(metrics::Writer&) const {}
 };
 
 /**
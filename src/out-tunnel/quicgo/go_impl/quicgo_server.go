@@ -11,6 +11,7 @@ import (
 	"fmt"
 	"unsafe"
 	"context"
+	"encoding/binary"
 	"crypto/rand"
 	"crypto/rsa"
 	"crypto/tls"
@@ -27,11 +28,6 @@ import (
 	"github.com/lucas-clemente/quic-go/qlog"
 )
 
-type datagram struct {
-	flowID uint64
-	data   []byte
-}
-
 type Session struct {
 	sess quic.Connection
 	wrapper *C.wrapper_t
@@ -118,12 +114,64 @@ func GetQLOGWriter(qlogDir string, wrapper *C.wrapper_t) (func(perspective loggi
 	}, nil
 }
 
-func sendDatagram(d *datagram) error {
-	return quicSession.sess.SendMessage(d.data)
+// The flow ID, sequence number and timestamp are in the tunnel header at the start of data,
+// written by the UDP sockets, so datagrams and streams carry them the same way
+func sendDatagram(data []byte) error {
+	return quicSession.sess.SendMessage(data)
 }
 
 const streamDataPacketLength = 2048
 
+// Framed mode : packets are sent length prefixed (16 bits big endian) on one long lived stream
+var framedStreams = false
+var framedStream quic.SendStream
+
+func sendFramed(data []byte) {
+	if framedStream == nil {
+		stream, err := quicSession.sess.OpenUniStream()
+		if err != nil {
+			print(err)
+			return
+		}
+		framedStream = stream
+	}
+
+	frame := make([]byte, 2 + len(data))
+	binary.BigEndian.PutUint16(frame, uint16(len(data)))
+	copy(frame[2:], data)
+
+	if _, err := framedStream.Write(frame); err != nil {
+		// The peer drops its partial packet, a new stream is opened on the next packet
+		fmt.Println("Framed stream write failed", err)
+		framedStream.CancelWrite(0)
+		framedStream = nil
+	}
+}
+
+func readFramed(stream quic.ReceiveStream, wrapper *C.wrapper_t) {
+	header := make([]byte, 2)
+	buffer := make([]byte, 0xffff)
+
+	for {
+		if _, err := io.ReadFull(stream, header); err != nil {
+			return
+		}
+
+		n := int(binary.BigEndian.Uint16(header))
+		if _, err := io.ReadFull(stream, buffer[:n]); err != nil {
+			return
+		}
+
+		// Copied by the callback, no need for a C string
+		C.on_message_received(wrapper, (*C.char)(unsafe.Pointer(&buffer[0])), C.int(n))
+	}
+}
+
+//export goServerSetFramedStreams
+func goServerSetFramedStreams(enable bool) {
+	framedStreams = enable
+}
+
 //export goServerStart
 func goServerStart(addr *C.char, datagrams bool, qlogDir *C.char, wrapper *C.wrapper_t) {
 	fmt.Println("Starting quic go server ")
@@ -162,6 +210,11 @@ func goServerStart(addr *C.char, datagrams bool, qlogDir *C.char, wrapper *C.wra
 				}
 			}
 
+			if framedStreams {
+				readFramed(stream, wrapper)
+				continue
+			}
+
 			buffer := make([]byte, streamDataPacketLength)
 			for {				
 				n, err := stream.Read(buffer)
@@ -204,6 +257,7 @@ func goServerStop() {
 		if quicSession.sess != nil {
 			quicSession.sess.CloseWithError(0, "normal shutdown")
 			quicSession.sess = nil
+			framedStream = nil
 			quicSession = nil
 		}
 	}
@@ -217,6 +271,11 @@ func goServerSendMessageStream(buf *C.char, len uint64) {
 	if quicSession.sess == nil {
 		return;
 	}
+
+	if framedStreams {
+		sendFramed(C.GoBytes(unsafe.Pointer(buf), C.int(len)))
+		return
+	}
 	
 	stream, err := quicSession.sess.OpenUniStream();
 	if err != nil {
@@ -232,7 +291,7 @@ func goServerSendMessageStream(buf *C.char, len uint64) {
 func goServerSendMessageDatagram(buf *C.char, len uint64) {
 	if len <= 1200 {
 		bufGo:= C.GoBytes(unsafe.Pointer(buf), C.int(len))
-		sendDatagram(&datagram{0, bufGo})
+		sendDatagram(bufGo)
 	} else {
 		goServerSendMessageStream(buf, len)
 	}
@@ -9,6 +9,7 @@ Capabilities QuicGoServer::get_capabilities()
   cap.impl = IMPL_NAME;
   cap.cc.emplace_back("newreno");
   cap.datagrams = true;
+  cap.framed_streams = true;
 
   return cap;
 }
@@ -62,6 +63,12 @@ bool QuicGoServer::set_datagrams(bool enable)
   return true;
 }
 
+bool QuicGoServer::set_framed_streams(bool enable)
+{
+  goServerSetFramedStreams(enable);
+  return true;
+}
+
 bool QuicGoServer::set_cc(std::string_view cc) noexcept
 {
   return true;
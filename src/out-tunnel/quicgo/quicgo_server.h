@@ -33,6 +33,7 @@ public:
   std::string_view get_qlog_path() const noexcept override;
   std::string_view get_qlog_filename() const noexcept override;
   bool set_datagrams(bool enable) override;
+  bool set_framed_streams(bool enable) override;
   // only newreno for quic go
   bool set_cc(std::string_view cc) noexcept override;
 
@@ -8,6 +8,7 @@
 #include <span>
 #include <algorithm>
 #include <mutex>
+#include <new>
 
 #include <unistd.h>
 
@@ -16,14 +17,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <linux/filter.h>
 #include <ev.h>
 #include <cinttypes>
 
+#include "udp_gso.h"
+
 constexpr size_t LOCAL_CONN_ID_LEN = 16;
 constexpr size_t MAX_DATAGRAM_SIZE = 2500;
 
-std::mutex server_flush_mutex;
-
 #define MAX_TOKEN_LEN \
     sizeof("quiche") - 1 + \
     sizeof(struct sockaddr_storage) + \
@@ -71,6 +74,11 @@ struct conn_io
 
   struct sockaddr_storage peer_addr;
   socklen_t               peer_addr_len;
+
+  bool gso; // Send with UDP_SEGMENT
+  udp::GsoBatch batch; // Egress packets of this connection
+
+  TrafficCounters * wire; // Of the session
 };
 
 struct timeout_cb_data
@@ -81,31 +89,34 @@ struct timeout_cb_data
   
 static void flush_egress(struct ev_loop *loop, struct conn_io *conn_io)
 {  
-  static uint8_t out[65535];
+  auto& batch = conn_io->batch;
 
   quiche_send_info send_info;
+  uint64_t bytes = 0, packets = 0;
 
   while (1) {
-    std::lock_guard<std::mutex> lock(server_flush_mutex);
-    ssize_t written = quiche_conn_send(conn_io->conn, out, sizeof(out), &send_info);
+    ssize_t written = quiche_conn_send(conn_io->conn, batch.tail(), batch.room(), &send_info);
 
     if (written == QUICHE_ERR_DONE) break;
     
     if (written < 0) {
       fprintf(stderr, "failed to create packet: %zd\n", written);
-      return;
+      break;
     }
 
-    ssize_t sent = sendto(conn_io->sock, out, written, 0,
-			  (struct sockaddr *) &send_info.to,
-			  send_info.to_len);
+    bytes += written;
+    ++packets;
 
-    if (sent != written) {
-      perror("failed to send");
-      return;
+    // Equal sized packets are sent together when GSO is enabled
+    if (!batch.push(conn_io->sock, conn_io->gso, written,
+		    (struct sockaddr *) &send_info.to, send_info.to_len)) {
+      break;
     }
   }
 
+  batch.flush(conn_io->sock, conn_io->gso);
+  if (packets > 0) conn_io->wire->on_tx(bytes, packets);
+
   double t = quiche_conn_timeout_as_nanos(conn_io->conn) / 1e9f;
   conn_io->timer.repeat = t;
   ev_timer_again(loop, &conn_io->timer);
@@ -178,7 +189,7 @@ static struct conn_io *create_conn(uint8_t *scid, size_t scid_len,
 				   socklen_t peer_addr_len,
 				   QuicheServer * server)
 {
-  struct conn_io *conn_io = (struct conn_io*)calloc(1, sizeof(*conn_io));
+  struct conn_io *conn_io = new (std::nothrow) (struct conn_io)();
   if (conn_io == NULL) {
     fprintf(stderr, "failed to allocate connection IO\n");
     return NULL;
@@ -200,6 +211,7 @@ static struct conn_io *create_conn(uint8_t *scid, size_t scid_len,
 
   if (conn == NULL) {
     fprintf(stderr, "failed to create connection\n");
+    delete conn_io;
     return NULL;
   }
 
@@ -217,8 +229,10 @@ static struct conn_io *create_conn(uint8_t *scid, size_t scid_len,
   
   server->set_conn(conn);
   
-  conn_io->sock = server->get_sock();
+  conn_io->sock = server->worker()->get_sock();
   conn_io->conn = conn;
+  conn_io->gso  = server->worker()->gso();
+  conn_io->wire = &server->wire();
 
   memcpy(&conn_io->peer_addr, peer_addr, peer_addr_len);
   conn_io->peer_addr_len = peer_addr_len;
@@ -236,144 +250,179 @@ static struct conn_io *create_conn(uint8_t *scid, size_t scid_len,
   return conn_io;
 }
 
-static void recv_cb(EV_P_ ev_io *w, int revents)
+static QuicheServer * recv_packet(QuicheWorker * worker, uint8_t * buf, size_t read,
+				  struct sockaddr_storage * peer_addr, socklen_t peer_addr_len)
 {
-  struct conn_io *tmp, *conn_io = NULL;
-
-  static uint8_t buf[65535];
-  static uint8_t out[65535];
-
-  QuicheServer* server = reinterpret_cast<QuicheServer*>(w->data);
+  uint8_t * out = worker->out_buffer();
   
-  while (1) {
-    struct sockaddr_storage peer_addr;
-    socklen_t peer_addr_len = sizeof(peer_addr);
-    memset(&peer_addr, 0, peer_addr_len);
+  QuicheServer * server = NULL;
 
-    ssize_t read = recvfrom(server->get_sock(), buf, sizeof(buf), 0,
-			    (struct sockaddr *) &peer_addr,
-			    &peer_addr_len);
+  uint8_t type;
+  uint32_t version;
 
-    if (read < 0) {
-      if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) break; 
-      perror("failed to read");
-      return;
-    }
+  uint8_t scid[QUICHE_MAX_CONN_ID_LEN];
+  size_t scid_len = sizeof(scid);
 
-    uint8_t type;
-    uint32_t version;
+  uint8_t dcid[QUICHE_MAX_CONN_ID_LEN];
+  size_t dcid_len = sizeof(dcid);
 
-    uint8_t scid[QUICHE_MAX_CONN_ID_LEN];
-    size_t scid_len = sizeof(scid);
+  uint8_t odcid[QUICHE_MAX_CONN_ID_LEN];
+  size_t odcid_len = sizeof(odcid);
 
-    uint8_t dcid[QUICHE_MAX_CONN_ID_LEN];
-    size_t dcid_len = sizeof(dcid);
+  uint8_t token[MAX_TOKEN_LEN];
+  size_t token_len = sizeof(token);
+
+  int rc = quiche_header_info(buf, read, LOCAL_CONN_ID_LEN, &version,
+			      &type, scid, &scid_len, dcid, &dcid_len,
+			      token, &token_len);
+  if (rc < 0) {
+    fprintf(stderr, "failed to parse header: %d\n", rc);
+    return NULL;
+  }
 
-    uint8_t odcid[QUICHE_MAX_CONN_ID_LEN];
-    size_t odcid_len = sizeof(odcid);
+  server = worker->find(dcid, dcid_len);
 
-    uint8_t token[MAX_TOKEN_LEN];
-    size_t token_len = sizeof(token);
+  if (server == NULL) {
+    // Short header packet of a connection that is gone
+    if ((buf[0] & 0x80) == 0) return NULL;
+    
+    if (!quiche_version_is_supported(version)) {
 
-    int rc = quiche_header_info(buf, read, LOCAL_CONN_ID_LEN, &version,
-				&type, scid, &scid_len, dcid, &dcid_len,
-				token, &token_len);
-    if (rc < 0) {
-      fprintf(stderr, "failed to parse header: %d\n", rc);
-      continue;
-    }
+      ssize_t written = quiche_negotiate_version(scid, scid_len,
+						 dcid, dcid_len,
+						 out, worker->buffer_size());
 
-    conn_io = server->conn_io;
+      if (written < 0) {
+	fprintf(stderr, "failed to create vneg packet: %zd\n", written);
+	return NULL;
+      }
 
-    if (conn_io == NULL) {
-      if (!quiche_version_is_supported(version)) {
-
-	ssize_t written = quiche_negotiate_version(scid, scid_len,
-						   dcid, dcid_len,
-						   out, sizeof(out));
-
-	if (written < 0) {
-	  fprintf(stderr, "failed to create vneg packet: %zd\n", written);
-	  continue;
-	}
-
-	ssize_t sent = sendto(server->get_sock(), out, written, 0,
-			      (struct sockaddr *) &peer_addr,
-			      peer_addr_len);
-	if (sent != written) {
-	  perror("failed to send");
-	  continue;
-	}
-
-	continue;
+      ssize_t sent = sendto(worker->get_sock(), out, written, 0,
+			    (struct sockaddr *) peer_addr,
+			    peer_addr_len);
+      if (sent != written) {
+	perror("failed to send");
       }
 
-      if (token_len == 0) {
-	fprintf(stderr, "stateless retry\n");
+      return NULL;
+    }
 
-	mint_token(dcid, dcid_len, &peer_addr, peer_addr_len,
-		   token, &token_len);
+    if (token_len == 0) {
+      fprintf(stderr, "stateless retry\n");
 
-	uint8_t new_cid[LOCAL_CONN_ID_LEN];
+      mint_token(dcid, dcid_len, peer_addr, peer_addr_len,
+		 token, &token_len);
 
-	if (gen_cid(new_cid, LOCAL_CONN_ID_LEN) == NULL) {
-	  continue;
-	}
+      uint8_t new_cid[LOCAL_CONN_ID_LEN];
 
-	ssize_t written = quiche_retry(scid, scid_len,
-				       dcid, dcid_len,
-				       new_cid, LOCAL_CONN_ID_LEN,
-				       token, token_len,
-				       version, out, sizeof(out));
+      if (gen_cid(new_cid, LOCAL_CONN_ID_LEN) == NULL) {
+	return NULL;
+      }
 
-	if (written < 0) {
-	  fprintf(stderr, "failed to create retry packet: %zd\n", written);
-	  continue;
-	}
+      // The reuseport steering program sends the packets of this connection to this worker
+      new_cid[0] = worker->index();
 
-	ssize_t sent = sendto(server->get_sock(), out, written, 0,
-			      (struct sockaddr *) &peer_addr,
-			      peer_addr_len);
-	if (sent != written) {
-	  perror("failed to send");
-	  continue;
-	}
+      ssize_t written = quiche_retry(scid, scid_len,
+				     dcid, dcid_len,
+				     new_cid, LOCAL_CONN_ID_LEN,
+				     token, token_len,
+				     version, out, worker->buffer_size());
 
-	continue;
+      if (written < 0) {
+	fprintf(stderr, "failed to create retry packet: %zd\n", written);
+	return NULL;
       }
 
-
-      if (!validate_token(token, token_len, &peer_addr, peer_addr_len,
-			  odcid, &odcid_len)) {
-	fprintf(stderr, "invalid address validation token\n");
-	continue;
+      ssize_t sent = sendto(worker->get_sock(), out, written, 0,
+			    (struct sockaddr *) peer_addr,
+			    peer_addr_len);
+      if (sent != written) {
+	perror("failed to send");
       }
 
-      conn_io = create_conn(dcid, dcid_len, odcid, odcid_len,
-			    server->get_local_addr(), server->get_local_addr_len(),
-			    &peer_addr, peer_addr_len, server);
+      return NULL;
+    }
 
-      if (conn_io == NULL) continue;
-      
+
+    if (!validate_token(token, token_len, peer_addr, peer_addr_len,
+			odcid, &odcid_len)) {
+      fprintf(stderr, "invalid address validation token\n");
+      return NULL;
     }
 
-    quiche_recv_info recv_info = {
-      (struct sockaddr *)&peer_addr,
-      peer_addr_len,
+    server = worker->listener()->take_pending(worker);
+    if (server == NULL) {
+      fprintf(stderr, "no tunnel waiting for a connection\n");
+      return NULL;
+    }
+
+    auto * conn_io = create_conn(dcid, dcid_len, odcid, odcid_len,
+				 worker->get_local_addr(), worker->get_local_addr_len(),
+				 peer_addr, peer_addr_len, server);
+
+    if (conn_io == NULL) {
+      worker->listener()->give_back(server);
+      return NULL;
+    }
+
+    worker->accept(server, dcid, dcid_len);
+  }
+
+  quiche_recv_info recv_info = {
+    (struct sockaddr *)peer_addr,
+    peer_addr_len,
+
+    worker->get_local_addr(),
+    worker->get_local_addr_len(),
+  };
+
+  ssize_t done = quiche_conn_recv(server->get_conn(), buf, read, &recv_info);
+
+  if (done < 0) {
+    fmt::print("Failed to process packet: {} {}\n", done, get_quiche_error(done));
+  }
+  else server->wire().on_rx(read);
+
+  return server;
+}
+
+static void recv_cb(EV_P_ ev_io *w, int revents)
+{
+  QuicheWorker* worker = reinterpret_cast<QuicheWorker*>(w->data);
 
-      server->get_local_addr(),
-      server->get_local_addr_len(),
-    };
+  uint8_t * buf = worker->recv_buffer();
+  size_t buf_len = worker->buffer_size();
 
-    ssize_t done;
-    {
-      std::lock_guard<std::mutex> lock(server_flush_mutex);
-      done = quiche_conn_recv(server->get_conn(), buf, read, &recv_info);
+  // Sessions which received packets during this read burst
+  std::vector<QuicheServer*> sessions;
+  
+  while (1) {
+    struct sockaddr_storage peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    memset(&peer_addr, 0, peer_addr_len);
+
+    size_t segment;
+    ssize_t read = udp::recv_gro(worker->get_sock(), buf, buf_len,
+				 &peer_addr, &peer_addr_len, &segment);
+
+    if (read < 0) {
+      if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) break; 
+      perror("failed to read");
+      break;
     }
 
-    if (done < 0) {
-      fmt::print("Failed to process packet: {} {}\n", done, get_quiche_error(done));
-      continue;
+    QuicheServer * server = NULL;
+    
+    // With GRO, one read may hold several packets of segment bytes, all from the same peer
+    for(size_t off = 0; off < (size_t)read; off += segment) {
+      auto len = std::min(segment, (size_t)read - off);
+      if(auto s = recv_packet(worker, buf + off, len, &peer_addr, peer_addr_len)) server = s;
+    }
+
+    if (server == NULL) continue;
+
+    if (std::find(sessions.begin(), sessions.end(), server) == sessions.end()) {
+      sessions.push_back(server);
     }
 
     if (quiche_conn_is_established(server->get_conn())) {
@@ -382,31 +431,37 @@ static void recv_cb(EV_P_ ev_io *w, int revents)
       quiche_stream_iter *readable = quiche_conn_readable(server->get_conn());
 
       while (quiche_stream_iter_next(readable, &s)) {
-	std::lock_guard<std::mutex> lock(server_flush_mutex);
-	
 	bool fin = false;
 	ssize_t recv_len = quiche_conn_stream_recv(server->get_conn(), s,
-						   buf, sizeof(buf),
+						   buf, buf_len,
 						   &fin);
 
 	if (recv_len < 0) break;
 	
-	server->on_recv(buf, recv_len);
+	server->on_recv_stream(buf, recv_len);
       }
 
       quiche_stream_iter_free(readable);
 
-      if(auto dgram_len = quiche_conn_dgram_recv(server->get_conn(), buf, sizeof(buf)); dgram_len >= 0) {
+      // Acks may have opened the stream window
+      server->resume_framed();
+
+      ssize_t dgram_len;
+      while((dgram_len = quiche_conn_dgram_recv(server->get_conn(), buf, buf_len)) >= 0) {
 	server->on_recv(buf, dgram_len);
       }
     }
   }
 
-  if(conn_io) {
-    flush_egress(loop, conn_io);
+  for(auto * server : sessions) {
+    // Send everything decapsulated during this read burst at once
+    server->flush_recv();
+
+    flush_egress(loop, server->conn_io);
+    server->update_transport_stats();
 
-    if (quiche_conn_is_closed(conn_io->conn)) {
-      ev_timer_stop(loop, &conn_io->timer);
+    if (quiche_conn_is_closed(server->get_conn())) {
+      ev_timer_stop(loop, &server->conn_io->timer);
     }
   }
 }
@@ -415,17 +470,15 @@ static void timeout_cb(EV_P_ ev_timer *w, int revents)
 {
   struct timeout_cb_data *data = reinterpret_cast<struct timeout_cb_data*>(w->data);
 
-  {
-    std::lock_guard<std::mutex> lock(server_flush_mutex);
-    quiche_conn_on_timeout(data->conn_io->conn);
+  quiche_conn_on_timeout(data->conn_io->conn);
 
-    if (quiche_conn_is_closed(data->conn_io->conn)) {
-      ev_timer_stop(loop, &data->conn_io->timer);
-      return;
-    }
+  if (quiche_conn_is_closed(data->conn_io->conn)) {
+    ev_timer_stop(loop, &data->conn_io->timer);
+    return;
   }
 
   flush_egress(loop, data->conn_io);
+  data->server->update_transport_stats();
 }
 
 static void debug_log(const char *line, void *argp)
@@ -434,16 +487,354 @@ static void debug_log(const char *line, void *argp)
   fmt::print(debug_file, "{}\n", line);
 }
 
-static void async_callback(EV_P_ ev_async*, int)
+static void stop_callback(EV_P_ ev_async * w, int)
 {
+  QuicheWorker* worker = reinterpret_cast<QuicheWorker*>(w->data);
+  worker->stop_timers();
+
   fmt::print("break loop\n");
   ev_break(EV_A_ EVBREAK_ONE);
 }
 
+static void udp_callback(EV_P_ ev_async * w, int)
+{
+  QuicheWorker* worker = reinterpret_cast<QuicheWorker*>(w->data);
+  worker->drain_udp();
+}
+
+static void ctl_callback(EV_P_ ev_async * w, int)
+{
+  QuicheWorker* worker = reinterpret_cast<QuicheWorker*>(w->data);
+  worker->update_sessions();
+}
+
+}
+
+// QuicheWorker ///////////////////////////////////////////////////////////////
+
+QuicheWorker::QuicheWorker(QuicheListener * listener, uint16_t port, unsigned index, unsigned nb_workers)
+  : _listener(listener), _port(port), _index(index), _nb_workers(nb_workers)
+{}
+
+QuicheWorker::~QuicheWorker()
+{
+  if(_loop) {
+    fmt::print("Closing quiche worker {} on port {}\n", _index, _port);
+    
+    ev_async_send(_loop, _stop_watcher.get());
+    if(_thread.joinable()) _thread.join();
+    
+    ev_loop_destroy(_loop);
+    _loop = nullptr;
+  }
+
+  if(_socket != -1) {
+    fmt::print("Closing quiche socket\n");
+    close(_socket);
+    _socket = -1;
+  }
+}
+
+bool QuicheWorker::init_socket()
+{
+  _local_len = sizeof(_local);
+
+  _local.sin_family = AF_INET;
+  _local.sin_port = htons(_port);
+  _local.sin_addr.s_addr = htonl(INADDR_ANY);
+  
+  _socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if(_socket < 0) {
+    perror("Quicheserver could not create socket");
+    return false;
+  }
+
+  if(fcntl(_socket, F_SETFL, O_NONBLOCK) < 0) {
+    perror("Quicheserver could not set unblokcing");
+    return false;
+  }
+
+  if(_nb_workers > 1) {
+    int one = 1;
+    if(setsockopt(_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+      perror("Quicheserver could not set SO_REUSEPORT");
+      return false;
+    }
+  }
+
+  _gso = udp::enable_gso(_socket);
+  _gro = udp::enable_gro(_socket);
+  fmt::print("GSO {}, GRO {}\n", _gso, _gro);
+  
+  fmt::print("Trying to bind {} {}\n", _port, _local_len);
+  
+  if(bind(_socket, (struct sockaddr*)&_local, _local_len) < 0) {
+    perror("Quicheserver could not bind socket");
+    return false;
+  }
+
+  return true;
+}
+
+bool QuicheWorker::start()
+{
+  if(!init_socket()) return false;
+
+  // Own loop rather than the default one, workers and listeners can run side by side
+  _loop = ev_loop_new(EVFLAG_AUTO);
+  if(!_loop) {
+    fmt::print("Quicheserver could not create ev loop\n");
+    return false;
+  }
+
+  _io_watcher = std::make_unique<struct ev_io>();
+  ev_io_init(_io_watcher.get(), recv_cb, _socket, EV_READ);
+  _io_watcher->data = (void*)this;
+  ev_io_start(_loop, _io_watcher.get());
+  
+  _stop_watcher = std::make_unique<struct ev_async>();
+  ev_async_init(_stop_watcher.get(), stop_callback);
+  _stop_watcher->data = (void*)this;
+  ev_async_start(_loop, _stop_watcher.get());
+
+  _udp_watcher = std::make_unique<struct ev_async>();
+  ev_async_init(_udp_watcher.get(), udp_callback);
+  _udp_watcher->data = (void*)this;
+  ev_async_start(_loop, _udp_watcher.get());
+
+  _ctl_watcher = std::make_unique<struct ev_async>();
+  ev_async_init(_ctl_watcher.get(), ctl_callback);
+  _ctl_watcher->data = (void*)this;
+  ev_async_start(_loop, _ctl_watcher.get());
+
+  _thread = std::thread([this]() {
+    if(_nb_workers > 1) {
+      // One core per worker
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(_index % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+
+      if(int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus); err != 0) {
+	fmt::print("Could not pin quiche worker {} : {}\n", _index, strerror(err));
+      }
+    }
+    
+    ev_run(_loop, 0);
+  });
+  
+  return true;
+}
+
+void QuicheWorker::remove(QuicheServer * session)
+{
+  std::unique_lock<std::mutex> lock(_ctl_mutex);
+  _to_remove.push_back(session);
+  
+  ev_async_send(_loop, _ctl_watcher.get());
+
+  _ctl_cv.wait(lock, [this, session]() {
+    return std::find(_to_remove.begin(), _to_remove.end(), session) == _to_remove.end();
+  });
+}
+
+void QuicheWorker::update_sessions()
+{
+  std::vector<QuicheServer*> to_remove;
+
+  {
+    std::lock_guard<std::mutex> lock(_ctl_mutex);
+    to_remove = _to_remove;
+  }
+
+  if(to_remove.empty()) return;
+
+  for(auto * session : to_remove) {
+    std::erase(_sessions, session);
+    std::erase_if(_connections, [session](const auto& item) { return item.second == session; });
+
+    // It may have been given back after a failed accept
+    _listener->forget(session);
+
+    if(session->conn_io) ev_timer_stop(_loop, &session->conn_io->timer);
+    session->close_conn();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_ctl_mutex);
+    std::erase_if(_to_remove, [&to_remove](auto * session) {
+      return std::find(to_remove.begin(), to_remove.end(), session) != to_remove.end();
+    });
+  }
+    
+  _ctl_cv.notify_all();
+}
+
+void QuicheWorker::wake_udp()
+{
+  ev_async_send(_loop, _udp_watcher.get());
+}
+
+void QuicheWorker::drain_udp()
+{
+  for(auto * session : _sessions) session->drain_udp();
+}
+
+void QuicheWorker::stop_timers()
+{
+  for(auto * session : _sessions) {
+    if(session->conn_io) ev_timer_stop(_loop, &session->conn_io->timer);
+  }
+}
+
+QuicheServer * QuicheWorker::find(const uint8_t * cid, size_t cid_len)
+{
+  auto it = _connections.find(std::string((const char*)cid, cid_len));
+  return it != _connections.end() ? it->second : nullptr;
+}
+
+void QuicheWorker::accept(QuicheServer * session, const uint8_t * cid, size_t cid_len)
+{
+  _sessions.push_back(session);
+  _connections.emplace(std::string((const char*)cid, cid_len), session);
+}
+
+// QuicheListener /////////////////////////////////////////////////////////////
+
+std::mutex QuicheListener::_listeners_mutex;
+std::unordered_map<uint16_t, std::weak_ptr<QuicheListener>> QuicheListener::_listeners;
+
+QuicheListener::QuicheListener(uint16_t port)
+  : _port(port)
+{}
+
+QuicheListener::~QuicheListener()
+{
+  fmt::print("Closing quiche listener on port {}\n", _port);
+  _workers.clear();
+}
+
+std::shared_ptr<QuicheListener> QuicheListener::get(uint16_t port, unsigned workers)
+{
+  std::lock_guard<std::mutex> lock(_listeners_mutex);
+
+  if(auto it = _listeners.find(port); it != _listeners.end()) {
+    if(auto listener = it->second.lock()) return listener;
+  }
+
+  auto listener = std::make_shared<QuicheListener>(port);
+  if(!listener->start(workers)) return nullptr;
+
+  _listeners[port] = listener;
+  
+  return listener;
+}
+
+bool QuicheListener::start(unsigned workers)
+{
+  workers = std::clamp(workers, 1u, 256u); // The worker index is one byte of the connection ID
+
+  // Sockets join the reuseport group in bind order, worker i is socket i
+  for(unsigned i = 0; i < workers; ++i) {
+    auto& worker = _workers.emplace_back(std::make_unique<QuicheWorker>(this, _port, i, workers));
+    if(!worker->start()) return false;
+  }
+
+  if(workers > 1 && !attach_steering()) {
+    fmt::print("Could not attach the reuseport steering program, packets are hashed on the 4-tuple\n");
+  }
+
+  return true;
+}
+
+bool QuicheListener::attach_steering()
+{
+  // Select the socket from the first byte of the destination connection ID, which is at
+  // offset 6 of a long header (flags, version, dcid length) and at offset 1 of a short one.
+  // Data starts at the UDP payload.
+  struct sock_filter code[] = {
+    { BPF_LD  | BPF_B    | BPF_ABS, 0, 0, 0 },
+    { BPF_JMP | BPF_JSET | BPF_K,   0, 2, 0x80 },
+    { BPF_LD  | BPF_B    | BPF_ABS, 0, 0, 6 },
+    { BPF_JMP | BPF_JA,             0, 0, 1 },
+    { BPF_LD  | BPF_B    | BPF_ABS, 0, 0, 1 },
+    { BPF_ALU | BPF_MOD  | BPF_K,   0, 0, (uint32_t)_workers.size() },
+    { BPF_RET | BPF_A,              0, 0, 0 },
+  };
+
+  struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+  if(setsockopt(_workers.front()->get_sock(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+		&prog, sizeof(prog)) < 0) {
+    perror("SO_ATTACH_REUSEPORT_CBPF");
+    return false;
+  }
+
+  return true;
+}
+
+bool QuicheListener::add(QuicheServer * session)
+{
+  std::lock_guard<std::mutex> lock(_pending_mutex);
+
+  // Nothing in the handshake tells which session a client is for yet, with two of them
+  // waiting a client could take the congestion control and the TURN socket of the other one
+  if(!_pending.empty()) {
+    fmt::print("A quiche session is already waiting for a client on port {}\n", _port);
+    return false;
+  }
+  
+  _pending.push_back(session);
+  return true;
+}
+
+void QuicheListener::remove(QuicheServer * session)
+{
+  QuicheWorker * worker = nullptr;
+  
+  {
+    std::lock_guard<std::mutex> lock(_pending_mutex);
+    
+    // No connection yet, nothing to release
+    if(std::erase(_pending, session) > 0) return;
+
+    worker = session->worker();
+  }
+
+  if(worker) worker->remove(session);
+}
+
+QuicheServer * QuicheListener::take_pending(QuicheWorker * worker)
+{
+  std::lock_guard<std::mutex> lock(_pending_mutex);
+
+  if(_pending.empty()) return nullptr;
+
+  auto * session = _pending.front();
+  _pending.pop_front();
+
+  session->set_worker(worker);
+  
+  return session;
+}
+
+void QuicheListener::give_back(QuicheServer * session)
+{
+  std::lock_guard<std::mutex> lock(_pending_mutex);
+
+  session->set_worker(nullptr);
+  _pending.push_front(session);
+}
+
+void QuicheListener::forget(QuicheServer * session)
+{
+  std::lock_guard<std::mutex> lock(_pending_mutex);
+  std::erase(_pending, session);
 }
 
+// QuicheServer ///////////////////////////////////////////////////////////////
+
 QuicheServer::QuicheServer(const std::string& host, uint16_t port, out::UdpSocket * udp_socket)
-  : _host(host), _port(port), _udp_socket(udp_socket), conn_io(nullptr), _conn(nullptr), _loop(nullptr), _socket{-1}, _stream_id{0}
+  : _host(host), _port(port), _udp_socket(udp_socket), _start(false), conn_io(nullptr), _conn(nullptr), _stream_id{0}
 {
   auto ver = quiche_version();
   fmt::print("Quiche version : {}\n", ver);
@@ -496,6 +887,9 @@ QuicheServer::QuicheServer(const std::string& host, uint16_t port, out::UdpSocke
 
 QuicheServer::~QuicheServer()
 {
+  // Not stopped, the listener must not keep a dangling session
+  if(_listener) _listener->remove(this);
+  
   quiche_config_free(_config);  
 }
 
@@ -505,6 +899,7 @@ Capabilities QuicheServer::get_capabilities()
 
   caps.impl = IMPL_NAME;
   caps.streams = true;
+  caps.framed_streams = true;
   caps.datagrams = true;
 
   caps.cc.push_back("newreno");
@@ -520,40 +915,19 @@ void QuicheServer::set_qlog_filename(std::string file_name)
   _qlog_file = std::move(file_name);
 }
 
-bool QuicheServer::init_socket()
+bool QuicheServer::start()
 {
-  _local_len = sizeof(_local);
-  _peer_len = sizeof(_peer);
+  // Sessions on the same port share the socket and the loop of the listener
+  _listener = QuicheListener::get(_port, _workers);
+  if(!_listener) return false;
 
-  _local.sin_family = AF_INET;
-  _local.sin_port = htons(_port);
-  _local.sin_addr.s_addr = htonl(INADDR_ANY);
-  
-  _socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if(_socket < 0) {
-    perror("Quicheserver could not create socket");
-    return false;
-  }
-
-  if(fcntl(_socket, F_SETFL, O_NONBLOCK) < 0) {
-    perror("Quicheserver could not set unblokcing");
+  if(!_listener->add(this)) {
+    _listener = nullptr;
     return false;
   }
 
-  fmt::print("Trying to bind {} {}\n", _port, _local_len);
+  _start = true;
   
-  if(bind(_socket, (struct sockaddr*)&_local, _local_len) < 0) {
-    perror("Quicheserver could not bind socket");
-    return false;
-  }
-
-  return true;
-}
-
-bool QuicheServer::start()
-{
-  if(!init_socket()) return false;
-
   _udp_socket->set_callback(this);
   _udp_socket->start();
   
@@ -562,22 +936,15 @@ bool QuicheServer::start()
 
 void QuicheServer::loop()
 {
-  ev_io watcher;
-
-  _loop = ev_default_loop(0);
-
-  ev_io_init(&watcher, recv_cb, _socket, EV_READ);
-  ev_io_start(_loop, &watcher);
-  watcher.data = (void*)this;
-
-  _async_watcher = std::make_unique<struct ev_async>();
-  ev_async_init(_async_watcher.get(), async_callback);
-  ev_async_start(_loop, _async_watcher.get());
+  // The connection runs on the listener thread, wait until the session is stopped
+  std::unique_lock<std::mutex> lock(_cv_mutex);
+  _cv.wait(lock, [this]() { return !_start; });
+}
 
-  ev_loop(_loop, 0);
-  ev_loop_destroy(_loop);
-    
-  _loop = nullptr;
+bool QuicheServer::set_framed_streams(bool enable)
+{
+  _framed = enable;
+  return true;
 }
 
 bool QuicheServer::set_datagrams(bool enable)
@@ -586,6 +953,12 @@ bool QuicheServer::set_datagrams(bool enable)
   return true;
 }
 
+bool QuicheServer::set_workers(unsigned workers)
+{
+  _workers = workers;
+  return true;
+}
+
 bool QuicheServer::set_cc(std::string_view cc) noexcept
 {
   if(cc == "newreno") {
@@ -613,17 +986,53 @@ void QuicheServer::stop()
   fmt::print("Closing out udp socket\n");
   _udp_socket->close();
 
-  if(_loop) {
-    fmt::print("Closing ev loop\n");
+  if(_listener) {
+    // Releases the connection on the listener thread
+    _listener->remove(this);
+    _listener = nullptr;
+  }
 
-    if(conn_io) ev_timer_stop(_loop, &conn_io->timer);
- 
-    ev_async_send(_loop, _async_watcher.get());
+  {
+    std::lock_guard<std::mutex> lock(_cv_mutex);
+    _start = false;
   }
+  _cv.notify_all();
+}
+
+void QuicheServer::update_transport_stats()
+{
+  if(!_conn) return;
+
+  quiche_stats stats;
+  quiche_conn_stats(_conn, &stats);
+  _lost.store(stats.lost, std::memory_order_relaxed);
+
+  quiche_path_stats path_stats;
+  if(quiche_conn_path_stats(_conn, 0, &path_stats) == 0) {
+    _cwnd.store(path_stats.cwnd, std::memory_order_relaxed);
+    _rtt_us.store(path_stats.rtt / 1000, std::memory_order_relaxed);
+  }
+}
+
+void QuicheServer::collect_metrics(metrics::Writer& w) const
+{
+  w.gauge("quic_tunnel_cwnd_bytes", "Congestion window", _cwnd.load(std::memory_order_relaxed));
+  w.gauge("quic_tunnel_rtt_microseconds", "Smoothed RTT", _rtt_us.load(std::memory_order_relaxed));
+  w.counter("quic_tunnel_lost_packets_total", "Packets declared lost by the transport",
+	    _lost.load(std::memory_order_relaxed));
   
+  w.gauge("quic_tunnel_queue_depth", "Packets waiting to be handed over to another thread",
+	  _udp_ring.size(), "queue=\"udp_ring\"");
+  w.counter("quic_tunnel_dropped_total", "Packets dropped by the tunnel",
+	    _udp_dropped.load(std::memory_order_relaxed), "reason=\"queue_full\"");
+}
+
+void QuicheServer::close_conn()
+{
   if(conn_io) {
     fmt::print("free conn_io\n");
-    free(conn_io);
+    free(conn_io->timer.data);
+    delete conn_io;
     conn_io = nullptr;
   }
 
@@ -634,53 +1043,105 @@ void QuicheServer::stop()
     quiche_conn_free(_conn);
     _conn = nullptr;
   }
-
-  if(_socket != -1) {
-    fmt::print("Closing quiche socket\n");
-    close(_socket);
-    _socket = -1;
-  }
 }
 
 void QuicheServer::on_recv(const uint8_t * buf, size_t len)
 {
-  _udp_socket->send((const char*)buf, len);
+  _udp_socket->queue((const char*)buf, len);
 } 
 
+void QuicheServer::on_recv_stream(const uint8_t * buf, size_t len)
+{
+  if(!_framed) {
+    on_recv(buf, len);
+    return;
+  }
+
+  _deframer.feed(buf, len, [this](const char * packet, size_t packet_len) {
+    _udp_socket->queue(packet, packet_len);
+  });
+}
+
+void QuicheServer::resume_framed()
+{
+  if(!_framed || !_conn) return;
+  
+  _framer.drain([this](const uint8_t * data, size_t len) -> ssize_t {
+    auto written = quiche_conn_stream_send(_conn, FRAMED_STREAM_ID, data, len, false);
+    if(written < 0 && written != QUICHE_ERR_DONE) {
+      fmt::print("Failed to send data in framed stream : {}\n", get_quiche_error(written));
+    }
+    
+    return written;
+  });
+}
+
+void QuicheServer::flush_recv()
+{
+  _udp_socket->flush();
+}
+
 void QuicheServer::onUdpMessage(const char* buffer, size_t len) noexcept
+{
+  auto * packet = _udp_ring.claim();
+  
+  if(!packet || len > sizeof(packet->data)) {
+    if(auto dropped = ++_udp_dropped; dropped % 1000 == 1) fmt::print("Quiche server dropped {} udp packets\n", dropped);
+    return;
+  }
+
+  memcpy(packet->data, buffer, len);
+  packet->len = len;
+  _udp_ring.publish();
+
+  // Wakeups are coalesced by libev until the loop runs the watcher. Before the
+  // connection is accepted, packets wait in the ring
+  if(auto * worker = _worker.load(std::memory_order_acquire)) worker->wake_udp();
+}
+
+void QuicheServer::drain_udp()
+{
+  while(auto * packet = _udp_ring.front()) {
+    // Nothing to tunnel in until a client is connected
+    if(_conn) send_packet(packet->data, packet->len);
+    _udp_ring.release();
+  }
+
+  if(conn_io) flush_egress(worker()->loop(), conn_io);
+}
+
+void QuicheServer::send_packet(const uint8_t * buf, size_t len)
 {
   if(_datagrams) {
-    std::lock_guard<std::mutex> lock(server_flush_mutex);
-    
-    if (quiche_conn_dgram_send(_conn, (const uint8_t*)buffer, len) < 0) {
+    if (quiche_conn_dgram_send(_conn, buf, len) < 0) {
       fmt::print("Failed to send data in dgram\n");
-      return;
     }
+    return;
   }
-  else {
-    std::lock_guard<std::mutex> lock(server_flush_mutex);
-    
-    uint64_t id = (_stream_id++ << 2) | 0x03;
-
-    std::vector<char> v(len);
-    memcpy(v.data(), buffer, len);
-    _queue.push(v);
-
-    while(!_queue.empty()) {
-      if (auto code = quiche_conn_stream_send(_conn, id, (const unsigned char*)_queue.front().data(), _queue.front().size(), true); code < 0) {
-	auto cap = quiche_conn_stream_capacity(_conn, id);
-	fmt::print("Send Capacity : {}\n", cap);
-	fmt::print("Failed to send data in stream, id {}, error {} : {}\n", id, code, get_quiche_error(code));
-	return;
-      }
 
-      _queue.pop();
-    }
-    
-    auto cap = quiche_conn_stream_capacity(_conn, id);
-    fmt::print("Send Capacity : {}\n", cap);
+  if(_framed) {
+    if(!_framer.push(buf, len)) fmt::print("Framed stream blocked, packet dropped\n");
+    resume_framed();
+    return;
   }
+  
+  uint64_t id = (_stream_id++ << 2) | 0x03;
 
-  flush_egress(_loop, conn_io);
-}
+  std::vector<char> v(len);
+  memcpy(v.data(), buf, len);
+  _queue.push(v);
+
+  while(!_queue.empty()) {
+    if (auto code = quiche_conn_stream_send(_conn, id, (const unsigned char*)_queue.front().data(), _queue.front().size(), true); code < 0) {
+      auto cap = quiche_conn_stream_capacity(_conn, id);
+      fmt::print("Send Capacity : {}\n", cap);
+      fmt::print("Failed to send data in stream, id {}, error {} : {}\n", id, code, get_quiche_error(code));
+      return;
+    }
 
+    _queue.pop();
+  }
+    
+  auto cap = quiche_conn_stream_capacity(_conn, id);
+  fmt::print("Send Capacity : {}\n", cap);
+}
@@ -3,18 +3,178 @@
 
 #include <atomic>
 #include <queue>
+#include <deque>
+#include <thread>
+#include <unordered_map>
 #include <condition_variable>
 
 // #include <openssl/ssl.h>
 #include <sys/socket.h>
 
 #include "quic_server.h"
+#include "spsc_ring.h"
+#include "framing.h"
 
 class quiche_config;
 class quiche_conn;
+class QuicheServer;
+class QuicheWorker;
 struct ev_loop;
 struct ev_timer;
 struct ev_async;
+struct ev_io;
+
+struct UdpPacket
+{
+  uint32_t len;
+  uint8_t  data[out::UdpSocket::MAX_BUF_LEN];
+};
+
+class QuicheListener;
+
+/**
+ * @brief One socket and one ev loop thread of a listener. Connections stay on the worker
+ * that accepted them, the reuseport steering program routes their packets by connection ID.
+ */
+class QuicheWorker
+{
+  static constexpr size_t MAX_RECV_LEN = 65535;
+
+  QuicheListener * _listener;
+  uint16_t _port;
+  unsigned _index;
+  unsigned _nb_workers;
+
+  int _socket = -1;
+  bool _gso = false; // UDP_SEGMENT egress
+  bool _gro = false; // UDP_GRO ingress
+
+  struct sockaddr_in _local;
+  socklen_t _local_len;
+
+  struct ev_loop * _loop = nullptr;
+  std::unique_ptr<struct ev_io>    _io_watcher;
+  std::unique_ptr<struct ev_async> _stop_watcher;
+  std::unique_ptr<struct ev_async> _udp_watcher; // Wakes the loop when a session ring is filled
+  std::unique_ptr<struct ev_async> _ctl_watcher; // Wakes the loop when sessions are removed
+  std::thread _thread;
+
+  // Only used from the loop thread
+  std::unordered_map<std::string, QuicheServer*> _connections; // By connection ID
+  std::vector<QuicheServer*> _sessions;
+
+  // Sessions to remove, from the control threads
+  std::mutex _ctl_mutex;
+  std::condition_variable _ctl_cv;
+  std::vector<QuicheServer*> _to_remove;
+
+  // Socket buffers
+  uint8_t _recv_buf[MAX_RECV_LEN];
+  uint8_t _out_buf[MAX_RECV_LEN];
+
+  bool init_socket();
+
+public:
+  QuicheWorker(QuicheListener * listener, uint16_t port, unsigned index, unsigned nb_workers);
+  ~QuicheWorker();
+
+  bool start();
+
+  /**
+   * @brief Control thread. Unregister a session and wait until its connection is released
+   */
+  void remove(QuicheServer * session);
+
+  /**
+   * @brief UDP receive thread of a session. Wakes the loop up to drain the session rings
+   */
+  void wake_udp();
+
+  /**
+   * @brief Loop thread. Find the session of a connection ID
+   */
+  QuicheServer * find(const uint8_t * cid, size_t cid_len);
+
+  /**
+   * @brief Loop thread. Route the connection ID to the session
+   */
+  void accept(QuicheServer * session, const uint8_t * cid, size_t cid_len);
+
+  // Loop thread callbacks
+  void drain_udp();
+  void update_sessions();
+  void stop_timers();
+
+  QuicheListener * listener() { return _listener; }
+  unsigned index() const { return _index; }
+  struct ev_loop * loop() { return _loop; }
+  int get_sock() const { return _socket; }
+  bool gso() const { return _gso; }
+
+  uint8_t * recv_buffer() { return _recv_buf; }
+  uint8_t * out_buffer() { return _out_buf; }
+  static constexpr size_t buffer_size() { return MAX_RECV_LEN; }
+
+  struct sockaddr * get_local_addr() { return (sockaddr *)&_local; }
+  socklen_t get_local_addr_len() const { return _local_len; }
+};
+
+/**
+ * @brief Workers shared by all the quiche sessions listening on the same port.
+ * A new connection is given to the session waiting for a client, only one may wait at a time.
+ */
+class QuicheListener
+{
+  uint16_t _port;
+  std::vector<std::unique_ptr<QuicheWorker>> _workers;
+
+  std::mutex _pending_mutex;
+  std::deque<QuicheServer*> _pending; // Sessions without a connection yet
+
+  static std::mutex _listeners_mutex;
+  static std::unordered_map<uint16_t, std::weak_ptr<QuicheListener>> _listeners;
+
+  bool attach_steering();
+
+public:
+  explicit QuicheListener(uint16_t port);
+  ~QuicheListener();
+
+  /**
+   * @brief Get the listener bound to this port, create and start it if there is none.
+   * The worker count of an existing listener is kept.
+   * @return nullptr if the sockets could not be created
+   */
+  static std::shared_ptr<QuicheListener> get(uint16_t port, unsigned workers);
+
+  bool start(unsigned workers);
+
+  /**
+   * @brief Control thread. Register a session, it is given the next new connection
+   * @return false if another session is still waiting for its client
+   */
+  bool add(QuicheServer * session);
+
+  /**
+   * @brief Control thread. Unregister a session and wait until its connection is released
+   */
+  void remove(QuicheServer * session);
+
+  /**
+   * @brief Worker thread. Take the pending session for a new connection
+   */
+  QuicheServer * take_pending(QuicheWorker * worker);
+
+  /**
+   * @brief Worker thread. The connection could not be created, the session is pending again
+   */
+  void give_back(QuicheServer * session);
+
+  /**
+   * @brief Worker thread. Drop the session if it is still pending
+   */
+  void forget(QuicheServer * session);
+};
 
 class QuicheServer : public QuicServer, public out::UdpSocketCallback
 {
@@ -25,12 +185,15 @@ class QuicheServer : public QuicServer, public out::UdpSocketCallback
 
   std::string _qlog_file;
   bool        _datagrams;
+  bool        _framed = false;
   bool        _start;
 
   uint8_t _cc;
 
-  int _socket = -1;
-  
+  unsigned _workers = 0;
+  std::shared_ptr<QuicheListener> _listener;
+  std::atomic<QuicheWorker*> _worker = nullptr; // Worker owning the connection
+
   std::condition_variable _cv;
   std::mutex _cv_mutex;
 
@@ -39,22 +202,29 @@ class QuicheServer : public QuicServer, public out::UdpSocketCallback
 
   int _stream_id;
   
-  struct sockaddr_in _local;
-  struct sockaddr_in _peer;
-  socklen_t _local_len;
-  socklen_t _peer_len;
-
-  std::unique_ptr<struct ev_timer> _timer;
-  std::unique_ptr<struct ev_async> _async_watcher;
-  struct ev_loop * _loop;
-
   std::queue<std::vector<char>> _queue;
+
+  // Framed mode, packets not taken by the stream yet and partial packet received
+  framing::Framer   _framer;
+  framing::Deframer _deframer;
   
-  bool init_socket();
+  // UDP receive thread -> listener loop thread. Every quiche_conn call happens on the loop thread
+  SpscRing<struct UdpPacket, 1024> _udp_ring;
+  std::atomic<uint64_t> _udp_dropped = 0;
+
+  TrafficCounters _wire; // Packets of the connection on the worker socket
+
+  // Path statistics, copied from the loop thread for the metrics
+  std::atomic<uint64_t> _cwnd = 0;
+  std::atomic<uint64_t> _rtt_us = 0;
+  std::atomic<uint64_t> _lost = 0;
+
+  void send_packet(const uint8_t * buf, size_t len);
   
 public:
   static constexpr const char * DEFAULT_QLOG_PATH = "tunnel-out-logs";
   static constexpr const char * IMPL_NAME = "quiche";
+  static constexpr uint64_t FRAMED_STREAM_ID = 0x03; // First server unidirectional stream
 
   struct conn_io * conn_io = nullptr;
   
@@ -71,21 +241,49 @@ public:
   quiche_conn * get_conn() { return _conn; }
   void set_conn(quiche_conn * conn) { _conn = conn; }
   quiche_config * get_config() { return _config; }
-  int get_sock() const { return _socket; }
-
-  const struct sockaddr * get_local_addr() const { return (sockaddr *)&_local; }
-  struct sockaddr * get_local_addr() { return (sockaddr *)&_local; }
-  
-  socklen_t get_local_addr_len() const { return _local_len; }
+  QuicheWorker * worker() { return _worker.load(std::memory_order_acquire); }
+  void set_worker(QuicheWorker * worker) { _worker.store(worker, std::memory_order_release); }
   
   std::string_view get_qlog_path() const noexcept override { return DEFAULT_QLOG_PATH; }
   std::string_view get_qlog_filename() const noexcept override { return _qlog_file; }
   bool set_datagrams(bool enable) override;
+  bool set_workers(unsigned workers) override;
+  bool set_framed_streams(bool enable) override;
+
+  const TrafficCounters * wire_traffic() const noexcept override { return &_wire; }
+  TrafficCounters& wire() noexcept { return _wire; }
+  void collect_metrics(metrics::Writer& w) const override;
   
   bool set_cc(std::string_view cc) noexcept override;
   void stop() override;
 
   void on_recv(const uint8_t * buf, size_t len);
+  void on_recv_stream(const uint8_t * buf, size_t len);
+  void flush_recv();
+
+  /**
+   * @brief Loop thread. Copies the congestion window, RTT and losses of the connection
+   */
+  void update_transport_stats();
+  
+  /**
+   * @brief Loop thread. Free the connection of this session
+   */
+  void close_conn();
+
+  /**
+   * @brief Loop thread. Writes the framed bytes the stream could not take before
+   */
+  void resume_framed();
+  
+  /**
+   * @brief Loop thread. Sends the packets received on the UDP socket since the last wakeup
+   */
+  void drain_udp();
+
+  /**
+   * @brief UDP receive thread. Copies the packet in the ring and wakes the loop up
+   */
   void onUdpMessage(const char* buffer, size_t len) noexcept override;
 };
 
@@ -17,6 +17,7 @@ TcpServer::TcpServer(const std::string& dst_host, uint16_t dst_port, uint16_t sr
     _pid_socat(-1),
     _pid_ss(-1),
     _tcp_socket(-1),
+    _connfd(-1),
     _udp_socket(sock)
 {
   _udp_socket->set_callback(this);
@@ -73,67 +74,31 @@ void TcpServer::loop()
   receive_loop();
 }
 
-constexpr int ANNOUNCE_FIELD = 4;
-
-ssize_t TcpServer::get_announce_len(int start, const char* buf, size_t len)
-{
-  auto size = ANNOUNCE_FIELD - announce_len_ptr;
-
-  if(len - start < ANNOUNCE_FIELD) size -= (len - start);
-  
-  for(int i = start; i < start + size; ++i) {   
-    announce_len[announce_len_ptr] = buf[i];
-    ++announce_len_ptr;
-  }
-
-  if(announce_len_ptr == ANNOUNCE_FIELD) {
-    announce_len_ptr = 0;
-    return atoll(announce_len);
-  }
-  else return -1;
-}
-
 void TcpServer::receive_loop()
 {
-  constexpr size_t MAX = 2048;
-  char buf[MAX], pending_buf[MAX];
-  ssize_t pending_len = -1, pending_buf_size;
+  auto buf = std::make_unique<uint8_t[]>(READ_BUF_LEN);
   
   for(;;) {
-    int data_start = 0;
-    bzero(buf, MAX);
-
-    auto res = read(_connfd, buf, MAX);
-    // std::cout << "received: " << res << "\n";
+    auto res = read(_connfd, buf.get(), READ_BUF_LEN);
 
     if(res < 0) {
       perror("Error reading tcp socket");
       break;
     }
 
-    while(res > 0) {
-      if(pending_len == -1) {
-	pending_len = pending_buf_size = get_announce_len(data_start, buf, res);
-	data_start += ANNOUNCE_FIELD;
-	res -= ANNOUNCE_FIELD;
-      }
-
-      if(res <= 0) continue;
+    if(res == 0) break; // Closed by the client
 
-      int copy_len = std::min(pending_len, res);
-      memcpy(pending_buf, buf + data_start, copy_len);
+    uint64_t packets = 0;
+    
+    // Every packet of the read goes out in one sendmmsg
+    _deframer.feed(buf.get(), res, [this, &packets](const char * packet, size_t len) {
+      _udp_socket->queue(packet, len);
+      ++packets;
+    });
 
-      pending_len -= copy_len;
-      res -= copy_len;
-      data_start += copy_len;
+    _wire.on_rx(res, packets);
 
-      if(pending_len == 0) {
-	static int i = 0;
-	std::cout << i++ << " " << "Transmitting: " <<  pending_buf_size << "\n";
-	_udp_socket->send(pending_buf, pending_buf_size);
-	pending_len = -1;
-      }
-    }
+    _udp_socket->flush();
   }
 }
 
@@ -190,15 +155,24 @@ Capabilities TcpServer::get_capabilities()
   return cap;
 }
 
-#include <iostream>
-void TcpServer::onUdpMessage(const char *buffer, size_t len) noexcept
+void TcpServer::collect_metrics(metrics::Writer& w) const
 {
-  static size_t i = 0;
-  std::cout << i++ << " sent: " << len << std::endl;
-
-  [[maybe_unused]] auto _ = write(_connfd, std::to_string(len).c_str(), 4);
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
   
-  if(write(_connfd, buffer, len) < 0) {
+  if(_connfd < 0 || getsockopt(_connfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) return;
+
+  w.gauge("quic_tunnel_cwnd_bytes", "Congestion window", (uint64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss);
+  w.gauge("quic_tunnel_rtt_microseconds", "Smoothed RTT", info.tcpi_rtt);
+  w.counter("quic_tunnel_lost_packets_total", "Packets declared lost by the transport", info.tcpi_total_retrans);
+}
+
+void TcpServer::onUdpMessage(const char *buffer, size_t len) noexcept
+{
+  if(!framing::send_frame(_connfd, buffer, len)) {
     perror("Error writing tcp");
+    return;
   }
+
+  _wire.on_tx(framing::HEADER_LEN + len);
 }
@@ -2,6 +2,7 @@
 #define TCP_SERVER_H
 
 #include "quic_server.h"
+#include "framing.h"
 
 class TcpServer final : public QuicServer, public out::UdpSocketCallback
 {
@@ -20,13 +21,15 @@ class TcpServer final : public QuicServer, public out::UdpSocketCallback
   int _connfd;
   out::UdpSocket * _udp_socket;
 
-  int announce_len_ptr;
-  char announce_len[4];
+  framing::Deframer _deframer; // Packets split between two reads
+  TrafficCounters   _wire;     // Framed packets on _connfd
   
   void setup_socat();
   void setup_ss();
   
 public:
+  static constexpr size_t READ_BUF_LEN = 1 << 16; // Many packets parsed out of each read
+  
   TcpServer(const std::string& dst_host, uint16_t dst_port, uint16_t src_port, out::UdpSocket * sock);
   ~TcpServer() = default;
   
@@ -38,8 +41,9 @@ public:
   std::string_view get_qlog_filename() const noexcept override { return dummy_file_name; }
   bool set_datagrams(bool) override { return false; }
   bool set_cc(std::string_view) noexcept override { return false; }
+  const TrafficCounters * wire_traffic() const noexcept override { return &_wire; }
+  void collect_metrics(metrics::Writer& w) const override;
   void receive_loop();
-  ssize_t get_announce_len(int start, const char* buf, size_t len);
   
   static Capabilities get_capabilities();
 
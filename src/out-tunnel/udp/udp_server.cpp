@@ -24,7 +24,7 @@ bool UdpServer::start()
   struct sockaddr_in addr;
 
   memset((char *)&addr, 0, sizeof(addr));
-  memset((char *)&_addr_other, 0, sizeof(struct sockaddr_in));
+  memset((char *)&_addr_other, 0, sizeof(_addr_other));
   
   addr.sin_family = AF_INET;
   addr.sin_port = htons(_port);
@@ -35,6 +35,9 @@ bool UdpServer::start()
     return false;
   }
 
+  _engine = io::Engine::create(BUF_SIZE, MAX_BATCH_LEN);
+  _engine->attach(_socket);
+
   _out_socket->set_callback(this);
   _out_socket->start();
   
@@ -50,39 +53,39 @@ void UdpServer::stop()
 {
   if(_socket < 0) return;
 
-  close(_socket);
-  shutdown(_socket, SHUT_RDWR);
+  int fd = _socket;
   _socket = -1;
+  _engine->close();
   
-  std::unique_lock<std::mutex> lock(_cv_mutex);
-  _cv.wait(lock);
+  {
+    std::unique_lock<std::mutex> lock(_cv_mutex);
+    _cv.wait(lock);
+  }
+
+  close(fd);
   
   _out_socket->close();
 }
 
 void UdpServer::recv()
 {
-  char buffer[BUF_SIZE];
-
-  struct sockaddr_in addr;
-  socklen_t          slen = sizeof(addr);
-  ssize_t            rec_len;
-
   while(_socket >= 0) {
-    rec_len = recvfrom(_socket, buffer, BUF_SIZE, 0, (struct sockaddr*)&addr, &slen);
+    int n = _engine->recv();
     
-    if(rec_len < 0) {
+    if(n < 0) {
       if(_socket < 0) puts("Closing UDP socket");
-      else if(errno == EAGAIN || errno == EWOULDBLOCK) puts("Refreshing UDP socket");      
       else perror("Could not receive data in UDP socket");
+      break;
     }
-    else {
-      _addr_other.sin_family = AF_INET;
-      _addr_other.sin_port = addr.sin_port;
-      _addr_other.sin_addr.s_addr = addr.sin_addr.s_addr;
-      _len_addr_other = slen;
+    else if(n > 0) {
+      memcpy(&_addr_other, _engine->peer(n - 1), _engine->peer_len(n - 1));
+      _len_addr_other = _engine->peer_len(n - 1);
 
-      _out_socket->send(buffer, rec_len);
+      uint64_t bytes = 0;
+      for(auto& payload : _engine->payloads()) bytes += payload.size();
+      _wire.on_rx(bytes, n);
+
+      _out_socket->send_batch(_engine->payloads());
     }
   }
 
@@ -91,12 +94,14 @@ void UdpServer::recv()
 
 void UdpServer::onUdpMessage(const char * buffer, size_t len) noexcept
 {
-  if(_socket == -1) return;
+  if(_socket == -1 || _len_addr_other == 0) return;
 
-  auto send_len = sendto(_socket, buffer, len, 0, (struct sockaddr *)&_addr_other, _len_addr_other);
-  if(send_len == -1) {
+  if(!_engine->send(buffer, len, (struct sockaddr *)&_addr_other, _len_addr_other)) {
     perror("Could not send back");
   }
+  else _wire.on_tx(len);
+
+  _engine->flush();
 }
 
 Capabilities UdpServer::get_capabilities()
@@ -9,6 +9,7 @@
 #include <condition_variable>
 
 #include "quic_server.h"
+#include "io/io_engine.h"
 
 class UdpServer final : public QuicServer, public out::UdpSocketCallback
 {
@@ -19,9 +20,13 @@ class UdpServer final : public QuicServer, public out::UdpSocketCallback
   int _port;
 
   static constexpr auto BUF_SIZE = 2048;
+  static constexpr auto MAX_BATCH_LEN = 32;
 
-  struct sockaddr_in _addr_other;
-  socklen_t _len_addr_other;
+  std::unique_ptr<io::Engine> _engine; // Batched reads and writes on _socket
+  TrafficCounters _wire; // Packets on _socket
+
+  struct sockaddr_storage _addr_other;
+  socklen_t _len_addr_other = 0;
 
   std::mutex              _cv_mutex;
   std::condition_variable _cv;
@@ -47,6 +52,8 @@ public:
   /* no congestion control for udp */
   bool set_cc(std::string_view cc) noexcept override { return false; }
 
+  const TrafficCounters * wire_traffic() const noexcept override { return &_wire; }
+
   void onUdpMessage(const char * buffer, size_t len) noexcept override;
   
   static Capabilities get_capabilities();
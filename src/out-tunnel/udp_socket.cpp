@@ -3,116 +3,292 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "udp_socket.h"
 
 namespace out
 {
 
-UdpSocket::UdpSocket(const char* hostname, int port) : _port(port), _socket(-1), _host(NULL)
+static constexpr int MAX_EVENTS = 32;
+static constexpr unsigned MAX_READ_BATCHES = 16; // Per socket readiness, so no flow starves the others
+
+UdpSocket::UdpSocket(const char* hostname, int port)
+  : _port(port), _epoll(-1), _wake(-1),
+    _flows(new std::atomic<Flow*>[MAX_FLOWS]), _created(new std::atomic<Flow*>[MAX_FLOWS]),
+    _nb_created(0), _callback(nullptr), _host(NULL), _start(false), _closed(false)
 {
   memset((char *)&_addr, 0, sizeof(_addr));
 
+  for(uint32_t i = 0; i < MAX_FLOWS; ++i) {
+    _flows[i] = nullptr;
+    _created[i] = nullptr;
+  }
+
   std::cout << "out::UdpSocket dst to " << hostname << " " << port << "\n";
   
   _host = gethostbyname(hostname);
-  if(!_host) perror("Could not get host by name");
-  else _socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    
-  if(_socket == -1) {
-    perror("Could not create UDP socket");
+  if(!_host) {
+    perror("Could not get host by name");
     std::exit(EXIT_FAILURE);
   }
   
   _addr.sin_family = AF_INET;
   _addr.sin_port   = htons(_port);
   memcpy(&_addr.sin_addr, _host->h_addr_list[0], _host->h_length);
+  _addr_len = sizeof(_addr);
+
+  _epoll = epoll_create1(EPOLL_CLOEXEC);
+  _wake  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  
+  if(_epoll == -1 || _wake == -1) {
+    perror("Could not create UDP socket poller");
+    std::exit(EXIT_FAILURE);
+  }
+
+  struct epoll_event ev;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = nullptr; // The wakeup, flows have their Flow
+  epoll_ctl(_epoll, EPOLL_CTL_ADD, _wake, &ev);
+}
+
+UdpSocket::Flow * UdpSocket::get_flow(uint64_t flow_id)
+{
+  if(flow_id >= MAX_FLOWS) return nullptr;
+
+  if(auto * flow = _flows[flow_id].load(std::memory_order_acquire)) return flow;
+
+  std::lock_guard<std::mutex> lock(_flows_mutex);
+
+  // Created by another thread in the meantime
+  if(auto * flow = _flows[flow_id].load(std::memory_order_relaxed)) return flow;
+  if(_closed) return nullptr;
+  
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if(sock == -1) {
+    perror("Could not create UDP socket");
+    return nullptr;
+  }
+
+  // Reads happen on readiness, until the socket is drained
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+  auto flow = std::make_unique<Flow>();
+  flow->id = flow_id;
+  flow->socket = sock;
+  
+  // Polled with the others, on the socket or on the completion ring of the engine. The packets
+  // sent carry no header, the received ones longer than MAX_PAYLOAD_LEN are dropped by recv_flow
+  flow->engine = io::Engine::create(MAX_BUF_LEN, MAX_BATCH_LEN);
+  flow->engine->attach(sock);
 
-  struct timeval optval;
-  optval.tv_usec = 0;
-  optval.tv_sec = 5; // 5 seconds timeout
+  struct epoll_event ev;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = flow.get();
   
-  if(setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &optval, sizeof(optval)) < 0)
-    perror("Could not set timeout");
+  if(epoll_ctl(_epoll, EPOLL_CTL_ADD, flow->engine->poll_fd(), &ev) == -1) {
+    perror("Could not poll UDP socket");
+    ::close(sock);
+    return nullptr;
+  }
+
+  auto * ptr = flow.get();
+  _storage.push_back(std::move(flow));
 
-  _start = false;
+  auto count = _nb_created.load(std::memory_order_relaxed);
+  _created[count].store(ptr, std::memory_order_release);
+  _nb_created.store(count + 1, std::memory_order_release);
+  
+  _flows[flow_id].store(ptr, std::memory_order_release);
+  
+  return ptr;
 }
 
 void UdpSocket::start()
 {
-  _start = true;
+  // Not started again once closed, close joins the thread under the same lock
+  std::lock_guard<std::mutex> lock(_flows_mutex);
+  if(_closed || _start.exchange(true)) return;
+  
   _recv_thread = std::thread([this](){
-    struct sockaddr_in addr_tmp;
-    socklen_t          slen_tmp = sizeof(addr_tmp);
-
+    struct epoll_event events[MAX_EVENTS];
+    uint8_t buf[MAX_BUF_LEN];
+    
     while(true) {
-      // printf("recvfrom\n");
-      auto rlen = recvfrom(_socket, _buf, MAX_BUF_LEN, 0,
-			   (struct sockaddr *) &addr_tmp, &slen_tmp);
+      int n = epoll_wait(_epoll, events, MAX_EVENTS, -1);
 
-      // printf("rec_len: %ld\n", rlen);
+      if(n == -1) {
+	if(errno == EINTR) continue;
+	perror("Could not receive data in UDP socket");
+	return;
+      }
 
-      if(rlen == -1) {
-	// perror("some error ? ");
-	if(_socket == -1) {
+      for(int i = 0; i < n; ++i) {
+	auto * flow = reinterpret_cast<Flow*>(events[i].data.ptr);
+
+	if(!flow) {
 	  puts("Closing UDP socket");
 	  return;
 	}
-	
-	if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
-	else {
-	  perror("Could not receive data in UDP socket");
-	  return;
-	}
+
+	recv_flow(flow, buf);
       }
-      else if(_callback) _callback->onUdpMessage(_buf, rlen);
     }
   });
 }
 
+void UdpSocket::recv_flow(Flow * flow, uint8_t * buf)
+{
+  tunnel::Header header;
+  header.flags = tunnel::default_flags();
+  header.flow_id = flow->id;
+  
+  for(unsigned batch = 0; batch < MAX_READ_BATCHES; ++batch) {
+    auto n = flow->engine->recv();
+    if(n <= 0) break;
+
+    uint64_t batch_bytes = 0;
+    for(auto& msg : flow->engine->payloads()) batch_bytes += msg.size();
+    _traffic.on_rx(batch_bytes, n);
+    
+    if(!_callback) continue;
+
+    header.timestamp = tunnel::now_us();
+    
+    for(auto& msg : flow->engine->payloads()) {
+      // No room left for the tunnel header
+      if(msg.size() > MAX_PAYLOAD_LEN) {
+	if(auto dropped = ++_dropped; dropped % 1000 == 1) std::cout << "out::UdpSocket dropped " << dropped << " packets\n";
+	continue;
+      }
+
+      header.seq = flow->next_seq++;
+
+      auto header_len = tunnel::write_header(buf, header);
+      memcpy(buf + header_len, msg.data(), msg.size());
+      _callback->onUdpMessage((const char*)buf, header_len + msg.size());
+    }
+  }
+}
+
 void UdpSocket::send(const char *buf, size_t len)
 {
-  constexpr size_t SIZE = 2048;
+  queue(buf, len);
+  flush();
+}
+
+void UdpSocket::queue(const char * buf, size_t len)
+{
+  if(_closed) return;
+
+  tunnel::Header header;
+  auto header_len = tunnel::read_header((const uint8_t*)buf, len, header);
+
+  auto * flow = header_len > 0 ? get_flow(header.flow_id) : nullptr;
+  if(!flow) {
+    if(auto dropped = ++_dropped; dropped % 1000 == 1) std::cout << "out::UdpSocket dropped " << dropped << " packets\n";
+    return;
+  }
 
-  if(_socket == -1) return;
+  buf += header_len;
+  len -= header_len;
+
+  auto now = tunnel::now_us();
+  flow->stats.on_packet(header, len, now);
+
+  if(auto * latency = _latency.load(std::memory_order_acquire); latency && header.has_timestamp()) {
+    latency->record((int32_t)(now - header.timestamp));
+  }
+
+  _traffic.on_tx(len, (len + MAX_BUF_LEN - 1) / MAX_BUF_LEN);
   
   while(len > 0) {
-    auto buf_len = std::min(SIZE, len);
-    // printf("send_len: %ld\n", buf_len);
-    
-    auto l = sendto(_socket, buf, buf_len, 0, (struct sockaddr *) &_addr, sizeof(_addr));
+    auto buf_len = std::min((size_t)MAX_BUF_LEN, len);
     
-    if(l == -1) {
-      perror("Could not send data in UDP socket");
-      break;
+    if(!flow->engine->send(buf, buf_len, (struct sockaddr *) &_addr, _addr_len)) {
+      if(auto dropped = ++_dropped; dropped % 1000 == 1) std::cout << "out::UdpSocket dropped " << dropped << " packets\n";
     }
 
+    buf += buf_len;
     len -= buf_len;
   }
+}
+
+void UdpSocket::flush()
+{
+  if(_closed) return;
+
+  auto count = _nb_created.load(std::memory_order_acquire);
+  for(uint32_t i = 0; i < count; ++i) _created[i].load(std::memory_order_acquire)->engine->flush();
 
   if(!_start) start();
 }
 
+void UdpSocket::send_batch(std::span<const std::string_view> messages)
+{
+  for(auto& msg : messages) queue(msg.data(), msg.size());
+  flush();
+}
+
+void UdpSocket::collect_metrics(metrics::Writer& w) const
+{
+  _traffic.collect(w, "udp");
+  
+  w.counter("quic_tunnel_dropped_total", "Packets dropped by the tunnel",
+	    _dropped.load(std::memory_order_relaxed), "reason=\"udp_socket\"");
+
+  auto count = nb_flows();
+  w.gauge("quic_tunnel_flows", "Flows of the tunnel", count);
+
+  uint64_t truncated = 0;
+  for(uint32_t i = 0; i < count; ++i) {
+    auto * flow = _created[i].load(std::memory_order_acquire);
+    flow->stats.collect(w, flow->id);
+    truncated += flow->engine->truncated();
+  }
+
+  w.counter("quic_tunnel_dropped_total", "Packets dropped by the tunnel", truncated, "reason=\"truncated\"");
+}
+
 void UdpSocket::close()
 {
-  if(_socket != -1) {
-    puts("Try closing UDP socket");
-    ::close(_socket);
-    _socket = -1;
-
-    if(_recv_thread.joinable()) {
-      _recv_thread.join();
-      puts("Thread is joined");
-    }
-    
-    _start = false;
+  if(_closed.exchange(true)) return;
+  
+  puts("Try closing UDP socket");
+
+  std::lock_guard<std::mutex> lock(_flows_mutex);
+
+  // Wakes the receive thread up
+  uint64_t one = 1;
+  if(write(_wake, &one, sizeof(one)) < 0) perror("Could not wake UDP socket up");
+  
+  if(_recv_thread.joinable()) {
+    _recv_thread.join();
+    puts("Thread is joined");
   }
+
+  for(auto& flow : _storage) flow->stats.print("out::UdpSocket", flow->id);
+
+  ::close(_epoll);
+  ::close(_wake);
+  _epoll = _wake = -1;
+
+  // The quic thread may still be in queue or flush past the _closed check, the flow sockets are
+  // closed by the destructor once the quic server loop is over
 }
 
 UdpSocket::~UdpSocket()
 {
   close();
+
+  for(auto& flow : _storage) {
+    flow->engine->close();
+    ::close(flow->socket);
+    flow->socket = -1;
+  }
 }
 
 }
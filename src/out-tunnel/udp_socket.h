@@ -2,12 +2,24 @@
 #define UDP_OUT_SOCKET_H
 
 #include <thread>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <span>
+#include <string_view>
 
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
+#include "io/io_engine.h"
+#include "tunnel_header.h"
+#include "flow_stats.h"
+#include "traffic_stats.h"
+#include "latency_histogram.h"
+
 namespace out
 {
 
@@ -20,14 +32,41 @@ public:
   virtual void onUdpMessage(const char * buffer, size_t len) noexcept = 0;
 };
 
+/**
+ * @brief Sockets of the out-tunnel towards the RTP destination, one per flow of the in-tunnel.
+ * Packets from the tunnel are sent on the socket of the flow in their header, packets
+ * received on a flow socket are given to the callback with the header of this flow.
+ * The sequence number and send time in the headers from the tunnel feed the flow statistics.
+ */
 class UdpSocket
 {
-  static constexpr auto MAX_BUF_LEN = 2048u;
+public:
+  static constexpr auto MAX_BUF_LEN = 2048u; // Max tunnel packet, header included
+  static constexpr auto MAX_PAYLOAD_LEN = MAX_BUF_LEN - tunnel::MAX_HEADER_LEN;
+  static constexpr auto MAX_BATCH_LEN = 32u; // Max number of datagrams read or sent at once
+  static constexpr uint32_t MAX_FLOWS = 1024; // Flow IDs above are dropped
+
+private:
+  struct Flow
+  {
+    uint32_t id;
+    int      socket;
+    std::unique_ptr<io::Engine> engine; // Batched reads and writes on socket
+    uint64_t next_seq = 0; // Receive thread only
+    FlowStats stats;       // Of the packets from the tunnel, written by queue
+  };
   
   int _port;
-  int _socket;
+  int _epoll; // Readiness of every flow engine, and of _wake
+  int _wake;  // eventfd, stops the receive thread
 
-  char _buf[MAX_BUF_LEN];
+  // Indexed by flow ID, created on the first packet of the flow and kept until close
+  std::unique_ptr<std::atomic<Flow*>[]> _flows;
+  // Flows in creation order, to flush them all
+  std::unique_ptr<std::atomic<Flow*>[]> _created;
+  std::atomic<uint32_t> _nb_created;
+  std::vector<std::unique_ptr<Flow>> _storage;
+  std::mutex _flows_mutex;
 
   UdpSocketCallback * _callback;
 
@@ -36,7 +75,21 @@ class UdpSocket
   socklen_t          _addr_len;
 
   std::thread        _recv_thread;
-  bool _start;
+  std::atomic<bool>  _start;
+  std::atomic<bool>  _closed;
+  std::atomic<uint64_t> _dropped = 0;
+
+  TrafficCounters _traffic; // Destination side, tx to it and rx from it
+  std::atomic<LatencyHistogram*> _latency = nullptr; // Delay of the timestamped packets, if set
+
+  /**
+   * @brief Socket of a flow, created on its first packet
+   * @return nullptr if the flow ID is out of range or the socket could not be created
+   */
+  Flow * get_flow(uint64_t flow_id);
+
+  /** @brief Receive thread. Drain a readable flow socket */
+  void recv_flow(Flow * flow, uint8_t * buf);
   
 public:
   explicit UdpSocket(const char* hostname, int port);
@@ -44,8 +97,49 @@ public:
   void set_callback(UdpSocketCallback * callback) { _callback = callback; }
 
   void start();
+
+  /**
+   * @brief Stop receiving, queue and flush do nothing from now on. The flow sockets stay open
+   * until the destructor, for a quic thread still sending when close is called
+   */
   void close();
   void send(const char * buf, size_t len);
+
+  /**
+   * @brief Copy a datagram in the send batch of its flow. The batch is sent when full or on flush.
+   */
+  void queue(const char * buf, size_t len);
+
+  /**
+   * @brief Send all the queued datagrams, with a single sendmmsg per flow
+   */
+  void flush();
+
+  /**
+   * @brief Send several datagrams at once
+   */
+  void send_batch(std::span<const std::string_view> messages);
+
+  uint32_t nb_flows() const noexcept { return _nb_created.load(std::memory_order_acquire); }
+
+  const TrafficCounters& traffic() const noexcept { return _traffic; }
+
+  /** @brief Histogram where queue records the delay of the packets carrying a timestamp */
+  void set_latency(LatencyHistogram * latency) noexcept { _latency.store(latency, std::memory_order_release); }
+
+  /** @brief Any thread. Traffic, drops and statistics of every flow */
+  void collect_metrics(metrics::Writer& w) const;
+
+  /**
+   * @brief Statistics of the packets received from the tunnel on a flow
+   * @return nullptr if no packet of this flow has been received
+   */
+  const FlowStats * stats(uint64_t flow_id) const noexcept
+  {
+    if(flow_id >= MAX_FLOWS) return nullptr;
+    auto * flow = _flows[flow_id].load(std::memory_order_acquire);
+    return flow ? &flow->stats : nullptr;
+  }
   
   ~UdpSocket() noexcept;
 };
@@ -1,8 +1,34 @@
 #ifndef QLOGFILE_H
 #define QLOGFILE_H
 
+#include <array>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <cctype>
+#include <algorithm>
+#include <string_view>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <condition_variable>
+
+#include <unistd.h>
+
+#include <zlib.h>
+#include <fmt/core.h>
+#include <folly/json.h>
+
 #include <quic/logging/FileQLogger.h>
 
+/**
+ * @brief Keeps every event in memory and writes them in one JSON file when the connection is
+ * released, the mvfst default.
+ */
 template<quic::VantagePoint Endpoint>
 class QLog : public quic::FileQLogger
 {
@@ -19,5 +45,372 @@ public:
   static auto create(std::string_view path) { return std::make_shared<QLog>(path); }
 };
 
+namespace qlog
+{
+
+/** @brief Event categories that can be sampled, the others are always logged */
+enum Category : size_t { PACKET, CONGESTION, RECOVERY, STREAM, DATAGRAM, NB_CATEGORIES };
+
+static constexpr const char * CATEGORY_NAMES[NB_CATEGORIES] = { "packet", "congestion", "recovery", "stream", "datagram" };
+
+/**
+ * @brief Qlog settings, from the environment:
+ * QUIC_TUNNEL_QLOG "stream" (default), "full" for the mvfst file written at the end, or "off".
+ * QUIC_TUNNEL_QLOG_GZIP=1 compresses the stream.
+ * QUIC_TUNNEL_QLOG_SAMPLE "packet=10,stream=0" keeps one event out of N of a category, 0 drops it.
+ */
+struct Config
+{
+  bool enabled  = true;
+  bool stream   = true;
+  bool compress = false;
+  std::array<uint32_t, NB_CATEGORIES> sample{ 1, 1, 1, 1, 1 };
+
+  static const Config& from_env()
+  {
+    static const Config config = [](){
+      Config c;
+
+      if(const char * mode = std::getenv("QUIC_TUNNEL_QLOG")) {
+	c.enabled = std::strcmp(mode, "off") != 0;
+	c.stream  = std::strcmp(mode, "full") != 0;
+      }
+
+      if(const char * gzip = std::getenv("QUIC_TUNNEL_QLOG_GZIP")) c.compress = std::strcmp(gzip, "1") == 0;
+
+      if(const char * sample = std::getenv("QUIC_TUNNEL_QLOG_SAMPLE")) {
+	std::string_view list = sample;
+
+	while(!list.empty()) {
+	  auto item = list.substr(0, list.find(','));
+	  list.remove_prefix(std::min(list.size(), item.size() + 1));
+
+	  auto eq = item.find('=');
+	  if(eq == std::string_view::npos) continue;
+
+	  for(size_t i = 0; i < NB_CATEGORIES; ++i) {
+	    if(item.substr(0, eq) == CATEGORY_NAMES[i]) c.sample[i] = std::atoi(std::string(item.substr(eq + 1)).c_str());
+	  }
+	}
+      }
+
+      return c;
+    }();
+
+    return config;
+  }
+};
+
+}
+
+/**
+ * @brief Qlog written while the connection runs, with bounded memory. The events are created
+ * by mvfst on the transport thread and handed over in batches to a writer thread, which
+ * serializes them as JSON-SEQ (RFC 7464 records, qlog 0.3 events), gzip compressed or not.
+ * Events of the sampled categories are skipped before they are even created, and the events
+ * are dropped when the writer falls more than MAX_PENDING_EVENTS behind.
+ */
+template<quic::VantagePoint Endpoint>
+class StreamingQLog : public quic::FileQLogger
+{
+  static constexpr size_t BATCH_EVENTS = 256;
+  static constexpr size_t MAX_PENDING_EVENTS = 1 << 16;
+
+  using Batch = std::vector<std::unique_ptr<quic::QLogEvent>>;
+
+  /** @brief Plain or gzip output file */
+  struct Sink
+  {
+    FILE * file = nullptr;
+    gzFile gz = nullptr;
+
+    void write(const std::string& data)
+    {
+      if(gz) gzwrite(gz, data.data(), data.size());
+      else if(file) fwrite(data.data(), 1, data.size(), file);
+    }
+
+    // A sync flush per batch, so the file can be read while it grows
+    void flush()
+    {
+      if(gz) gzflush(gz, Z_SYNC_FLUSH);
+      else if(file) fflush(file);
+    }
+
+    void close()
+    {
+      if(gz) gzclose(gz);
+      if(file) fclose(file);
+      gz = nullptr;
+      file = nullptr;
+    }
+
+    explicit operator bool() const { return gz || file; }
+  };
+
+  std::string  _dir;
+  qlog::Config _config;
+  std::array<uint64_t, qlog::NB_CATEGORIES> _seen{}; // Transport thread
+
+  // Transport thread -> writer thread
+  std::mutex              _mutex;
+  std::condition_variable _cv;
+  std::deque<Batch>       _pending;
+  size_t                  _pending_events = 0;
+  uint64_t                _dropped = 0;
+  std::string             _file_name; // In _dir, set once the connection ID is known
+  bool                    _stop = false;
+
+  std::thread _writer;
+
+  static inline std::atomic<uint64_t> _unknown{0}; // Connections without an ID, each gets its own file
+
+  /** @brief Under _mutex */
+  std::string make_file_name() const
+  {
+    auto id = dcid ? dcid->hex() : fmt::format("unknown-{}-{}", getpid(), _unknown.fetch_add(1, std::memory_order_relaxed));
+    return fmt::format("{}.sqlog{}", id, _config.compress ? ".gz" : "");
+  }
+
+  bool sampled(qlog::Category category)
+  {
+    auto n = _config.sample[category];
+    return n != 0 && _seen[category]++ % n == 0;
+  }
+
+  /** @brief Transport thread. Hands the logged events to the writer once a batch is full */
+  void hand_over(bool force = false)
+  {
+    if(logs.empty() || (!force && logs.size() < BATCH_EVENTS)) return;
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      if(_file_name.empty()) _file_name = make_file_name();
+
+      if(_pending_events + logs.size() > MAX_PENDING_EVENTS) {
+	_dropped += logs.size();
+	logs.clear();
+	return;
+      }
+
+      _pending_events += logs.size();
+      _pending.push_back(std::move(logs));
+    }
+
+    logs.clear();
+    _cv.notify_one();
+  }
+
+  bool open(Sink& sink, const std::string& name)
+  {
+    std::error_code ec;
+    std::filesystem::create_directories(_dir, ec);
+
+    auto path = _dir + "/" + name;
+
+    if(_config.compress) sink.gz = gzopen(path.c_str(), "wb");
+    else sink.file = fopen(path.c_str(), "w");
+
+    if(!sink) {
+      fmt::print("Could not open qlog file {}\n", path);
+      return false;
+    }
+
+    folly::dynamic vantage = folly::dynamic::object("type", Endpoint == quic::VantagePoint::Server ? "server" : "client");
+    folly::dynamic trace = folly::dynamic::object("vantage_point", vantage)
+      ("common_fields", folly::dynamic::object("time_format", "relative"));
+    folly::dynamic header = folly::dynamic::object("qlog_version", "0.3")("qlog_format", "JSON-SEQ")
+      ("title", "quic-tunnel qlog")("trace", trace);
+
+    sink.write("\x1e" + folly::toJson(header) + "\n");
+
+    return true;
+  }
+
+  /** @brief Writer thread. mvfst events are [time us, category, event, data] arrays */
+  static void write_event(Sink& sink, const quic::QLogEvent& event)
+  {
+    auto d = event.toDynamic();
+
+    auto name = d[1].asString();
+    for(auto& c : name) c = std::tolower(c);
+    name += ':';
+    name += d[2].asString();
+
+    folly::dynamic obj = folly::dynamic::object("time", d[0].asDouble() / 1000.)("name", name)("data", d[3]);
+    sink.write("\x1e" + folly::toJson(obj) + "\n");
+  }
+
+  void run()
+  {
+    Sink sink;
+    bool failed = false;
+
+    while(true) {
+      Batch batch;
+      std::string name;
+
+      {
+	std::unique_lock<std::mutex> lock(_mutex);
+	_cv.wait(lock, [this]() { return _stop || !_pending.empty(); });
+
+	if(_pending.empty()) break;
+
+	batch = std::move(_pending.front());
+	_pending.pop_front();
+	_pending_events -= batch.size();
+	name = _file_name;
+      }
+
+      if(!sink && !failed) failed = !open(sink, name);
+      if(!sink) continue;
+
+      for(auto& event : batch) write_event(sink, *event);
+      sink.flush();
+    }
+
+    sink.close();
+
+    if(_dropped > 0) fmt::print("qlog writer too slow, {} events dropped\n", _dropped);
+  }
+
+public:
+  StreamingQLog(std::string_view dir, const qlog::Config& config)
+    : quic::FileQLogger(Endpoint, quic::kHTTP3ProtocolType, std::string(dir), false, false),
+      _dir(dir), _config(config)
+  {
+    _writer = std::thread([this]() { run(); });
+  }
+
+  ~StreamingQLog()
+  {
+    hand_over(true);
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+
+    _cv.notify_one();
+    _writer.join();
+  }
+
+  static auto create(std::string_view dir, const qlog::Config& config)
+  {
+    return std::make_shared<StreamingQLog>(dir, config);
+  }
+
+  /** @brief Transport thread. Name of the file in the qlog directory, fixed on the first call */
+  std::string file_name()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if(_file_name.empty()) _file_name = make_file_name();
+    return _file_name;
+  }
+
+  using quic::FileQLogger::addPacket;
+
+  // Packets
+  void addPacket(const quic::RegularQuicPacket& packet, uint64_t size) override
+  {
+    if(!sampled(qlog::PACKET)) return;
+    quic::FileQLogger::addPacket(packet, size);
+    hand_over();
+  }
+
+  void addPacket(const quic::RegularQuicWritePacket& packet, uint64_t size) override
+  {
+    if(!sampled(qlog::PACKET)) return;
+    quic::FileQLogger::addPacket(packet, size);
+    hand_over();
+  }
+
+  // Congestion control
+  void addCongestionMetricUpdate(uint64_t bytes_in_flight, uint64_t cwnd, std::string event,
+				 std::string state, std::string recovery_state) override
+  {
+    if(!sampled(qlog::CONGESTION)) return;
+    quic::FileQLogger::addCongestionMetricUpdate(bytes_in_flight, cwnd, std::move(event),
+						 std::move(state), std::move(recovery_state));
+    hand_over();
+  }
+
+  void addBandwidthEstUpdate(uint64_t bytes, std::chrono::microseconds interval) override
+  {
+    if(!sampled(qlog::CONGESTION)) return;
+    quic::FileQLogger::addBandwidthEstUpdate(bytes, interval);
+    hand_over();
+  }
+
+  void addPacingMetricUpdate(uint64_t burst_size, std::chrono::microseconds interval) override
+  {
+    if(!sampled(qlog::CONGESTION)) return;
+    quic::FileQLogger::addPacingMetricUpdate(burst_size, interval);
+    hand_over();
+  }
+
+  // Loss recovery
+  void addMetricUpdate(std::chrono::microseconds latest_rtt, std::chrono::microseconds mrtt,
+		       std::chrono::microseconds srtt, std::chrono::microseconds ack_delay) override
+  {
+    if(!sampled(qlog::RECOVERY)) return;
+    quic::FileQLogger::addMetricUpdate(latest_rtt, mrtt, srtt, ack_delay);
+    hand_over();
+  }
+
+  void addPacketsLost(quic::PacketNum largest_lost, uint64_t lost_bytes, uint64_t lost_packets) override
+  {
+    if(!sampled(qlog::RECOVERY)) return;
+    quic::FileQLogger::addPacketsLost(largest_lost, lost_bytes, lost_packets);
+    hand_over();
+  }
+
+  // Streams and datagrams
+  void addStreamStateUpdate(quic::StreamId id, std::string update,
+			    folly::Optional<std::chrono::milliseconds> since_creation) override
+  {
+    if(!sampled(qlog::STREAM)) return;
+    quic::FileQLogger::addStreamStateUpdate(id, std::move(update), since_creation);
+    hand_over();
+  }
+
+  void addDatagramReceived(uint64_t len) override
+  {
+    if(!sampled(qlog::DATAGRAM)) return;
+    quic::FileQLogger::addDatagramReceived(len);
+    hand_over();
+  }
+};
+
+/**
+ * @brief The qlogger of a new connection, as configured by qlog::Config
+ * @return nullptr when qlog is disabled
+ */
+template<quic::VantagePoint Endpoint>
+std::shared_ptr<quic::QLogger> make_qlogger(std::string_view dir)
+{
+  auto& config = qlog::Config::from_env();
+
+  if(!config.enabled) return nullptr;
+  if(config.stream) return StreamingQLog<Endpoint>::create(dir, config);
+
+  return QLog<Endpoint>::create(dir);
+}
+
+/**
+ * @brief Transport thread. Name of the file written by the qlogger of a connection, in its directory
+ * @return Empty if there is no qlogger
+ */
+template<quic::VantagePoint Endpoint>
+std::string qlog_file_name(const std::shared_ptr<quic::QLogger>& qlogger)
+{
+  if(auto streaming = std::dynamic_pointer_cast<StreamingQLog<Endpoint>>(qlogger)) return streaming->file_name();
+  if(!qlogger) return {};
+
+  // Named by mvfst when the connection is released
+  return (qlogger->dcid ? qlogger->dcid->hex() : std::string("error")) + quic::FileQLogger::kQlogExtension;
+}
 
 #endif /* QLOGFILE_H */
@@ -33,7 +33,11 @@ struct RandomGenerator
   RandomGenerator(handle_type h) : _h(h) {}
   ~RandomGenerator() { _h.destroy(); }
 
-  int operator()() { return _h.promise().value;  }
+  int operator()() {
+    // Run the generator up to its next co_yield
+    _h.resume();
+    return _h.promise().value;
+  }
 };
 
 #endif /* RANDOM_GENERATOR_H */
@@ -0,0 +1,97 @@
+#ifndef SESSION_REGISTRY_H
+#define SESSION_REGISTRY_H
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#include "random_generator.h"
+
+/**
+ * @brief Sessions of the tunnel by id, safe to use from the command workers, the websocket
+ * thread and the tunnels at once. An id is reserved before its session is built, so the
+ * session is not built under the lock, and the reserved ids are skipped by the lookups.
+ */
+template<typename T>
+class SessionRegistry
+{
+  mutable std::mutex _mutex;
+  std::unordered_map<int, std::shared_ptr<T>> _sessions; // nullptr while reserved
+  const size_t _max;
+
+public:
+  explicit SessionRegistry(size_t max) noexcept : _max(max) {}
+
+  SessionRegistry(const SessionRegistry&) = delete;
+  SessionRegistry& operator=(const SessionRegistry&) = delete;
+
+  /** @brief Reserve a free id drawn from ids, -1 if every id is taken */
+  int reserve(RandomGenerator& ids)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(_sessions.size() >= _max) return -1;
+
+    int id;
+    do id = ids(); while(_sessions.contains(id));
+
+    _sessions.emplace(id, nullptr);
+    return id;
+  }
+
+  /** @brief Set the session of a reserved id */
+  void insert(int id, std::shared_ptr<T> session)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sessions[id] = std::move(session);
+  }
+
+  std::shared_ptr<T> find(int id) const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _sessions.find(id);
+    return it != _sessions.end() ? it->second : nullptr;
+  }
+
+  /** @brief Remove a session and return it, so only one caller gets to stop it */
+  std::shared_ptr<T> take(int id)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _sessions.find(id);
+    if(it == _sessions.end() || !it->second) return nullptr;
+
+    auto session = std::move(it->second);
+    _sessions.erase(it);
+    return session;
+  }
+
+  /** @brief Remove a session, or release a reserved id */
+  void erase(int id)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sessions.erase(id);
+  }
+
+  size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _sessions.size();
+  }
+
+  /** @brief Call f on each session, outside of the lock so f may take its time */
+  template<typename F>
+  void for_each(F&& f) const
+  {
+    std::vector<std::shared_ptr<T>> sessions;
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      sessions.reserve(_sessions.size());
+      for(auto& [id, session] : _sessions) if(session) sessions.push_back(session);
+    }
+
+    for(auto& session : sessions) f(*session);
+  }
+};
+
+#endif /* SESSION_REGISTRY_H */
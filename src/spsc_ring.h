@@ -0,0 +1,99 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <cstddef>
+
+/**
+ * @brief Bounded lock-free ring for exactly one producer thread and one consumer thread.
+ * N must be a power of two.
+ */
+template<typename T, size_t N>
+class SpscRing
+{
+  static_assert(N > 0 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+  static constexpr size_t CACHE_LINE = 64;
+  static constexpr size_t MASK = N - 1;
+
+  // Head and tail on their own cache line so the two threads do not false share
+  alignas(CACHE_LINE) std::atomic<size_t> _head{0}; // Next slot to pop, written by the consumer
+  alignas(CACHE_LINE) std::atomic<size_t> _tail{0}; // Next slot to push, written by the producer
+  alignas(CACHE_LINE) std::array<T, N>    _items;
+
+public:
+  /** @brief Producer side. Next item to fill in place, nullptr when the ring is full. */
+  T * claim() noexcept
+  {
+    auto tail = _tail.load(std::memory_order_relaxed);
+    if(tail - _head.load(std::memory_order_acquire) == N) return nullptr;
+
+    return &_items[tail & MASK];
+  }
+
+  /** @brief Producer side. Makes the claimed item visible to the consumer. */
+  void publish() noexcept
+  {
+    _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /** @brief Producer side. Returns false when the ring is full. */
+  bool push(const T& item) noexcept
+  {
+    auto * slot = claim();
+    if(!slot) return false;
+
+    *slot = item;
+    publish();
+
+    return true;
+  }
+
+  /** @brief Consumer side. Oldest item, read in place, nullptr when the ring is empty. */
+  T * front() noexcept
+  {
+    auto head = _head.load(std::memory_order_relaxed);
+    if(head == _tail.load(std::memory_order_acquire)) return nullptr;
+
+    return &_items[head & MASK];
+  }
+
+  /** @brief Consumer side. Gives the front item back to the producer. */
+  void release() noexcept
+  {
+    _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /** @brief Consumer side. Returns false when the ring is empty. */
+  bool pop(T& item) noexcept
+  {
+    auto * slot = front();
+    if(!slot) return false;
+
+    item = *slot;
+    release();
+
+    return true;
+  }
+
+  bool empty() const noexcept
+  {
+    return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+  }
+
+  /** @brief Items waiting, exact only from the producer or the consumer thread */
+  size_t size() const noexcept
+  {
+    // Head first, it never passes the tail loaded after it. Both may move in between, hence the bound
+    auto head = _head.load(std::memory_order_acquire);
+    auto tail = _tail.load(std::memory_order_acquire);
+
+    return std::min(tail - head, N);
+  }
+
+  static constexpr size_t capacity() noexcept { return N; }
+};
+
+#endif /* SPSC_RING_H */
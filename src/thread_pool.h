@@ -0,0 +1,114 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <mutex>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+/**
+ * @brief Fixed set of worker threads running the posted tasks. The tasks posted on a same
+ * strand run one at a time in the order they were posted, the other ones in any order.
+ */
+class ThreadPool
+{
+public:
+  using Task = std::function<void()>;
+
+private:
+  struct Ready
+  {
+    std::string strand; // Empty for a task without one
+    Task        task;
+  };
+
+  std::mutex              _mutex;
+  std::condition_variable _cv;
+  std::deque<Ready>       _ready;
+  // Tasks waiting for the running one of their strand. A strand is in the map while one of its
+  // tasks is ready or running
+  std::unordered_map<std::string, std::deque<Task>> _strands;
+  bool _stop = false;
+
+  std::vector<std::thread> _workers;
+
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while(true) {
+      _cv.wait(lock, [this]() { return _stop || !_ready.empty(); });
+      if(_ready.empty()) return; // Stopped, and nothing left to run
+
+      auto ready = std::move(_ready.front());
+      _ready.pop_front();
+
+      lock.unlock();
+      ready.task();
+      lock.lock();
+
+      if(ready.strand.empty()) continue;
+
+      // Hand the strand to its next task
+      auto it = _strands.find(ready.strand);
+      if(it->second.empty()) _strands.erase(it);
+      else {
+	_ready.push_back({ std::move(ready.strand), std::move(it->second.front()) });
+	it->second.pop_front();
+	_cv.notify_one();
+      }
+    }
+  }
+
+public:
+  explicit ThreadPool(unsigned workers)
+  {
+    if(workers == 0) workers = 1;
+
+    _workers.reserve(workers);
+    for(unsigned i = 0; i < workers; ++i) _workers.emplace_back([this]() { run(); });
+  }
+
+  /** @brief Run the tasks already posted, then join the workers */
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+
+    _cv.notify_all();
+    for(auto& worker : _workers) worker.join();
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void post(Task task) { post({}, std::move(task)); }
+
+  /** @brief Run task after the ones posted before on strand, or on any worker if strand is empty */
+  void post(const std::string& strand, Task task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      if(!strand.empty()) {
+	auto [it, idle] = _strands.try_emplace(strand);
+	if(!idle) {
+	  it->second.push_back(std::move(task));
+	  return;
+	}
+      }
+
+      _ready.push_back({ strand, std::move(task) });
+    }
+
+    _cv.notify_one();
+  }
+};
+
+#endif /* THREAD_POOL_H */
@@ -0,0 +1,177 @@
+#ifndef TRAFFIC_STATS_H
+#define TRAFFIC_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <condition_variable>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "metrics.h"
+
+/**
+ * @brief Bytes and packets through a socket, counted by the threads doing the I/O and read
+ * by the sampler. Receive and send are on their own cache line, they are usually updated by
+ * different threads.
+ */
+struct TrafficCounters
+{
+  static constexpr size_t CACHE_LINE = 64;
+
+  alignas(CACHE_LINE) std::atomic<uint64_t> rx_bytes{0};
+  std::atomic<uint64_t> rx_packets{0};
+  alignas(CACHE_LINE) std::atomic<uint64_t> tx_bytes{0};
+  std::atomic<uint64_t> tx_packets{0};
+
+  void on_rx(uint64_t bytes, uint64_t packets = 1) noexcept
+  {
+    rx_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    rx_packets.fetch_add(packets, std::memory_order_relaxed);
+  }
+
+  void on_tx(uint64_t bytes, uint64_t packets = 1) noexcept
+  {
+    tx_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    tx_packets.fetch_add(packets, std::memory_order_relaxed);
+  }
+
+  /** @brief Both directions, as a capture of the interface would see them */
+  uint64_t bytes() const noexcept
+  {
+    return rx_bytes.load(std::memory_order_relaxed) + tx_bytes.load(std::memory_order_relaxed);
+  }
+
+  uint64_t packets() const noexcept
+  {
+    return rx_packets.load(std::memory_order_relaxed) + tx_packets.load(std::memory_order_relaxed);
+  }
+
+  /** @brief Writes the counters with a socket label, "udp" for the RTP side, "quic" for the wire */
+  void collect(metrics::Writer& w, std::string_view socket) const
+  {
+    auto label = fmt::format("socket=\"{}\"", socket);
+
+    w.counter("quic_tunnel_rx_packets_total", "Packets received", rx_packets.load(std::memory_order_relaxed), label);
+    w.counter("quic_tunnel_rx_bytes_total", "Bytes received", rx_bytes.load(std::memory_order_relaxed), label);
+    w.counter("quic_tunnel_tx_packets_total", "Packets sent", tx_packets.load(std::memory_order_relaxed), label);
+    w.counter("quic_tunnel_tx_bytes_total", "Bytes sent", tx_bytes.load(std::memory_order_relaxed), label);
+  }
+};
+
+/**
+ * @brief Thread writing the rate of a set of counters in a csv file, one "sec,bytes/s,packets/s"
+ * line per period. It runs with the idle scheduling policy so it never takes CPU time from the
+ * datapath threads.
+ */
+class TrafficSampler
+{
+  const TrafficCounters * _counters;
+  std::string _file_name;
+  std::chrono::milliseconds _period;
+
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _stop = false;
+
+  void run()
+  {
+    struct sched_param param{};
+    if(pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+      perror("Could not lower the sampler priority");
+    }
+
+    FILE * file = fopen(_file_name.c_str(), "w");
+    if(!file) {
+      perror("Could not open the traffic stats file");
+      return;
+    }
+
+    using clock = std::chrono::steady_clock;
+
+    auto start = clock::now();
+    auto last = start;
+    auto next = start + _period;
+    auto last_bytes = _counters->bytes();
+    auto last_packets = _counters->packets();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // Deadlines from the start, so a late wakeup does not shift the next samples
+    while(!_cv.wait_until(lock, next, [this]() { return _stop; })) {
+      auto now = clock::now();
+      auto bytes = _counters->bytes();
+      auto packets = _counters->packets();
+
+      double elapsed = std::chrono::duration<double>(now - last).count();
+      double sec = std::chrono::duration<double>(now - start).count();
+
+      fprintf(file, "%.3f,%.0f,%.0f\n", sec, (bytes - last_bytes) / elapsed, (packets - last_packets) / elapsed);
+      fflush(file);
+
+      last = now;
+      last_bytes = bytes;
+      last_packets = packets;
+
+      do next += _period; while(next <= now);
+    }
+
+    fclose(file);
+  }
+
+public:
+  static constexpr std::chrono::milliseconds MIN_PERIOD{10};
+  static constexpr std::chrono::milliseconds DEFAULT_PERIOD{1000};
+
+  /**
+   * @brief Period from the QUIC_TUNNEL_SAMPLE_MS environment variable, one second by default
+   * and MIN_PERIOD at least
+   */
+  static std::chrono::milliseconds default_period()
+  {
+    const char * env = std::getenv("QUIC_TUNNEL_SAMPLE_MS");
+    if(!env) return DEFAULT_PERIOD;
+
+    auto period = std::chrono::milliseconds(std::atol(env));
+    return period < MIN_PERIOD ? MIN_PERIOD : period;
+  }
+
+  TrafficSampler(const TrafficCounters * counters, std::string file_name,
+		 std::chrono::milliseconds period = default_period())
+    : _counters(counters), _file_name(std::move(file_name)), _period(std::max(period, MIN_PERIOD))
+  {}
+
+  ~TrafficSampler() { stop(); }
+
+  TrafficSampler(const TrafficSampler&) = delete;
+  TrafficSampler& operator=(const TrafficSampler&) = delete;
+
+  void start()
+  {
+    if(_thread.joinable()) return;
+
+    _stop = false;
+    _thread = std::thread([this]() { run(); });
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+
+    _cv.notify_one();
+    if(_thread.joinable()) _thread.join();
+  }
+};
+
+#endif /* TRAFFIC_STATS_H */
@@ -0,0 +1,167 @@
+#ifndef TUNNEL_HEADER_H
+#define TUNNEL_HEADER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+/**
+ * Header put in front of every packet carried in the tunnel, in datagrams and streams alike,
+ * so every QUIC backend carries it the same way. It starts with a flags byte, then the flow ID
+ * of the packet, the peer of the in-tunnel, as a QUIC variable length integer: 1 byte up to 63,
+ * 2 bytes up to 16383. The flags tell whether a per flow sequence number (varint) and a send
+ * timestamp (32 bits big endian, microseconds) follow.
+ */
+namespace tunnel
+{
+
+enum Flags : uint8_t
+{
+  HAS_SEQ       = 0x01,
+  HAS_TIMESTAMP = 0x02
+};
+
+static constexpr size_t MAX_HEADER_LEN = 1 + 8 + 8 + 4;
+static constexpr uint64_t MAX_VARINT = (1ull << 62) - 1;
+
+/** @brief Bytes needed to encode v, 0 if v is larger than MAX_VARINT. */
+inline size_t varint_len(uint64_t v) noexcept
+{
+  if(v < (1ull << 6))  return 1;
+  if(v < (1ull << 14)) return 2;
+  if(v < (1ull << 30)) return 4;
+  if(v <= MAX_VARINT)  return 8;
+  return 0;
+}
+
+/** @brief Writes v in dst, which holds at least varint_len(v) bytes. */
+inline size_t write_varint(uint8_t * dst, uint64_t v) noexcept
+{
+  auto len = varint_len(v);
+
+  for(size_t i = len; i > 0; --i) {
+    dst[i - 1] = v & 0xff;
+    v >>= 8;
+  }
+
+  // The two high bits give the length: 00 = 1, 01 = 2, 10 = 4, 11 = 8 bytes
+  switch(len) {
+  case 2: dst[0] |= 0x40; break;
+  case 4: dst[0] |= 0x80; break;
+  case 8: dst[0] |= 0xc0; break;
+  }
+
+  return len;
+}
+
+/** @brief Reads a varint from src, returns its length or 0 if src is too short. */
+inline size_t read_varint(const uint8_t * src, size_t len, uint64_t& v) noexcept
+{
+  if(len == 0) return 0;
+
+  size_t vlen = 1u << (src[0] >> 6);
+  if(len < vlen) return 0;
+
+  v = src[0] & 0x3f;
+  for(size_t i = 1; i < vlen; ++i) v = (v << 8) | src[i];
+
+  return vlen;
+}
+
+struct Header
+{
+  uint8_t  flags     = 0;
+  uint64_t flow_id   = 0;
+  uint64_t seq       = 0; // Valid with HAS_SEQ
+  uint32_t timestamp = 0; // Valid with HAS_TIMESTAMP, see now_us
+
+  bool has_seq() const noexcept { return flags & HAS_SEQ; }
+  bool has_timestamp() const noexcept { return flags & HAS_TIMESTAMP; }
+};
+
+/**
+ * @brief Wall clock in microseconds, truncated to 32 bits. It wraps every 71 minutes, a one way
+ * delay is the difference of two of them taken as a signed integer, so it only holds when the
+ * clocks of the two tunnel ends are synchronized.
+ */
+inline uint32_t now_us() noexcept
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000);
+}
+
+/**
+ * @brief Optional fields put in the headers sent by this process, from the QUIC_TUNNEL_HEADER
+ * environment variable: "seq", "ts", "seq,ts" or "none". Both by default.
+ */
+inline uint8_t default_flags()
+{
+  static const uint8_t flags = [](){
+    const char * env = std::getenv("QUIC_TUNNEL_HEADER");
+    if(!env) return (uint8_t)(HAS_SEQ | HAS_TIMESTAMP);
+
+    uint8_t f = 0;
+    if(std::strstr(env, "seq")) f |= HAS_SEQ;
+    if(std::strstr(env, "ts"))  f |= HAS_TIMESTAMP;
+    return f;
+  }();
+
+  return flags;
+}
+
+/** @brief Writes the header in dst, which holds at least MAX_HEADER_LEN bytes. */
+inline size_t write_header(uint8_t * dst, const Header& header) noexcept
+{
+  size_t len = 0;
+
+  dst[len++] = header.flags;
+  len += write_varint(dst + len, header.flow_id);
+
+  if(header.has_seq()) len += write_varint(dst + len, header.seq & MAX_VARINT);
+
+  if(header.has_timestamp()) {
+    dst[len++] = (header.timestamp >> 24) & 0xff;
+    dst[len++] = (header.timestamp >> 16) & 0xff;
+    dst[len++] = (header.timestamp >> 8) & 0xff;
+    dst[len++] = header.timestamp & 0xff;
+  }
+
+  return len;
+}
+
+/** @brief Parses the header at the start of a packet, returns its length or 0 if it is malformed. */
+inline size_t read_header(const uint8_t * src, size_t len, Header& header) noexcept
+{
+  if(len == 0) return 0;
+
+  size_t pos = 0;
+  header.flags = src[pos++];
+
+  auto n = read_varint(src + pos, len - pos, header.flow_id);
+  if(n == 0) return 0;
+  pos += n;
+
+  if(header.has_seq()) {
+    n = read_varint(src + pos, len - pos, header.seq);
+    if(n == 0) return 0;
+    pos += n;
+  }
+
+  if(header.has_timestamp()) {
+    if(len - pos < 4) return 0;
+
+    header.timestamp = ((uint32_t)src[pos] << 24) | ((uint32_t)src[pos + 1] << 16)
+      | ((uint32_t)src[pos + 2] << 8) | src[pos + 3];
+    pos += 4;
+  }
+
+  return pos;
+}
+
+}
+
+#endif /* TUNNEL_HEADER_H */
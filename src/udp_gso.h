@@ -0,0 +1,327 @@
+#ifndef UDP_GSO_H
+#define UDP_GSO_H
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <cstdio>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* UDP segmentation offload helpers for the sockets we own (quiche and lsquic) */
+namespace udp
+{
+
+static constexpr size_t   MAX_GSO_LEN      = 65507; // Max UDP payload over IPv4
+static constexpr unsigned MAX_GSO_SEGMENTS = 64;    // UDP_MAX_SEGMENTS in the kernel
+
+/**
+ * @brief Whether GSO/GRO was requested, with the QUIC_TUNNEL_GSO=1 environment variable
+ */
+inline bool gso_requested()
+{
+  static const bool requested = [](){
+    const char * env = std::getenv("QUIC_TUNNEL_GSO");
+    return env && std::strcmp(env, "1") == 0;
+  }();
+
+  return requested;
+}
+
+/**
+ * @brief Check the kernel accepts UDP_SEGMENT on this socket
+ */
+inline bool enable_gso(int sock)
+{
+  if(!gso_requested()) return false;
+
+  int segment = 1200; // Only probes the option, the real size is given per sendmsg
+  if(setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) < 0) {
+    perror("UDP_SEGMENT not supported");
+    return false;
+  }
+
+  segment = 0;
+  setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment));
+
+  return true;
+}
+
+/**
+ * @brief Enable UDP_GRO on this socket. Reads must then go through recv_gro
+ */
+inline bool enable_gro(int sock)
+{
+  if(!gso_requested()) return false;
+
+  int enable = 1;
+  if(setsockopt(sock, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) < 0) {
+    perror("UDP_GRO not supported");
+    return false;
+  }
+
+  return true;
+}
+
+inline bool same_addr(const struct sockaddr * a, socklen_t a_len, const struct sockaddr * b, socklen_t b_len)
+{
+  return a_len == b_len && std::memcmp(a, b, a_len) == 0;
+}
+
+inline socklen_t addr_len(const struct sockaddr * addr)
+{
+  return addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+/**
+ * @brief Send iov as one datagram, or as segment sized datagrams if segment is not 0
+ * @return What sendmsg returns
+ */
+inline ssize_t send_segments(int sock, struct iovec * iov, size_t iovlen, uint16_t segment,
+			     const struct sockaddr * to, socklen_t to_len)
+{
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+
+  msg.msg_name    = const_cast<struct sockaddr*>(to);
+  msg.msg_namelen = to_len;
+  msg.msg_iov     = iov;
+  msg.msg_iovlen  = iovlen;
+
+  if(segment > 0) {
+    std::memset(control, 0, sizeof(control));
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr * cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type  = UDP_SEGMENT;
+    cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+    std::memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+  }
+
+  return sendmsg(sock, &msg, 0);
+}
+
+/**
+ * @brief recvfrom that also returns the size of the coalesced segments
+ * @param segment Set to the GRO segment size, or to the read length if the kernel did not coalesce
+ */
+inline ssize_t recv_gro(int sock, uint8_t * buf, size_t len,
+			struct sockaddr_storage * from, socklen_t * from_len, size_t * segment)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { buf, len };
+
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+
+  msg.msg_name       = from;
+  msg.msg_namelen    = *from_len;
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t read = recvmsg(sock, &msg, 0);
+  if(read < 0) return read;
+
+  *from_len = msg.msg_namelen;
+  *segment  = read;
+
+  for(struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+    if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+      int gso_size;
+      std::memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+      if(gso_size > 0) *segment = gso_size;
+    }
+  }
+
+  return read;
+}
+
+/**
+ * @brief Accumulates equal sized packets for one peer and sends them as a single GSO super-datagram.
+ * Packets are written by the caller at tail() then committed with push().
+ */
+class GsoBatch
+{
+  uint8_t  _buf[MAX_GSO_LEN];
+  size_t   _len     = 0; // Bytes of the pending batch
+  size_t   _segment = 0; // Size of the first segment, the last one may be smaller
+  unsigned _count   = 0;
+
+  struct sockaddr_storage _to;
+  socklen_t               _to_len = 0;
+
+  bool send(int sock, bool& gso)
+  {
+    if(_count == 0) return true;
+
+    struct iovec iov = { _buf, _len };
+    ssize_t sent;
+
+    if(gso && _count > 1) {
+      sent = send_segments(sock, &iov, 1, _segment, (struct sockaddr*)&_to, _to_len);
+
+      if(sent < 0 && errno == EIO) {
+	// No checksum offload on this device, fall back to one sendto per packet
+	perror("GSO send failed, disabling it");
+	gso = false;
+      }
+    }
+
+    if(!gso || _count == 1) {
+      sent = 0;
+
+      for(size_t off = 0; off < _len; off += _segment) {
+	auto len = std::min(_segment, _len - off);
+	auto res = sendto(sock, _buf + off, len, 0, (struct sockaddr*)&_to, _to_len);
+	if(res < 0) { sent = res; break; }
+	sent += res;
+      }
+    }
+
+    _len = 0;
+    _count = 0;
+
+    if(sent < 0) {
+      perror("failed to send");
+      return false;
+    }
+
+    return true;
+  }
+
+public:
+  uint8_t * tail() { return _buf + _len; }
+  size_t room() const { return MAX_GSO_LEN - _len; }
+
+  /**
+   * @brief Commit the len bytes written at tail(). Sends the batch when it can not grow anymore
+   * @param gso Whether to use GSO, set to false if the device does not support it
+   * @return false if a send failed
+   */
+  bool push(int sock, bool& gso, size_t len, const struct sockaddr * to, socklen_t to_len)
+  {
+    bool ok = true;
+
+    if(_count > 0 && (!gso || len > _segment || !same_addr((struct sockaddr*)&_to, _to_len, to, to_len))) {
+      // This packet can not be part of the pending batch, send it and start a new one
+      size_t pending = _len;
+
+      ok = send(sock, gso);
+      std::memmove(_buf, _buf + pending, len);
+    }
+
+    if(_count == 0) {
+      _segment = len;
+      std::memcpy(&_to, to, to_len);
+      _to_len = to_len;
+    }
+
+    _len += len;
+    ++_count;
+
+    if(!gso || len < _segment || _count == MAX_GSO_SEGMENTS || room() < _segment) {
+      ok = send(sock, gso) && ok;
+    }
+
+    return ok;
+  }
+
+  /**
+   * @brief Send the pending batch
+   */
+  bool flush(int sock, bool& gso) { return send(sock, gso); }
+};
+
+/**
+ * @brief Send lsquic out specs, coalescing consecutive equal sized datagrams for one peer with GSO
+ * @return The number of specs sent
+ */
+template<typename Spec>
+int send_specs(int sock, bool& gso, const Spec * specs, unsigned n_specs)
+{
+  constexpr size_t MAX_IOV = 256;
+  struct iovec iov[MAX_IOV];
+
+  unsigned n = 0;
+
+  while(n < n_specs) {
+    const auto * to = specs[n].dest_sa;
+    socklen_t to_len = addr_len(to);
+
+    auto spec_len = [&](unsigned i) {
+      size_t len = 0;
+      for(size_t j = 0; j < specs[i].iovlen; ++j) len += specs[i].iov[j].iov_len;
+      return len;
+    };
+
+    size_t segment = spec_len(n);
+    size_t total = 0, iovlen = 0;
+    unsigned count = 0;
+
+    // Group the specs that can be sent in one GSO super-datagram
+    do {
+      size_t len = spec_len(n + count);
+
+      if(count > 0 && (!gso || len > segment || total + len > MAX_GSO_LEN
+		       || iovlen + specs[n + count].iovlen > MAX_IOV
+		       || !same_addr(to, to_len, specs[n + count].dest_sa, addr_len(specs[n + count].dest_sa))))
+	break;
+
+      if(specs[n + count].iovlen > MAX_IOV) break;
+
+      std::copy(specs[n + count].iov, specs[n + count].iov + specs[n + count].iovlen, iov + iovlen);
+      iovlen += specs[n + count].iovlen;
+      total += len;
+      ++count;
+
+      if(len < segment) break;
+    } while(n + count < n_specs && count < MAX_GSO_SEGMENTS);
+
+    if(count == 0) break;
+
+    ssize_t sent = send_segments(sock, iov, iovlen, count > 1 ? segment : 0, to, to_len);
+    if(sent < 0) {
+      if(count > 1 && errno == EIO) {
+	perror("GSO send failed, disabling it");
+	gso = false;
+	continue;
+      }
+
+      // A full socket buffer is not an error, the caller retries once writable
+      if(errno != EAGAIN && errno != EWOULDBLOCK) perror("Could not send lsquic packets");
+      break;
+    }
+
+    n += count;
+  }
+
+  return (int) n;
+}
+
+}
+
+#endif /* UDP_GSO_H */